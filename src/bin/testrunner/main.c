@@ -19,9 +19,12 @@
 
 #define _GNU_SOURCE
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "lwan.h"
+#include "lwan-sse.h"
+#include "lwan-template.h"
 
 enum lwan_http_status
 quit_lwan(struct lwan_request *request __attribute__((unused)),
@@ -92,6 +95,141 @@ test_server_sent_event(struct lwan_request *request,
     return HTTP_OK;
 }
 
+/* One hub for each policy; "?policy=disconnect" picks the other one.  */
+static struct lwan_sse_channel *sse_hubs[2];
+
+static struct lwan_sse_channel *
+get_sse_hub(struct lwan_request *request)
+{
+    const char *policy_name = lwan_request_get_query_param(request, "policy");
+    enum lwan_sse_slow_policy policy =
+        policy_name && !strcmp(policy_name, "disconnect") ?
+        LWAN_SSE_DISCONNECT : LWAN_SSE_DROP_OLDEST;
+    struct lwan_sse_channel *hub = ATOMIC_READ(sse_hubs[policy]);
+
+    if (!hub) {
+        hub = lwan_sse_channel_new(request->conn->thread->lwan, 16, policy);
+        if (hub && !__sync_bool_compare_and_swap(&sse_hubs[policy], NULL, hub)) {
+            lwan_sse_channel_free(hub);
+            hub = ATOMIC_READ(sse_hubs[policy]);
+        }
+    }
+
+    return hub;
+}
+
+enum lwan_http_status
+test_sse_subscribe(struct lwan_request *request,
+            struct lwan_response *response __attribute__((unused)),
+            void *data __attribute__((unused)))
+{
+    struct lwan_sse_channel *hub = get_sse_hub(request);
+
+    if (!hub)
+        return HTTP_INTERNAL_ERROR;
+
+    return lwan_sse_channel_subscribe(request, hub);
+}
+
+enum lwan_http_status
+test_sse_publish(struct lwan_request *request,
+            struct lwan_response *response,
+            void *data __attribute__((unused)))
+{
+    struct lwan_sse_channel *hub = get_sse_hub(request);
+    const char *event = lwan_request_get_query_param(request, "event");
+    const char *text = lwan_request_get_query_param(request, "data");
+    const char *pad = lwan_request_get_query_param(request, "pad");
+    size_t text_len, pad_len;
+    bool published;
+    char *padded;
+
+    if (!hub)
+        return HTTP_INTERNAL_ERROR;
+    if (!text)
+        return HTTP_BAD_REQUEST;
+
+    /* Large events, to fill up the socket buffers of slow subscribers.  */
+    text_len = strlen(text);
+    pad_len = pad ? (size_t)parse_long(pad, 0) : 0;
+    if (pad_len > 1 << 20)
+        return HTTP_BAD_REQUEST;
+    padded = malloc(text_len + pad_len);
+    if (!padded)
+        return HTTP_INTERNAL_ERROR;
+    memcpy(padded, text, text_len);
+    memset(padded + text_len, '.', pad_len);
+
+    published = lwan_sse_channel_publish(hub, event, padded, text_len + pad_len);
+    free(padded);
+    if (!published)
+        return HTTP_INTERNAL_ERROR;
+
+    response->mime_type = "text/plain";
+    strbuf_printf(response->buffer, "%u", lwan_sse_channel_get_subscribers(hub));
+
+    return HTTP_OK;
+}
+
+struct sequence_vars {
+    long n;
+
+    struct {
+        coro_function_t generator;
+        int i;
+    } items;
+};
+
+static int
+generate_items(struct coro *coro, void *data)
+{
+    struct sequence_vars *vars = data;
+
+    for (vars->items.i = 0; vars->items.i < vars->n; vars->items.i++) {
+        if (coro_yield(coro, 1))
+            break;
+    }
+
+    return 0;
+}
+
+static const struct lwan_var_descriptor sequence_desc[] = {
+    TPL_VAR_SEQUENCE(struct sequence_vars, items, generate_items, (
+        (const struct lwan_var_descriptor[]) {
+            TPL_VAR_INT(struct sequence_vars, items.i),
+            TPL_VAR_SENTINEL
+        }
+    )),
+    TPL_VAR_SENTINEL
+};
+
+enum lwan_http_status
+test_template_sequence(struct lwan_request *request,
+            struct lwan_response *response,
+            void *data __attribute__((unused)))
+{
+    struct sequence_vars vars = {
+        .n = parse_long(lwan_request_get_query_param(request, "n"), 0),
+    };
+    struct lwan_tpl *tpl;
+    bool applied;
+
+    /* What follows a sequence must be there whether it's empty or not,
+     * and so must the negated sequence if it's empty.  */
+    tpl = lwan_tpl_compile_string("{{#items}}[{{items.i}}]{{/items}}."
+                                  "{{^#items}}empty{{/items}}!", sequence_desc);
+    if (!tpl)
+        return HTTP_INTERNAL_ERROR;
+
+    applied = lwan_tpl_apply_with_buffer(tpl, response->buffer, &vars) != NULL;
+    lwan_tpl_free(tpl);
+    if (!applied)
+        return HTTP_INTERNAL_ERROR;
+
+    response->mime_type = "text/plain";
+    return HTTP_OK;
+}
+
 enum lwan_http_status
 test_proxy(struct lwan_request *request,
            struct lwan_response *response,
@@ -232,6 +370,8 @@ main()
     lwan_init(&l);
     lwan_main_loop(&l);
     lwan_shutdown(&l);
+    lwan_sse_channel_free(sse_hubs[0]);
+    lwan_sse_channel_free(sse_hubs[1]);
 
     return EXIT_SUCCESS;
 }
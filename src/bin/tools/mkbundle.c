@@ -0,0 +1,356 @@
+/*
+ * mkbundle - pack a directory tree into an asset bundle for serve_files
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "../../lib/lwan-bundle.h"
+
+/* Contents are aligned to this, so that small files don't straddle more
+ * cache lines than they need to.  */
+#define CONTENTS_ALIGNMENT 64
+
+struct file {
+    char *path;
+    size_t path_len;
+    char *full_path;
+};
+
+static struct {
+    struct file *files;
+    size_t n_files, capacity;
+    size_t root_len;
+} tree;
+
+static bool compress_files = true;
+
+static int add_file(const char *full_path, const struct stat *st, int type,
+    struct FTW *ftw __attribute__((unused)))
+{
+    struct file *file;
+
+    /* serve_files won't serve anything that isn't world-readable either.  */
+    if (type != FTW_F || !S_ISREG(st->st_mode) || !(st->st_mode & S_IROTH))
+        return 0;
+
+    if (tree.n_files == tree.capacity) {
+        size_t capacity = tree.capacity ? tree.capacity * 2 : 256;
+        struct file *files = realloc(tree.files, capacity * sizeof(*files));
+
+        if (!files)
+            return -1;
+
+        tree.files = files;
+        tree.capacity = capacity;
+    }
+
+    file = &tree.files[tree.n_files];
+    file->full_path = strdup(full_path);
+    file->path = file->full_path ? file->full_path + tree.root_len : NULL;
+    if (!file->path)
+        return -1;
+    while (*file->path == '/')
+        file->path++;
+    file->path_len = strlen(file->path);
+
+    tree.n_files++;
+    return 0;
+}
+
+static bool is_compression_worthy(size_t compressed_size, size_t size)
+{
+    /* Same criteria used by serve_files for files it compresses itself.  */
+    return compressed_size + sizeof("Content-Encoding: deflate\r\n") - 1 < size;
+}
+
+static bool write_padding(FILE *out, uint64_t *offset, size_t alignment)
+{
+    static const char zeroes[CONTENTS_ALIGNMENT];
+    size_t padding = (alignment - *offset % alignment) % alignment;
+
+    if (fwrite(zeroes, 1, padding, out) != padding)
+        return false;
+
+    *offset += padding;
+    return true;
+}
+
+static bool write_contents(FILE *out, uint64_t *offset, const void *data,
+    size_t size, uint64_t *data_offset)
+{
+    if (!write_padding(out, offset, CONTENTS_ALIGNMENT))
+        return false;
+
+    if (size && fwrite(data, 1, size, out) != size)
+        return false;
+
+    *data_offset = *offset;
+    *offset += size;
+    return true;
+}
+
+static bool write_file(FILE *out, uint64_t *offset, const struct file *file,
+    struct lwan_bundle_entry *entry)
+{
+    struct stat st;
+    void *contents = NULL;
+    bool success = false;
+    int fd;
+
+    fd = open(file->full_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open %s: %s\n", file->full_path, strerror(errno));
+        return false;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "Could not stat %s: %s\n", file->full_path, strerror(errno));
+        goto out;
+    }
+
+    if (st.st_size) {
+        contents = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (contents == MAP_FAILED) {
+            fprintf(stderr, "Could not map %s: %s\n", file->full_path, strerror(errno));
+            contents = NULL;
+            goto out;
+        }
+    }
+
+    entry->contents_size = (uint64_t)st.st_size;
+    entry->mtime = (int64_t)st.st_mtime;
+    if (!write_contents(out, offset, contents, (size_t)st.st_size,
+                        &entry->contents_offset))
+        goto out;
+
+    entry->deflated_offset = 0;
+    entry->deflated_size = 0;
+    if (compress_files && st.st_size) {
+        uLongf deflated_size = compressBound((uLong)st.st_size);
+        Bytef *deflated = malloc(deflated_size);
+
+        if (!deflated) {
+            fprintf(stderr, "Could not allocate memory to compress %s\n", file->path);
+            goto out;
+        }
+
+        if (compress2(deflated, &deflated_size, contents, (uLong)st.st_size, 9) == Z_OK &&
+                is_compression_worthy(deflated_size, (size_t)st.st_size)) {
+            entry->deflated_size = deflated_size;
+            if (!write_contents(out, offset, deflated, deflated_size,
+                                &entry->deflated_offset)) {
+                free(deflated);
+                goto out;
+            }
+        }
+
+        free(deflated);
+    }
+
+    success = true;
+
+out:
+    if (contents)
+        munmap(contents, (size_t)st.st_size);
+    close(fd);
+
+    return success;
+}
+
+static bool write_bundle(FILE *out, uint32_t seed, uint32_t n_buckets,
+    const uint32_t *displacements, struct file **slots)
+{
+    struct lwan_bundle_header header = {
+        .magic = LWAN_BUNDLE_MAGIC,
+        .version = LWAN_BUNDLE_VERSION,
+        .n_entries = (uint32_t)tree.n_files,
+        .n_buckets = n_buckets,
+        .seed = seed,
+    };
+    struct lwan_bundle_entry *entries;
+    uint64_t offset;
+    bool success = false;
+
+    entries = calloc(tree.n_files, sizeof(*entries));
+    if (!entries)
+        return false;
+
+    header.displacements_offset = sizeof(header);
+    header.entries_offset = header.displacements_offset +
+        (n_buckets * sizeof(*displacements) + 7) / 8 * 8;
+
+    /* Paths go right after the entries; contents after the paths.  */
+    offset = header.entries_offset + tree.n_files * sizeof(*entries);
+    for (size_t i = 0; i < tree.n_files; i++) {
+        entries[i].path_offset = offset;
+        entries[i].path_len = (uint32_t)slots[i]->path_len;
+        offset += slots[i]->path_len + 1;
+    }
+
+    /* Entries are written last, once the offsets of contents are known.  */
+    if (fseek(out, (long)offset, SEEK_SET) < 0)
+        goto out;
+    for (size_t i = 0; i < tree.n_files; i++) {
+        if (!write_file(out, &offset, slots[i], &entries[i]))
+            goto out;
+    }
+
+    if (fseek(out, 0, SEEK_SET) < 0)
+        goto out;
+    if (fwrite(&header, sizeof(header), 1, out) != 1)
+        goto out;
+    offset = sizeof(header);
+    if (n_buckets && fwrite(displacements, sizeof(*displacements), n_buckets, out) != n_buckets)
+        goto out;
+    offset += n_buckets * sizeof(*displacements);
+    if (!write_padding(out, &offset, 8))
+        goto out;
+    if (tree.n_files && fwrite(entries, sizeof(*entries), tree.n_files, out) != tree.n_files)
+        goto out;
+    for (size_t i = 0; i < tree.n_files; i++) {
+        if (fwrite(slots[i]->path, slots[i]->path_len + 1, 1, out) != 1)
+            goto out;
+    }
+
+    success = true;
+
+out:
+    free(entries);
+    return success;
+}
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s [-n] /path/to/root output.bundle\n", progname);
+    fprintf(stderr, "  -n  Do not store deflated copies of the files\n");
+}
+
+int main(int argc, char *argv[])
+{
+    char output_tmp[PATH_MAX];
+    struct lwan_perfect_hash_key *keys;
+    uint32_t *displacements, *order;
+    struct file **slots;
+    uint32_t n_buckets, seed;
+    FILE *out;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n")) != -1) {
+        switch (opt) {
+        case 'n':
+            compress_files = false;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* Symbolic links aren't followed (nor packed): they could lead out
+     * of the tree, or around in circles.  */
+    tree.root_len = strlen(argv[optind]);
+    if (nftw(argv[optind], add_file, 64, FTW_PHYS) < 0) {
+        fprintf(stderr, "Could not read directory tree %s: %s\n", argv[optind],
+            strerror(errno));
+        return 1;
+    }
+    if (tree.n_files > UINT32_MAX / 2) {
+        fprintf(stderr, "Too many files\n");
+        return 1;
+    }
+
+    n_buckets = lwan_perfect_hash_n_buckets((uint32_t)tree.n_files);
+
+    keys = calloc(tree.n_files ? tree.n_files : 1, sizeof(*keys));
+    displacements = calloc(n_buckets, sizeof(*displacements));
+    order = calloc(tree.n_files ? tree.n_files : 1, sizeof(*order));
+    slots = calloc(tree.n_files ? tree.n_files : 1, sizeof(*slots));
+    if (!keys || !displacements || !order || !slots) {
+        fprintf(stderr, "Could not allocate memory for the hash table\n");
+        return 1;
+    }
+
+    for (size_t i = 0; i < tree.n_files; i++) {
+        keys[i] = (struct lwan_perfect_hash_key) {
+            .key = tree.files[i].path,
+            .len = tree.files[i].path_len,
+        };
+    }
+    if (!lwan_perfect_hash_build(keys, (uint32_t)tree.n_files, n_buckets,
+                                 &seed, displacements, order)) {
+        fprintf(stderr, "Could not find a perfect hash for these files\n");
+        return 1;
+    }
+    for (size_t i = 0; i < tree.n_files; i++)
+        slots[i] = &tree.files[order[i]];
+
+    if (snprintf(output_tmp, sizeof(output_tmp), "%s.tmp", argv[optind + 1]) >= (int)sizeof(output_tmp)) {
+        fprintf(stderr, "Output path is too long\n");
+        return 1;
+    }
+
+    out = fopen(output_tmp, "we");
+    if (!out) {
+        fprintf(stderr, "Could not create %s: %s\n", output_tmp, strerror(errno));
+        return 1;
+    }
+
+    if (!write_bundle(out, seed, n_buckets, displacements, slots) || fclose(out)) {
+        fprintf(stderr, "Could not write bundle to %s\n", output_tmp);
+        unlink(output_tmp);
+        return 1;
+    }
+
+    /* Servers mapping the previous bundle keep seeing it unchanged.  */
+    if (rename(output_tmp, argv[optind + 1]) < 0) {
+        fprintf(stderr, "Could not rename %s to %s: %s\n", output_tmp,
+            argv[optind + 1], strerror(errno));
+        unlink(output_tmp);
+        return 1;
+    }
+
+    fprintf(stderr, "Packed %zu files into %s\n", tree.n_files, argv[optind + 1]);
+
+    for (size_t i = 0; i < tree.n_files; i++)
+        free(tree.files[i].full_path);
+    free(tree.files);
+    free(keys);
+    free(displacements);
+    free(order);
+    free(slots);
+
+    return 0;
+}
@@ -0,0 +1,85 @@
+/*
+ * mkredirmap - prebuild a redirect map for the redirect module
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+#include "lwan-redirect-map.h"
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s redirects.txt output.map\n", progname);
+    fprintf(stderr, "  Each line of redirects.txt is \"source target [status]\"\n");
+}
+
+int main(int argc, char *argv[])
+{
+    char output_tmp[PATH_MAX];
+    size_t size;
+    void *map;
+    FILE *out;
+
+    if (argc != 3) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* Errors in the input are reported by the library.  */
+    map = lwan_redirect_map_compile(argv[1], &size);
+    if (!map)
+        return 1;
+
+    if (snprintf(output_tmp, sizeof(output_tmp), "%s.tmp", argv[2]) >= (int)sizeof(output_tmp)) {
+        fprintf(stderr, "Output path is too long\n");
+        return 1;
+    }
+
+    out = fopen(output_tmp, "we");
+    if (!out) {
+        fprintf(stderr, "Could not create %s: %s\n", output_tmp, strerror(errno));
+        return 1;
+    }
+
+    if (fwrite(map, size, 1, out) != 1 || fclose(out)) {
+        fprintf(stderr, "Could not write redirect map to %s\n", output_tmp);
+        unlink(output_tmp);
+        return 1;
+    }
+
+    /* Servers mapping the previous file keep seeing it unchanged, and
+     * reload once the new one is moved in place.  */
+    if (rename(output_tmp, argv[2]) < 0) {
+        fprintf(stderr, "Could not rename %s to %s: %s\n", output_tmp,
+            argv[2], strerror(errno));
+        unlink(output_tmp);
+        return 1;
+    }
+
+    fprintf(stderr, "Packed %u redirects into %s\n",
+        ((const struct lwan_redirect_map_header *)map)->n_entries, argv[2]);
+
+    free(map);
+    return 0;
+}
@@ -30,6 +30,7 @@
 #cmakedefine HAS_READAHEAD
 #cmakedefine HAS_REALLOCARRAY
 #cmakedefine HAS_MKOSTEMP
+#cmakedefine HAS_OPENAT2
 
 /* Compiler builtins for specific CPU instruction support */
 #cmakedefine HAVE_BUILTIN_CLZLL
@@ -43,6 +44,7 @@
 
 /* Libraries */
 #cmakedefine HAVE_LUA
+#cmakedefine HAVE_LIBCRYPT
 
 /* Valgrind support for coroutines */
 #cmakedefine USE_VALGRIND
@@ -6,6 +6,7 @@
  * See README for more details.
  */
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -116,20 +117,20 @@ unsigned char * base64_encode(const unsigned char *src, size_t len,
 }
 
 /**
- * base64_decode - Base64 decode
+ * base64_decode_into - Base64 decode into a buffer
  * @src: Data to be decoded
  * @len: Length of the data to be decoded
+ * @out: Buffer to decode into
+ * @out_size: Size of the buffer
  * @out_len: Pointer to output length variable
- * Returns: Allocated buffer of out_len bytes of decoded data,
- * or %NULL on failure
- *
- * Caller is responsible for freeing the returned buffer.
+ * Returns: true if the data could be decoded and fits in out_size bytes,
+ * along with a nul terminator (not included in out_len), false otherwise
  */
-unsigned char * base64_decode(const unsigned char *src, size_t len,
-			      size_t *out_len)
+bool base64_decode_into(const unsigned char *src, size_t len,
+			unsigned char *out, size_t out_size, size_t *out_len)
 {
-	unsigned char *out, *pos, block[4];
-	size_t i, count, olen;
+	unsigned char *pos, block[4];
+	size_t i, count;
 	int pad = 0;
 
 	count = 0;
@@ -139,13 +140,12 @@ unsigned char * base64_decode(const unsigned char *src, size_t len,
 	}
 
 	if (count == 0 || count % 4)
-		return NULL;
+		return false;
 
-	olen = (count / 4 * 3) + 1;
-	pos = out = malloc(olen);
-	if (out == NULL)
-		return NULL;
+	if ((count / 4 * 3) + 1 > out_size)
+		return false;
 
+	pos = out;
 	count = 0;
 	for (i = 0; i < len; i++) {
 		unsigned char tmp = base64_decode_table[src[i]];
@@ -168,8 +168,7 @@ unsigned char * base64_decode(const unsigned char *src, size_t len,
 					pos -= 2;
 				else {
 					/* Invalid padding */
-					free(out);
-					return NULL;
+					return false;
 				}
 				break;
 			}
@@ -178,5 +177,32 @@ unsigned char * base64_decode(const unsigned char *src, size_t len,
         *pos = '\0';
 
 	*out_len = (size_t)(pos - out);
+	return true;
+}
+
+/**
+ * base64_decode - Base64 decode
+ * @src: Data to be decoded
+ * @len: Length of the data to be decoded
+ * @out_len: Pointer to output length variable
+ * Returns: Allocated buffer of out_len bytes of decoded data,
+ * or %NULL on failure
+ *
+ * Caller is responsible for freeing the returned buffer.
+ */
+unsigned char * base64_decode(const unsigned char *src, size_t len,
+			      size_t *out_len)
+{
+	size_t olen = (len / 4 * 3) + 4;
+	unsigned char *out = malloc(olen);
+
+	if (out == NULL)
+		return NULL;
+
+	if (!base64_decode_into(src, len, out, olen, out_len)) {
+		free(out);
+		return NULL;
+	}
+
 	return out;
 }
@@ -1,9 +1,11 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 
 unsigned char *base64_encode(const unsigned char *src, size_t len,
 			      size_t *out_len);
 unsigned char *base64_decode(const unsigned char *src, size_t len,
                              size_t *out_len);
-
+bool base64_decode_into(const unsigned char *src, size_t len,
+			unsigned char *out, size_t out_size, size_t *out_len);
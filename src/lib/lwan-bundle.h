@@ -0,0 +1,58 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lwan-perfect-hash.h"
+
+/*
+ * Asset bundles are written by mkbundle (src/bin/tools) and served by
+ * serve_files.  A bundle is a header, followed by the displacement table
+ * of a perfect hash of the paths (lwan-perfect-hash.h), the entries (in
+ * the order given by the hash), the NUL-terminated paths, and the
+ * contents, all in host byte order.
+ */
+
+#define LWAN_BUNDLE_MAGIC "LWANBNDL"
+#define LWAN_BUNDLE_VERSION 1
+
+struct lwan_bundle_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_entries;
+    uint32_t n_buckets;
+    uint32_t seed;
+    uint64_t displacements_offset;
+    uint64_t entries_offset;
+};
+
+struct lwan_bundle_entry {
+    uint64_t path_offset;
+    uint64_t contents_offset;
+    uint64_t contents_size;
+    /* Contents compressed with zlib (served as "deflate"), if smaller.  */
+    uint64_t deflated_offset;
+    uint64_t deflated_size;
+    int64_t mtime;
+    uint32_t path_len;
+    uint32_t padding;
+};
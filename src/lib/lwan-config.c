@@ -135,6 +135,9 @@ long parse_long(const char *value, long default_value)
     char *endptr;
     long parsed;
 
+    if (!value)
+        return default_value;
+
     errno = 0;
     parsed = strtol(value, &endptr, 0);
 
@@ -790,6 +793,14 @@ struct config *config_isolate_section(struct config *current_conf,
     return isolated;
 }
 
+const char *config_isolated_section_text(struct config *isolated, size_t *len)
+{
+    /* Only meaningful before any line has been read from the isolated
+     * section, as the lexer moves its start pointer while scanning.  */
+    *len = (size_t)(isolated->parser.lexer.end - isolated->parser.lexer.start);
+    return isolated->parser.lexer.start;
+}
+
 bool config_skip_section(struct config *conf, struct config_line *line)
 {
     if (line->type != CONFIG_LINE_TYPE_SECTION)
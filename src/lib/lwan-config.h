@@ -56,6 +56,7 @@ int config_cur_line(struct config *conf);
 
 struct config *config_isolate_section(struct config *current_conf,
     struct config_line *current_line);
+const char *config_isolated_section_text(struct config *isolated, size_t *len);
 bool config_skip_section(struct config *conf, struct config_line *line);
 
 bool parse_bool(const char *value, bool default_value);
@@ -0,0 +1,480 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <netdb.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+
+#include "lwan-private.h"
+#include "lwan-conn.h"
+
+/*
+ * Each I/O thread keeps the connections that were closed with keep_alive
+ * in a small pool, most recently used last; when it's full, the least
+ * recently used connection is closed to make room.  Only the thread
+ * owning the pool touches it, so there's no locking.
+ */
+
+#define POOL_SIZE 32
+
+struct pooled_conn {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int fd;
+};
+
+struct lwan_conn_pool {
+    unsigned int count;
+    struct pooled_conn conns[POOL_SIZE];
+};
+
+struct lwan_conn {
+    struct lwan_connection *client;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int fd;
+    int timeout_ms;
+    bool reused;
+    bool broken;
+};
+
+static ALWAYS_INLINE uint64_t
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static ALWAYS_INLINE uint64_t
+deadline_for(const struct lwan_conn *conn)
+{
+    return conn->timeout_ms > 0 ? now_ms() + (uint64_t)conn->timeout_ms : 0;
+}
+
+static bool
+await(struct lwan_conn *conn, uint32_t events, uint64_t deadline)
+{
+    if (lwan_thread_await_fd_until(conn->client, conn->fd, events, deadline))
+        return true;
+
+    conn->broken = true;
+    errno = ETIMEDOUT;
+    return false;
+}
+
+static bool
+parse_address(const char *address, struct sockaddr_storage *addr,
+    socklen_t *addr_len, bool resolve_names)
+{
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_NUMERICSERV | AI_NUMERICHOST,
+    };
+    struct addrinfo *result;
+    char *host, *port;
+    int ret;
+
+    if (!strncmp(address, "unix:", sizeof("unix:") - 1)) {
+        struct sockaddr_un *sun = (struct sockaddr_un *)addr;
+        const char *path = address + sizeof("unix:") - 1;
+        const size_t path_len = strlen(path);
+
+        if (!path_len || path_len >= sizeof(sun->sun_path)) {
+            lwan_status_error("Invalid Unix socket path: %s", path);
+            return false;
+        }
+
+        sun->sun_family = AF_UNIX;
+        memcpy(sun->sun_path, path, path_len + 1);
+        *addr_len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + path_len + 1);
+        return true;
+    }
+
+    host = strdupa(address);
+    if (*host == '[') {
+        char *bracket = strchr(host, ']');
+
+        if (!bracket || bracket[1] != ':') {
+            lwan_status_error("Invalid address: %s", address);
+            return false;
+        }
+        *bracket = '\0';
+        port = bracket + 2;
+        host++;
+    } else {
+        port = strrchr(host, ':');
+        if (!port) {
+            lwan_status_error("Address %s lacks a port", address);
+            return false;
+        }
+        *port++ = '\0';
+    }
+
+    /* Numeric addresses are the common case and never block; names
+     * might have to be looked up with DNS, which does.  */
+    ret = getaddrinfo(host, port, &hints, &result);
+    if (ret == EAI_NONAME) {
+        if (!resolve_names) {
+            lwan_status_error("Not a numeric address: %s", address);
+            return false;
+        }
+
+        hints.ai_flags &= ~AI_NUMERICHOST;
+        ret = getaddrinfo(host, port, &hints, &result);
+    }
+    if (ret) {
+        lwan_status_error("Could not resolve %s: %s", address, gai_strerror(ret));
+        return false;
+    }
+
+    memcpy(addr, result->ai_addr, result->ai_addrlen);
+    *addr_len = result->ai_addrlen;
+    freeaddrinfo(result);
+
+    return true;
+}
+
+bool
+lwan_conn_parse_address(const char *address, struct sockaddr_storage *addr,
+    socklen_t *addr_len)
+{
+    return parse_address(address, addr, addr_len, true);
+}
+
+static struct lwan_conn_pool *
+get_pool(struct lwan_thread *thread)
+{
+    if (UNLIKELY(!thread->conn_pool))
+        thread->conn_pool = calloc(1, sizeof(*thread->conn_pool));
+
+    return thread->conn_pool;
+}
+
+static void
+pool_remove(struct lwan_conn_pool *pool, unsigned int idx)
+{
+    pool->count--;
+    memmove(&pool->conns[idx], &pool->conns[idx + 1],
+        (pool->count - idx) * sizeof(pool->conns[0]));
+}
+
+static bool
+is_idle_conn_alive(int fd)
+{
+    char byte;
+    ssize_t r = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    /* Nothing should be readable from an idle connection: either the peer
+     * closed it, or it sent something out of turn.  */
+    return r < 0 && errno == EAGAIN;
+}
+
+static int
+pool_take(struct lwan_thread *thread, const struct sockaddr_storage *addr,
+    socklen_t addr_len)
+{
+    struct lwan_conn_pool *pool = thread->conn_pool;
+
+    if (!pool)
+        return -1;
+
+    for (unsigned int i = pool->count; i-- > 0;) {
+        struct pooled_conn *pc = &pool->conns[i];
+        int fd;
+
+        if (pc->addr_len != addr_len || memcmp(&pc->addr, addr, addr_len))
+            continue;
+
+        fd = pc->fd;
+        pool_remove(pool, i);
+        if (is_idle_conn_alive(fd))
+            return fd;
+
+        close(fd);
+    }
+
+    return -1;
+}
+
+static void
+pool_put(struct lwan_thread *thread, const struct lwan_conn *conn)
+{
+    struct lwan_conn_pool *pool = get_pool(thread);
+
+    if (UNLIKELY(!pool)) {
+        close(conn->fd);
+        return;
+    }
+
+    if (pool->count == POOL_SIZE) {
+        close(pool->conns[0].fd);
+        pool_remove(pool, 0);
+    }
+
+    pool->conns[pool->count++] = (struct pooled_conn) {
+        .addr = conn->addr,
+        .addr_len = conn->addr_len,
+        .fd = conn->fd,
+    };
+}
+
+void
+lwan_conn_pool_free(struct lwan_conn_pool *pool)
+{
+    if (!pool)
+        return;
+
+    for (unsigned int i = 0; i < pool->count; i++)
+        close(pool->conns[i].fd);
+    free(pool);
+}
+
+static void
+conn_cleanup(void *data)
+{
+    struct lwan_conn *conn = data;
+
+    /* The request ended (or the coroutine was aborted) with the connection
+     * still open; whatever state the protocol is in is unknown.  */
+    if (conn->fd >= 0) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+}
+
+static bool
+conn_establish(struct lwan_conn *conn)
+{
+    const uint64_t deadline = deadline_for(conn);
+
+    conn->fd = socket(conn->addr.ss_family,
+        SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn->fd < 0)
+        return false;
+
+    if (conn->addr.ss_family != AF_UNIX) {
+        int one = 1;
+
+        (void)setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    /* Calling connect() again on a socket that's being connected tells
+     * if it's done, and how it went.  */
+    while (connect(conn->fd, (const struct sockaddr *)&conn->addr,
+            conn->addr_len) < 0) {
+        switch (errno) {
+        case EISCONN:
+            return true;
+        case EINPROGRESS:
+        case EALREADY:
+            if (!await(conn, EPOLLOUT, deadline))
+                goto error;
+            /* fallthrough */
+        case EINTR:
+            continue;
+        default:
+            goto error;
+        }
+    }
+
+    return true;
+
+error:
+    {
+        int saved_errno = errno;
+
+        close(conn->fd);
+        conn->fd = -1;
+        errno = saved_errno;
+    }
+    return false;
+}
+
+struct lwan_conn *
+lwan_conn_connect_addr(struct lwan_request *request,
+    const struct sockaddr_storage *addr, socklen_t addr_len, int timeout_ms)
+{
+    struct coro *coro = request->conn->coro;
+    struct lwan_conn *conn;
+
+    conn = coro_malloc(coro, sizeof(*conn));
+    if (UNLIKELY(!conn)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    conn->client = request->conn;
+    memcpy(&conn->addr, addr, addr_len);
+    conn->addr_len = addr_len;
+    conn->timeout_ms = timeout_ms;
+    conn->broken = false;
+
+    conn->fd = pool_take(request->conn->thread, addr, addr_len);
+    conn->reused = conn->fd >= 0;
+    if (!conn->reused && !conn_establish(conn))
+        return NULL;
+
+    coro_defer(coro, conn_cleanup, conn);
+    return conn;
+}
+
+struct lwan_conn *
+lwan_conn_connect(struct lwan_request *request, const char *address,
+    int timeout_ms)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+
+    /* Looking names up would block every connection on this thread.  */
+    if (!parse_address(address, &addr, &addr_len, false)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return lwan_conn_connect_addr(request, &addr, addr_len, timeout_ms);
+}
+
+ssize_t
+lwan_conn_read(struct lwan_conn *conn, void *buf, size_t count)
+{
+    const uint64_t deadline = deadline_for(conn);
+
+    while (true) {
+        ssize_t r = read(conn->fd, buf, count);
+
+        if (r > 0)
+            return r;
+        if (!r) {
+            conn->broken = true;
+            return 0;
+        }
+
+        switch (errno) {
+        case EINTR:
+            break;
+        case EAGAIN:
+            if (!await(conn, EPOLLIN | EPOLLRDHUP, deadline))
+                return -1;
+            break;
+        default:
+            conn->broken = true;
+            return -1;
+        }
+    }
+}
+
+ssize_t
+lwan_conn_writev(struct lwan_conn *conn, struct iovec *iov, int iov_count)
+{
+    const uint64_t deadline = deadline_for(conn);
+    struct msghdr msg = { .msg_iov = iov };
+    ssize_t total = 0;
+    int curr_iov = 0;
+
+    while (curr_iov < iov_count) {
+        ssize_t written;
+
+        msg.msg_iov = iov + curr_iov;
+        msg.msg_iovlen = (size_t)(iov_count - curr_iov);
+        if (msg.msg_iovlen > IOV_MAX)
+            msg.msg_iovlen = IOV_MAX;
+
+        /* sendmsg() rather than writev(), so that a peer that went away
+         * doesn't get this thread killed with SIGPIPE.  */
+        written = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        if (written < 0) {
+            switch (errno) {
+            case EINTR:
+                continue;
+            case EAGAIN:
+                if (!await(conn, EPOLLOUT, deadline))
+                    return -1;
+                continue;
+            default:
+                conn->broken = true;
+                return -1;
+            }
+        }
+
+        total += written;
+        while (curr_iov < iov_count && written >= (ssize_t)iov[curr_iov].iov_len) {
+            written -= (ssize_t)iov[curr_iov].iov_len;
+            curr_iov++;
+        }
+        if (curr_iov < iov_count) {
+            iov[curr_iov].iov_base = (char *)iov[curr_iov].iov_base + written;
+            iov[curr_iov].iov_len -= (size_t)written;
+        }
+    }
+
+    return total;
+}
+
+ssize_t
+lwan_conn_write(struct lwan_conn *conn, const void *buf, size_t count)
+{
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = count };
+
+    return lwan_conn_writev(conn, &iov, 1);
+}
+
+void
+lwan_conn_close(struct lwan_conn *conn, bool keep_alive)
+{
+    if (conn->fd < 0)
+        return;
+
+    if (keep_alive && !conn->broken)
+        pool_put(conn->client->thread, conn);
+    else
+        close(conn->fd);
+
+    conn->fd = -1;
+}
+
+bool
+lwan_conn_was_reused(const struct lwan_conn *conn)
+{
+    return conn->reused;
+}
+
+int
+lwan_conn_get_fd(const struct lwan_conn *conn)
+{
+    return conn->fd;
+}
+
+void
+lwan_conn_set_timeout(struct lwan_conn *conn, int timeout_ms)
+{
+    conn->timeout_ms = timeout_ms;
+}
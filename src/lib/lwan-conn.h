@@ -0,0 +1,70 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "lwan.h"
+
+/* Outbound connections for handlers.  Reads and writes that would block
+ * yield the coroutine handling the request until the socket is ready, so
+ * other connections on the same I/O thread keep being served.  A
+ * connection belongs to the request that opened it, and is closed when
+ * the request ends if it hasn't been before.  */
+struct lwan_conn;
+
+/* Host names are looked up with DNS, blocking: only call this outside
+ * the I/O threads, e.g. while reading the configuration.  */
+bool lwan_conn_parse_address(const char *address,
+    struct sockaddr_storage *addr, socklen_t *addr_len);
+
+/* Addresses are "host:port", "[ipv6]:port" or "unix:/path", with numeric
+ * hosts only (others fail with EINVAL; resolve them beforehand with
+ * lwan_conn_parse_address()).  timeout_ms bounds connecting and each
+ * subsequent read or write (0 means only the keep-alive timeout
+ * applies); failures set errno to ETIMEDOUT.  */
+struct lwan_conn *lwan_conn_connect(struct lwan_request *request,
+    const char *address, int timeout_ms)
+    __attribute__((warn_unused_result));
+struct lwan_conn *lwan_conn_connect_addr(struct lwan_request *request,
+    const struct sockaddr_storage *addr, socklen_t addr_len, int timeout_ms)
+    __attribute__((warn_unused_result));
+
+/* Returns as soon as something has been read: 0 if the peer closed the
+ * connection, -1 on errors.  */
+ssize_t lwan_conn_read(struct lwan_conn *conn, void *buf, size_t count);
+/* Only returns after everything has been written, or on errors.  */
+ssize_t lwan_conn_write(struct lwan_conn *conn, const void *buf, size_t count);
+ssize_t lwan_conn_writev(struct lwan_conn *conn, struct iovec *iov, int iov_count);
+
+/* With keep_alive, the connection is kept open for another request on the
+ * same I/O thread to the same address, unless an error has been seen on
+ * it.  Only ask for that if the protocol is at a message boundary.  */
+void lwan_conn_close(struct lwan_conn *conn, bool keep_alive);
+
+/* Whether the connection was kept open by a previous request: the peer
+ * might have closed it in the meantime, so getting EOF before anything
+ * else usually means the request should be sent again on a new one.  */
+bool lwan_conn_was_reused(const struct lwan_conn *conn) __attribute__((pure));
+int lwan_conn_get_fd(const struct lwan_conn *conn) __attribute__((pure));
+void lwan_conn_set_timeout(struct lwan_conn *conn, int timeout_ms);
@@ -0,0 +1,133 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+#include "lwan-file-watch.h"
+
+static bool watch_job(void *data)
+{
+    struct lwan_file_watch *watch = data;
+    char buffer[sizeof(struct inotify_event) + NAME_MAX + 1]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    ssize_t r;
+
+    while ((r = read(watch->inotify_fd, buffer, sizeof(buffer))) > 0) {
+        for (char *p = buffer; p < buffer + r;) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+
+            if (event->len && streq(event->name, watch->name))
+                changed = true;
+
+            p += sizeof(*event) + event->len;
+        }
+    }
+
+    if (!changed)
+        return false;
+
+    /* Errors are reported by reload(), and what was loaded before is
+     * kept.  */
+    lwan_status_info("%s changed, reloading", watch->path);
+    if (watch->reload(watch->data))
+        ATOMIC_INC(watch->generation);
+
+    return true;
+}
+
+bool lwan_file_watch_start(struct lwan_file_watch *watch, const char *path,
+    bool (*reload)(void *data), void *data)
+{
+    const char *slash = strrchr(path, '/');
+    const char *dir;
+
+    if (slash) {
+        watch->name = slash + 1;
+        dir = slash == path ? "/" : strndupa(path, (size_t)(slash - path));
+    } else {
+        watch->name = path;
+        dir = ".";
+    }
+
+    watch->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->inotify_fd < 0) {
+        lwan_status_perror("inotify_init1");
+        return false;
+    }
+
+    if (inotify_add_watch(watch->inotify_fd, dir,
+                          IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        lwan_status_perror("inotify_add_watch");
+        close(watch->inotify_fd);
+        return false;
+    }
+
+    watch->path = path;
+    watch->reload = reload;
+    watch->data = data;
+    lwan_job_add(watch_job, watch);
+
+    return true;
+}
+
+void lwan_file_watch_stop(struct lwan_file_watch *watch)
+{
+    if (!watch->path)
+        return;
+
+    lwan_job_del(watch_job, watch);
+    close(watch->inotify_fd);
+    watch->path = NULL;
+}
+
+/* Returns this thread's copy (stored with key), after passing it to
+ * update() if there has been a reload since it was made, or if there's no
+ * copy yet.  update() returns the copy to use from then on, which might
+ * be the one it was given (if it couldn't make a new one), or NULL.  */
+void *lwan_file_watch_get_copy(struct lwan_file_watch *watch,
+    pthread_key_t key,
+    struct lwan_file_watch_copy *(*update)(void *data,
+                                           struct lwan_file_watch_copy *copy),
+    void *data)
+{
+    struct lwan_file_watch_copy *copy = pthread_getspecific(key);
+    unsigned int generation = ATOMIC_READ(watch->generation);
+    struct lwan_file_watch_copy *new_copy;
+
+    if (LIKELY(copy && copy->generation == generation))
+        return copy;
+
+    /* If there's another reload meanwhile, the copy will be updated again
+     * next time.  */
+    new_copy = update(data, copy);
+    if (UNLIKELY(!new_copy))
+        return NULL;
+
+    new_copy->generation = generation;
+    if (new_copy != copy)
+        pthread_setspecific(key, new_copy);
+
+    return new_copy;
+}
@@ -0,0 +1,62 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+
+/*
+ * Reloads something (a Lua script, a redirect map) whenever the file it
+ * was loaded from changes.  The directory containing the file is watched,
+ * so that editors and tools replacing the file, instead of writing to it,
+ * are noticed too.
+ *
+ * Each I/O thread uses its own copy of what was loaded, replaced the
+ * first time the thread uses it after a reload; copies start with a
+ * struct lwan_file_watch_copy.  A zeroed struct lwan_file_watch can be
+ * used for copies even if the file isn't watched.
+ */
+
+struct lwan_file_watch_copy {
+    unsigned int generation;
+};
+
+struct lwan_file_watch {
+    /* Bumped after every successful reload.  */
+    unsigned int generation;
+
+    /* Both point to the path given to lwan_file_watch_start().  */
+    const char *path;
+    const char *name;
+    int inotify_fd;
+
+    bool (*reload)(void *data);
+    void *data;
+};
+
+bool lwan_file_watch_start(struct lwan_file_watch *watch, const char *path,
+    bool (*reload)(void *data), void *data);
+void lwan_file_watch_stop(struct lwan_file_watch *watch);
+
+void *lwan_file_watch_get_copy(struct lwan_file_watch *watch,
+    pthread_key_t key,
+    struct lwan_file_watch_copy *(*update)(void *data,
+                                           struct lwan_file_watch_copy *copy),
+    void *data);
@@ -17,22 +17,84 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#define _GNU_SOURCE
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBCRYPT
+#include <crypt.h>
+#endif
 
 #include "base64.h"
+#include "lwan-private.h"
 #include "lwan-cache.h"
 #include "lwan-config.h"
 #include "lwan-http-authorize.h"
 
+/* Entries in the per-thread cache of checked credentials; only the first
+ * request from a client pays for hashing its password.  Credentials found
+ * to be invalid are remembered for a shorter while.  */
+#define AUTH_CACHE_ENTRIES 256
+#define AUTH_CACHE_TTL 60
+#define AUTH_CACHE_FAILED_TTL 5
+
+/* Hashing a password with crypt(3) is slow on purpose, and happens on the
+ * I/O thread: clients failing to match a hashed password more than
+ * AUTH_MAX_FAILURES times within AUTH_FAILURE_WINDOW seconds are turned
+ * away without hashing anything until the window is over.  Tracked per
+ * thread, in a table of AUTH_FAILURE_ENTRIES clients.  */
+#define AUTH_FAILURE_ENTRIES 64
+#define AUTH_MAX_FAILURES 5
+#define AUTH_FAILURE_WINDOW 10
+
+/* Longest "user:password" accepted, decoded.  */
+#define MAX_CREDENTIALS_LEN 255
+
 struct realm_password_file_t {
     struct cache_entry base;
     struct hash *entries;
+
+    /* Different for each time a password file is read, so that cached
+     * credentials don't outlive the file they were checked against.  */
+    unsigned int generation;
+};
+
+struct auth_cache_entry {
+    uint64_t digest[2];
+    unsigned int generation;
+    bool valid;
+    time_t expires;
+};
+
+struct auth_failures {
+    uint64_t client;
+    unsigned int count;
+    time_t window_end;
+};
+
+struct lwan_auth_cache {
+    struct auth_cache_entry entries[AUTH_CACHE_ENTRIES];
+    struct auth_failures failures[AUTH_FAILURE_ENTRIES];
+
+#ifdef HAVE_LIBCRYPT
+    /* Too large for a coroutine stack.  */
+    struct crypt_data crypt_data;
+#endif
 };
 
 static struct cache *realm_password_cache = NULL;
+static unsigned int realm_file_generation;
+
+/* Credentials are cached as their SipHash, keyed with this, rather than
+ * as they were sent.  Nothing is cached if it couldn't be generated.  */
+static uint64_t auth_cache_key[2];
+static bool auth_cache_enabled;
 
 static void fourty_two_and_free(void *str)
 {
@@ -71,6 +133,15 @@ static struct cache_entry *create_realm_file(
             if (!username)
                 goto error;
 
+#ifndef HAVE_LIBCRYPT
+            if (l.value[0] == '$') {
+                lwan_status_warning(
+                    "Lwan has been built without libcrypt, ignoring hashed "
+                    "password for \"%s\"", l.key);
+                continue;
+            }
+#endif
+
             char *password = strdup(l.value);
             if (!password) {
                 free(username);
@@ -106,6 +177,7 @@ static struct cache_entry *create_realm_file(
     }
 
     config_close(f);
+    rpf->generation = ATOMIC_INC(realm_file_generation);
     return (struct cache_entry *)rpf;
 
 error:
@@ -124,9 +196,32 @@ static void destroy_realm_file(struct cache_entry *entry,
     free(rpf);
 }
 
+static bool
+get_random_key(uint64_t key[2])
+{
+#ifdef SYS_getrandom
+    if (syscall(SYS_getrandom, key, 2 * sizeof(uint64_t), 0) ==
+        2 * sizeof(uint64_t))
+        return true;
+#endif
+
+    int fd = open("/dev/urandom", O_CLOEXEC | O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    ssize_t r = read(fd, key, 2 * sizeof(uint64_t));
+    close(fd);
+
+    return r == 2 * sizeof(uint64_t);
+}
+
 bool
 lwan_http_authorize_init(void)
 {
+    auth_cache_enabled = get_random_key(auth_cache_key);
+    if (!auth_cache_enabled)
+        lwan_status_warning("Could not get random key, won't cache credentials");
+
     realm_password_cache = cache_create(create_realm_file,
           destroy_realm_file, NULL, 60);
 
@@ -139,27 +234,174 @@ lwan_http_authorize_shutdown(void)
     cache_destroy(realm_password_cache);
 }
 
+void
+lwan_http_authorize_cache_free(struct lwan_auth_cache *cache)
+{
+    free(cache);
+}
+
+static struct lwan_auth_cache *
+get_auth_cache(struct lwan_thread *thread)
+{
+    if (UNLIKELY(!thread->auth_cache))
+        thread->auth_cache = calloc(1, sizeof(*thread->auth_cache));
+
+    return thread->auth_cache;
+}
+
+#define ROTL64(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND                                                               \
+    do {                                                                       \
+        v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32);          \
+        v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2;                               \
+        v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0;                               \
+        v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32);          \
+    } while (0)
+
+/* SipHash-2-4, with 128-bit output.  */
+static void
+siphash128(const uint64_t key[2], const void *data, size_t len,
+    uint64_t out[2])
+{
+    const unsigned char *in = data;
+    uint64_t v0 = UINT64_C(0x736f6d6570736575) ^ key[0];
+    uint64_t v1 = UINT64_C(0x646f72616e646f6d) ^ key[1] ^ 0xee;
+    uint64_t v2 = UINT64_C(0x6c7967656e657261) ^ key[0];
+    uint64_t v3 = UINT64_C(0x7465646279746573) ^ key[1];
+    uint64_t b = (uint64_t)len << 56;
+
+    for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t), in += sizeof(uint64_t)) {
+        uint64_t m;
+
+        memcpy(&m, in, sizeof(m));
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+    for (size_t i = 0; i < len; i++)
+        b |= (uint64_t)in[i] << (8 * i);
+
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+
+    v2 ^= 0xee;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    out[0] = v0 ^ v1 ^ v2 ^ v3;
+
+    v1 ^= 0xdd;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    out[1] = v0 ^ v1 ^ v2 ^ v3;
+}
+
+#undef SIPROUND
+#undef ROTL64
+
+static bool
+streq_constant_time(const char *a, const char *b)
+{
+    size_t len_a = strlen(a);
+    size_t len_b = strlen(b);
+    unsigned char diff = len_a != len_b;
+
+    for (size_t i = 0; i < len_a; i++)
+        diff |= (unsigned char)(a[i] ^ b[i % (len_b ? len_b : 1)]);
+
+    return !diff;
+}
+
+static bool
+check_password(struct lwan_auth_cache *cache __attribute__((unused)),
+    const char *password,
+    const char *stored)
+{
+    /* Entries starting with "$" are hashed with crypt(3): SHA-crypt,
+     * bcrypt, yescrypt, or whatever else libcrypt supports.  */
+    if (stored[0] != '$')
+        return streq_constant_time(password, stored);
+
+#ifdef HAVE_LIBCRYPT
+    if (UNLIKELY(!cache))
+        return false;
+
+    const char *hashed = crypt_r(password, stored, &cache->crypt_data);
+    if (UNLIKELY(!hashed || hashed[0] == '*'))
+        return false;
+
+    return streq_constant_time(hashed, stored);
+#else
+    return false;
+#endif
+}
+
+static struct auth_failures *
+get_failures(struct lwan_request *request, struct lwan_auth_cache *cache,
+    time_t now)
+{
+    char buffer[INET6_ADDRSTRLEN];
+    const char *addr = lwan_request_get_remote_address(request, buffer);
+    struct auth_failures *failures;
+    uint64_t digest[2];
+
+    if (UNLIKELY(!addr))
+        addr = "";
+
+    siphash128(auth_cache_key, addr, strlen(addr), digest);
+
+    failures = &cache->failures[digest[0] % AUTH_FAILURE_ENTRIES];
+    if (failures->client != digest[0] || failures->window_end <= now) {
+        *failures = (struct auth_failures) {
+            .client = digest[0],
+            .window_end = now + AUTH_FAILURE_WINDOW,
+        };
+    }
+
+    return failures;
+}
+
 static bool
-authorize(struct coro *coro,
+authorize(struct lwan_request *request,
     struct lwan_value *authorization,
     const char *password_file)
 {
     struct realm_password_file_t *rpf;
-    unsigned char *decoded;
+    struct lwan_auth_cache *cache;
+    struct auth_cache_entry *cached = NULL;
+    unsigned char decoded[MAX_CREDENTIALS_LEN + 1];
+    uint64_t digest[2];
+    time_t now = request->conn->thread->date.last;
     char *colon;
-    char *password;
     char *looked_password;
     size_t decoded_len;
     bool password_ok = false;
 
     rpf = (struct realm_password_file_t *)cache_coro_get_and_ref_entry(
-            realm_password_cache, coro, password_file);
+            realm_password_cache, request->conn->coro, password_file);
     if (UNLIKELY(!rpf))
         return false;
 
-    decoded = base64_decode((unsigned char *)authorization->value,
-                            authorization->len, &decoded_len);
-    if (UNLIKELY(!decoded))
+    cache = get_auth_cache(request->conn->thread);
+    if (LIKELY(cache && auth_cache_enabled)) {
+        siphash128(auth_cache_key, authorization->value, authorization->len,
+            digest);
+
+        cached = &cache->entries[digest[0] % AUTH_CACHE_ENTRIES];
+        if (cached->generation == rpf->generation && cached->expires > now &&
+            cached->digest[0] == digest[0] && cached->digest[1] == digest[1])
+            return cached->valid;
+    }
+
+    if (UNLIKELY(!base64_decode_into((unsigned char *)authorization->value,
+                                     authorization->len, decoded,
+                                     sizeof(decoded), &decoded_len)))
         return false;
 
     colon = memchr(decoded, ':', decoded_len);
@@ -167,14 +409,35 @@ authorize(struct coro *coro,
         goto out;
 
     *colon = '\0';
-    password = colon + 1;
 
     looked_password = hash_find(rpf->entries, decoded);
-    if (looked_password)
-        password_ok = streq(password, looked_password);
+    if (!looked_password)
+        goto out;
+
+    if (looked_password[0] == '$' && cache) {
+        struct auth_failures *failures = get_failures(request, cache, now);
+
+        if (failures->count >= AUTH_MAX_FAILURES)
+            return false;
+
+        password_ok = check_password(cache, colon + 1, looked_password);
+        if (!password_ok)
+            failures->count++;
+    } else {
+        password_ok = check_password(cache, colon + 1, looked_password);
+    }
+
+    /* Don't let invalid credentials evict valid ones.  */
+    if (cached && (password_ok || !cached->valid || cached->expires <= now)) {
+        *cached = (struct auth_cache_entry) {
+            .digest = { digest[0], digest[1] },
+            .generation = rpf->generation,
+            .valid = password_ok,
+            .expires = now + (password_ok ? AUTH_CACHE_TTL : AUTH_CACHE_FAILED_TTL),
+        };
+    }
 
 out:
-    free(decoded);
     return password_ok;
 }
 
@@ -197,7 +460,7 @@ lwan_http_authorize(struct lwan_request *request,
     authorization->value += basic_len;
     authorization->len -= basic_len;
 
-    if (authorize(request->conn->coro, authorization, password_file))
+    if (authorize(request, authorization, password_file))
         return true;
 
 unauthorized:
@@ -24,6 +24,9 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <time.h>
 
 #include "lwan.h"
 #include "lwan-io-wrappers.h"
@@ -113,40 +116,188 @@ static inline size_t min_size(size_t a, size_t b)
     return (a > b) ? b : a;
 }
 
-void
-lwan_sendfile(struct lwan_request *request, int in_fd, off_t offset, size_t count,
-    const char *header, size_t header_len)
+/* Writers are woken up once the data that hasn't been sent yet goes below
+ * this, instead of whenever there's room in the send buffer: slow clients
+ * don't get megabytes queued for them, and fast ones are refilled before
+ * they run dry.  */
+#define SENDFILE_NOTSENT_LOWAT (1<<17)
+#define SENDFILE_MAX_CHUNK (1<<19)
+/* Bytes sent to a client that keeps up before yielding anyway, so that
+ * other connections handled by this thread get a chance to run.  */
+#define SENDFILE_FAIRNESS_BUDGET (1<<21)
+
+struct sendfile_state {
+    off_t offset;
+    size_t since_yield;
+    unsigned int waits;
+    struct timespec start;
+};
+
+static void
+sendfile_state_init(struct lwan_request *request, struct sendfile_state *state,
+    off_t offset)
 {
-    size_t chunk_size = min_size(count, 1<<17);
-    size_t to_be_written = count;
+    struct lwan_connection *conn = request->conn;
 
-    lwan_send(request, header, header_len, MSG_MORE);
+#ifdef TCP_NOTSENT_LOWAT
+    if (!(conn->flags & CONN_NOTSENT_LOWAT)) {
+        int lowat = SENDFILE_NOTSENT_LOWAT;
+
+        /* Only available since Linux 3.12; sending works without it.  */
+        (void)setsockopt(request->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                         &lowat, sizeof(lowat));
+        conn->flags |= CONN_NOTSENT_LOWAT;
+    }
+#else
+    (void)conn;
+#endif
+
+    state->offset = offset;
+    state->since_yield = 0;
+    state->waits = 0;
+    clock_gettime(CLOCK_MONOTONIC, &state->start);
+}
+
+static void
+sendfile_state_log(struct lwan_request *request,
+    const struct sendfile_state *state, size_t count)
+{
+    struct lwan_thread *t = request->conn->thread;
+    struct timespec now;
+    uint64_t elapsed_ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed_ns = (uint64_t)(now.tv_sec - state->start.tv_sec) * 1000000000ull +
+        (uint64_t)(now.tv_nsec - state->start.tv_nsec);
+
+    /* Bytes and yields have been counted as they happened.  */
+    ATOMIC_INC(t->sendfile.files);
+    ATOMIC_AAF(&t->sendfile.ns, elapsed_ns);
+
+    lwan_status_debug("Sent %zu bytes in %.3fs (%.2f MiB/s), yielding %u times",
+        count, (double)elapsed_ns / 1e9,
+        elapsed_ns ? (double)count * 1e9 / (double)elapsed_ns / (1<<20) : 0.0,
+        state->waits);
+}
+
+static ALWAYS_INLINE void
+sendfile_yield(struct lwan_request *request, struct sendfile_state *state)
+{
+    /* The coroutine is resumed once the socket is writable, which, with
+     * TCP_NOTSENT_LOWAT, means there's little left to send in it.  */
+    coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
+
+    state->since_yield = 0;
+    state->waits++;
+    ATOMIC_INC(request->conn->thread->sendfile.yields);
+}
+
+/* Sends as much as the socket takes right away, up to count bytes, so that
+ * chunks are as large as the space available in the socket.  Yields if it
+ * didn't take everything, or if the fairness budget has been used up.  */
+static size_t
+sendfile_some(struct lwan_request *request, int in_fd,
+    struct sendfile_state *state, size_t count)
+{
+    count = min_size(count, SENDFILE_MAX_CHUNK);
+
+    while (true) {
+        ssize_t written = sendfile(request->fd, in_fd, &state->offset, count);
+
+        if (LIKELY(written > 0)) {
+            state->since_yield += (size_t)written;
+            ATOMIC_AAF(&request->conn->thread->sendfile.bytes, (uint64_t)written);
+
+            if ((size_t)written < count ||
+                    state->since_yield >= SENDFILE_FAIRNESS_BUDGET)
+                sendfile_yield(request, state);
+
+            return (size_t)written;
+        }
 
-    do {
-        ssize_t written = sendfile(request->fd, in_fd, &offset, chunk_size);
         if (written < 0) {
             switch (errno) {
             case EAGAIN:
+                sendfile_yield(request, state);
+                /* Fallthrough */
             case EINTR:
-                coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
                 continue;
-
-            default:
-                coro_yield(request->conn->coro, CONN_CORO_ABORT);
-                __builtin_unreachable();
             }
         }
 
-        to_be_written -= (size_t)written;
-        chunk_size = min_size(to_be_written, 1<<19);
-
-        coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
-    } while (to_be_written > 0);
+        /* Error, or file truncated while it was being sent.  */
+        coro_yield(request->conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
 }
-#elif defined(__FreeBSD__) || defined(__APPLE__)
+
 void
 lwan_sendfile(struct lwan_request *request, int in_fd, off_t offset, size_t count,
     const char *header, size_t header_len)
+{
+    struct sendfile_state state;
+    size_t to_be_written = count;
+
+    sendfile_state_init(request, &state, offset);
+
+    lwan_send(request, header, header_len, MSG_MORE);
+
+    while (to_be_written > 0)
+        to_be_written -= sendfile_some(request, in_fd, &state, to_be_written);
+
+    sendfile_state_log(request, &state, count);
+}
+
+#define STREAMING_CHUNK_SIZE SENDFILE_MAX_CHUNK
+#define STREAMING_READAHEAD (4 * STREAMING_CHUNK_SIZE)
+#define STREAMING_DROP_BEHIND (16 * STREAMING_CHUNK_SIZE)
+
+void
+lwan_sendfile_streaming(struct lwan_request *request, int in_fd, off_t offset,
+    size_t count, const char *header, size_t header_len)
+{
+    const off_t end = offset + (off_t)count;
+    off_t read_ahead_until = offset;
+    off_t dropped_until = offset;
+    struct sendfile_state state;
+
+    sendfile_state_init(request, &state, offset);
+
+    /* Ask for the next few chunks to be read before they're needed, and
+     * drop from the page cache what has already been sent, so that a
+     * large file doesn't evict everything else while it's streamed.  Pages
+     * still referenced by socket buffers (which can hold a few MiB) can't
+     * be dropped, so stay well behind what has been sent.  */
+    lwan_send(request, header, header_len, MSG_MORE);
+
+    while (state.offset < end) {
+        if (read_ahead_until < end &&
+                read_ahead_until - state.offset < STREAMING_READAHEAD / 2) {
+            off_t len = (off_t)min_size((size_t)(end - read_ahead_until),
+                                        STREAMING_READAHEAD);
+
+            posix_fadvise(in_fd, read_ahead_until, len, POSIX_FADV_WILLNEED);
+            read_ahead_until += len;
+        }
+
+        sendfile_some(request, in_fd, &state, (size_t)(end - state.offset));
+
+        if (state.offset - dropped_until >= STREAMING_DROP_BEHIND + STREAMING_CHUNK_SIZE) {
+            off_t len = state.offset - STREAMING_DROP_BEHIND - dropped_until;
+
+            posix_fadvise(in_fd, dropped_until, len, POSIX_FADV_DONTNEED);
+            dropped_until += len;
+        }
+    }
+
+    posix_fadvise(in_fd, dropped_until, end - dropped_until, POSIX_FADV_DONTNEED);
+
+    sendfile_state_log(request, &state, count);
+}
+#elif defined(__FreeBSD__) || defined(__APPLE__)
+static void
+sendfile_with_flags(struct lwan_request *request, int in_fd, off_t offset,
+    size_t count, const char *header, size_t header_len, int flags)
 {
     struct sf_hdtr headers = {
         .headers = (struct iovec[]) {
@@ -164,9 +315,10 @@ lwan_sendfile(struct lwan_request *request, int in_fd, off_t offset, size_t coun
         int r;
 
 #ifdef __APPLE__
-        r = sendfile(in_fd, request->fd, offset, &sbytes, &headers, 0);
+        r = sendfile(in_fd, request->fd, offset, &sbytes, &headers, flags);
 #else
-        r = sendfile(in_fd, request->fd, offset, count, &headers, &sbytes, SF_MNOWAIT);
+        r = sendfile(in_fd, request->fd, offset, count, &headers, &sbytes,
+                     SF_MNOWAIT | flags);
 #endif
 
         if (UNLIKELY(r < 0)) {
@@ -188,6 +340,27 @@ lwan_sendfile(struct lwan_request *request, int in_fd, off_t offset, size_t coun
         coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
     } while (total_written < count);
 }
+
+void
+lwan_sendfile(struct lwan_request *request, int in_fd, off_t offset, size_t count,
+    const char *header, size_t header_len)
+{
+    sendfile_with_flags(request, in_fd, offset, count, header, header_len, 0);
+}
+
+void
+lwan_sendfile_streaming(struct lwan_request *request, int in_fd, off_t offset,
+    size_t count, const char *header, size_t header_len)
+{
+    /* SF_NOCACHE (FreeBSD 11+) has sent pages freed rather than cached;
+     * macOS has no equivalent, so files are sent as usual there.  */
+#ifdef SF_NOCACHE
+    sendfile_with_flags(request, in_fd, offset, count, header, header_len,
+                        SF_NOCACHE);
+#else
+    lwan_sendfile(request, in_fd, offset, count, header, header_len);
+#endif
+}
 #else
 #error No sendfile() implementation for this platform
 #endif
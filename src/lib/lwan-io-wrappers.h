@@ -31,4 +31,7 @@ ssize_t lwan_send(struct lwan_request *request, const void *buf, size_t count,
 void lwan_sendfile(struct lwan_request *request, int in_fd,
                     off_t offset, size_t count,
                     const char *header, size_t header_len);
+void lwan_sendfile_streaming(struct lwan_request *request, int in_fd,
+                    off_t offset, size_t count,
+                    const char *header, size_t header_len);
 
@@ -0,0 +1,589 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <lauxlib.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lwan-private.h"
+#include "lwan-lua-shared.h"
+
+/*
+ * Dictionaries are shared by the Lua states of all I/O threads.  Memory
+ * is allocated up front: a dictionary is split in stripes, each with its
+ * own lock, hash table, and a fixed number of fixed-size entries kept in
+ * LRU order.  A key can only be in the stripe picked by its hash, so
+ * threads only contend when touching keys in the same stripe; once a
+ * stripe is full, storing a new key in it evicts its least recently used
+ * entry.  Expired entries are dropped when they're found.
+ */
+
+#define MAX_STRIPES 64
+#define MIN_ENTRIES_PER_STRIPE 16
+#define NO_ENTRY UINT32_MAX
+
+/* Seconds; longer TTLs are taken as never expiring.  */
+#define MAX_TTL (10.0 * 365 * 24 * 60 * 60)
+
+enum value_type {
+    VALUE_STRING,
+    VALUE_NUMBER,
+    VALUE_BOOLEAN,
+};
+
+struct entry {
+    uint32_t hash;
+    uint32_t next; /* Next in the hash chain, or in the free list.  */
+    uint32_t lru_prev, lru_next;
+
+    /* Milliseconds, CLOCK_MONOTONIC; 0 if it never expires.  */
+    uint64_t expires;
+
+    lua_Number number;
+    uint32_t value_len;
+    uint16_t key_len;
+    uint8_t type;
+
+    /* The key, followed by the value if it's a string.  */
+    char data[];
+};
+
+struct stripe {
+    pthread_mutex_t lock;
+    char *entries;
+    uint32_t *buckets;
+    uint32_t free;
+    uint32_t lru_head, lru_tail; /* Most recently used at the head.  */
+} __attribute__((aligned(64)));
+
+struct lwan_lua_shared_dict {
+    char *name;
+
+    size_t key_size;
+    size_t value_size;
+    size_t entry_size;
+
+    uint32_t stripe_mask;
+    uint32_t bucket_mask;
+
+    char *entries;
+    uint32_t *buckets;
+    struct stripe *stripes;
+};
+
+static const char *shared_dict_metatable_name = "Lwan.SharedDict";
+
+static uint64_t now_msec(void)
+{
+    struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+    if (clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) < 0)
+#endif
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static uint64_t hash_key(const char *key, size_t len)
+{
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+
+    /* FNV-1a and a finalizer: the low bits pick the bucket, and the high
+     * bits pick the stripe.  */
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= UINT64_C(0x100000001b3);
+    }
+
+    hash ^= hash >> 33;
+    hash *= UINT64_C(0xff51afd7ed558ccd);
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+struct lwan_lua_shared_dict *lwan_lua_shared_dict_new(const char *name,
+    size_t entries, size_t key_size, size_t value_size)
+{
+    struct lwan_lua_shared_dict *dict;
+    size_t n_stripes = MAX_STRIPES;
+    size_t entries_per_stripe;
+    size_t n_buckets = 1;
+
+    if (!entries || !key_size || key_size > UINT16_MAX ||
+        value_size > UINT32_MAX)
+        return NULL;
+
+    while (n_stripes > 1 && entries / n_stripes < MIN_ENTRIES_PER_STRIPE)
+        n_stripes >>= 1;
+    entries_per_stripe = (entries + n_stripes - 1) / n_stripes;
+    if (entries_per_stripe >= NO_ENTRY)
+        return NULL;
+    while (n_buckets < entries_per_stripe)
+        n_buckets <<= 1;
+
+    dict = calloc(1, sizeof(*dict));
+    if (!dict)
+        return NULL;
+
+    dict->name = strdup(name);
+    if (!dict->name)
+        goto error;
+
+    dict->key_size = key_size;
+    dict->value_size = value_size;
+    dict->entry_size = (sizeof(struct entry) + key_size + value_size + 7) & ~(size_t)7;
+    dict->stripe_mask = (uint32_t)(n_stripes - 1);
+    dict->bucket_mask = (uint32_t)(n_buckets - 1);
+
+    dict->entries = calloc(n_stripes * entries_per_stripe, dict->entry_size);
+    if (!dict->entries)
+        goto error;
+
+    dict->buckets = malloc(n_stripes * n_buckets * sizeof(uint32_t));
+    if (!dict->buckets)
+        goto error;
+    memset(dict->buckets, 0xff, n_stripes * n_buckets * sizeof(uint32_t));
+
+    if (posix_memalign((void **)&dict->stripes, 64,
+                       n_stripes * sizeof(struct stripe))) {
+        dict->stripes = NULL;
+        goto error;
+    }
+
+    for (size_t i = 0; i < n_stripes; i++) {
+        struct stripe *stripe = &dict->stripes[i];
+
+        pthread_mutex_init(&stripe->lock, NULL);
+        stripe->entries = dict->entries + i * entries_per_stripe * dict->entry_size;
+        stripe->buckets = dict->buckets + i * n_buckets;
+        stripe->lru_head = stripe->lru_tail = NO_ENTRY;
+
+        stripe->free = NO_ENTRY;
+        for (size_t j = entries_per_stripe; j > 0; j--) {
+            struct entry *entry = (struct entry *)(stripe->entries +
+                                                   (j - 1) * dict->entry_size);
+
+            entry->next = stripe->free;
+            stripe->free = (uint32_t)(j - 1);
+        }
+    }
+
+    return dict;
+
+error:
+    free(dict->buckets);
+    free(dict->entries);
+    free(dict->name);
+    free(dict);
+    return NULL;
+}
+
+void lwan_lua_shared_dict_free(struct lwan_lua_shared_dict *dict)
+{
+    if (!dict)
+        return;
+
+    for (uint32_t i = 0; i <= dict->stripe_mask; i++)
+        pthread_mutex_destroy(&dict->stripes[i].lock);
+
+    free(dict->stripes);
+    free(dict->buckets);
+    free(dict->entries);
+    free(dict->name);
+    free(dict);
+}
+
+const char *lwan_lua_shared_dict_name(const struct lwan_lua_shared_dict *dict)
+{
+    return dict->name;
+}
+
+static ALWAYS_INLINE struct entry *
+entry_at(const struct lwan_lua_shared_dict *dict, const struct stripe *stripe,
+    uint32_t index)
+{
+    return (struct entry *)(stripe->entries + index * dict->entry_size);
+}
+
+static void lru_unlink(const struct lwan_lua_shared_dict *dict,
+    struct stripe *stripe, uint32_t index)
+{
+    struct entry *entry = entry_at(dict, stripe, index);
+
+    if (entry->lru_prev != NO_ENTRY)
+        entry_at(dict, stripe, entry->lru_prev)->lru_next = entry->lru_next;
+    else
+        stripe->lru_head = entry->lru_next;
+
+    if (entry->lru_next != NO_ENTRY)
+        entry_at(dict, stripe, entry->lru_next)->lru_prev = entry->lru_prev;
+    else
+        stripe->lru_tail = entry->lru_prev;
+}
+
+static void lru_push_head(const struct lwan_lua_shared_dict *dict,
+    struct stripe *stripe, uint32_t index)
+{
+    struct entry *entry = entry_at(dict, stripe, index);
+
+    entry->lru_prev = NO_ENTRY;
+    entry->lru_next = stripe->lru_head;
+    if (stripe->lru_head != NO_ENTRY)
+        entry_at(dict, stripe, stripe->lru_head)->lru_prev = index;
+    else
+        stripe->lru_tail = index;
+    stripe->lru_head = index;
+}
+
+static void entry_remove(const struct lwan_lua_shared_dict *dict,
+    struct stripe *stripe, uint32_t index)
+{
+    struct entry *entry = entry_at(dict, stripe, index);
+    uint32_t *link = &stripe->buckets[entry->hash & dict->bucket_mask];
+
+    while (*link != index)
+        link = &entry_at(dict, stripe, *link)->next;
+    *link = entry->next;
+
+    lru_unlink(dict, stripe, index);
+
+    entry->next = stripe->free;
+    stripe->free = index;
+}
+
+static uint32_t entry_find(const struct lwan_lua_shared_dict *dict,
+    struct stripe *stripe, uint64_t hash, const char *key, size_t key_len)
+{
+    uint32_t index = stripe->buckets[(uint32_t)hash & dict->bucket_mask];
+
+    while (index != NO_ENTRY) {
+        struct entry *entry = entry_at(dict, stripe, index);
+
+        if (entry->hash == (uint32_t)hash && entry->key_len == key_len &&
+            !memcmp(entry->data, key, key_len)) {
+            if (entry->expires && entry->expires <= now_msec()) {
+                entry_remove(dict, stripe, index);
+                return NO_ENTRY;
+            }
+
+            return index;
+        }
+
+        index = entry->next;
+    }
+
+    return NO_ENTRY;
+}
+
+static uint32_t entry_insert(const struct lwan_lua_shared_dict *dict,
+    struct stripe *stripe, uint64_t hash, const char *key, size_t key_len)
+{
+    uint32_t *bucket = &stripe->buckets[(uint32_t)hash & dict->bucket_mask];
+    struct entry *entry;
+    uint32_t index;
+
+    if (stripe->free == NO_ENTRY)
+        entry_remove(dict, stripe, stripe->lru_tail);
+
+    index = stripe->free;
+    entry = entry_at(dict, stripe, index);
+    stripe->free = entry->next;
+
+    entry->hash = (uint32_t)hash;
+    entry->key_len = (uint16_t)key_len;
+    memcpy(entry->data, key, key_len);
+
+    entry->next = *bucket;
+    *bucket = index;
+    lru_push_head(dict, stripe, index);
+
+    return index;
+}
+
+static uint64_t ttl_to_expires(lua_State *L, int n)
+{
+    lua_Number ttl = luaL_optnumber(L, n, 0);
+
+    /* Also catches NaN.  */
+    if (!(ttl > 0))
+        return 0;
+    /* Converting something as large as math.huge to an integer is
+     * undefined, and entries living for years never expire in practice.  */
+    if (ttl >= MAX_TTL)
+        return 0;
+    return now_msec() + (ttl < 0.001 ? 1 : (uint64_t)(ttl * 1000));
+}
+
+static ALWAYS_INLINE struct lwan_lua_shared_dict *
+userdata_as_shared_dict(lua_State *L, int n)
+{
+    return *((struct lwan_lua_shared_dict **)luaL_checkudata(
+        L, n, shared_dict_metatable_name));
+}
+
+static struct stripe *lock_stripe_for_key(lua_State *L,
+    struct lwan_lua_shared_dict **dict, const char **key, size_t *key_len,
+    uint64_t *hash)
+{
+    struct stripe *stripe;
+
+    *dict = userdata_as_shared_dict(L, 1);
+    *key = luaL_checklstring(L, 2, key_len);
+    if (*key_len > (*dict)->key_size)
+        luaL_argerror(L, 2, "key too long");
+
+    *hash = hash_key(*key, *key_len);
+    stripe = &(*dict)->stripes[(uint32_t)(*hash >> 32) & (*dict)->stripe_mask];
+    pthread_mutex_lock(&stripe->lock);
+
+    return stripe;
+}
+
+static int shared_dict_get_cb(lua_State *L)
+{
+    struct lwan_lua_shared_dict *dict = userdata_as_shared_dict(L, 1);
+    char small_buffer[256];
+    char *buffer = small_buffer;
+    enum value_type type = VALUE_STRING;
+    lua_Number number = 0;
+    size_t value_len = 0;
+    const char *key;
+    size_t key_len;
+    uint64_t hash;
+
+    /* Nothing that can raise an error (and longjmp past the unlock) is
+     * done while the stripe is locked: strings are copied out, and only
+     * pushed once it has been unlocked.  Larger buffers are allocated
+     * beforehand, as userdata that the collector takes care of.  */
+    if (dict->value_size > sizeof(small_buffer))
+        buffer = lua_newuserdata(L, dict->value_size);
+
+    struct stripe *stripe = lock_stripe_for_key(L, &dict, &key, &key_len, &hash);
+    uint32_t index = entry_find(dict, stripe, hash, key, key_len);
+
+    if (index != NO_ENTRY) {
+        struct entry *entry = entry_at(dict, stripe, index);
+
+        lru_unlink(dict, stripe, index);
+        lru_push_head(dict, stripe, index);
+
+        type = entry->type;
+        if (type == VALUE_STRING) {
+            value_len = entry->value_len;
+            memcpy(buffer, entry->data + entry->key_len, value_len);
+        } else {
+            number = entry->number;
+        }
+    }
+
+    pthread_mutex_unlock(&stripe->lock);
+
+    if (index == NO_ENTRY) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    switch (type) {
+    case VALUE_STRING:
+        lua_pushlstring(L, buffer, value_len);
+        break;
+    case VALUE_NUMBER:
+        lua_pushnumber(L, number);
+        break;
+    case VALUE_BOOLEAN:
+        lua_pushboolean(L, number != 0);
+        break;
+    }
+
+    return 1;
+}
+
+static int shared_dict_set_cb(lua_State *L)
+{
+    int type = lua_type(L, 3);
+    const char *value = NULL;
+    size_t value_len = 0;
+
+    if (type == LUA_TSTRING) {
+        value = lua_tolstring(L, 3, &value_len);
+        if (value_len > userdata_as_shared_dict(L, 1)->value_size) {
+            lua_pushnil(L);
+            lua_pushstring(L, "value too large");
+            return 2;
+        }
+    } else if (type != LUA_TNUMBER && type != LUA_TBOOLEAN && type != LUA_TNIL) {
+        return luaL_argerror(L, 3, "string, number, boolean or nil expected");
+    }
+
+    uint64_t expires = ttl_to_expires(L, 4);
+    struct lwan_lua_shared_dict *dict;
+    const char *key;
+    size_t key_len;
+    uint64_t hash;
+    struct stripe *stripe = lock_stripe_for_key(L, &dict, &key, &key_len, &hash);
+    uint32_t index = entry_find(dict, stripe, hash, key, key_len);
+
+    if (type == LUA_TNIL) {
+        /* Setting a key to nil deletes it.  */
+        if (index != NO_ENTRY)
+            entry_remove(dict, stripe, index);
+    } else {
+        struct entry *entry;
+
+        if (index == NO_ENTRY) {
+            index = entry_insert(dict, stripe, hash, key, key_len);
+        } else {
+            lru_unlink(dict, stripe, index);
+            lru_push_head(dict, stripe, index);
+        }
+
+        entry = entry_at(dict, stripe, index);
+        entry->expires = expires;
+        entry->value_len = (uint32_t)value_len;
+
+        switch (type) {
+        case LUA_TSTRING:
+            entry->type = VALUE_STRING;
+            memcpy(entry->data + key_len, value, value_len);
+            break;
+        case LUA_TNUMBER:
+            entry->type = VALUE_NUMBER;
+            entry->number = lua_tonumber(L, 3);
+            break;
+        case LUA_TBOOLEAN:
+            entry->type = VALUE_BOOLEAN;
+            entry->number = lua_toboolean(L, 3);
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&stripe->lock);
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int shared_dict_delete_cb(lua_State *L)
+{
+    lua_settop(L, 2);
+    lua_pushnil(L);
+    return shared_dict_set_cb(L);
+}
+
+static int shared_dict_incr_cb(lua_State *L)
+{
+    lua_Number delta = luaL_optnumber(L, 3, 1);
+    lua_Number initial = luaL_optnumber(L, 4, 0);
+    uint64_t expires = ttl_to_expires(L, 5);
+    struct lwan_lua_shared_dict *dict;
+    const char *key;
+    size_t key_len;
+    uint64_t hash;
+    struct stripe *stripe = lock_stripe_for_key(L, &dict, &key, &key_len, &hash);
+    uint32_t index = entry_find(dict, stripe, hash, key, key_len);
+    struct entry *entry;
+    lua_Number value;
+
+    if (index == NO_ENTRY) {
+        /* Keys that aren't there start at the initial value, and only
+         * these get the TTL.  */
+        index = entry_insert(dict, stripe, hash, key, key_len);
+        entry = entry_at(dict, stripe, index);
+        entry->type = VALUE_NUMBER;
+        entry->number = initial;
+        entry->expires = expires;
+    } else {
+        entry = entry_at(dict, stripe, index);
+        if (entry->type != VALUE_NUMBER) {
+            pthread_mutex_unlock(&stripe->lock);
+
+            lua_pushnil(L);
+            lua_pushstring(L, "not a number");
+            return 2;
+        }
+
+        lru_unlink(dict, stripe, index);
+        lru_push_head(dict, stripe, index);
+    }
+
+    entry->number += delta;
+    value = entry->number;
+
+    pthread_mutex_unlock(&stripe->lock);
+
+    lua_pushnumber(L, value);
+    return 1;
+}
+
+static int shared_dict_expire_cb(lua_State *L)
+{
+    uint64_t expires = ttl_to_expires(L, 3);
+    struct lwan_lua_shared_dict *dict;
+    const char *key;
+    size_t key_len;
+    uint64_t hash;
+    struct stripe *stripe = lock_stripe_for_key(L, &dict, &key, &key_len, &hash);
+    uint32_t index = entry_find(dict, stripe, hash, key, key_len);
+
+    if (index != NO_ENTRY)
+        entry_at(dict, stripe, index)->expires = expires;
+
+    pthread_mutex_unlock(&stripe->lock);
+
+    lua_pushboolean(L, index != NO_ENTRY);
+    return 1;
+}
+
+static const struct luaL_reg lwan_shared_dict_meta_regs[] = {
+    { "get", shared_dict_get_cb },
+    { "set", shared_dict_set_cb },
+    { "delete", shared_dict_delete_cb },
+    { "incr", shared_dict_incr_cb },
+    { "expire", shared_dict_expire_cb },
+    { NULL, NULL }
+};
+
+void lwan_lua_shared_dict_register(lua_State *L,
+    struct lwan_lua_shared_dict *const *dicts, size_t n_dicts)
+{
+    luaL_newmetatable(L, shared_dict_metatable_name);
+    luaL_register(L, NULL, lwan_shared_dict_meta_regs);
+    lua_setfield(L, -1, "__index");
+
+    /* lwan.shared.<name>  */
+    lua_newtable(L);
+    lua_newtable(L);
+    for (size_t i = 0; i < n_dicts; i++) {
+        struct lwan_lua_shared_dict **userdata =
+            lua_newuserdata(L, sizeof(struct lwan_lua_shared_dict *));
+
+        *userdata = dicts[i];
+        luaL_getmetatable(L, shared_dict_metatable_name);
+        lua_setmetatable(L, -2);
+        lua_setfield(L, -2, dicts[i]->name);
+    }
+    lua_setfield(L, -2, "shared");
+    lua_setglobal(L, "lwan");
+}
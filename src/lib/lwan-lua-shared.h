@@ -0,0 +1,33 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include <lua.h>
+#include <stddef.h>
+
+struct lwan_lua_shared_dict;
+
+struct lwan_lua_shared_dict *lwan_lua_shared_dict_new(const char *name,
+    size_t entries, size_t key_size, size_t value_size);
+void lwan_lua_shared_dict_free(struct lwan_lua_shared_dict *dict);
+const char *lwan_lua_shared_dict_name(const struct lwan_lua_shared_dict *dict);
+
+void lwan_lua_shared_dict_register(lua_State *L,
+    struct lwan_lua_shared_dict *const *dicts, size_t n_dicts);
@@ -19,6 +19,7 @@
 
 #define _GNU_SOURCE
 #include <ctype.h>
+#include <errno.h>
 #include <lauxlib.h>
 #include <lualib.h>
 #include <pthread.h>
@@ -27,13 +28,50 @@
 
 #include "lwan-private.h"
 
+#include "lwan-conn.h"
 #include "lwan-lua.h"
+#include "lwan-lua-shared.h"
 
 static const char *request_metatable_name = "Lwan.Request";
+static const char *conn_metatable_name = "Lwan.Conn";
 
 static ALWAYS_INLINE struct lwan_request *userdata_as_request(lua_State *L, int n)
 {
-    return *((struct lwan_request **)luaL_checkudata(L, n, request_metatable_name));
+    struct lwan_request *request =
+        *((struct lwan_request **)luaL_checkudata(L, n, request_metatable_name));
+
+    /* Request objects kept by a script (e.g. in a global) outlive the
+     * request they were given for.  */
+    if (UNLIKELY(!request))
+        luaL_error(L, "request has already finished");
+
+    return request;
+}
+
+/* Connections are allocated from, and closed with, the request that
+ * opened them; scripts might keep them around for longer.  The request
+ * ending and the userdata being collected, whichever happens first, sever
+ * the link between the two.  */
+struct lua_conn {
+    struct lwan_conn *conn;
+    struct lua_conn **anchor;
+};
+
+static ALWAYS_INLINE struct lwan_conn *userdata_as_conn(lua_State *L, int n)
+{
+    struct lua_conn *lua_conn = luaL_checkudata(L, n, conn_metatable_name);
+
+    if (UNLIKELY(!lua_conn->conn))
+        luaL_error(L, "connection belongs to a request that has already finished");
+
+    return lua_conn->conn;
+}
+
+static int push_errno(lua_State *L)
+{
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(errno));
+    return 2;
 }
 
 static int req_say_cb(lua_State *L)
@@ -182,6 +220,123 @@ out:
     return 1;
 }
 
+static void detach_conn(void *data)
+{
+    struct lua_conn **anchor = data;
+
+    if (*anchor) {
+        (*anchor)->conn = NULL;
+        (*anchor)->anchor = NULL;
+    }
+}
+
+/* Connections are closed when the request ends, so they can't be kept
+ * around between requests.  */
+static int req_connect_cb(lua_State *L)
+{
+    struct lwan_request *request = userdata_as_request(L, 1);
+    const char *address = luaL_checkstring(L, 2);
+    int timeout_ms = (int)luaL_optinteger(L, 3, 0);
+    struct lwan_conn *conn = lwan_conn_connect(request, address, timeout_ms);
+    struct lua_conn **anchor;
+    struct lua_conn *userdata;
+
+    if (!conn)
+        return push_errno(L);
+
+    anchor = coro_malloc(request->conn->coro, sizeof(*anchor));
+    if (UNLIKELY(!anchor)) {
+        lwan_conn_close(conn, false);
+        errno = ENOMEM;
+        return push_errno(L);
+    }
+
+    userdata = lua_newuserdata(L, sizeof(*userdata));
+    userdata->conn = conn;
+    userdata->anchor = anchor;
+    *anchor = userdata;
+    coro_defer(request->conn->coro, detach_conn, anchor);
+
+    luaL_getmetatable(L, conn_metatable_name);
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+static int conn_gc_cb(lua_State *L)
+{
+    struct lua_conn *lua_conn = luaL_checkudata(L, 1, conn_metatable_name);
+
+    if (lua_conn->anchor)
+        *lua_conn->anchor = NULL;
+    lua_conn->anchor = NULL;
+    lua_conn->conn = NULL;
+
+    return 0;
+}
+
+static int conn_read_cb(lua_State *L)
+{
+    struct lwan_conn *conn = userdata_as_conn(L, 1);
+    size_t max_len = (size_t)luaL_optinteger(L, 2, LUAL_BUFFERSIZE);
+    luaL_Buffer buffer;
+    ssize_t r;
+
+    luaL_buffinit(L, &buffer);
+    if (max_len > LUAL_BUFFERSIZE)
+        max_len = LUAL_BUFFERSIZE;
+
+    r = lwan_conn_read(conn, luaL_prepbuffer(&buffer), max_len);
+    if (r < 0)
+        return push_errno(L);
+    if (!r) {
+        lua_pushnil(L);
+        lua_pushstring(L, "closed");
+        return 2;
+    }
+
+    luaL_addsize(&buffer, (size_t)r);
+    luaL_pushresult(&buffer);
+    return 1;
+}
+
+static int conn_write_cb(lua_State *L)
+{
+    struct lwan_conn *conn = userdata_as_conn(L, 1);
+    size_t len;
+    const char *str = luaL_checklstring(L, 2, &len);
+
+    if (lwan_conn_write(conn, str, len) < 0)
+        return push_errno(L);
+
+    lua_pushinteger(L, (lua_Integer)len);
+    return 1;
+}
+
+static int conn_close_cb(lua_State *L)
+{
+    struct lwan_conn *conn = userdata_as_conn(L, 1);
+
+    lwan_conn_close(conn, lua_toboolean(L, 2));
+    return 0;
+}
+
+static int conn_set_timeout_cb(lua_State *L)
+{
+    struct lwan_conn *conn = userdata_as_conn(L, 1);
+
+    lwan_conn_set_timeout(conn, (int)luaL_checkinteger(L, 2));
+    return 0;
+}
+
+static const struct luaL_reg lwan_conn_meta_regs[] = {
+    { "read", conn_read_cb },
+    { "write", conn_write_cb },
+    { "close", conn_close_cb },
+    { "set_timeout", conn_set_timeout_cb },
+    { NULL, NULL }
+};
+
 static const struct luaL_reg lwan_request_meta_regs[] = {
     { "query_param", req_query_param_cb },
     { "post_param", req_post_param_cb },
@@ -190,6 +345,7 @@ static const struct luaL_reg lwan_request_meta_regs[] = {
     { "send_event", req_send_event_cb },
     { "cookie", req_cookie_cb },
     { "set_headers", req_set_headers_cb },
+    { "connect", req_connect_cb },
     { NULL, NULL }
 };
 
@@ -198,7 +354,7 @@ const char *lwan_lua_state_last_error(lua_State *L)
     return lua_tostring(L, -1);
 }
 
-lua_State *lwan_lua_create_state(const char *script_file, const char *script)
+static lua_State *new_state(void)
 {
     lua_State *L;
 
@@ -212,6 +368,23 @@ lua_State *lwan_lua_create_state(const char *script_file, const char *script)
     luaL_register(L, NULL, lwan_request_meta_regs);
     lua_setfield(L, -1, "__index");
 
+    luaL_newmetatable(L, conn_metatable_name);
+    luaL_register(L, NULL, lwan_conn_meta_regs);
+    lua_pushcfunction(L, conn_gc_cb);
+    lua_setfield(L, -2, "__gc");
+    lua_setfield(L, -1, "__index");
+
+    return L;
+}
+
+lua_State *lwan_lua_create_state(const char *script_file, const char *script)
+{
+    lua_State *L;
+
+    L = new_state();
+    if (UNLIKELY(!L))
+        return NULL;
+
     if (script_file) {
         if (UNLIKELY(luaL_dofile(L, script_file) != 0)) {
             lwan_status_error("Error opening Lua script %s: %s",
@@ -230,11 +403,83 @@ close_lua_state:
     return NULL;
 }
 
-void lwan_lua_state_push_request(lua_State *L, struct lwan_request *request)
+lua_State *lwan_lua_create_state_from_bytecode(const char *name,
+    const struct strbuf *bytecode, struct lwan_lua_shared_dict *const *shared,
+    size_t n_shared)
+{
+    lua_State *L;
+
+    L = new_state();
+    if (UNLIKELY(!L))
+        return NULL;
+
+    /* Before running the script, so that it can hold on to them.  */
+    lwan_lua_shared_dict_register(L, shared, n_shared);
+
+    if (UNLIKELY(luaL_loadbuffer(L, strbuf_get_buffer(bytecode),
+                                 strbuf_get_length(bytecode), name) != 0 ||
+                 lua_pcall(L, 0, 0, 0) != 0)) {
+        lwan_status_error("Error evaluating Lua script %s: %s", name,
+            lua_tostring(L, -1));
+        lua_close(L);
+        return NULL;
+    }
+
+    return L;
+}
+
+static int append_bytecode(lua_State *L __attribute__((unused)),
+    const void *p, size_t sz, void *ud)
+{
+    struct strbuf *bytecode = ud;
+
+    return strbuf_append_str(bytecode, p, sz) ? 0 : 1;
+}
+
+bool lwan_lua_compile(const char *script_file, const char *script,
+    struct strbuf *bytecode)
+{
+    lua_State *L;
+    int r;
+
+    /* Only parses the script: nothing is registered or run in this
+     * state, which is thrown away once the bytecode has been dumped.  */
+    L = luaL_newstate();
+    if (UNLIKELY(!L))
+        return false;
+
+    if (script_file)
+        r = luaL_loadfile(L, script_file);
+    else
+        r = luaL_loadstring(L, script);
+    if (UNLIKELY(r != 0)) {
+        lwan_status_error("Error compiling Lua script %s: %s",
+            script_file ? script_file : "", lua_tostring(L, -1));
+        goto out;
+    }
+
+    if (UNLIKELY(!strbuf_reset(bytecode) ||
+                 lua_dump(L, append_bytecode, bytecode) != 0)) {
+        lwan_status_error("Could not dump bytecode for Lua script");
+        r = -1;
+    }
+
+out:
+    lua_close(L);
+    return r == 0;
+}
+
+struct lwan_request **lwan_lua_state_push_new_request(lua_State *L)
 {
     struct lwan_request **userdata = lua_newuserdata(L, sizeof(struct lwan_request *));
-    *userdata = request;
+    *userdata = NULL;
     luaL_getmetatable(L, request_metatable_name);
     lua_setmetatable(L, -2);
+    return userdata;
+}
+
+void lwan_lua_state_push_request(lua_State *L, struct lwan_request *request)
+{
+    *lwan_lua_state_push_new_request(L) = request;
 }
 
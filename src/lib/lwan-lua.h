@@ -21,7 +21,15 @@
 
 #include <lua.h>
 
+struct lwan_lua_shared_dict;
+
 const char *lwan_lua_state_last_error(lua_State *L);
 lua_State *lwan_lua_create_state(const char *script_file, const char *script);
+lua_State *lwan_lua_create_state_from_bytecode(const char *name,
+    const struct strbuf *bytecode, struct lwan_lua_shared_dict *const *shared,
+    size_t n_shared);
+bool lwan_lua_compile(const char *script_file, const char *script,
+    struct strbuf *bytecode);
 
 void lwan_lua_state_push_request(lua_State *L, struct lwan_request *request);
+struct lwan_request **lwan_lua_state_push_new_request(lua_State *L);
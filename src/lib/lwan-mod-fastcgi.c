@@ -0,0 +1,863 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "lwan-private.h"
+#include "int-to-str.h"
+#include "lwan-conn.h"
+#include "lwan-mod-fastcgi.h"
+
+/*
+ * FastCGI client.  Connections to the application are kept open
+ * (FCGI_KEEP_CONN) in the per-thread pool of lwan_conn, and each one
+ * carries a single request at a time: most applications (php-fpm included) don't
+ * multiplex requests over a connection, and a pool of connections gets the
+ * same concurrency without the bookkeeping.
+ *
+ * Records are parsed as they arrive: the CGI headers are collected until
+ * the empty line, and everything after that is sent to the client as
+ * chunks, so bodies are never buffered as a whole.
+ */
+
+#define FCGI_VERSION_1 1
+#define FCGI_RESPONDER 1
+#define FCGI_KEEP_CONN 1
+#define FCGI_REQUEST_COMPLETE 0
+#define FCGI_REQUEST_ID 1
+#define FCGI_MAX_CONTENT_LENGTH 65535
+
+/* Flush body data to the client once this much has been collected.  */
+#define CHUNK_SIZE (16 * 1024)
+
+enum fcgi_record_type {
+    FCGI_BEGIN_REQUEST = 1,
+    FCGI_ABORT_REQUEST = 2,
+    FCGI_END_REQUEST = 3,
+    FCGI_PARAMS = 4,
+    FCGI_STDIN = 5,
+    FCGI_STDOUT = 6,
+    FCGI_STDERR = 7,
+};
+
+struct fcgi_record_header {
+    uint8_t version;
+    uint8_t type;
+    uint16_t request_id;
+    uint16_t content_length;
+    uint8_t padding_length;
+    uint8_t reserved;
+} __attribute__((packed));
+
+struct fcgi_begin_request {
+    struct fcgi_record_header header;
+    uint16_t role;
+    uint8_t flags;
+    uint8_t reserved[5];
+} __attribute__((packed));
+
+struct fastcgi {
+    char *address;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+
+    char *script;
+    char *root;
+    char *index;
+    bool keep_alive;
+    int timeout_ms;
+};
+
+struct fastcgi_request {
+    struct fastcgi *fcgi;
+    struct lwan_conn *conn;
+
+    enum lwan_http_status status;
+    bool received;
+    bool headers_sent;
+    bool has_body;
+    bool ended;
+
+    /* Record being parsed */
+    bool in_record;
+    uint8_t type;
+    uint16_t request_id;
+    size_t content_left;
+    size_t padding_left;
+    uint8_t end_request[8];
+    size_t end_request_len;
+
+    size_t headers_len;
+    char headers[DEFAULT_BUFFER_SIZE];
+
+    size_t pos, len;
+    char buffer[4 * DEFAULT_BUFFER_SIZE];
+};
+
+static struct fcgi_record_header
+record_header(enum fcgi_record_type type, size_t content_length)
+{
+    return (struct fcgi_record_header) {
+        .version = FCGI_VERSION_1,
+        .type = (uint8_t)type,
+        .request_id = htons(FCGI_REQUEST_ID),
+        .content_length = htons((uint16_t)content_length),
+    };
+}
+
+static size_t
+encode_length(unsigned char *out, size_t len)
+{
+    if (len < 128) {
+        out[0] = (unsigned char)len;
+        return 1;
+    }
+
+    out[0] = (unsigned char)((len >> 24) | 0x80);
+    out[1] = (unsigned char)(len >> 16);
+    out[2] = (unsigned char)(len >> 8);
+    out[3] = (unsigned char)len;
+    return 4;
+}
+
+static bool
+append_param_len(struct strbuf *buf, const char *name, size_t name_len,
+    const char *value, size_t value_len)
+{
+    unsigned char lengths[8];
+    size_t n;
+
+    n = encode_length(lengths, name_len);
+    n += encode_length(lengths + n, value_len);
+
+    /* strbuf_append_str() takes a length of 0 to mean strlen().  */
+    if (!strbuf_append_str(buf, (const char *)lengths, n))
+        return false;
+    if (!strbuf_append_str(buf, name, name_len))
+        return false;
+    return !value_len || strbuf_append_str(buf, value, value_len);
+}
+
+static bool
+append_param(struct strbuf *buf, const char *name, const char *value)
+{
+    return append_param_len(buf, name, strlen(name), value, strlen(value));
+}
+
+static bool
+append_header_params(struct strbuf *buf, const struct lwan_value *raw_headers,
+    const char **host, size_t *host_len)
+{
+    struct lwan_value headers = *raw_headers;
+    struct lwan_value line;
+
+    while (lwan_request_next_raw_header(&headers, &line)) {
+        char *p = line.value;
+        char *line_end = p + line.len;
+        char name[128] = "HTTP_";
+        char *colon, *value;
+        size_t name_len;
+
+        colon = memchr(p, ':', line.len);
+        if (!colon || colon == p)
+            continue;
+
+        name_len = (size_t)(colon - p);
+        if (name_len + sizeof("HTTP_") > sizeof(name))
+            continue;
+        for (value = colon + 1; value < line_end && (*value == ' ' || *value == '\t'); value++);
+
+        /* Passed as CONTENT_TYPE and CONTENT_LENGTH.  HTTP_PROXY is
+         * never set, as CGI applications take it to be their outbound
+         * proxy ("httpoxy").  */
+        if ((name_len == sizeof("Content-Type") - 1 && !strncasecmp(p, "Content-Type", name_len)) ||
+                (name_len == sizeof("Content-Length") - 1 && !strncasecmp(p, "Content-Length", name_len)) ||
+                (name_len == sizeof("Proxy") - 1 && !strncasecmp(p, "Proxy", name_len)))
+            continue;
+
+        if (name_len == sizeof("Host") - 1 && !strncasecmp(p, "Host", name_len)) {
+            *host = value;
+            *host_len = (size_t)(line_end - value);
+        }
+
+        for (size_t i = 0; i < name_len; i++)
+            name[sizeof("HTTP_") - 1 + i] = p[i] == '-' ? '_' : (char)toupper((unsigned char)p[i]);
+
+        if (!append_param_len(buf, name, sizeof("HTTP_") - 1 + name_len,
+                value, (size_t)(line_end - value)))
+            return false;
+    }
+
+    return true;
+}
+
+static bool
+has_dot_dot_segment(const struct lwan_value *url)
+{
+    const char *end = url->value + url->len;
+
+    for (const char *p = url->value; p < end; p++) {
+        if (p[0] == '.' && p + 1 < end && p[1] == '.' &&
+                (p == url->value || p[-1] == '/') && (p + 2 == end || p[2] == '/'))
+            return true;
+    }
+
+    return false;
+}
+
+static enum lwan_http_status
+build_params(struct lwan_request *request, const struct fastcgi *fcgi,
+    struct strbuf *buf)
+{
+    const struct lwan_value *query = lwan_request_get_raw_query_string(request);
+    const struct lwan_value *body = request->header.body;
+    const struct lwan_value *content_type = request->header.content_type;
+    const size_t prefix_len = (size_t)(request->url.value - request->original_url.value);
+    const char *host = NULL;
+    size_t host_len = 0;
+    char addr_buf[INET6_ADDRSTRLEN];
+    struct sockaddr_storage sock_addr;
+    socklen_t sock_addr_len = sizeof(sock_addr);
+    struct strbuf *uri;
+    const char *addr;
+
+    if (UNLIKELY(!strbuf_reset(buf)))
+        return HTTP_INTERNAL_ERROR;
+
+#define APPEND(name_, value_) \
+    do { if (UNLIKELY(!append_param(buf, name_, value_))) return HTTP_INTERNAL_ERROR; } while (0)
+#define APPEND_LEN(name_, value_, len_) \
+    do { if (UNLIKELY(!append_param_len(buf, name_, sizeof(name_) - 1, value_, len_))) \
+             return HTTP_INTERNAL_ERROR; } while (0)
+
+    APPEND("GATEWAY_INTERFACE", "CGI/1.1");
+    APPEND("SERVER_SOFTWARE", "lwan");
+    APPEND("SERVER_PROTOCOL", (request->flags & REQUEST_IS_HTTP_1_0) ? "HTTP/1.0" : "HTTP/1.1");
+    APPEND("REQUEST_METHOD", lwan_request_get_method_name(request));
+    APPEND_LEN("QUERY_STRING", query->value, query->len);
+
+    if (fcgi->script) {
+        APPEND("SCRIPT_FILENAME", fcgi->script);
+        APPEND_LEN("SCRIPT_NAME", request->original_url.value, prefix_len);
+        APPEND_LEN("PATH_INFO", request->url.value, request->url.len);
+    } else {
+        const bool is_dir = !request->url.len ||
+            request->url.value[request->url.len - 1] == '/';
+        char *filename;
+
+        if (has_dot_dot_segment(&request->url))
+            return HTTP_FORBIDDEN;
+
+        filename = coro_printf(request->conn->coro, "%s/%.*s%s", fcgi->root,
+            (int)request->url.len, request->url.value, is_dir ? fcgi->index : "");
+        if (UNLIKELY(!filename))
+            return HTTP_INTERNAL_ERROR;
+
+        APPEND("SCRIPT_FILENAME", filename);
+        APPEND("DOCUMENT_ROOT", fcgi->root);
+        APPEND_LEN("SCRIPT_NAME", request->original_url.value, request->original_url.len);
+    }
+
+    /* REQUEST_URI is the URL as sent by the client, but lwan has decoded
+     * it already; DOCUMENT_URI is the decoded one.  */
+    uri = strbuf_new();
+    if (UNLIKELY(!uri))
+        return HTTP_INTERNAL_ERROR;
+    coro_defer(request->conn->coro, CORO_DEFER(strbuf_free), uri);
+    if (!lwan_append_encoded_path(uri, request->original_url.value,
+            request->original_url.len))
+        return HTTP_INTERNAL_ERROR;
+    if (query->len) {
+        if (!strbuf_append_char(uri, '?') ||
+                !strbuf_append_str(uri, query->value, query->len))
+            return HTTP_INTERNAL_ERROR;
+    }
+    APPEND_LEN("REQUEST_URI", strbuf_get_buffer(uri), strbuf_get_length(uri));
+    APPEND_LEN("DOCUMENT_URI", request->original_url.value, request->original_url.len);
+
+    if (body) {
+        char length[INT_TO_STR_BUFFER_SIZE];
+        size_t length_len;
+
+        APPEND("CONTENT_LENGTH", int_to_string((ssize_t)body->len, length, &length_len));
+        if (content_type && content_type->len)
+            APPEND_LEN("CONTENT_TYPE", content_type->value, content_type->len);
+    }
+
+    addr = lwan_request_get_remote_address(request, addr_buf);
+    if (addr)
+        APPEND("REMOTE_ADDR", addr);
+
+    if (!getsockname(request->fd, (struct sockaddr *)&sock_addr, &sock_addr_len)) {
+        char port[INT_TO_STR_BUFFER_SIZE];
+        size_t port_len;
+
+        if (sock_addr.ss_family == AF_INET) {
+            struct sockaddr_in *sin = (struct sockaddr_in *)&sock_addr;
+
+            if (inet_ntop(AF_INET, &sin->sin_addr, addr_buf, sizeof(addr_buf)))
+                APPEND("SERVER_ADDR", addr_buf);
+            APPEND("SERVER_PORT", int_to_string(ntohs(sin->sin_port), port, &port_len));
+        } else if (sock_addr.ss_family == AF_INET6) {
+            struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&sock_addr;
+
+            if (inet_ntop(AF_INET6, &sin6->sin6_addr, addr_buf, sizeof(addr_buf)))
+                APPEND("SERVER_ADDR", addr_buf);
+            APPEND("SERVER_PORT", int_to_string(ntohs(sin6->sin6_port), port, &port_len));
+        }
+    }
+
+    if (!append_header_params(buf, lwan_request_get_raw_headers(request),
+            &host, &host_len))
+        return HTTP_INTERNAL_ERROR;
+
+    if (host) {
+        const char *colon = memrchr(host, ':', host_len);
+
+        /* Don't mistake the end of an IPv6 address for a port.  */
+        if (colon && !memchr(colon, ']', host_len - (size_t)(colon - host)))
+            host_len = (size_t)(colon - host);
+        APPEND_LEN("SERVER_NAME", host, host_len);
+    }
+
+#undef APPEND
+#undef APPEND_LEN
+
+    return HTTP_OK;
+}
+
+static enum lwan_http_status
+status_from_cgi(const char *value)
+{
+    static const enum lwan_http_status by_class[] = {
+        [1] = HTTP_OK,
+        [2] = HTTP_OK,
+        [3] = HTTP_FOUND,
+        [4] = HTTP_BAD_REQUEST,
+        [5] = HTTP_INTERNAL_ERROR,
+    };
+    int status = parse_int(strndupa(value, 3), 0);
+
+    if (status < 100 || status > 599)
+        return HTTP_BAD_GATEWAY;
+
+    /* Statuses lwan doesn't know about are sent as their class.  */
+    if (!strncmp(lwan_http_status_as_string_with_code((enum lwan_http_status)status),
+            "999", 3))
+        return by_class[status / 100];
+
+    return (enum lwan_http_status)status;
+}
+
+static bool
+send_response_headers(struct lwan_request *request, struct fastcgi_request *fr,
+    char *headers_end)
+{
+    struct lwan_response *response = &request->response;
+    struct lwan_key_value *headers;
+    size_t n_headers = 0;
+    bool has_status = false;
+
+    for (char *p = fr->headers; p < headers_end; p++) {
+        if (*p == '\n')
+            n_headers++;
+    }
+
+    headers = coro_malloc(request->conn->coro, (n_headers + 1) * sizeof(*headers));
+    if (UNLIKELY(!headers))
+        return false;
+
+    fr->status = HTTP_OK;
+    response->mime_type = "text/html";
+    n_headers = 0;
+
+    for (char *p = fr->headers; p < headers_end;) {
+        char *eol = memchr(p, '\n', (size_t)(headers_end - p));
+        char *line_end = eol;
+        char *colon, *value;
+
+        if (line_end > p && line_end[-1] == '\r')
+            line_end--;
+        *line_end = '\0';
+
+        colon = memchr(p, ':', (size_t)(line_end - p));
+        if (!colon)
+            goto next;
+        *colon = '\0';
+        for (value = colon + 1; *value == ' ' || *value == '\t'; value++);
+
+        if (!strcasecmp(p, "Status")) {
+            fr->status = status_from_cgi(value);
+            has_status = true;
+        } else if (!strcasecmp(p, "Content-Type")) {
+            response->mime_type = value;
+        } else if (!strcasecmp(p, "Location")) {
+            /* A local redirect, without a status, is a 302 in CGI.  */
+            if (!has_status)
+                fr->status = HTTP_FOUND;
+            headers[n_headers++] = (struct lwan_key_value) { .key = p, .value = value };
+        } else if (strcasecmp(p, "Content-Length") &&
+                strcasecmp(p, "Connection") &&
+                strcasecmp(p, "Keep-Alive") &&
+                strcasecmp(p, "Transfer-Encoding")) {
+            headers[n_headers++] = (struct lwan_key_value) { .key = p, .value = value };
+        }
+
+next:
+        p = eol + 1;
+    }
+    headers[n_headers] = (struct lwan_key_value) { .key = NULL, .value = NULL };
+    response->headers = headers;
+
+    if (fr->status == HTTP_NO_CONTENT || fr->status == HTTP_NOT_MODIFIED ||
+            lwan_request_get_method(request) == REQUEST_METHOD_HEAD)
+        fr->has_body = false;
+
+    if (!lwan_response_set_chunked(request, fr->status))
+        return false;
+
+    /* Without a body, not even the last chunk is sent.  */
+    if (!fr->has_body)
+        request->flags &= ~RESPONSE_CHUNKED_ENCODING;
+
+    fr->headers_sent = true;
+    return true;
+}
+
+static void
+flush_body(struct lwan_request *request)
+{
+    if (strbuf_get_length(request->response.buffer))
+        lwan_response_send_chunk(request);
+}
+
+static bool
+append_body(struct lwan_request *request, struct fastcgi_request *fr,
+    const char *data, size_t len)
+{
+    struct strbuf *buf = request->response.buffer;
+
+    if (!fr->has_body || !len)
+        return true;
+    if (UNLIKELY(!strbuf_append_str(buf, data, len)))
+        return false;
+    if (strbuf_get_length(buf) >= CHUNK_SIZE)
+        lwan_response_send_chunk(request);
+
+    return true;
+}
+
+static bool
+handle_stdout(struct lwan_request *request, struct fastcgi_request *fr,
+    const char *data, size_t len)
+{
+    const size_t space = sizeof(fr->headers) - 1 - fr->headers_len;
+    const size_t copied = len < space ? len : space;
+    const size_t prev_len = fr->headers_len;
+    char *headers_end;
+    size_t skip = 2;
+
+    if (fr->headers_sent)
+        return append_body(request, fr, data, len);
+
+    memcpy(fr->headers + fr->headers_len, data, copied);
+    fr->headers_len += copied;
+    fr->headers[fr->headers_len] = '\0';
+
+    /* CGI applications may end lines with just "\n".  */
+    headers_end = strstr(fr->headers, "\n\r\n");
+    if (headers_end) {
+        skip = 3;
+    } else {
+        headers_end = strstr(fr->headers, "\n\n");
+        if (!headers_end) {
+            if (copied < len) {
+                lwan_status_warning("FastCGI response headers are too large");
+                return false;
+            }
+            return true;
+        }
+    }
+    headers_end++;
+
+    if (!send_response_headers(request, fr, headers_end))
+        return false;
+
+    /* Whatever came after the headers is the beginning of the body.  As
+     * the terminator wasn't found before, it must end in this record.  */
+    headers_end += skip - 1;
+    data += headers_end - (fr->headers + prev_len);
+    return append_body(request, fr, data,
+        len - (size_t)(headers_end - (fr->headers + prev_len)));
+}
+
+static bool
+handle_record_content(struct lwan_request *request, struct fastcgi_request *fr,
+    const char *data, size_t len)
+{
+    if (fr->request_id != FCGI_REQUEST_ID)
+        return true;
+
+    switch (fr->type) {
+    case FCGI_STDOUT:
+        return handle_stdout(request, fr, data, len);
+    case FCGI_STDERR:
+        lwan_status_warning("FastCGI application at %s: %.*s",
+            fr->fcgi->address, (int)len, data);
+        return true;
+    case FCGI_END_REQUEST:
+        if (len > sizeof(fr->end_request) - fr->end_request_len)
+            len = sizeof(fr->end_request) - fr->end_request_len;
+        memcpy(fr->end_request + fr->end_request_len, data, len);
+        fr->end_request_len += len;
+        return true;
+    default:
+        return true;
+    }
+}
+
+/* Returns 1 once the application ends the request, 0 if the connection
+ * was closed before anything was received, or -1 on any other error.  */
+static int
+read_response(struct lwan_request *request, struct fastcgi_request *fr)
+{
+    while (!fr->ended) {
+        size_t avail = fr->len - fr->pos;
+
+        if (fr->in_record ? (!avail && (fr->content_left || fr->padding_left)) :
+                avail < sizeof(struct fcgi_record_header)) {
+            ssize_t n;
+
+            /* About to wait for the application: send whatever is
+             * buffered so the client doesn't have to wait as well.  */
+            if (fr->headers_sent)
+                flush_body(request);
+
+            memmove(fr->buffer, fr->buffer + fr->pos, avail);
+            fr->pos = 0;
+            fr->len = avail;
+
+            n = lwan_conn_read(fr->conn, fr->buffer + fr->len,
+                sizeof(fr->buffer) - fr->len);
+            if (n <= 0)
+                return fr->received ? -1 : 0;
+
+            fr->len += (size_t)n;
+            fr->received = true;
+            continue;
+        }
+
+        if (!fr->in_record) {
+            struct fcgi_record_header header;
+
+            memcpy(&header, fr->buffer + fr->pos, sizeof(header));
+            fr->pos += sizeof(header);
+
+            if (header.version != FCGI_VERSION_1)
+                return -1;
+
+            fr->in_record = true;
+            fr->type = header.type;
+            fr->request_id = ntohs(header.request_id);
+            fr->content_left = ntohs(header.content_length);
+            fr->padding_left = header.padding_length;
+            continue;
+        }
+
+        if (fr->content_left) {
+            size_t n = avail < fr->content_left ? avail : fr->content_left;
+
+            if (!handle_record_content(request, fr, fr->buffer + fr->pos, n))
+                return -1;
+
+            fr->pos += n;
+            fr->content_left -= n;
+            continue;
+        }
+
+        if (fr->padding_left) {
+            size_t n = avail < fr->padding_left ? avail : fr->padding_left;
+
+            fr->pos += n;
+            fr->padding_left -= n;
+            continue;
+        }
+
+        fr->in_record = false;
+        if (fr->type == FCGI_END_REQUEST && fr->request_id == FCGI_REQUEST_ID)
+            fr->ended = true;
+    }
+
+    return 1;
+}
+
+static size_t
+records_for(size_t len)
+{
+    /* Content, if any, plus the empty record ending the stream.  */
+    return (len + FCGI_MAX_CONTENT_LENGTH - 1) / FCGI_MAX_CONTENT_LENGTH + 1;
+}
+
+/* Adds a stream of records, terminated by an empty one, to the iovec.  */
+static int
+add_stream(struct iovec *iov, struct fcgi_record_header *headers,
+    enum fcgi_record_type type, const char *data, size_t len)
+{
+    int n_iov = 0;
+
+    while (len) {
+        const size_t n = len > FCGI_MAX_CONTENT_LENGTH ? FCGI_MAX_CONTENT_LENGTH : len;
+
+        *headers = record_header(type, n);
+        iov[n_iov++] = (struct iovec) { .iov_base = headers++, .iov_len = sizeof(*headers) };
+        iov[n_iov++] = (struct iovec) { .iov_base = (void *)data, .iov_len = n };
+
+        data += n;
+        len -= n;
+    }
+
+    *headers = record_header(type, 0);
+    iov[n_iov++] = (struct iovec) { .iov_base = headers, .iov_len = sizeof(*headers) };
+
+    return n_iov;
+}
+
+static bool
+send_request(struct lwan_request *request, struct fastcgi_request *fr,
+    struct strbuf *params)
+{
+    const struct lwan_value *body = request->header.body;
+    const size_t body_len = body ? body->len : 0;
+    const size_t n_records = records_for(strbuf_get_length(params)) +
+        records_for(body_len);
+    struct fcgi_begin_request begin = {
+        .header = record_header(FCGI_BEGIN_REQUEST,
+            sizeof(begin) - sizeof(begin.header)),
+        .role = htons(FCGI_RESPONDER),
+        .flags = fr->fcgi->keep_alive ? FCGI_KEEP_CONN : 0,
+    };
+    struct fcgi_record_header *headers;
+    struct iovec *iov;
+    int n_iov = 0;
+
+    /* Everything is sent at once, so that it can go out in as few
+     * packets as possible.  */
+    iov = coro_malloc(request->conn->coro,
+        (1 + 2 * n_records) * sizeof(*iov) + n_records * sizeof(*headers));
+    if (UNLIKELY(!iov))
+        return false;
+    headers = (struct fcgi_record_header *)(iov + 1 + 2 * n_records);
+
+    iov[n_iov++] = (struct iovec) { .iov_base = &begin, .iov_len = sizeof(begin) };
+    n_iov += add_stream(iov + n_iov, headers, FCGI_PARAMS,
+        strbuf_get_buffer(params), strbuf_get_length(params));
+    n_iov += add_stream(iov + n_iov,
+        headers + records_for(strbuf_get_length(params)), FCGI_STDIN,
+        body ? body->value : NULL, body_len);
+
+    return lwan_conn_writev(fr->conn, iov, n_iov) >= 0;
+}
+
+static enum lwan_http_status
+fastcgi_handle_request(struct lwan_request *request,
+                       struct lwan_response *response,
+                       void *data)
+{
+    struct fastcgi *fcgi = data;
+    struct fastcgi_request *fr;
+    enum lwan_http_status status;
+
+    if (UNLIKELY(!lwan_request_get_method_name(request)))
+        return HTTP_NOT_ALLOWED;
+
+    fr = coro_malloc(request->conn->coro, sizeof(*fr));
+    if (UNLIKELY(!fr))
+        return HTTP_INTERNAL_ERROR;
+
+    fr->fcgi = fcgi;
+
+    status = build_params(request, fcgi, response->buffer);
+    if (status != HTTP_OK)
+        return status;
+
+    while (true) {
+        bool timed_out;
+        int ret;
+
+        fr->conn = lwan_conn_connect_addr(request, &fcgi->addr, fcgi->addr_len,
+            fcgi->timeout_ms);
+        if (!fr->conn) {
+            lwan_status_warning("Could not connect to FastCGI application at %s: %s",
+                fcgi->address, strerror(errno));
+            return errno == ETIMEDOUT ? HTTP_GATEWAY_TIMEOUT : HTTP_BAD_GATEWAY;
+        }
+
+        fr->received = fr->headers_sent = fr->ended = fr->in_record = false;
+        fr->has_body = true;
+        fr->headers_len = fr->end_request_len = 0;
+        fr->pos = fr->len = 0;
+
+        if (!send_request(request, fr, response->buffer))
+            ret = 0;
+        else if (UNLIKELY(!strbuf_reset(response->buffer)))
+            return HTTP_INTERNAL_ERROR;
+        else
+            ret = read_response(request, fr);
+
+        if (ret > 0)
+            break;
+
+        timed_out = errno == ETIMEDOUT;
+        lwan_conn_close(fr->conn, false);
+
+        /* A pooled connection might have been closed by the application
+         * while idle, before it got to see the request.  */
+        if (!ret && lwan_conn_was_reused(fr->conn)) {
+            status = build_params(request, fcgi, response->buffer);
+            if (status != HTTP_OK)
+                return status;
+            continue;
+        }
+
+        if (fr->headers_sent) {
+            /* Too late to tell the client with a proper response.  */
+            coro_yield(request->conn->coro, CONN_CORO_ABORT);
+            __builtin_unreachable();
+        }
+        return timed_out ? HTTP_GATEWAY_TIMEOUT : HTTP_BAD_GATEWAY;
+    }
+
+    /* If the request didn't end cleanly, the application might still send
+     * records for it, so the connection can't be reused.  */
+    lwan_conn_close(fr->conn, fcgi->keep_alive &&
+        fr->end_request_len == sizeof(fr->end_request) &&
+        fr->end_request[4] == FCGI_REQUEST_COMPLETE && fr->pos == fr->len);
+
+    if (!fr->headers_sent) {
+        lwan_status_warning("FastCGI application at %s sent no response headers",
+            fcgi->address);
+        return HTTP_BAD_GATEWAY;
+    }
+
+    flush_body(request);
+    return fr->status;
+}
+
+static void
+fastcgi_shutdown(void *data)
+{
+    struct fastcgi *fcgi = data;
+
+    if (!fcgi)
+        return;
+
+    free(fcgi->address);
+    free(fcgi->script);
+    free(fcgi->root);
+    free(fcgi->index);
+    free(fcgi);
+}
+
+static void *
+fastcgi_init(const char *prefix __attribute__((unused)), void *data)
+{
+    struct lwan_fastcgi_settings *settings = data;
+    struct fastcgi *fcgi;
+
+    if (!settings->address) {
+        lwan_status_error("FastCGI application address not specified");
+        return NULL;
+    }
+    if (!settings->script && !settings->root) {
+        lwan_status_error("Either a FastCGI script or root directory is needed");
+        return NULL;
+    }
+
+    fcgi = calloc(1, sizeof(*fcgi));
+    if (!fcgi)
+        return NULL;
+
+    fcgi->keep_alive = settings->keep_alive;
+    fcgi->timeout_ms = (int)settings->timeout * 1000;
+    fcgi->address = strdup(settings->address);
+    fcgi->index = strdup(settings->index ? settings->index : "index.php");
+    if (!fcgi->address || !fcgi->index)
+        goto error;
+
+    if (settings->script) {
+        fcgi->script = strdup(settings->script);
+        if (!fcgi->script)
+            goto error;
+    } else {
+        fcgi->root = realpath(settings->root, NULL);
+        if (!fcgi->root) {
+            lwan_status_perror("Could not resolve FastCGI root %s", settings->root);
+            goto error;
+        }
+    }
+
+    if (!lwan_conn_parse_address(settings->address, &fcgi->addr, &fcgi->addr_len))
+        goto error;
+
+    return fcgi;
+
+error:
+    fastcgi_shutdown(fcgi);
+    return NULL;
+}
+
+static void *
+fastcgi_init_from_hash(const char *prefix, const struct hash *hash)
+{
+    struct lwan_fastcgi_settings settings = {
+        .address = hash_find(hash, "address"),
+        .script = hash_find(hash, "script"),
+        .root = hash_find(hash, "root"),
+        .index = hash_find(hash, "index"),
+        .keep_alive = parse_bool(hash_find(hash, "keep_alive"), true),
+        .timeout = parse_time_period(hash_find(hash, "timeout"), 0),
+    };
+
+    return fastcgi_init(prefix, &settings);
+}
+
+const struct lwan_module *
+lwan_module_fastcgi(void)
+{
+    static const struct lwan_module fastcgi_module = {
+        .init = fastcgi_init,
+        .init_from_hash = fastcgi_init_from_hash,
+        .shutdown = fastcgi_shutdown,
+        .handle = fastcgi_handle_request,
+        .flags = HANDLER_PARSE_POST_DATA | HANDLER_RAW_POST_DATA,
+    };
+
+    return &fastcgi_module;
+}
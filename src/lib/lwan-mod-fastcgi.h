@@ -0,0 +1,47 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include "lwan.h"
+
+struct lwan_fastcgi_settings {
+  /* "host:port", "[ipv6]:port" or "unix:/path" of the application */
+  const char *address;
+  /* SCRIPT_FILENAME is the script if set, or the URL under the root
+   * directory (with index appended to directories) otherwise */
+  const char *script;
+  const char *root;
+  const char *index;
+  /* Keep connections open between requests */
+  bool keep_alive;
+  /* Seconds to wait on the application; 0 for the keep-alive timeout */
+  unsigned int timeout;
+};
+
+#define FASTCGI(address_, script_) \
+  .module = lwan_module_fastcgi(), \
+  .args = ((struct lwan_fastcgi_settings[]) {{ \
+    .address = address_, \
+    .script = script_, \
+    .keep_alive = true, \
+  }}), \
+  .flags = 0
+
+const struct lwan_module *lwan_module_fastcgi(void);
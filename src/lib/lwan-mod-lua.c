@@ -18,7 +18,6 @@
  */
 
 #define _GNU_SOURCE
-#include <ctype.h>
 #include <lauxlib.h>
 #include <lualib.h>
 #include <pthread.h>
@@ -27,145 +26,336 @@
 
 #include "lwan-private.h"
 
-#include "lwan-array.h"
-#include "lwan-cache.h"
 #include "lwan-config.h"
+#include "lwan-file-watch.h"
 #include "lwan-lua.h"
+#include "lwan-lua-shared.h"
 #include "lwan-mod-lua.h"
+#include "hash.h"
+#include "list.h"
+
+/* Lua threads kept around by each state to run requests in.  */
+#define LUA_THREAD_POOL_SIZE 256
+
+/* Compiled script.  States are created from it without holding the lock,
+ * so a reload only drops the module's reference.  */
+struct lwan_lua_bytecode {
+    unsigned int refs;
+    struct strbuf *strbuf;
+};
 
 struct lwan_lua_priv {
     char *default_type;
     char *script_file;
     char *script;
-    pthread_key_t cache_key;
-    unsigned cache_period;
+
+    /* The script is compiled once, and every I/O thread gets its own
+     * state, created from this bytecode the first time it handles a
+     * request.  States are kept until script_file changes, and each
+     * thread then replaces its state.  */
+    pthread_mutex_t lock;
+    struct lwan_lua_bytecode *bytecode;
+
+    pthread_key_t state_key;
+    struct list_head states;
+    struct lwan_file_watch watch;
+
+    /* Declared with "shared <name> { ... }"; available to the script
+     * as lwan.shared.<name>, in every state.  */
+    struct lwan_lua_shared_dict **shared;
+    size_t n_shared;
+};
+
+/* A Lua thread, along with the request userdata passed to the handler
+ * running in it; both are anchored in the registry.  Each request gets a
+ * new userdata, as scripts might have kept the previous one around.  */
+struct lwan_lua_thread {
+    lua_State *L;
+    struct lwan_request **request;
+    int thread_ref;
+    int request_ref;
+    bool finished;
 };
 
 struct lwan_lua_state {
-    struct cache_entry base;
+    struct lwan_file_watch_copy copy;
+    struct list_node states;
     lua_State *L;
+
+    /* Threads whose last handler returned, ready to run another one.  */
+    struct lwan_lua_thread *threads[LUA_THREAD_POOL_SIZE];
+    unsigned int n_threads;
+
+    unsigned int refs;
+    bool retired;
+
+    /* Registry references to the handle_<method>_<name> functions,
+     * keyed by <name>, for each request method.  */
+    struct hash *handlers[REQUEST_METHOD_MASK + 1];
+};
+
+static const struct {
+    enum lwan_request_flags method;
+    const char *prefix;
+    size_t prefix_len;
+} handler_prefixes[] = {
+#define PREFIX(method_, prefix_) \
+    { .method = method_, .prefix = prefix_, .prefix_len = sizeof(prefix_) - 1 }
+    PREFIX(REQUEST_METHOD_GET, "handle_get_"),
+    PREFIX(REQUEST_METHOD_POST, "handle_post_"),
+    PREFIX(REQUEST_METHOD_HEAD, "handle_head_"),
+    PREFIX(REQUEST_METHOD_OPTIONS, "handle_options_"),
+    PREFIX(REQUEST_METHOD_DELETE, "handle_delete_"),
+#undef PREFIX
 };
 
-static struct cache_entry *state_create(const char *key __attribute__((unused)),
-        void *context)
+static bool build_dispatch_table(struct lwan_lua_state *state)
 {
-    struct lwan_lua_priv *priv = context;
-    struct lwan_lua_state *state = malloc(sizeof(*state));
+    lua_State *L = state->L;
 
-    if (UNLIKELY(!state))
-        return NULL;
+    for (size_t i = 0; i < N_ELEMENTS(handler_prefixes); i++) {
+        state->handlers[handler_prefixes[i].method] = hash_str_new(free, NULL);
+        if (UNLIKELY(!state->handlers[handler_prefixes[i].method]))
+            return false;
+    }
 
-    state->L = lwan_lua_create_state(priv->script_file, priv->script);
-    if (LIKELY(state->L))
-        return (struct cache_entry *)state;
+    lua_pushnil(L);
+    while (lua_next(L, LUA_GLOBALSINDEX)) {
+        if (lua_type(L, -2) != LUA_TSTRING || !lua_isfunction(L, -1))
+            goto next;
 
-    free(state);
-    return NULL;
+        const char *name = lua_tostring(L, -2);
+        for (size_t i = 0; i < N_ELEMENTS(handler_prefixes); i++) {
+            if (strncmp(name, handler_prefixes[i].prefix,
+                        handler_prefixes[i].prefix_len))
+                continue;
+
+            char *key = strdup(name + handler_prefixes[i].prefix_len);
+            if (UNLIKELY(!key)) {
+                lua_pop(L, 2);
+                return false;
+            }
+
+            lua_pushvalue(L, -1);
+            int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+            if (hash_add(state->handlers[handler_prefixes[i].method], key,
+                         (void *)(intptr_t)ref) < 0) {
+                free(key);
+                lua_pop(L, 2);
+                return false;
+            }
+            break;
+        }
+
+next:
+        lua_pop(L, 1);
+    }
+
+    return true;
 }
 
-static void state_destroy(struct cache_entry *entry,
-        void *context __attribute__((unused)))
+static void state_destroy(struct lwan_lua_state *state)
 {
-    struct lwan_lua_state *state = (struct lwan_lua_state *)entry;
-
+    for (size_t i = 0; i < N_ELEMENTS(state->handlers); i++)
+        hash_free(state->handlers[i]);
+    for (unsigned int i = 0; i < state->n_threads; i++)
+        free(state->threads[i]);
     lua_close(state->L);
     free(state);
 }
 
-static struct cache *get_or_create_cache(struct lwan_lua_priv *priv)
+static void unref_bytecode(struct lwan_lua_bytecode *bytecode)
 {
-    struct cache *cache = pthread_getspecific(priv->cache_key);
-    if (UNLIKELY(!cache)) {
-        lwan_status_debug("Creating cache for this thread");
-        cache = cache_create(state_create, state_destroy, priv, priv->cache_period);
-        if (UNLIKELY(!cache))
-            lwan_status_error("Could not create cache");
-        /* FIXME: This cache instance leaks: store it somewhere and
-         * free it on module shutdown */
-        pthread_setspecific(priv->cache_key, cache);
+    if (bytecode && !ATOMIC_DEC(bytecode->refs)) {
+        strbuf_free(bytecode->strbuf);
+        free(bytecode);
     }
-    return cache;
 }
 
-static void unref_thread(void *data1, void *data2)
+static struct lwan_lua_state *state_create(struct lwan_lua_priv *priv)
 {
-    lua_State *L = data1;
-    int thread_ref = (int)(intptr_t)data2;
-    luaL_unref(L, LUA_REGISTRYINDEX, thread_ref);
+    struct lwan_lua_state *state = calloc(1, sizeof(*state));
+    struct lwan_lua_bytecode *bytecode;
+
+    if (UNLIKELY(!state))
+        return NULL;
+
+    pthread_mutex_lock(&priv->lock);
+    bytecode = priv->bytecode;
+    ATOMIC_INC(bytecode->refs);
+    pthread_mutex_unlock(&priv->lock);
+
+    state->L = lwan_lua_create_state_from_bytecode(
+        priv->script_file ? priv->script_file : "script", bytecode->strbuf,
+        priv->shared, priv->n_shared);
+    unref_bytecode(bytecode);
+
+    if (UNLIKELY(!state->L)) {
+        free(state);
+        return NULL;
+    }
+
+    if (UNLIKELY(!build_dispatch_table(state))) {
+        lwan_status_error("Could not build Lua handler table");
+        state_destroy(state);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&priv->lock);
+    list_add_tail(&priv->states, &state->states);
+    pthread_mutex_unlock(&priv->lock);
+
+    return state;
 }
 
-static ALWAYS_INLINE const char *get_handle_prefix(struct lwan_request *request, size_t *len)
+static void state_unlink_and_destroy(struct lwan_lua_priv *priv,
+    struct lwan_lua_state *state)
 {
-    switch (lwan_request_get_method(request)) {
-    case REQUEST_METHOD_GET:
-        *len = sizeof("handle_get_");
-        return "handle_get_";
-    case REQUEST_METHOD_POST:
-        *len = sizeof("handle_post_");
-        return "handle_post_";
-    case REQUEST_METHOD_HEAD:
-        *len = sizeof("handle_head_");
-        return "handle_head_";
-    case REQUEST_METHOD_OPTIONS:
-        *len = sizeof("handle_options_");
-        return "handle_options_";
-    case REQUEST_METHOD_DELETE:
-        *len = sizeof("handle_delete_");
-        return "handle_delete_";
-    default:
-        return NULL;
+    pthread_mutex_lock(&priv->lock);
+    list_del(&state->states);
+    pthread_mutex_unlock(&priv->lock);
+
+    state_destroy(state);
+}
+
+static struct lwan_file_watch_copy *
+update_state(void *data, struct lwan_file_watch_copy *copy)
+{
+    struct lwan_lua_priv *priv = data;
+    struct lwan_lua_state *state = (struct lwan_lua_state *)copy;
+    struct lwan_lua_state *new_state = state_create(priv);
+
+    /* Keep using the previous state rather than trying again on every
+     * request.  */
+    if (UNLIKELY(!new_state))
+        return copy;
+
+    if (state) {
+        /* Requests still running in the previous state are unaware of
+         * the new one; the last of them destroys it.  */
+        if (state->refs)
+            state->retired = true;
+        else
+            state_unlink_and_destroy(priv, state);
     }
+
+    return &new_state->copy;
 }
 
-static bool get_handler_function(lua_State *L, struct lwan_request *request)
+static void unref_state(void *data1, void *data2)
 {
-    char handler_name[128];
-    size_t handle_prefix_len;
-    const char *handle_prefix = get_handle_prefix(request, &handle_prefix_len);
+    struct lwan_lua_priv *priv = data1;
+    struct lwan_lua_state *state = data2;
 
-    if (UNLIKELY(!handle_prefix))
-        return false;
-    if (UNLIKELY(request->url.len >= sizeof(handler_name) - handle_prefix_len))
+    if (!--state->refs && state->retired)
+        state_unlink_and_destroy(priv, state);
+}
+
+/* A script with errors is reported, and the previous one is kept.  */
+static bool compile_script(void *data)
+{
+    struct lwan_lua_priv *priv = data;
+    struct lwan_lua_bytecode *bytecode = malloc(sizeof(*bytecode));
+    struct lwan_lua_bytecode *old;
+
+    if (UNLIKELY(!bytecode))
         return false;
 
-    char *url;
-    size_t url_len;
-    if (request->url.len) {
-        url = strndupa(request->url.value, request->url.len);
-        for (char *c = url; *c; c++) {
-            if (*c == '/') {
-                *c = '\0';
-                break;
-            }
-            if (UNLIKELY(!isalnum(*c) && *c != '_'))
-                return false;
-        }
-        url_len = strlen(url);
-    } else {
-        url = "root";
-        url_len = 4;
+    bytecode->refs = 1;
+    bytecode->strbuf = strbuf_new();
+    if (UNLIKELY(!bytecode->strbuf)) {
+        free(bytecode);
+        return false;
     }
 
-    if (UNLIKELY((handle_prefix_len + url_len + 1) > sizeof(handler_name)))
+    if (!lwan_lua_compile(priv->script_file, priv->script, bytecode->strbuf)) {
+        unref_bytecode(bytecode);
         return false;
+    }
+
+    pthread_mutex_lock(&priv->lock);
+    old = priv->bytecode;
+    priv->bytecode = bytecode;
+    pthread_mutex_unlock(&priv->lock);
+
+    unref_bytecode(old);
+    return true;
+}
+
+static int get_handler_ref(const struct lwan_lua_state *state,
+    struct lwan_request *request)
+{
+    const struct hash *handlers = state->handlers[lwan_request_get_method(request)];
+    char name[128];
+    const char *slash;
+    size_t len;
+
+    if (UNLIKELY(!handlers))
+        return LUA_NOREF;
 
-    char *method_name = mempcpy(handler_name, handle_prefix, handle_prefix_len);
-    memcpy(method_name - 1, url, url_len + 1);
+    if (!request->url.len)
+        return (int)(intptr_t)hash_find(handlers, "root") ?: LUA_NOREF;
 
-    lua_getglobal(L, handler_name);
-    return lua_isfunction(L, -1);
+    slash = memchr(request->url.value, '/', request->url.len);
+    len = slash ? (size_t)(slash - request->url.value) : request->url.len;
+    if (UNLIKELY(len >= sizeof(name)))
+        return LUA_NOREF;
+
+    memcpy(name, request->url.value, len);
+    name[len] = '\0';
+
+    return (int)(intptr_t)hash_find(handlers, name) ?: LUA_NOREF;
 }
 
-static lua_State *push_newthread(lua_State *L, struct coro *coro)
+static struct lwan_lua_thread *get_thread(struct lwan_lua_state *state)
 {
-    lua_State *L1 = lua_newthread(L);
-    if (UNLIKELY(!L1))
+    struct lwan_lua_thread *thread;
+
+    if (LIKELY(state->n_threads))
+        return state->threads[--state->n_threads];
+
+    thread = malloc(sizeof(*thread));
+    if (UNLIKELY(!thread))
         return NULL;
 
-    int thread_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    coro_defer2(coro, CORO_DEFER2(unref_thread), L, (void *)(intptr_t)thread_ref);
+    thread->L = lua_newthread(state->L);
+    if (UNLIKELY(!thread->L)) {
+        free(thread);
+        return NULL;
+    }
+    thread->thread_ref = luaL_ref(state->L, LUA_REGISTRYINDEX);
+
+    /* Registry slot for the request userdata, set on every request.  */
+    lua_pushboolean(state->L, 0);
+    thread->request_ref = luaL_ref(state->L, LUA_REGISTRYINDEX);
+    thread->request = NULL;
+
+    return thread;
+}
+
+static void put_thread(void *data1, void *data2)
+{
+    struct lwan_lua_state *state = data1;
+    struct lwan_lua_thread *thread = data2;
+
+    /* Scripts might have kept the request object around.  */
+    if (thread->request)
+        *thread->request = NULL;
+
+    /* Lua 5.1 has no lua_resetthread(), but a thread whose function
+     * returned can run another one once its stack is cleared.  Threads
+     * that errored, or that were left suspended by an aborted request,
+     * are dropped and left to the garbage collector.  */
+    if (LIKELY(thread->finished && state->n_threads < LUA_THREAD_POOL_SIZE)) {
+        lua_settop(thread->L, 0);
+        thread->finished = false;
+        state->threads[state->n_threads++] = thread;
+        return;
+    }
 
-    return L1;
+    luaL_unref(state->L, LUA_REGISTRYINDEX, thread->request_ref);
+    luaL_unref(state->L, LUA_REGISTRYINDEX, thread->thread_ref);
+    free(thread);
 }
 
 static enum lwan_http_status
@@ -178,24 +368,31 @@ lua_handle_cb(struct lwan_request *request,
     if (UNLIKELY(!priv))
         return HTTP_INTERNAL_ERROR;
 
-    struct cache *cache = get_or_create_cache(priv);
-    if (UNLIKELY(!cache))
+    struct lwan_lua_state *state = lwan_file_watch_get_copy(
+        &priv->watch, priv->state_key, update_state, priv);
+    if (UNLIKELY(!state))
         return HTTP_INTERNAL_ERROR;
 
-    struct lwan_lua_state *state = (struct lwan_lua_state *)cache_coro_get_and_ref_entry(
-            cache, request->conn->coro, "");
-    if (UNLIKELY(!state))
+    int handler_ref = get_handler_ref(state, request);
+    if (UNLIKELY(handler_ref == LUA_NOREF))
         return HTTP_NOT_FOUND;
 
-    lua_State *L = push_newthread(state->L, request->conn->coro);
-    if (UNLIKELY(!L))
+    state->refs++;
+    coro_defer2(request->conn->coro, CORO_DEFER2(unref_state), priv, state);
+
+    struct lwan_lua_thread *thread = get_thread(state);
+    if (UNLIKELY(!thread))
         return HTTP_INTERNAL_ERROR;
+    coro_defer2(request->conn->coro, CORO_DEFER2(put_thread), state, thread);
 
-    if (UNLIKELY(!get_handler_function(L, request)))
-        return HTTP_NOT_FOUND;
+    lua_State *L = thread->L;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, handler_ref);
 
     int n_arguments = 1;
-    lwan_lua_state_push_request(L, request);
+    thread->request = lwan_lua_state_push_new_request(L);
+    *thread->request = request;
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, LUA_REGISTRYINDEX, thread->request_ref);
     response->mime_type = priv->default_type;
     while (true) {
         switch (lua_resume(L, n_arguments)) {
@@ -204,6 +401,7 @@ lua_handle_cb(struct lwan_request *request,
             n_arguments = 0;
             break;
         case 0:
+            thread->finished = true;
             return HTTP_OK;
         default:
             lwan_status_error("Error from Lua script: %s", lua_tostring(L, -1));
@@ -223,6 +421,9 @@ static void *lua_init(const char *prefix __attribute__((unused)), void *data)
         return NULL;
     }
 
+    pthread_mutex_init(&priv->lock, NULL);
+    list_head_init(&priv->states);
+
     priv->default_type = strdup(
         settings->default_type ? settings->default_type : "text/plain");
     if (!priv->default_type) {
@@ -247,16 +448,24 @@ static void *lua_init(const char *prefix __attribute__((unused)), void *data)
         goto error;
     }
 
-    if (pthread_key_create(&priv->cache_key, NULL)) {
+    if (!compile_script(priv))
+        goto error;
+
+    if (pthread_key_create(&priv->state_key, NULL)) {
         lwan_status_perror("pthread_key_create");
         goto error;
     }
 
-    priv->cache_period = settings->cache_period;
+    if (priv->script_file &&
+            !lwan_file_watch_start(&priv->watch, priv->script_file,
+                                   compile_script, priv))
+        lwan_status_warning("Changes to %s won't be noticed", priv->script_file);
 
     return priv;
 
 error:
+    pthread_mutex_destroy(&priv->lock);
+    unref_bytecode(priv->bytecode);
     free(priv->script_file);
     free(priv->default_type);
     free(priv->script);
@@ -268,7 +477,22 @@ static void lua_shutdown(void *data)
 {
     struct lwan_lua_priv *priv = data;
     if (priv) {
-        pthread_key_delete(priv->cache_key);
+        struct lwan_lua_state *state, *next;
+
+        lwan_file_watch_stop(&priv->watch);
+
+        /* Requests are done with this module by now; states left around
+         * are those of each I/O thread.  */
+        list_for_each_safe(&priv->states, state, next, states)
+            state_destroy(state);
+
+        for (size_t i = 0; i < priv->n_shared; i++)
+            lwan_lua_shared_dict_free(priv->shared[i]);
+        free(priv->shared);
+
+        pthread_key_delete(priv->state_key);
+        pthread_mutex_destroy(&priv->lock);
+        unref_bytecode(priv->bytecode);
         free(priv->default_type);
         free(priv->script_file);
         free(priv->script);
@@ -281,22 +505,121 @@ static void *lua_init_from_hash(const char *prefix, const struct hash *hash)
     struct lwan_lua_settings settings = {
         .default_type = hash_find(hash, "default_type"),
         .script_file = hash_find(hash, "script_file"),
-        .cache_period = parse_time_period(hash_find(hash, "cache_period"), 15),
         .script = hash_find(hash, "script")
     };
     return lua_init(prefix, &settings);
 }
 
+static bool lua_parse_conf_shared(struct lwan_lua_priv *priv,
+    struct config *config, const struct config_line *section)
+{
+    char *name = strdupa(section->value);
+    long entries = 1024, key_size = 64, value_size = 256;
+    struct lwan_lua_shared_dict **shared;
+    struct config_line line;
+
+    for (size_t i = 0; i < priv->n_shared; i++) {
+        if (streq(lwan_lua_shared_dict_name(priv->shared[i]), name)) {
+            config_error(config, "Shared dictionary %s already declared", name);
+            return false;
+        }
+    }
+
+    while (config_read_line(config, &line)) {
+        switch (line.type) {
+        case CONFIG_LINE_TYPE_LINE:
+            if (streq(line.key, "entries")) {
+                entries = parse_long(line.value, -1);
+            } else if (streq(line.key, "key_size")) {
+                key_size = parse_long(line.value, -1);
+            } else if (streq(line.key, "value_size")) {
+                value_size = parse_long(line.value, -1);
+            } else {
+                config_error(config, "Unexpected key: %s", line.key);
+                return false;
+            }
+            break;
+        case CONFIG_LINE_TYPE_SECTION:
+            config_error(config, "Unexpected section: %s", line.key);
+            return false;
+        case CONFIG_LINE_TYPE_SECTION_END:
+            goto add_dict;
+        }
+    }
+
+    config_error(config, "Expecting section end while parsing shared dictionary");
+    return false;
+
+add_dict:
+    if (entries <= 0 || key_size <= 0 || key_size > UINT16_MAX || value_size < 0) {
+        config_error(config, "Invalid size for shared dictionary %s", name);
+        return false;
+    }
+
+    shared = realloc(priv->shared, (priv->n_shared + 1) * sizeof(*shared));
+    if (!shared) {
+        config_error(config, "Could not allocate shared dictionary %s", name);
+        return false;
+    }
+    priv->shared = shared;
+
+    shared[priv->n_shared] = lwan_lua_shared_dict_new(name, (size_t)entries,
+        (size_t)key_size, (size_t)value_size);
+    if (!shared[priv->n_shared]) {
+        config_error(config, "Could not allocate shared dictionary %s", name);
+        return false;
+    }
+    priv->n_shared++;
+
+    return true;
+}
+
+static bool lua_parse_conf(void *data, struct config *config)
+{
+    struct lwan_lua_priv *priv = data;
+    struct config_line line;
+
+    /* Nothing to attach dictionaries to if initialization failed; that
+     * has already been reported.  */
+    if (!priv)
+        return true;
+
+    while (config_read_line(config, &line)) {
+        switch (line.type) {
+        case CONFIG_LINE_TYPE_LINE:
+            /* Already handled by lua_init_from_hash().  */
+            break;
+        case CONFIG_LINE_TYPE_SECTION:
+            if (streq(line.key, "shared")) {
+                if (!lua_parse_conf_shared(priv, config, &line))
+                    return false;
+            } else if (!config_skip_section(config, &line)) {
+                /* Sections such as "authorization" are handled when the
+                 * prefix is read.  */
+                config_error(config, "Could not skip section");
+                return false;
+            }
+            break;
+        case CONFIG_LINE_TYPE_SECTION_END:
+            break;
+        }
+    }
+
+    return !config_last_error(config);
+}
+
 const struct lwan_module *lwan_module_lua(void)
 {
     static const struct lwan_module lua_module = {
         .init = lua_init,
         .init_from_hash = lua_init_from_hash,
+        .parse_conf = lua_parse_conf,
         .shutdown = lua_shutdown,
         .handle = lua_handle_cb,
         .flags = HANDLER_PARSE_QUERY_STRING
             | HANDLER_REMOVE_LEADING_SLASH
             | HANDLER_PARSE_COOKIES
+            | HANDLER_PARSE_POST_DATA
     };
 
     return &lua_module;
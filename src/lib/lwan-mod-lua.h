@@ -25,7 +25,6 @@ struct lwan_lua_settings {
     const char *default_type;
     const char *script_file;
     const char *script;
-    unsigned int cache_period;
 };
 
 #define LUA(default_type_) \
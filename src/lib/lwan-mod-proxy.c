@@ -0,0 +1,1242 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "lwan-private.h"
+#include "lwan-conn.h"
+#include "lwan-io-wrappers.h"
+#include "lwan-mod-proxy.h"
+
+/*
+ * Requests are relayed over connections that are kept open between
+ * requests; each I/O thread has its own pool of idle connections for each
+ * upstream, so no locking is needed to take or return them.  Waiting on
+ * an upstream socket is done by yielding the coroutine with
+ * lwan_thread_await_fd_until(), so that upstreams that take longer than
+ * connect_timeout to accept a connection, or read_timeout between reads
+ * and writes, get a "504 Gateway timeout" instead of holding the
+ * request until the client connection times out.
+ *
+ * An upstream that fails max_fails times in a row (connection refused,
+ * reset, timed out, or an invalid response) isn't picked for fail_timeout
+ * seconds; after that, the next request sent to it decides if it's back.
+ */
+
+#define MAX_IDLE_PIPES 4
+#define SPLICE_CHUNK (1 << 16)
+#define MAX_STALLED_WRITES 5
+
+enum proxy_balance {
+    BALANCE_ROUND_ROBIN,
+    BALANCE_LEAST_CONN,
+};
+
+enum body_mode {
+    BODY_NONE,
+    BODY_LENGTH,
+    BODY_CHUNKED,
+    BODY_UNTIL_CLOSE,
+};
+
+struct proxy_upstream {
+    char *name;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+
+    /* Shared between all I/O threads.  */
+    unsigned int active;
+    unsigned int fails;
+    time_t down_until;
+};
+
+struct proxy_thread {
+    /* keep_alive slots for each upstream */
+    int *idle;
+    unsigned int *n_idle;
+
+    int pipes[MAX_IDLE_PIPES][2];
+    unsigned int n_pipes;
+};
+
+struct proxy {
+    struct proxy_upstream *upstreams;
+    unsigned int n_upstreams;
+    enum proxy_balance balance;
+
+    unsigned int keep_alive;
+    unsigned int max_fails;
+    unsigned int fail_timeout;
+    int connect_timeout_ms;
+    int read_timeout_ms;
+    size_t splice_threshold;
+    bool strip_prefix;
+
+    unsigned int next;
+
+    /* Allocated by the first request, as the number of threads isn't
+     * known when the module is initialized.  */
+    struct proxy_thread *threads;
+    unsigned int n_threads;
+};
+
+struct proxy_request {
+    struct proxy *proxy;
+    struct proxy_thread *thread;
+    struct proxy_upstream *upstream;
+    int fd;
+
+    int pipe[2];
+    bool pipe_dirty;
+
+    size_t len;
+    char buffer[DEFAULT_BUFFER_SIZE];
+};
+
+struct upstream_response {
+    char *head_end;
+    int status;
+    long content_length;
+    bool chunked;
+    bool keep_alive;
+};
+
+enum chunk_state {
+    CHUNK_SIZE,
+    CHUNK_EXTENSION,
+    CHUNK_DATA,
+    CHUNK_DATA_END,
+    CHUNK_TRAILER_START,
+    CHUNK_TRAILER,
+    CHUNK_DONE,
+};
+
+struct chunk_parser {
+    enum chunk_state state;
+    unsigned int digits;
+    size_t size;
+};
+
+static bool
+is_token_in_list(const char *value, size_t len, const char *token)
+{
+    const size_t token_len = strlen(token);
+    const char *end = value + len;
+
+    while (value < end) {
+        const char *comma = memchr(value, ',', (size_t)(end - value));
+        const char *item_end = comma ? comma : end;
+
+        while (value < item_end && (*value == ' ' || *value == '\t'))
+            value++;
+        while (item_end > value && (item_end[-1] == ' ' || item_end[-1] == '\t'))
+            item_end--;
+
+        if ((size_t)(item_end - value) == token_len
+                && !strncasecmp(value, token, token_len))
+            return true;
+
+        if (!comma)
+            break;
+        value = comma + 1;
+    }
+
+    return false;
+}
+
+/* Returns the value of a "Name: value" line if it's the named header.  */
+static const char *
+header_value(const char *line, size_t len, const char *name, size_t *value_len)
+{
+    const size_t name_len = strlen(name);
+    const char *end = line + len;
+    const char *value;
+
+    if (len <= name_len || line[name_len] != ':')
+        return NULL;
+    if (strncasecmp(line, name, name_len))
+        return NULL;
+
+    for (value = line + name_len + 1; value < end && (*value == ' ' || *value == '\t'); value++);
+    *value_len = (size_t)(end - value);
+
+    return value;
+}
+
+static bool
+is_hop_by_hop_header(const char *line, size_t len, bool request)
+{
+    static const char *hop_by_hop[] = {
+        "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Upgrade",
+        /* Request bodies are always sent with a Content-Length.  */
+        "Transfer-Encoding", "Trailer", "Expect",
+    };
+    /* Response bodies are relayed as they were received.  */
+    const size_t n_headers = request ? N_ELEMENTS(hop_by_hop) : 5;
+    size_t value_len;
+
+    for (size_t i = 0; i < n_headers; i++) {
+        if (header_value(line, len, hop_by_hop[i], &value_len))
+            return true;
+    }
+
+    return false;
+}
+
+static ssize_t
+chunk_parser_feed(struct chunk_parser *p, const char *buf, size_t len)
+{
+    size_t i = 0;
+
+    while (i < len && p->state != CHUNK_DONE) {
+        const char ch = buf[i];
+
+        switch (p->state) {
+        case CHUNK_SIZE:
+            if (lwan_char_isxdigit(ch)) {
+                if (p->size > (SIZE_MAX >> 4))
+                    return -1;
+                p->size = (p->size << 4) |
+                    (size_t)((ch <= '9') ? ch - '0' : (ch & 7) + 9);
+                p->digits++;
+                i++;
+                break;
+            }
+            if (!p->digits)
+                return -1;
+            p->state = CHUNK_EXTENSION;
+            break;
+        case CHUNK_EXTENSION:
+            i++;
+            if (ch == '\n')
+                p->state = p->size ? CHUNK_DATA : CHUNK_TRAILER_START;
+            break;
+        case CHUNK_DATA: {
+            size_t n = len - i;
+
+            if (n > p->size)
+                n = p->size;
+            i += n;
+            p->size -= n;
+            if (!p->size)
+                p->state = CHUNK_DATA_END;
+            break;
+        }
+        case CHUNK_DATA_END:
+            i++;
+            if (ch == '\n') {
+                p->state = CHUNK_SIZE;
+                p->digits = 0;
+            } else if (ch != '\r') {
+                return -1;
+            }
+            break;
+        case CHUNK_TRAILER_START:
+            i++;
+            if (ch == '\n')
+                p->state = CHUNK_DONE;
+            else if (ch != '\r')
+                p->state = CHUNK_TRAILER;
+            break;
+        case CHUNK_TRAILER:
+            i++;
+            if (ch == '\n')
+                p->state = CHUNK_TRAILER_START;
+            break;
+        case CHUNK_DONE:
+            break;
+        }
+    }
+
+    return (ssize_t)i;
+}
+
+static bool
+upstream_is_up(const struct proxy *proxy, struct proxy_upstream *upstream,
+    time_t now)
+{
+    return ATOMIC_READ(upstream->fails) < proxy->max_fails ||
+        ATOMIC_READ(upstream->down_until) <= now;
+}
+
+static struct proxy_upstream *
+pick_upstream(struct proxy *proxy, const struct proxy_upstream *avoid)
+{
+    const unsigned int start = ATOMIC_INC(proxy->next);
+    const time_t now = time(NULL);
+    struct proxy_upstream *best = NULL;
+
+    for (unsigned int i = 0; i < proxy->n_upstreams; i++) {
+        struct proxy_upstream *upstream =
+            &proxy->upstreams[(start + i) % proxy->n_upstreams];
+
+        if (upstream == avoid || !upstream_is_up(proxy, upstream, now))
+            continue;
+        if (proxy->balance == BALANCE_ROUND_ROBIN)
+            return upstream;
+        if (!best || ATOMIC_READ(upstream->active) < ATOMIC_READ(best->active))
+            best = upstream;
+    }
+
+    return best;
+}
+
+static void
+upstream_failed(struct proxy *proxy, struct proxy_upstream *upstream)
+{
+    unsigned int fails = ATOMIC_INC(upstream->fails);
+
+    if (fails >= proxy->max_fails) {
+        upstream->down_until = time(NULL) + (time_t)proxy->fail_timeout;
+
+        if (fails == proxy->max_fails) {
+            lwan_status_warning("Upstream %s failed %u times in a row, not using it for %us",
+                upstream->name, fails, proxy->fail_timeout);
+        }
+    }
+}
+
+static void
+upstream_succeeded(struct proxy_upstream *upstream)
+{
+    if (UNLIKELY(ATOMIC_READ(upstream->fails)))
+        upstream->fails = 0;
+}
+
+/* Idle connections to each upstream take keep_alive slots in a thread's
+ * idle array.  */
+static ALWAYS_INLINE size_t
+idle_slot(const struct proxy *proxy, size_t upstream, unsigned int n)
+{
+    return upstream * proxy->keep_alive + n;
+}
+
+static struct proxy_thread *
+proxy_get_thread(struct proxy *proxy, struct lwan_thread *thread)
+{
+    const struct lwan *l = thread->lwan;
+    struct proxy_thread *threads = ATOMIC_READ(proxy->threads);
+    struct proxy_thread *pt;
+
+    if (UNLIKELY(!threads)) {
+        threads = calloc(l->thread.count, sizeof(*threads));
+        if (!threads)
+            return NULL;
+
+        proxy->n_threads = l->thread.count;
+        if (!__sync_bool_compare_and_swap(&proxy->threads, NULL, threads)) {
+            free(threads);
+            threads = ATOMIC_READ(proxy->threads);
+        }
+    }
+
+    /* Only touched by the thread it belongs to from now on.  */
+    pt = &threads[thread - l->thread.threads];
+    if (UNLIKELY(!pt->n_idle)) {
+        /* At least one slot, so that calloc() doesn't fail with keep_alive
+         * set to 0.  */
+        pt->idle = calloc(idle_slot(proxy, proxy->n_upstreams, 0) + 1,
+            sizeof(int));
+        if (!pt->idle)
+            return NULL;
+
+        pt->n_idle = calloc(proxy->n_upstreams, sizeof(unsigned int));
+        if (!pt->n_idle) {
+            free(pt->idle);
+            pt->idle = NULL;
+            return NULL;
+        }
+    }
+
+    return pt;
+}
+
+/* An idle connection closed by the upstream (or with unexpected data in
+ * it) has something to read.  */
+static bool
+idle_connection_is_usable(int fd)
+{
+    char c;
+
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN;
+}
+
+static int
+take_idle_connection(struct proxy_request *pr, bool check_usable)
+{
+    const size_t idx = (size_t)(pr->upstream - pr->proxy->upstreams);
+    struct proxy_thread *pt = pr->thread;
+
+    while (pt->n_idle[idx]) {
+        int fd = pt->idle[idle_slot(pr->proxy, idx, --pt->n_idle[idx])];
+
+        if (!check_usable || idle_connection_is_usable(fd))
+            return fd;
+        close(fd);
+    }
+
+    return -1;
+}
+
+static bool
+return_idle_connection(struct proxy_request *pr)
+{
+    const size_t idx = (size_t)(pr->upstream - pr->proxy->upstreams);
+    struct proxy_thread *pt = pr->thread;
+
+    if (pt->n_idle[idx] >= pr->proxy->keep_alive)
+        return false;
+
+    pt->idle[idle_slot(pr->proxy, idx, pt->n_idle[idx]++)] = pr->fd;
+    pr->fd = -1;
+    return true;
+}
+
+static bool
+take_pipe(struct proxy_request *pr)
+{
+    struct proxy_thread *pt = pr->thread;
+
+    if (pt->n_pipes) {
+        pt->n_pipes--;
+        pr->pipe[0] = pt->pipes[pt->n_pipes][0];
+        pr->pipe[1] = pt->pipes[pt->n_pipes][1];
+        return true;
+    }
+
+    return pipe2(pr->pipe, O_NONBLOCK | O_CLOEXEC) == 0;
+}
+
+static void
+release_pipe(struct proxy_request *pr)
+{
+    struct proxy_thread *pt = pr->thread;
+
+    /* A pipe with data still in it can't be used by another request.  */
+    if (!pr->pipe_dirty && pt->n_pipes < MAX_IDLE_PIPES) {
+        pt->pipes[pt->n_pipes][0] = pr->pipe[0];
+        pt->pipes[pt->n_pipes][1] = pr->pipe[1];
+        pt->n_pipes++;
+    } else {
+        close(pr->pipe[0]);
+        close(pr->pipe[1]);
+    }
+
+    pr->pipe[0] = pr->pipe[1] = -1;
+}
+
+static void
+release_upstream(struct proxy_request *pr)
+{
+    if (pr->fd >= 0) {
+        close(pr->fd);
+        pr->fd = -1;
+    }
+    if (pr->upstream) {
+        ATOMIC_DEC(pr->upstream->active);
+        pr->upstream = NULL;
+    }
+}
+
+static void
+proxy_request_cleanup(void *data)
+{
+    struct proxy_request *pr = data;
+
+    /* Also called if the coroutine is aborted halfway through a request
+     * (e.g. the client went away), so the upstream connection can't be
+     * reused: it might still have parts of the response in flight.  */
+    release_upstream(pr);
+    if (pr->pipe[0] >= 0)
+        release_pipe(pr);
+}
+
+static ALWAYS_INLINE uint64_t
+deadline_for(int timeout_ms)
+{
+    struct timespec ts;
+
+    if (timeout_ms <= 0)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000 +
+        (uint64_t)timeout_ms;
+}
+
+static bool
+await_upstream(struct lwan_request *request, int fd, uint32_t events,
+    uint64_t deadline)
+{
+    if (lwan_thread_await_fd_until(request->conn, fd, events, deadline))
+        return true;
+
+    errno = ETIMEDOUT;
+    return false;
+}
+
+static ssize_t
+upstream_read(struct lwan_request *request, const struct proxy_request *pr,
+    void *buf, size_t count)
+{
+    const uint64_t deadline = deadline_for(pr->proxy->read_timeout_ms);
+
+    while (true) {
+        ssize_t r = read(pr->fd, buf, count);
+
+        if (r >= 0)
+            return r;
+
+        switch (errno) {
+        case EINTR:
+            break;
+        case EAGAIN:
+            if (!await_upstream(request, pr->fd, EPOLLIN | EPOLLRDHUP, deadline))
+                return -1;
+            break;
+        default:
+            return -1;
+        }
+    }
+}
+
+static bool
+upstream_writev(struct lwan_request *request, const struct proxy_request *pr,
+    struct iovec *iov, int iov_count)
+{
+    const uint64_t deadline = deadline_for(pr->proxy->read_timeout_ms);
+    const int fd = pr->fd;
+    int curr_iov = 0;
+
+    while (curr_iov < iov_count) {
+        ssize_t written = writev(fd, iov + curr_iov, iov_count - curr_iov);
+
+        if (written < 0) {
+            switch (errno) {
+            case EINTR:
+                continue;
+            case EAGAIN:
+                if (!await_upstream(request, fd, EPOLLOUT, deadline))
+                    return false;
+                continue;
+            default:
+                return false;
+            }
+        }
+
+        while (curr_iov < iov_count && written >= (ssize_t)iov[curr_iov].iov_len) {
+            written -= (ssize_t)iov[curr_iov].iov_len;
+            curr_iov++;
+        }
+        if (curr_iov < iov_count) {
+            iov[curr_iov].iov_base = (char *)iov[curr_iov].iov_base + written;
+            iov[curr_iov].iov_len -= (size_t)written;
+        }
+    }
+
+    return true;
+}
+
+static int
+upstream_connect(struct lwan_request *request, const struct proxy *proxy,
+    const struct proxy_upstream *upstream)
+{
+    const uint64_t deadline = deadline_for(proxy->connect_timeout_ms);
+    int saved_errno;
+    int fd = socket(upstream->addr.ss_family,
+        SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd < 0) {
+        lwan_status_perror("socket");
+        return -1;
+    }
+
+    if (upstream->addr.ss_family != AF_UNIX) {
+        int one = 1;
+
+        (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    /* Calling connect() again on a socket that's being connected tells
+     * if it's done, and how it went.  */
+    while (connect(fd, (const struct sockaddr *)&upstream->addr,
+            upstream->addr_len) < 0) {
+        switch (errno) {
+        case EISCONN:
+            return fd;
+        case EINPROGRESS:
+        case EALREADY:
+            if (await_upstream(request, fd, EPOLLOUT, deadline))
+                continue;
+            goto error;
+        case EINTR:
+            continue;
+        default:
+            goto error;
+        }
+    }
+
+    return fd;
+
+error:
+    saved_errno = errno;
+    lwan_status_debug("Could not connect to upstream %s: %s",
+        upstream->name, strerror(saved_errno));
+    close(fd);
+    errno = saved_errno;
+    return -1;
+}
+
+static bool
+is_idempotent(const struct lwan_request *request)
+{
+    return lwan_request_get_method(request) != REQUEST_METHOD_POST;
+}
+
+static bool
+build_upstream_request(struct lwan_request *request, const struct proxy *proxy,
+    const struct proxy_upstream *upstream, struct strbuf *buf)
+{
+    struct lwan_value headers = *lwan_request_get_raw_headers(request);
+    const struct lwan_value *query = lwan_request_get_raw_query_string(request);
+    const bool is_post = lwan_request_get_method(request) == REQUEST_METHOD_POST;
+    const struct lwan_value *url = proxy->strip_prefix ?
+        &request->url : &request->original_url;
+    char remote_addr[INET6_ADDRSTRLEN];
+    const char *forwarded_for = NULL;
+    size_t forwarded_for_len = 0;
+    struct lwan_value line;
+    bool has_host = false;
+
+    if (UNLIKELY(!strbuf_reset(buf)))
+        return false;
+
+    if (!strbuf_append_printf(buf, "%s ", lwan_request_get_method_name(request)))
+        return false;
+    if (!url->len || *url->value != '/') {
+        if (!strbuf_append_char(buf, '/'))
+            return false;
+    }
+    if (!lwan_append_encoded_path(buf, url->value, url->len))
+        return false;
+    if (query->len) {
+        if (!strbuf_append_char(buf, '?'))
+            return false;
+        if (!strbuf_append_str(buf, query->value, query->len))
+            return false;
+    }
+    /* Asking for HTTP/1.0 keeps the upstream from using chunked encoding
+     * with clients that wouldn't understand it.  */
+    if (!strbuf_append_str(buf, (request->flags & REQUEST_IS_HTTP_1_0) ?
+            " HTTP/1.0\r\n" : " HTTP/1.1\r\n", sizeof(" HTTP/1.1\r\n") - 1))
+        return false;
+
+    while (lwan_request_next_raw_header(&headers, &line)) {
+        const char *p = line.value;
+        const size_t len = line.len;
+        size_t value_len;
+        const char *value;
+
+        if (!len || is_hop_by_hop_header(p, len, true))
+            continue;
+        if (!is_post && header_value(p, len, "Content-Length", &value_len))
+            continue;
+        if ((value = header_value(p, len, "X-Forwarded-For", &value_len))) {
+            forwarded_for = value;
+            forwarded_for_len = value_len;
+            continue;
+        }
+        if (header_value(p, len, "Host", &value_len))
+            has_host = true;
+
+        if (!strbuf_append_str(buf, p, len) || !strbuf_append_str(buf, "\r\n", 2))
+            return false;
+    }
+
+    if (!has_host) {
+        const char *host = upstream->addr.ss_family == AF_UNIX ?
+            "localhost" : upstream->name;
+
+        if (!strbuf_append_printf(buf, "Host: %s\r\n", host))
+            return false;
+    }
+
+    const char *addr = lwan_request_get_remote_address(request, remote_addr);
+    if (forwarded_for) {
+        if (!strbuf_append_printf(buf, "X-Forwarded-For: %.*s, %s\r\n",
+                (int)forwarded_for_len, forwarded_for, addr ? addr : "unknown"))
+            return false;
+    } else if (addr) {
+        if (!strbuf_append_printf(buf, "X-Forwarded-For: %s\r\n", addr))
+            return false;
+    }
+
+    if (proxy->keep_alive)
+        return strbuf_append_str(buf, "Connection: keep-alive\r\n\r\n",
+            sizeof("Connection: keep-alive\r\n\r\n") - 1);
+    return strbuf_append_str(buf, "Connection: close\r\n\r\n",
+        sizeof("Connection: close\r\n\r\n") - 1);
+}
+
+static bool
+parse_upstream_response(char *head_end, char *buffer, struct upstream_response *r)
+{
+    char *p;
+
+    if (strncmp(buffer, "HTTP/1.", sizeof("HTTP/1.") - 1))
+        return false;
+    if (buffer[8] != ' ' || !lwan_char_isdigit(buffer[9]) ||
+            !lwan_char_isdigit(buffer[10]) || !lwan_char_isdigit(buffer[11]))
+        return false;
+
+    *r = (struct upstream_response) {
+        .head_end = head_end,
+        .status = (buffer[9] - '0') * 100 + (buffer[10] - '0') * 10 + (buffer[11] - '0'),
+        .content_length = -1,
+        .keep_alive = buffer[7] != '0',
+    };
+
+    p = strstr(buffer, "\r\n") + 2;
+    while (p < head_end - 2) {
+        char *eol = strstr(p, "\r\n");
+        const size_t len = (size_t)(eol - p);
+        const char *value;
+        size_t value_len;
+
+        if ((value = header_value(p, len, "Content-Length", &value_len))) {
+            char *endptr;
+            long content_length;
+
+            errno = 0;
+            content_length = strtol(value, &endptr, 10);
+            if (errno || content_length < 0 || endptr == value || endptr < value + value_len)
+                return false;
+            if (r->content_length >= 0 && r->content_length != content_length)
+                return false;
+            r->content_length = content_length;
+        } else if ((value = header_value(p, len, "Transfer-Encoding", &value_len))) {
+            /* "chunked" is always the last transfer coding.  */
+            r->chunked = value_len >= sizeof("chunked") - 1 &&
+                !strncasecmp(value + value_len - (sizeof("chunked") - 1),
+                             "chunked", sizeof("chunked") - 1);
+        } else if ((value = header_value(p, len, "Connection", &value_len))) {
+            if (is_token_in_list(value, value_len, "close"))
+                r->keep_alive = false;
+            else if (is_token_in_list(value, value_len, "keep-alive"))
+                r->keep_alive = true;
+        }
+
+        p = eol + 2;
+    }
+
+    return true;
+}
+
+/* Returns 1 with the response head in pr->buffer, 0 if the connection was
+ * closed before anything was received, or -1 on any other error (errno is
+ * ETIMEDOUT if the upstream took longer than read_timeout).  */
+static int
+read_upstream_response(struct lwan_request *request, struct proxy_request *pr,
+    struct upstream_response *r)
+{
+    pr->len = 0;
+
+    while (true) {
+        char *head_end;
+        ssize_t n;
+
+        if (pr->len == sizeof(pr->buffer) - 1)
+            return -1;
+
+        n = upstream_read(request, pr, pr->buffer + pr->len,
+            sizeof(pr->buffer) - 1 - pr->len);
+        if (n < 0 && errno == ETIMEDOUT)
+            return -1;
+        if (n <= 0)
+            return pr->len ? -1 : 0;
+
+        pr->len += (size_t)n;
+        pr->buffer[pr->len] = '\0';
+
+        head_end = memmem(pr->buffer, pr->len, "\r\n\r\n", 4);
+        if (!head_end)
+            continue;
+        head_end += 4;
+
+        if (!parse_upstream_response(head_end, pr->buffer, r))
+            return -1;
+
+        /* Interim responses (e.g. 103 Early Hints) aren't relayed.  */
+        if (r->status >= 100 && r->status < 200) {
+            pr->len -= (size_t)(head_end - pr->buffer);
+            memmove(pr->buffer, head_end, pr->len);
+            continue;
+        }
+
+        return 1;
+    }
+}
+
+static void
+send_to_client(struct lwan_request *request, const char *buf, size_t len)
+{
+    if (len)
+        lwan_send(request, buf, len, 0);
+}
+
+static bool
+relay_spliced(struct lwan_request *request, struct proxy_request *pr,
+    size_t remaining)
+{
+    while (remaining) {
+        const uint64_t deadline = deadline_for(pr->proxy->read_timeout_ms);
+        ssize_t in = splice(pr->fd, NULL, pr->pipe[1], NULL,
+            remaining < SPLICE_CHUNK ? remaining : SPLICE_CHUNK,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (in < 0) {
+            if (errno == EAGAIN) {
+                if (!await_upstream(request, pr->fd, EPOLLIN | EPOLLRDHUP,
+                        deadline))
+                    return false;
+                continue;
+            }
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        if (!in)
+            return false;
+
+        pr->pipe_dirty = true;
+        remaining -= (size_t)in;
+
+        for (int tries = MAX_STALLED_WRITES; in;) {
+            ssize_t out = splice(pr->pipe[0], NULL, request->fd, NULL,
+                (size_t)in, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+            if (out < 0) {
+                if (errno == EAGAIN && --tries) {
+                    coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
+                    continue;
+                }
+                if (errno == EINTR)
+                    continue;
+
+                coro_yield(request->conn->coro, CONN_CORO_ABORT);
+                __builtin_unreachable();
+            }
+
+            in -= out;
+            tries = MAX_STALLED_WRITES;
+        }
+        pr->pipe_dirty = false;
+    }
+
+    return true;
+}
+
+static bool
+relay_body(struct lwan_request *request, struct proxy_request *pr,
+    enum body_mode mode, size_t remaining, struct chunk_parser *chunks)
+{
+    if (mode == BODY_LENGTH && remaining >= pr->proxy->splice_threshold
+            && take_pipe(pr))
+        return relay_spliced(request, pr, remaining);
+
+    while (mode == BODY_LENGTH ? remaining > 0 : true) {
+        size_t to_read = sizeof(pr->buffer);
+        ssize_t n;
+
+        if (mode == BODY_LENGTH && remaining < to_read)
+            to_read = remaining;
+
+        n = upstream_read(request, pr, pr->buffer, to_read);
+        if (n < 0)
+            return false;
+        if (!n)
+            return mode == BODY_UNTIL_CLOSE;
+
+        if (mode == BODY_CHUNKED) {
+            ssize_t used = chunk_parser_feed(chunks, pr->buffer, (size_t)n);
+
+            if (used < 0)
+                return false;
+            send_to_client(request, pr->buffer, (size_t)used);
+
+            if (chunks->state == CHUNK_DONE)
+                return used == n;
+        } else {
+            send_to_client(request, pr->buffer, (size_t)n);
+            remaining -= (size_t)n;
+        }
+    }
+
+    return true;
+}
+
+static enum lwan_http_status
+relay_response(struct lwan_request *request, struct proxy_request *pr,
+    const struct upstream_response *r)
+{
+    struct strbuf *buf = request->response.buffer;
+    char *body = r->head_end;
+    size_t body_len = pr->len - (size_t)(r->head_end - pr->buffer);
+    struct chunk_parser chunks = { .state = CHUNK_SIZE };
+    enum body_mode mode;
+    bool client_keep_alive, reusable = r->keep_alive;
+    size_t remaining = 0;
+
+    if (lwan_request_get_method(request) == REQUEST_METHOD_HEAD ||
+            r->status == 204 || r->status == 304)
+        mode = BODY_NONE;
+    else if (r->chunked)
+        mode = BODY_CHUNKED;
+    else if (r->content_length >= 0)
+        mode = BODY_LENGTH;
+    else
+        mode = BODY_UNTIL_CLOSE;
+
+    client_keep_alive = (request->conn->flags & CONN_KEEP_ALIVE) &&
+        mode != BODY_UNTIL_CLOSE;
+
+    if (UNLIKELY(!strbuf_reset(buf)))
+        return HTTP_INTERNAL_ERROR;
+
+    for (char *p = pr->buffer; p < r->head_end - 2;) {
+        char *eol = strstr(p, "\r\n");
+        const size_t len = (size_t)(eol - p);
+
+        if (p == pr->buffer || !is_hop_by_hop_header(p, len, false)) {
+            if (!strbuf_append_str(buf, p, len + 2))
+                return HTTP_INTERNAL_ERROR;
+        }
+
+        p = eol + 2;
+    }
+    if (client_keep_alive) {
+        if (!strbuf_append_str(buf, "Connection: keep-alive\r\n\r\n",
+                sizeof("Connection: keep-alive\r\n\r\n") - 1))
+            return HTTP_INTERNAL_ERROR;
+    } else {
+        if (!strbuf_append_str(buf, "Connection: close\r\n\r\n",
+                sizeof("Connection: close\r\n\r\n") - 1))
+            return HTTP_INTERNAL_ERROR;
+        request->conn->flags &= ~CONN_KEEP_ALIVE;
+    }
+
+    switch (mode) {
+    case BODY_NONE:
+        if (body_len)
+            reusable = false;
+        body_len = 0;
+        break;
+    case BODY_LENGTH:
+        if (body_len > (size_t)r->content_length) {
+            reusable = false;
+            body_len = (size_t)r->content_length;
+        }
+        remaining = (size_t)r->content_length - body_len;
+        break;
+    case BODY_CHUNKED: {
+        ssize_t used = chunk_parser_feed(&chunks, body, body_len);
+
+        if (used < 0)
+            return HTTP_BAD_GATEWAY;
+        if (chunks.state == CHUNK_DONE) {
+            if ((size_t)used < body_len)
+                reusable = false;
+            mode = BODY_NONE;
+        }
+        body_len = (size_t)used;
+        break;
+    }
+    case BODY_UNTIL_CLOSE:
+        reusable = false;
+        break;
+    }
+
+    struct iovec iov[] = {
+        { .iov_base = strbuf_get_buffer(buf), .iov_len = strbuf_get_length(buf) },
+        { .iov_base = body, .iov_len = body_len },
+    };
+    request->flags |= RESPONSE_SENT_HEADERS;
+    lwan_writev(request, iov, body_len ? 2 : 1);
+
+    if (mode != BODY_NONE && !relay_body(request, pr, mode, remaining, &chunks)) {
+        /* Too late to tell the client with a proper response.  */
+        coro_yield(request->conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+
+    if (reusable)
+        return_idle_connection(pr);
+    if (mode == BODY_UNTIL_CLOSE) {
+        /* The client will only know the response is over when the
+         * connection is closed.  As the handler won't return, log the
+         * request now: lwan_response() only does that once the headers
+         * have been sent.  */
+        lwan_response(request, (enum lwan_http_status)r->status);
+        coro_yield(request->conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+
+    return (enum lwan_http_status)r->status;
+}
+
+static enum lwan_http_status
+proxy_handle_request(struct lwan_request *request,
+                     struct lwan_response *response,
+                     void *data)
+{
+    struct proxy *proxy = data;
+    struct proxy_request *pr;
+    struct proxy_upstream *failed = NULL;
+    struct upstream_response r;
+    unsigned int connect_attempts = 0;
+    bool timed_out;
+
+    if (UNLIKELY(!lwan_request_get_method_name(request)))
+        return HTTP_NOT_ALLOWED;
+
+    pr = coro_malloc(request->conn->coro, sizeof(*pr));
+    if (UNLIKELY(!pr))
+        return HTTP_INTERNAL_ERROR;
+
+    pr->proxy = proxy;
+    pr->upstream = NULL;
+    pr->fd = pr->pipe[0] = pr->pipe[1] = -1;
+    pr->pipe_dirty = false;
+    coro_defer(request->conn->coro, proxy_request_cleanup, pr);
+
+    pr->thread = proxy_get_thread(proxy, request->conn->thread);
+    if (UNLIKELY(!pr->thread))
+        return HTTP_INTERNAL_ERROR;
+
+    while (true) {
+        const struct lwan_value *body = request->header.body;
+        bool reused;
+        int ret;
+
+        pr->upstream = pick_upstream(proxy, failed);
+        if (!pr->upstream)
+            return HTTP_BAD_GATEWAY;
+        ATOMIC_INC(pr->upstream->active);
+
+        /* Requests that won't be sent again if the connection turns out
+         * to have been closed are only sent over connections that look
+         * alive.  */
+        pr->fd = take_idle_connection(pr, !is_idempotent(request));
+        reused = pr->fd >= 0;
+        if (!reused) {
+            pr->fd = upstream_connect(request, proxy, pr->upstream);
+            if (pr->fd < 0) {
+                /* Nothing has been sent, so any other upstream can be
+                 * tried.  */
+                timed_out = errno == ETIMEDOUT;
+                failed = pr->upstream;
+                upstream_failed(proxy, failed);
+                release_upstream(pr);
+
+                if (++connect_attempts >= proxy->n_upstreams)
+                    return timed_out ? HTTP_GATEWAY_TIMEOUT : HTTP_BAD_GATEWAY;
+                continue;
+            }
+        }
+
+        if (!build_upstream_request(request, proxy, pr->upstream, response->buffer))
+            return HTTP_INTERNAL_ERROR;
+
+        struct iovec iov[] = {
+            { .iov_base = strbuf_get_buffer(response->buffer),
+              .iov_len = strbuf_get_length(response->buffer) },
+            { .iov_base = body ? body->value : NULL,
+              .iov_len = body ? body->len : 0 },
+        };
+        if (!upstream_writev(request, pr, iov, (body && body->len) ? 2 : 1))
+            ret = errno == ETIMEDOUT ? -1 : 0;
+        else
+            ret = read_upstream_response(request, pr, &r);
+
+        if (ret > 0)
+            break;
+
+        timed_out = errno == ETIMEDOUT;
+
+        /* A connection taken from the pool might have been closed by the
+         * upstream while it was idle, and the request might not have been
+         * seen by it.  It might also have been, with the connection closed
+         * before the response was sent, so only requests that can be
+         * repeated safely are sent again.  */
+        if (!ret && reused && is_idempotent(request)) {
+            release_upstream(pr);
+            continue;
+        }
+
+        upstream_failed(proxy, pr->upstream);
+        release_upstream(pr);
+        return timed_out ? HTTP_GATEWAY_TIMEOUT : HTTP_BAD_GATEWAY;
+    }
+
+    upstream_succeeded(pr->upstream);
+
+    return relay_response(request, pr, &r);
+}
+
+static void
+proxy_shutdown(void *data)
+{
+    struct proxy *proxy = data;
+
+    if (!proxy)
+        return;
+
+    if (proxy->threads) {
+        for (unsigned int t = 0; t < proxy->n_threads; t++) {
+            struct proxy_thread *pt = &proxy->threads[t];
+
+            if (pt->n_idle) {
+                for (unsigned int u = 0; u < proxy->n_upstreams; u++) {
+                    for (unsigned int i = 0; i < pt->n_idle[u]; i++)
+                        close(pt->idle[u * proxy->keep_alive + i]);
+                }
+            }
+            for (unsigned int i = 0; i < pt->n_pipes; i++) {
+                close(pt->pipes[i][0]);
+                close(pt->pipes[i][1]);
+            }
+
+            free(pt->idle);
+            free(pt->n_idle);
+        }
+        free(proxy->threads);
+    }
+
+    for (unsigned int u = 0; u < proxy->n_upstreams; u++)
+        free(proxy->upstreams[u].name);
+    free(proxy->upstreams);
+    free(proxy);
+}
+
+static void *
+proxy_init(const char *prefix __attribute__((unused)), void *data)
+{
+    struct lwan_proxy_settings *settings = data;
+    struct proxy *proxy;
+    char *upstreams, *saveptr;
+
+    if (!settings->upstreams || !*settings->upstreams) {
+        lwan_status_error("Proxy needs at least one upstream");
+        return NULL;
+    }
+
+    proxy = calloc(1, sizeof(*proxy));
+    if (!proxy)
+        return NULL;
+
+    if (!settings->balance || !strcmp(settings->balance, "round_robin")) {
+        proxy->balance = BALANCE_ROUND_ROBIN;
+    } else if (!strcmp(settings->balance, "least_conn")) {
+        proxy->balance = BALANCE_LEAST_CONN;
+    } else {
+        lwan_status_error("Unknown balancing method: %s", settings->balance);
+        goto error;
+    }
+
+    proxy->keep_alive = settings->keep_alive;
+    proxy->max_fails = settings->max_fails ? settings->max_fails : 1;
+    proxy->fail_timeout = settings->fail_timeout;
+    proxy->connect_timeout_ms = (int)settings->connect_timeout * 1000;
+    proxy->read_timeout_ms = (int)settings->read_timeout * 1000;
+    proxy->splice_threshold = settings->splice_threshold;
+    proxy->strip_prefix = settings->strip_prefix;
+
+    upstreams = strdupa(settings->upstreams);
+    for (char *spec = strtok_r(upstreams, ", ", &saveptr); spec;
+            spec = strtok_r(NULL, ", ", &saveptr)) {
+        struct proxy_upstream *new_upstreams = realloc(proxy->upstreams,
+            (proxy->n_upstreams + 1) * sizeof(*new_upstreams));
+        struct proxy_upstream *upstream;
+
+        if (!new_upstreams)
+            goto error;
+        proxy->upstreams = new_upstreams;
+
+        upstream = &proxy->upstreams[proxy->n_upstreams];
+        *upstream = (struct proxy_upstream) { .name = strdup(spec) };
+        if (!upstream->name)
+            goto error;
+        proxy->n_upstreams++;
+
+        if (!lwan_conn_parse_address(spec, &upstream->addr, &upstream->addr_len))
+            goto error;
+    }
+
+    return proxy;
+
+error:
+    proxy_shutdown(proxy);
+    return NULL;
+}
+
+static void *
+proxy_init_from_hash(const char *prefix, const struct hash *hash)
+{
+    struct lwan_proxy_settings settings = {
+        .upstreams = hash_find(hash, "upstream"),
+        .balance = hash_find(hash, "balance"),
+        .keep_alive = (unsigned int)parse_int(hash_find(hash, "keep_alive"), 16),
+        .max_fails = (unsigned int)parse_int(hash_find(hash, "max_fails"), 3),
+        .fail_timeout = parse_time_period(hash_find(hash, "fail_timeout"), 10),
+        .connect_timeout = parse_time_period(hash_find(hash, "connect_timeout"), 5),
+        .read_timeout = parse_time_period(hash_find(hash, "read_timeout"), 10),
+        .splice_threshold = (size_t)parse_long(hash_find(hash, "splice_threshold"),
+            64 * 1024),
+        .strip_prefix = parse_bool(hash_find(hash, "strip_prefix"), false),
+    };
+
+    return proxy_init(prefix, &settings);
+}
+
+const struct lwan_module *
+lwan_module_proxy(void)
+{
+    static const struct lwan_module proxy_module = {
+        .init = proxy_init,
+        .init_from_hash = proxy_init_from_hash,
+        .shutdown = proxy_shutdown,
+        .handle = proxy_handle_request,
+        .flags = HANDLER_PARSE_POST_DATA | HANDLER_RAW_POST_DATA,
+    };
+
+    return &proxy_module;
+}
@@ -0,0 +1,59 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include "lwan.h"
+
+struct lwan_proxy_settings {
+  /* Comma-separated list of "host:port", "[ipv6]:port" or "unix:/path" */
+  const char *upstreams;
+  /* "round_robin" (default) or "least_conn" */
+  const char *balance;
+  /* Idle connections kept open per I/O thread and upstream */
+  unsigned int keep_alive;
+  /* Consecutive failures before an upstream is considered down, and for
+   * how long (in seconds) it won't be picked afterwards */
+  unsigned int max_fails;
+  unsigned int fail_timeout;
+  /* Seconds to wait for a connection to be accepted, and for the upstream
+   * to accept or send more data once connected; 0 waits forever.  Timing
+   * out is a failure, answered with "504 Gateway timeout". */
+  unsigned int connect_timeout;
+  unsigned int read_timeout;
+  /* Response bodies at least this large are relayed with splice(2) */
+  size_t splice_threshold;
+  /* Send the URL without the prefix to the upstream */
+  bool strip_prefix;
+};
+
+#define PROXY(upstreams_) \
+  .module = lwan_module_proxy(), \
+  .args = ((struct lwan_proxy_settings[]) {{ \
+    .upstreams = upstreams_, \
+    .keep_alive = 16, \
+    .max_fails = 3, \
+    .fail_timeout = 10, \
+    .connect_timeout = 5, \
+    .read_timeout = 10, \
+    .splice_threshold = 64 * 1024, \
+  }}), \
+  .flags = 0
+
+const struct lwan_module *lwan_module_proxy(void);
@@ -17,44 +17,255 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#define _GNU_SOURCE
+#include <pthread.h>
 #include <string.h>
 #include <stdlib.h>
 
-#include "lwan.h"
+#include "lwan-private.h"
+#include "lwan-file-watch.h"
 #include "lwan-mod-redirect.h"
+#include "lwan-redirect-map.h"
+#include "list.h"
+
+struct redirect_map_version {
+    struct lwan_redirect_map *map;
+    unsigned int refs;
+};
+
+/* The map version each I/O thread is using, replaced on the thread's
+ * first request after a reload; so a target returned by the map stays
+ * valid until the response headers have been written.  */
+struct redirect_map_holder {
+    struct lwan_file_watch_copy copy;
+    struct list_node holders;
+    struct redirect_map_version *version;
+};
+
+struct redirect_priv {
+    char *to;
+
+    char *map_file;
+    pthread_mutex_t lock;
+    struct redirect_map_version *current;
+
+    pthread_key_t holder_key;
+    struct list_head holders;
+
+    struct lwan_file_watch watch;
+};
+
+static void version_unref(struct redirect_priv *priv,
+    struct redirect_map_version *version)
+{
+    bool last;
+
+    if (!version)
+        return;
+
+    pthread_mutex_lock(&priv->lock);
+    last = !--version->refs;
+    pthread_mutex_unlock(&priv->lock);
+
+    if (last) {
+        lwan_redirect_map_close(version->map);
+        free(version);
+    }
+}
+
+static struct lwan_file_watch_copy *
+update_holder(void *data, struct lwan_file_watch_copy *copy)
+{
+    struct redirect_priv *priv = data;
+    struct redirect_map_holder *holder = (struct redirect_map_holder *)copy;
+    struct redirect_map_version *old;
+
+    if (UNLIKELY(!holder)) {
+        holder = calloc(1, sizeof(*holder));
+        if (UNLIKELY(!holder))
+            return NULL;
+
+        pthread_mutex_lock(&priv->lock);
+        list_add_tail(&priv->holders, &holder->holders);
+        pthread_mutex_unlock(&priv->lock);
+    }
+
+    old = holder->version;
+
+    pthread_mutex_lock(&priv->lock);
+    holder->version = priv->current;
+    holder->version->refs++;
+    pthread_mutex_unlock(&priv->lock);
+
+    version_unref(priv, old);
+
+    return &holder->copy;
+}
 
 static enum lwan_http_status
 redirect_handle_cb(struct lwan_request *request,
                    struct lwan_response *response,
                    void *data)
 {
-    if (UNLIKELY(!data))
+    struct redirect_priv *priv = data;
+    enum lwan_http_status status = HTTP_MOVED_PERMANENTLY;
+    const char *location = NULL;
+
+    if (UNLIKELY(!priv))
         return HTTP_INTERNAL_ERROR;
 
+    if (priv->map_file) {
+        struct redirect_map_holder *holder = lwan_file_watch_get_copy(
+            &priv->watch, priv->holder_key, update_holder, priv);
+
+        if (UNLIKELY(!holder))
+            return HTTP_INTERNAL_ERROR;
+
+        location = lwan_redirect_map_find(holder->version->map,
+                                          request->original_url.value,
+                                          request->original_url.len,
+                                          &status);
+    }
+    if (!location) {
+        if (!priv->to)
+            return HTTP_NOT_FOUND;
+
+        location = priv->to;
+        status = HTTP_MOVED_PERMANENTLY;
+    }
+
     struct lwan_key_value *headers = coro_malloc(request->conn->coro, sizeof(*headers) * 2);
     if (UNLIKELY(!headers))
         return HTTP_INTERNAL_ERROR;
 
     headers[0].key = "Location";
-    headers[0].value = data;
+    headers[0].value = (char *)location;
     headers[1].key = NULL;
     headers[1].value = NULL;
 
     response->headers = headers;
 
-    return HTTP_MOVED_PERMANENTLY;
+    return status;
+}
+
+/* A map with errors is reported, and the previous one is kept.  */
+static bool load_map(void *data)
+{
+    struct redirect_priv *priv = data;
+    struct redirect_map_version *version, *old;
+
+    version = malloc(sizeof(*version));
+    if (!version) {
+        lwan_status_perror("malloc");
+        return false;
+    }
+
+    version->map = lwan_redirect_map_open(priv->map_file);
+    if (!version->map) {
+        free(version);
+        return false;
+    }
+    version->refs = 1;
+
+    lwan_status_debug("Loaded %u redirects from %s",
+                      lwan_redirect_map_get_count(version->map),
+                      priv->map_file);
+
+    pthread_mutex_lock(&priv->lock);
+    old = priv->current;
+    priv->current = version;
+    pthread_mutex_unlock(&priv->lock);
+
+    version_unref(priv, old);
+    return true;
+}
+
+static void redirect_shutdown(void *data)
+{
+    struct redirect_priv *priv = data;
+    struct redirect_map_holder *holder, *next;
+
+    if (!priv)
+        return;
+
+    lwan_file_watch_stop(&priv->watch);
+
+    if (priv->map_file) {
+        /* Requests are done with this module by now; holders left around
+         * are those of each I/O thread.  */
+        list_for_each_safe(&priv->holders, holder, next, holders) {
+            version_unref(priv, holder->version);
+            free(holder);
+        }
+        version_unref(priv, priv->current);
+
+        pthread_key_delete(priv->holder_key);
+    }
+
+    pthread_mutex_destroy(&priv->lock);
+    free(priv->map_file);
+    free(priv->to);
+    free(priv);
 }
 
 static void *redirect_init(const char *prefix __attribute__((unused)), void *data)
 {
     struct lwan_redirect_settings *settings = data;
-    return (settings->to) ? strdup(settings->to) : NULL;
+    struct redirect_priv *priv;
+
+    if (!settings->to && !settings->map) {
+        lwan_status_error("Redirect needs either \"to\" or \"map\"");
+        return NULL;
+    }
+
+    priv = calloc(1, sizeof(*priv));
+    if (!priv) {
+        lwan_status_perror("calloc");
+        return NULL;
+    }
+
+    pthread_mutex_init(&priv->lock, NULL);
+    list_head_init(&priv->holders);
+
+    if (settings->to) {
+        priv->to = strdup(settings->to);
+        if (!priv->to)
+            goto error;
+    }
+
+    if (settings->map) {
+        priv->map_file = strdup(settings->map);
+        if (!priv->map_file)
+            goto error;
+
+        if (!load_map(priv))
+            goto error;
+
+        if (pthread_key_create(&priv->holder_key, NULL)) {
+            lwan_status_perror("pthread_key_create");
+            version_unref(priv, priv->current);
+            goto error;
+        }
+
+        if (!lwan_file_watch_start(&priv->watch, priv->map_file, load_map, priv))
+            lwan_status_warning("Changes to %s won't be noticed", priv->map_file);
+    }
+
+    return priv;
+
+error:
+    pthread_mutex_destroy(&priv->lock);
+    free(priv->map_file);
+    free(priv->to);
+    free(priv);
+    return NULL;
 }
 
 static void *redirect_init_from_hash(const char *prefix, const struct hash *hash)
 {
     struct lwan_redirect_settings settings = {
-        .to = hash_find(hash, "to")
+        .to = hash_find(hash, "to"),
+        .map = hash_find(hash, "map")
     };
     return redirect_init(prefix, &settings);
 }
@@ -64,7 +275,7 @@ const struct lwan_module *lwan_module_redirect(void)
     static const struct lwan_module redirect_module = {
         .init = redirect_init,
         .init_from_hash = redirect_init_from_hash,
-        .shutdown = free,
+        .shutdown = redirect_shutdown,
         .handle = redirect_handle_cb,
         .flags = 0
     };
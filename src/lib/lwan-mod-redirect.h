@@ -23,12 +23,18 @@
 
 struct lwan_redirect_settings {
   char *to;
+
+  /* File with "source target [status]" lines, or its mkredirmap
+   * output; redirects whose source matches the request path exactly
+   * take precedence over "to".  */
+  char *map;
 };
 
 #define REDIRECT(to_) \
   .module = lwan_module_redirect(), \
   .args = ((struct lwan_redirect_settings[]) {{ \
-    .to = to_ \
+    .to = to_, \
+    .map = NULL \
   }}), \
   .flags = 0
 
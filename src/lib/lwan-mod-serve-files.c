@@ -21,15 +21,24 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <zlib.h>
 
+#ifdef HAS_OPENAT2
+#include <linux/openat2.h>
+#include <sys/syscall.h>
+#endif
+
 #include "lwan-private.h"
 
+#include "lwan-bundle.h"
 #include "lwan-cache.h"
 #include "lwan-config.h"
 #include "lwan-io-wrappers.h"
@@ -46,10 +55,54 @@ static const char *compression_deflate = "deflate";
 
 static const int open_mode = O_RDONLY | O_NONBLOCK | O_CLOEXEC;
 
+/* Descriptors held by the sendfile() entries of every instance; see
+ * lwan_get_stats().  */
+static unsigned int cached_fds;
+
+/* Files smaller than this are always kept in memory, unless memory is
+ * getting scarce; larger files have to be popular to be kept in memory. */
+#define SMALL_FILE_SIZE 16384
+
+/* Files kept in memory get a deflated copy only up to this size, as it's
+ * made while the request that created the cache entry waits: deflating
+ * takes about half a millisecond for every 16KiB.  */
+#define DEFLATE_MAX_SIZE 16384
+
+#define POPULARITY_SLOTS 4096
+#define POPULAR_HITS 16
+
+#define DIR_CACHE_SLOTS 64
+#define DIR_CACHE_TTL 5
+
+/* Set in sendfile_cache_data's state once its descriptors are closed.  */
+#define SENDFILE_CLOSED (1u << 31)
+
+/* Directory listings are sent in chunks of about this size.  */
+#define DIRLIST_CHUNK_SIZE 16384
+
+/* Large enough for "\r\n--boundary", Content-Type and Content-Range
+ * lines preceding each part of a multipart/byteranges response.  */
+#define PART_HEADER_SIZE 256
+#define MULTIPART_BOUNDARY_LEN 16
+
+/* Quoted inode, modification time in nanoseconds and size, in hex, with
+ * an optional suffix for the encoded variant.  */
+#define ETAG_SIZE 64
+
 struct file_cache_entry;
+struct bundle;
+
+struct dir_cache_slot {
+    char *path;
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    time_t expires;
+};
 
 struct serve_files_priv {
     struct cache *cache;
+    struct bundle *bundle;
 
     char *root_path;
     size_t root_path_len;
@@ -59,6 +112,50 @@ struct serve_files_priv {
     char *prefix;
 
     struct lwan_tpl *directory_list_tpl;
+    struct lwan_tpl *directory_list_json_tpl;
+
+    /* Files up to max_size bytes can be kept in memory (mapped, with a
+     * deflated copy) as long as everything kept in memory fits in budget
+     * bytes; everything else is sent with sendfile().  Popularity outlives
+     * cache entries: each slot decays by half whenever an entry hashing
+     * to it is destroyed, and then gets the hits that entry had.  */
+    struct {
+        unsigned int popularity[POPULARITY_SLOTS];
+        size_t max_size;
+        size_t budget;
+        size_t used;
+    } in_memory;
+
+    /* Files at least this large are streamed without filling the page
+     * cache with them.  */
+    size_t stream_min_size;
+
+    /* Descriptors held by sendfile() entries.  Once more than max are
+     * open, those of entries not being sent from, and not hit since the
+     * last time they were looked at, are closed (in the order the entries
+     * are in lru); they're reopened on the entry's next hit.  */
+    struct {
+        struct list_head lru;
+        pthread_mutex_t lock;
+        unsigned int open;
+        unsigned int max;
+    } fds;
+
+    /* Directories in which files were recently looked up, opened with
+     * openat2(RESOLVE_BENEATH), so that resolving a path takes a couple of
+     * fstatat() calls instead of a realpath() walk.  Slots are replaced
+     * on collision, and reopened after DIR_CACHE_TTL seconds or if their
+     * path leads somewhere else.  */
+    struct {
+        struct dir_cache_slot slots[DIR_CACHE_SLOTS];
+        pthread_mutex_t lock;
+        bool usable;
+    } dirs;
+
+    /* Content-Type of multi-range responses, ending with the boundary
+     * separating the parts.  */
+    char multipart_type[sizeof("multipart/byteranges; boundary=") +
+                        MULTIPART_BOUNDARY_LEN];
 
     bool serve_precompressed_files;
     bool auto_index;
@@ -72,23 +169,72 @@ struct cache_funcs {
     size_t struct_size;
 };
 
+/* Complete responses for a small file: the 304 headers, followed by the
+ * 200 headers and the contents, so that each can be sent with a single
+ * call.  Files sent with sendfile() only get the headers.  These are never
+ * modified once built; when the second changes, a copy with the new Date
+ * and Expires headers replaces it.  */
+struct precomputed_response {
+    unsigned int refs;
+    time_t date;
+
+    size_t not_modified_len;
+    size_t ok_headers_len;
+    size_t len;
+
+    /* Date and Expires in the 304 headers, then in the 200 headers.  */
+    size_t date_offsets[4];
+
+    char data[];
+};
+
 struct mmap_cache_data {
     struct {
         void *contents;
         /* zlib expects unsigned longs instead of size_t */
         unsigned long size;
+
+        struct precomputed_response *response;
     } compressed, uncompressed;
+
+    /* NULL for files in a bundle, which aren't counted in the budget.  */
+    struct serve_files_priv *priv;
+
+    pthread_spinlock_t lock;
 };
 
 struct sendfile_cache_data {
     struct {
         int fd;
         size_t size;
+
+        /* To make sure the same file is reopened.  */
+        ino_t ino;
+        time_t mtime;
+
+        struct precomputed_response *response;
     } compressed, uncompressed;
+
+    bool streaming;
+    pthread_spinlock_t lock;
+
+    struct serve_files_priv *priv;
+    char *path;
+
+    /* Requests sending from the descriptors, plus SENDFILE_CLOSED once
+     * they've been closed.  Only changed atomically, so that hits don't
+     * have to take priv->fds.lock unless the descriptors have to be
+     * reopened.  */
+    unsigned int state;
+    bool referenced;
+
+    /* Protected by priv->fds.lock.  */
+    struct list_node lru;
 };
 
 struct dir_list_cache_data {
-    struct strbuf *rendered;
+    char *full_path;
+    const char *rel_path;
 };
 
 struct redir_cache_data {
@@ -105,11 +251,58 @@ struct file_cache_entry {
 
     const char *mime_type;
     const struct cache_funcs *funcs;
+
+    /* Strong validators for the file as is and for its compressed
+     * variant; directory listings don't get one.  */
+    struct {
+        char identity[ETAG_SIZE];
+        char encoded[ETAG_SIZE];
+    } etag;
+
+    unsigned int popularity_slot;
+    unsigned int hits;
+};
+
+/* Files packed by mkbundle.  The bundle is mapped once, and each file in
+ * it gets a cache entry (followed by its mmap_cache_data, pointing into
+ * the mapping) that lives as long as the bundle, found with the perfect
+ * hash stored in the bundle itself.  */
+struct bundle {
+    void *base;
+    size_t size;
+
+    const struct lwan_bundle_header *header;
+    const uint32_t *displacements;
+    const struct lwan_bundle_entry *entries;
+
+    char *fces;
+};
+
+/* Where the parts of a response come from: a file in memory, or a
+ * descriptor to sendfile() from.  */
+struct file_source {
+    const void *contents;
+    int fd;
+    bool streaming;
+};
+
+/* Offsets into a file, with "to" not included.  */
+struct file_range {
+    off_t from, to;
 };
 
 struct file_list {
     const char *full_path;
     const char *rel_path;
+
+    /* Entries before offset are skipped, and at most limit entries are
+     * listed (0 meaning all of them); if there are more, next_page points
+     * to the query string for the following page, in the same format.  */
+    long offset, limit;
+    bool json;
+    const char *next_page;
+    char next_page_buf[96];
+
     struct {
         coro_function_t generator;
 
@@ -117,9 +310,11 @@ struct file_list {
         const char *icon_alt;
         const char *name;
         const char *type;
+        const char *separator;
 
         int size;
         const char *unit;
+        off_t bytes;
     } file_list;
 };
 
@@ -140,6 +335,8 @@ static bool dirlist_init(struct file_cache_entry *ce,
 static void dirlist_free(void *data);
 static enum lwan_http_status dirlist_serve(struct lwan_request *request, void *data);
 
+static void bundle_entry_free(void *data);
+
 static bool redir_init(struct file_cache_entry *ce,
     struct serve_files_priv *priv, const char *full_path, struct stat *st);
 static void redir_free(void *data);
@@ -152,6 +349,12 @@ static const struct cache_funcs mmap_funcs = {
     .struct_size = sizeof(struct mmap_cache_data)
 };
 
+static const struct cache_funcs bundle_funcs = {
+    .free = bundle_entry_free,
+    .serve = mmap_serve,
+    .struct_size = sizeof(struct mmap_cache_data)
+};
+
 static const struct cache_funcs sendfile_funcs = {
     .init = sendfile_init,
     .free = sendfile_free,
@@ -173,17 +376,36 @@ static const struct cache_funcs redir_funcs = {
     .struct_size = sizeof(struct redir_cache_data)
 };
 
+static void append_json_str_to_strbuf(struct strbuf *buf, void *ptr);
+static void append_bytes_to_strbuf(struct strbuf *buf, void *ptr);
+static bool bytes_is_empty(void *ptr);
+
+#define TPL_VAR_JSON_STR(struct_, name_, var_) \
+    { \
+        .name = name_, \
+        .offset = offsetof(struct_, var_), \
+        .append_to_strbuf = append_json_str_to_strbuf, \
+        .get_is_empty = lwan_tpl_str_is_empty \
+    }
+
 static const struct lwan_var_descriptor file_list_desc[] = {
     TPL_VAR_STR_ESCAPE(struct file_list, full_path),
     TPL_VAR_STR_ESCAPE(struct file_list, rel_path),
+    TPL_VAR_JSON_STR(struct file_list, "rel_path_json", rel_path),
+    TPL_VAR_STR(struct file_list, next_page),
     TPL_VAR_SEQUENCE(struct file_list, file_list, directory_list_generator, (
         (const struct lwan_var_descriptor[]) {
             TPL_VAR_STR(struct file_list, file_list.icon),
             TPL_VAR_STR(struct file_list, file_list.icon_alt),
             TPL_VAR_STR(struct file_list, file_list.name),
+            TPL_VAR_JSON_STR(struct file_list, "file_list.name_json",
+                             file_list.name),
             TPL_VAR_STR(struct file_list, file_list.type),
+            TPL_VAR_STR(struct file_list, file_list.separator),
             TPL_VAR_INT(struct file_list, file_list.size),
             TPL_VAR_STR(struct file_list, file_list.unit),
+            TPL_VAR_SIMPLE(struct file_list, file_list.bytes,
+                           append_bytes_to_strbuf, bytes_is_empty),
             TPL_VAR_SENTINEL
         }
     )),
@@ -214,7 +436,7 @@ static const char *directory_list_tpl_str = "<html>\n"
     "      <td><img src=\"?icon={{file_list.icon}}\" alt=\"{{file_list.icon_alt}}\"></td>\n"
     "      <td><a href=\"{{rel_path}}/{{{file_list.name}}}\">{{{file_list.name}}}</a></td>\n"
     "      <td>{{file_list.type}}</td>\n"
-    "      <td>{{file_list.size}}{{file_list.unit}}</td>\n"
+    "      <td>{{file_list.unit?}}{{file_list.size}}{{file_list.unit}}{{/file_list.unit?}}{{^file_list.unit?}}-{{/file_list.unit?}}</td>\n"
     "    </tr>\n"
     "{{/file_list}}"
     "{{^#file_list}}"
@@ -223,14 +445,129 @@ static const char *directory_list_tpl_str = "<html>\n"
     "    </tr>\n"
     "{{/file_list}}"
     "  </table>\n"
+    "{{next_page?}}  <p><a href=\"{{{next_page}}}\">Next page</a></p>\n{{/next_page?}}"
     "</body>\n"
     "</html>\n";
 
+static const char *directory_list_json_tpl_str = "{"
+    "\"path\":\"{{rel_path_json}}\","
+    "\"entries\":["
+    "{{#file_list}}"
+    "{{file_list.separator}}"
+    "{\"name\":\"{{file_list.name_json}}\","
+    "\"type\":\"{{file_list.type}}\","
+    "\"size\":{{file_list.bytes?}}{{file_list.bytes}}{{/file_list.bytes?}}"
+    "{{^file_list.bytes?}}null{{/file_list.bytes?}}}"
+    "{{/file_list}}"
+    "]"
+    "{{next_page?}},\"next\":\"{{next_page}}\"{{/next_page?}}"
+    "}\n";
+
+static void
+append_json_str_to_strbuf(struct strbuf *buf, void *ptr)
+{
+    const char *str = *(const char **)ptr;
+
+    if (UNLIKELY(!str))
+        return;
+
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            strbuf_append_char(buf, '\\');
+            strbuf_append_char(buf, (char)*p);
+        } else if (*p < 0x20) {
+            strbuf_append_printf(buf, "\\u%04x", *p);
+        } else {
+            strbuf_append_char(buf, (char)*p);
+        }
+    }
+}
+
+static void
+append_bytes_to_strbuf(struct strbuf *buf, void *ptr)
+{
+    strbuf_append_printf(buf, "%" PRIu64, (uint64_t)*(off_t *)ptr);
+}
+
+static bool
+bytes_is_empty(void *ptr)
+{
+    /* Directories have no size; empty files do.  */
+    return *(off_t *)ptr < 0;
+}
+
+enum dir_entry_kind {
+    DIR_ENTRY_SKIP,
+    DIR_ENTRY_DIRECTORY,
+    DIR_ENTRY_FILE,
+};
+
+/* Whether an entry should be listed, going by d_type whenever it's known
+ * so that skipped entries and directories don't cost a fstatat().  Only
+ * files being listed (size != NULL) are stat'ed for their size.  */
+static enum dir_entry_kind
+classify_dir_entry(int fd, const struct dirent *entry, off_t *size)
+{
+    struct stat st;
+
+    if (entry->d_name[0] == '.')
+        return DIR_ENTRY_SKIP;
+
+    switch (entry->d_type) {
+    case DT_DIR:
+        return DIR_ENTRY_DIRECTORY;
+    case DT_REG:
+        if (!size)
+            return DIR_ENTRY_FILE;
+        /* fallthrough */
+    case DT_LNK:
+    case DT_UNKNOWN:
+        if (fstatat(fd, entry->d_name, &st, 0) < 0)
+            return DIR_ENTRY_SKIP;
+        if (S_ISDIR(st.st_mode))
+            return DIR_ENTRY_DIRECTORY;
+        if (!S_ISREG(st.st_mode))
+            return DIR_ENTRY_SKIP;
+        if (size)
+            *size = st.st_size;
+        return DIR_ENTRY_FILE;
+    default:
+        return DIR_ENTRY_SKIP;
+    }
+}
+
+static void
+set_file_list_size(struct file_list *fl, off_t size)
+{
+    fl->file_list.bytes = size;
+
+    if (size < 1024) {
+        fl->file_list.size = (int)size;
+        fl->file_list.unit = "B";
+    } else if (size < 1024 * 1024) {
+        fl->file_list.size = (int)(size / 1024);
+        fl->file_list.unit = "KiB";
+    } else if (size < 1024 * 1024 * 1024) {
+        fl->file_list.size = (int)(size / (1024 * 1024));
+        fl->file_list.unit = "MiB";
+    } else {
+        fl->file_list.size = (int)(size / (1024 * 1024 * 1024));
+        fl->file_list.unit = "GiB";
+    }
+}
+
+static void closedir_wrapper(void *data)
+{
+    closedir(data);
+}
+
 static int
 directory_list_generator(struct coro *coro, void *data)
 {
     struct file_list *fl = data;
     struct dirent *entry;
+    long skip = fl->offset;
+    long left = fl->limit ? fl->limit : LONG_MAX;
     DIR *dir;
     int fd;
 
@@ -238,56 +575,104 @@ directory_list_generator(struct coro *coro, void *data)
     if (!dir)
         return 0;
 
+    /* Entries are produced while the response is being sent, so this
+     * might be freed without ever reaching the end of the directory.  */
+    coro_defer(coro, closedir_wrapper, dir);
+
     fd = dirfd(dir);
     if (fd < 0)
-        goto out;
+        return 0;
+
+    fl->file_list.separator = "";
 
     while ((entry = readdir(dir))) {
-        struct stat st;
+        enum dir_entry_kind kind;
+        off_t size;
 
-        if (entry->d_name[0] == '.')
+        if (skip) {
+            if (classify_dir_entry(fd, entry, NULL) != DIR_ENTRY_SKIP)
+                skip--;
             continue;
+        }
 
-        if (fstatat(fd, entry->d_name, &st, 0) < 0)
-            continue;
+        if (!left) {
+            if (classify_dir_entry(fd, entry, NULL) == DIR_ENTRY_SKIP)
+                continue;
+
+            snprintf(fl->next_page_buf, sizeof(fl->next_page_buf),
+                     "?offset=%ld&limit=%ld%s",
+                     fl->offset > LONG_MAX - fl->limit ? LONG_MAX : fl->offset + fl->limit,
+                     fl->limit, fl->json ? "&format=json" : "");
+            fl->next_page = fl->next_page_buf;
+            break;
+        }
 
-        if (S_ISDIR(st.st_mode)) {
+        kind = classify_dir_entry(fd, entry, &size);
+        if (kind == DIR_ENTRY_DIRECTORY) {
             fl->file_list.icon = "folder";
             fl->file_list.icon_alt = "DIR";
             fl->file_list.type = "directory";
-        } else if (S_ISREG(st.st_mode)) {
+            fl->file_list.unit = NULL;
+            fl->file_list.bytes = -1;
+        } else if (kind == DIR_ENTRY_FILE) {
             fl->file_list.icon = "file";
             fl->file_list.icon_alt = "FILE";
             fl->file_list.type = lwan_determine_mime_type_for_file_name(entry->d_name);
+            set_file_list_size(fl, size);
         } else {
             continue;
         }
 
-        if (st.st_size < 1024) {
-            fl->file_list.size = (int)st.st_size;
-            fl->file_list.unit = "B";
-        } else if (st.st_size < 1024 * 1024) {
-            fl->file_list.size = (int)(st.st_size / 1024);
-            fl->file_list.unit = "KiB";
-        } else if (st.st_size < 1024 * 1024 * 1024) {
-            fl->file_list.size = (int)(st.st_size / (1024 * 1024));
-            fl->file_list.unit = "MiB";
-        } else {
-            fl->file_list.size = (int)(st.st_size / (1024 * 1024 * 1024));
-            fl->file_list.unit = "GiB";
-        }
-
         fl->file_list.name = entry->d_name;
 
         if (coro_yield(coro, 1))
             break;
+
+        fl->file_list.separator = ",";
+        left--;
     }
 
-out:
-    closedir(dir);
     return 0;
 }
 
+static void
+format_etag(char etag[static ETAG_SIZE], uint64_t id, uint64_t mtime_ns,
+    uint64_t size, const char *suffix)
+{
+    snprintf(etag, ETAG_SIZE, "\"%" PRIx64 "-%" PRIx64 "-%" PRIx64 "%s\"",
+             id, mtime_ns, size, suffix);
+}
+
+static void
+format_etag_from_stat(char etag[static ETAG_SIZE], const struct stat *st,
+    const char *suffix)
+{
+    uint64_t mtime_ns = (uint64_t)st->st_mtim.tv_sec * 1000000000ull +
+                        (uint64_t)st->st_mtim.tv_nsec;
+
+    format_etag(etag, (uint64_t)st->st_ino, mtime_ns, (uint64_t)st->st_size,
+                suffix);
+}
+
+static void
+init_multipart_type(struct serve_files_priv *priv)
+{
+    uint64_t seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32) ^
+                    (uint64_t)(uintptr_t)priv;
+
+    /* Doesn't need to be unpredictable, just unlikely to show up in the
+     * files being served.  */
+    seed ^= seed >> 33;
+    seed *= 0xff51afd7ed558ccdull;
+    seed ^= seed >> 33;
+    seed *= 0xc4ceb9fe1a85ec53ull;
+    seed ^= seed >> 33;
+
+    snprintf(priv->multipart_type, sizeof(priv->multipart_type),
+             "multipart/byteranges; boundary=%0*" PRIx64,
+             MULTIPART_BOUNDARY_LEN, seed);
+}
+
 static ALWAYS_INLINE bool
 is_compression_worthy(const size_t compressed_sz, const size_t uncompressed_sz)
 {
@@ -299,6 +684,12 @@ is_compression_worthy(const size_t compressed_sz, const size_t uncompressed_sz)
 static void
 compress_cached_entry(struct mmap_cache_data *md)
 {
+    if (md->uncompressed.size > DEFLATE_MAX_SIZE) {
+        md->compressed.contents = NULL;
+        md->compressed.size = 0;
+        return;
+    }
+
     md->compressed.size = compressBound(md->uncompressed.size);
 
     if (UNLIKELY(!(md->compressed.contents = malloc(md->compressed.size))))
@@ -318,6 +709,22 @@ error_zero_out:
     md->compressed.size = 0;
 }
 
+static bool
+reserve_memory(struct serve_files_priv *priv, size_t size)
+{
+    if (ATOMIC_AAF(&priv->in_memory.used, size) <= priv->in_memory.budget)
+        return true;
+
+    ATOMIC_AAF(&priv->in_memory.used, -size);
+    return false;
+}
+
+static ALWAYS_INLINE void
+release_memory(struct serve_files_priv *priv, size_t size)
+{
+    ATOMIC_AAF(&priv->in_memory.used, -size);
+}
+
 static bool
 mmap_init(struct file_cache_entry *ce, struct serve_files_priv *priv,
     const char *full_path, struct stat *st)
@@ -329,13 +736,20 @@ mmap_init(struct file_cache_entry *ce, struct serve_files_priv *priv,
 
     path += *path == '/';
 
+    /* If it doesn't fit, this file is served with sendfile() instead.  */
+    if (!reserve_memory(priv, (size_t)st->st_size))
+        return false;
+
     file_fd = openat(priv->root_fd, path, open_mode);
-    if (UNLIKELY(file_fd < 0))
+    if (UNLIKELY(file_fd < 0)) {
+        release_memory(priv, (size_t)st->st_size);
         return false;
+    }
 
     md->uncompressed.contents = mmap(NULL, (size_t)st->st_size, PROT_READ,
                                      MAP_SHARED, file_fd, 0);
     if (UNLIKELY(md->uncompressed.contents == MAP_FAILED)) {
+        release_memory(priv, (size_t)st->st_size);
         success = false;
         goto close_file;
     }
@@ -347,6 +761,17 @@ mmap_init(struct file_cache_entry *ce, struct serve_files_priv *priv,
     md->uncompressed.size = (size_t)st->st_size;
     compress_cached_entry(md);
 
+    /* The deflated copy might take the budget over a bit; that's fine,
+     * as it's smaller than the file itself.  */
+    if (md->compressed.size) {
+        ATOMIC_AAF(&priv->in_memory.used, md->compressed.size);
+        format_etag_from_stat(ce->etag.encoded, st, "-deflate");
+    }
+
+    md->uncompressed.response = md->compressed.response = NULL;
+    md->priv = priv;
+    pthread_spin_init(&md->lock, PTHREAD_PROCESS_PRIVATE);
+
     ce->mime_type = lwan_determine_mime_type_for_file_name(
                 full_path + priv->root_path_len);
 
@@ -366,12 +791,77 @@ is_world_readable(mode_t mode)
     return (mode & world_readable) == world_readable;
 }
 
+/* Must be called with priv->fds.lock held.  */
+static void
+count_fds(struct serve_files_priv *priv, int delta)
+{
+    priv->fds.open += (unsigned int)delta;
+    ATOMIC_AAF(&cached_fds, (unsigned int)delta);
+}
+
+unsigned int
+lwan_serve_files_cached_fds(void)
+{
+    return ATOMIC_READ(cached_fds);
+}
+
+/* Must be called with priv->fds.lock held.  Entries that were hit since
+ * they were last looked at get a second chance, and those being sent from
+ * are skipped, so this might leave more than max_open descriptors open
+ * until it's called again.  */
+static void
+close_idle_fds(struct serve_files_priv *priv, unsigned int max_open)
+{
+    unsigned int tries = priv->fds.open * 2;
+
+    while (priv->fds.open > max_open && tries--) {
+        struct sendfile_cache_data *sd =
+            list_pop(&priv->fds.lru, struct sendfile_cache_data, lru);
+
+        if (!sd)
+            break;
+
+        if (ATOMIC_READ(sd->referenced) ||
+                !__sync_bool_compare_and_swap(&sd->state, 0, SENDFILE_CLOSED)) {
+            sd->referenced = false;
+            list_add_tail(&priv->fds.lru, &sd->lru);
+            continue;
+        }
+
+        if (sd->compressed.fd >= 0) {
+            close(sd->compressed.fd);
+            count_fds(priv, -1);
+        }
+        close(sd->uncompressed.fd);
+        count_fds(priv, -1);
+    }
+}
+
+/* Must be called with priv->fds.lock held.  If the process is out of
+ * descriptors, some idle ones are closed to make room, even if the
+ * budget hasn't been reached.  */
+static int
+open_file(struct serve_files_priv *priv, const char *path)
+{
+    int fd = openat(priv->root_fd, path, open_mode);
+
+    if (UNLIKELY(fd < 0) && (errno == EMFILE || errno == ENFILE) &&
+            !list_empty(&priv->fds.lru)) {
+        lwan_status_debug("Out of file descriptors with %u held by the cache",
+                          priv->fds.open);
+
+        close_idle_fds(priv, priv->fds.open > 16 ? priv->fds.open - 16 : 0);
+        fd = openat(priv->root_fd, path, open_mode);
+    }
+
+    return fd;
+}
+
 static int
-try_open_compressed(const char *relpath, const struct serve_files_priv *priv,
-    const struct stat *uncompressed, size_t *compressed_sz)
+try_open_compressed(const char *relpath, struct serve_files_priv *priv,
+    const struct stat *uncompressed, struct stat *st)
 {
     char gzpath[PATH_MAX];
-    struct stat st;
     int ret, fd;
 
     /* Try to serve a compressed file using sendfile() if $FILENAME.gz exists */
@@ -379,35 +869,115 @@ try_open_compressed(const char *relpath, const struct serve_files_priv *priv,
     if (UNLIKELY(ret < 0 || ret >= PATH_MAX))
         goto out;
 
-    fd = openat(priv->root_fd, gzpath, open_mode);
+    fd = open_file(priv, gzpath);
     if (UNLIKELY(fd < 0))
         goto out;
 
-    ret = fstat(fd, &st);
+    ret = fstat(fd, st);
     if (UNLIKELY(ret < 0))
         goto close_and_out;
 
-    if (UNLIKELY(st.st_mtime < uncompressed->st_mtime))
+    if (UNLIKELY(st->st_mtime < uncompressed->st_mtime))
         goto close_and_out;
 
-    if (UNLIKELY(!is_world_readable(st.st_mode)))
+    if (UNLIKELY(!is_world_readable(st->st_mode)))
         goto close_and_out;
 
-    if (LIKELY(is_compression_worthy((size_t)st.st_size, (size_t)uncompressed->st_size))) {
-        *compressed_sz = (size_t)st.st_size;
-
-        readahead(fd, 0, *compressed_sz);
-
+    if (LIKELY(is_compression_worthy((size_t)st->st_size, (size_t)uncompressed->st_size)))
         return fd;
-    }
 
 close_and_out:
     close(fd);
 out:
-    *compressed_sz = 0;
     return -ENOENT;
 }
 
+static void
+advise_streaming(int fd)
+{
+    /* Reading it all now would just evict other files; these are read
+     * ahead as they're sent instead.  */
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_NOREUSE);
+}
+
+/* Must be called with priv->fds.lock held.  */
+static bool
+reopen_file(struct serve_files_priv *priv, const char *path, bool streaming,
+    int *fd, ino_t ino, time_t mtime, size_t size)
+{
+    struct stat st;
+    int new_fd = open_file(priv, path);
+
+    if (UNLIKELY(new_fd < 0))
+        return false;
+
+    if (UNLIKELY(fstat(new_fd, &st) < 0 || st.st_ino != ino ||
+            st.st_mtime != mtime || (size_t)st.st_size != size)) {
+        close(new_fd);
+        return false;
+    }
+
+    if (streaming)
+        advise_streaming(new_fd);
+
+    *fd = new_fd;
+    count_fds(priv, 1);
+    return true;
+}
+
+static bool
+sendfile_acquire(struct sendfile_cache_data *sd)
+{
+    struct serve_files_priv *priv = sd->priv;
+    bool success = true;
+
+    sd->referenced = true;
+    if (LIKELY(!(ATOMIC_INC(sd->state) & SENDFILE_CLOSED)))
+        return true;
+
+    pthread_mutex_lock(&priv->fds.lock);
+
+    /* Another request might have reopened them in the meantime.  */
+    if (!(sd->state & SENDFILE_CLOSED)) {
+        /* Nothing to do.  */
+    } else if (reopen_file(priv, sd->path, sd->streaming, &sd->uncompressed.fd,
+                           sd->uncompressed.ino, sd->uncompressed.mtime,
+                           sd->uncompressed.size)) {
+        if (sd->compressed.size) {
+            char gzpath[PATH_MAX];
+            int ret = snprintf(gzpath, PATH_MAX, "%s.gz", sd->path);
+
+            /* If the .gz file changed, the uncompressed one will do.  */
+            if (ret < 0 || ret >= PATH_MAX ||
+                    !reopen_file(priv, gzpath, sd->streaming, &sd->compressed.fd,
+                                 sd->compressed.ino, sd->compressed.mtime,
+                                 sd->compressed.size)) {
+                sd->compressed.fd = -ENOENT;
+                sd->compressed.size = 0;
+            }
+        }
+
+        ATOMIC_BITWISE(&sd->state, and, ~SENDFILE_CLOSED);
+        list_add_tail(&priv->fds.lru, &sd->lru);
+        close_idle_fds(priv, priv->fds.max);
+    } else {
+        success = false;
+    }
+
+    pthread_mutex_unlock(&priv->fds.lock);
+
+    return success;
+}
+
+static void
+sendfile_release(void *data)
+{
+    struct sendfile_cache_data *sd = data;
+
+    ATOMIC_DEC(sd->state);
+}
+
 static bool
 sendfile_init(struct file_cache_entry *ce, struct serve_files_priv *priv,
     const char *full_path, struct stat *st)
@@ -417,34 +987,82 @@ sendfile_init(struct file_cache_entry *ce, struct serve_files_priv *priv,
 
     ce->mime_type = lwan_determine_mime_type_for_file_name(relpath);
 
-    sd->uncompressed.fd = openat(priv->root_fd, relpath + 1, open_mode);
+    sd->path = strdup(relpath + 1);
+    if (UNLIKELY(!sd->path))
+        return false;
+
+    /* Not closed until it's been passed over once.  */
+    sd->state = 0;
+    sd->referenced = true;
+    sd->uncompressed.response = sd->compressed.response = NULL;
+    pthread_spin_init(&sd->lock, PTHREAD_PROCESS_PRIVATE);
+
+    pthread_mutex_lock(&priv->fds.lock);
+
+    sd->uncompressed.fd = open_file(priv, sd->path);
     if (UNLIKELY(sd->uncompressed.fd < 0)) {
-        switch (errno) {
+        int error = errno;
+
+        pthread_mutex_unlock(&priv->fds.lock);
+        free(sd->path);
+
+        switch (error) {
         case ENFILE:
         case EMFILE:
         case EACCES:
             /* These errors should produce responses other than 404, so
-             * store errno as the file descriptor.  */
-            sd->uncompressed.fd = sd->compressed.fd = -errno;
+             * store errno as the file descriptor.  Entries without priv
+             * hold no descriptors.  */
+            sd->uncompressed.fd = sd->compressed.fd = -error;
             sd->compressed.size = sd->uncompressed.size = 0;
+            sd->priv = NULL;
 
             return true;
         }
 
         return false;
     }
+    count_fds(priv, 1);
+
+    sd->priv = priv;
+    sd->uncompressed.size = (size_t)st->st_size;
+    sd->uncompressed.ino = st->st_ino;
+    sd->uncompressed.mtime = st->st_mtime;
+    sd->streaming = sd->uncompressed.size >= priv->stream_min_size;
 
     /* If precompressed files can be served, try opening it */
     if (LIKELY(priv->serve_precompressed_files)) {
-        size_t compressed_sz;
-        int fd = try_open_compressed(relpath, priv, st, &compressed_sz);
+        struct stat compressed_st;
+
+        sd->compressed.fd = try_open_compressed(relpath, priv, st, &compressed_st);
+        if (sd->compressed.fd >= 0) {
+            sd->compressed.size = (size_t)compressed_st.st_size;
+            sd->compressed.ino = compressed_st.st_ino;
+            sd->compressed.mtime = compressed_st.st_mtime;
+            format_etag_from_stat(ce->etag.encoded, &compressed_st, "");
+            count_fds(priv, 1);
+        } else {
+            sd->compressed.size = 0;
+        }
+    } else {
+        sd->compressed.fd = -ENOENT;
+        sd->compressed.size = 0;
+    }
 
-        sd->compressed.fd = fd;
-        sd->compressed.size = compressed_sz;
+    if (sd->streaming) {
+        advise_streaming(sd->uncompressed.fd);
+        if (sd->compressed.fd >= 0)
+            advise_streaming(sd->compressed.fd);
+    } else {
+        readahead(sd->uncompressed.fd, 0, sd->uncompressed.size);
+        if (sd->compressed.fd >= 0)
+            readahead(sd->compressed.fd, 0, sd->compressed.size);
     }
 
-    sd->uncompressed.size = (size_t)st->st_size;
-    readahead(sd->uncompressed.fd, 0, sd->uncompressed.size);
+    list_add_tail(&priv->fds.lru, &sd->lru);
+    close_idle_fds(priv, priv->fds.max);
+
+    pthread_mutex_unlock(&priv->fds.lock);
 
     return true;
 }
@@ -474,15 +1092,17 @@ dirlist_init(struct file_cache_entry *ce, struct serve_files_priv *priv,
     const char *full_path, struct stat *st __attribute__((unused)))
 {
     struct dir_list_cache_data *dd = (struct dir_list_cache_data *)(ce + 1);
-    struct file_list vars = {
-        .full_path = full_path,
-        .rel_path = get_rel_path(full_path, priv)
-    };
 
-    dd->rendered = lwan_tpl_apply(priv->directory_list_tpl, &vars);
+    /* Listings aren't cached: they're generated (and sent) as the
+     * directory is read, for every request.  */
+    dd->full_path = strdup(full_path);
+    if (UNLIKELY(!dd->full_path))
+        return false;
+
+    dd->rel_path = get_rel_path(dd->full_path, priv);
     ce->mime_type = "text/html";
 
-    return !!dd->rendered;
+    return true;
 }
 
 static bool
@@ -498,6 +1118,25 @@ redir_init(struct file_cache_entry *ce, struct serve_files_priv *priv,
     return true;
 }
 
+static unsigned int
+hash_path(const char *key)
+{
+    unsigned int hash = 2166136261u;
+
+    for (; *key; key++) {
+        hash ^= (unsigned char)*key;
+        hash *= 16777619u;
+    }
+
+    return hash ^ (hash >> 16);
+}
+
+static ALWAYS_INLINE unsigned int
+popularity_slot(const char *key)
+{
+    return hash_path(key) % POPULARITY_SLOTS;
+}
+
 static const struct cache_funcs *
 get_funcs(struct serve_files_priv *priv, const char *key, char *full_path,
     struct stat *st)
@@ -559,8 +1198,17 @@ get_funcs(struct serve_files_priv *priv, const char *key, char *full_path,
         return NULL;
 
     /* It's not a directory: choose the fastest way to serve the file
-     * judging by its size. */
-    if (st->st_size < 16384)
+     * judging by its size and popularity.  Small files are kept in memory
+     * unless more than half the budget is used, in which case only popular
+     * ones are; medium-sized files only if they're popular.  */
+    if ((size_t)st->st_size > priv->in_memory.max_size)
+        return &sendfile_funcs;
+
+    if (ATOMIC_READ(priv->in_memory.popularity[popularity_slot(key)]) >= POPULAR_HITS)
+        return &mmap_funcs;
+
+    if (st->st_size < SMALL_FILE_SIZE &&
+            ATOMIC_READ(priv->in_memory.used) <= priv->in_memory.budget / 2)
         return &mmap_funcs;
 
     return &sendfile_funcs;
@@ -576,6 +1224,8 @@ create_cache_entry_from_funcs(struct serve_files_priv *priv,
     if (UNLIKELY(!fce))
         return NULL;
 
+    format_etag_from_stat(fce->etag.identity, st, "");
+
     if (LIKELY(funcs->init(fce, priv, full_path, st))) {
         fce->funcs = funcs;
         return fce;
@@ -590,33 +1240,248 @@ create_cache_entry_from_funcs(struct serve_files_priv *priv,
 }
 
 static void
-destroy_cache_entry(struct cache_entry *entry, void *context __attribute__((unused)))
+destroy_cache_entry(struct cache_entry *entry, void *context)
 {
     struct file_cache_entry *fce = (struct file_cache_entry *)entry;
+    struct serve_files_priv *priv = context;
+
+    if (LIKELY(priv)) {
+        unsigned int *popularity =
+            &priv->in_memory.popularity[fce->popularity_slot];
+
+        /* Racy, but a lost update only delays a promotion or demotion.  */
+        *popularity = *popularity / 2 + fce->hits;
+    }
 
     fce->funcs->free(fce + 1);
     free(fce);
 }
 
-static struct cache_entry *
-create_cache_entry(const char *key, void *context)
+/* Lexically resolves "." and ".." in key, and removes extra slashes,
+ * without a leading slash.  Fails if the path would go above the root.  */
+static bool
+normalize_path(const char *key, char *normalized, size_t normalized_size)
 {
-    struct serve_files_priv *priv = context;
+    const char *start, *end;
+    char *dest = normalized;
+
+    for (start = end = key; *start; start = end) {
+        size_t len;
+
+        while (*start == '/')
+            start++;
+        for (end = start; *end && *end != '/'; end++)
+            ;
+
+        len = (size_t)(end - start);
+        if (!len)
+            break;
+        if (len == 1 && start[0] == '.')
+            continue;
+        if (len == 2 && start[0] == '.' && start[1] == '.') {
+            if (dest == normalized)
+                return false;
+            while (dest > normalized && dest[-1] != '/')
+                dest--;
+            if (dest > normalized)
+                dest--;
+            continue;
+        }
+
+        if ((size_t)(dest - normalized) + len + 2 > normalized_size)
+            return false;
+        if (dest != normalized)
+            *dest++ = '/';
+        dest = mempcpy(dest, start, len);
+    }
+
+    *dest = '\0';
+    return true;
+}
+
+#ifdef HAS_OPENAT2
+static time_t
+dir_cache_now(void)
+{
+    struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+    if (!clock_gettime(CLOCK_MONOTONIC_COARSE, &ts))
+        return ts.tv_sec;
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/* Must be called with priv->dirs.lock held.  Returns -ENOENT if the
+ * directory doesn't exist or isn't beneath the root, or another negative
+ * errno if it couldn't be determined.  */
+static int
+dir_cache_get_fd(struct serve_files_priv *priv, const char *dir)
+{
+    struct dir_cache_slot *slot =
+        &priv->dirs.slots[hash_path(dir) % DIR_CACHE_SLOTS];
+    struct open_how how = {
+        .flags = O_PATH | O_DIRECTORY | O_CLOEXEC,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+    };
+    time_t now = dir_cache_now();
+    struct stat st;
+    char *path;
+    int fd;
+
+    if (slot->path && slot->expires > now && !strcmp(slot->path, dir)) {
+        /* The directory might have been renamed, even out of the root,
+         * since it was opened.  */
+        if (!fstatat(priv->root_fd, dir, &st, 0) &&
+                st.st_ino == slot->ino && st.st_dev == slot->dev)
+            return slot->fd;
+    }
+
+    fd = (int)syscall(SYS_openat2, priv->root_fd, dir, &how, sizeof(how));
+    if (fd < 0) {
+        switch (errno) {
+        case ENOENT:
+        case ENOTDIR:
+        case ELOOP:
+        case EACCES:
+            return -ENOENT;
+        }
+        /* Including EXDEV, for symbolic links that are absolute or lead
+         * out of the root: realpathat2() tells those apart.  */
+        return -errno;
+    }
+
+    if (UNLIKELY(fstat(fd, &st) < 0)) {
+        close(fd);
+        return -errno;
+    }
+
+    path = strdup(dir);
+    if (UNLIKELY(!path)) {
+        close(fd);
+        return -ENOMEM;
+    }
+
+    if (slot->path) {
+        close(slot->fd);
+        free(slot->path);
+    }
+    slot->path = path;
+    slot->fd = fd;
+    slot->dev = st.st_dev;
+    slot->ino = st.st_ino;
+    slot->expires = now + DIR_CACHE_TTL;
+
+    return fd;
+}
+
+/* Returns 1 if the path has been resolved, 0 if it doesn't exist (or
+ * isn't beneath the root), and -1 if it has to be resolved the slow way
+ * (e.g. it's a symbolic link, which realpathat2() canonicalizes).  */
+static int
+resolve_beneath(struct serve_files_priv *priv, char *path, struct stat *st)
+{
+    char *name = strrchr(path, '/');
+    int r;
+
+    if (!*path)
+        return fstat(priv->root_fd, st) < 0 ? -1 : 1;
+
+    if (!name) {
+        r = fstatat(priv->root_fd, path, st, AT_SYMLINK_NOFOLLOW);
+    } else {
+        int dir_fd;
+
+        *name = '\0';
+
+        pthread_mutex_lock(&priv->dirs.lock);
+        dir_fd = dir_cache_get_fd(priv, path);
+        if (dir_fd >= 0)
+            r = fstatat(dir_fd, name + 1, st, AT_SYMLINK_NOFOLLOW);
+        pthread_mutex_unlock(&priv->dirs.lock);
+
+        *name = '/';
+
+        if (dir_fd == -ENOENT)
+            return 0;
+        if (dir_fd < 0) {
+            /* Seccomp filters might return EPERM instead of ENOSYS.  */
+            if (dir_fd == -ENOSYS || dir_fd == -EPERM)
+                priv->dirs.usable = false;
+            return -1;
+        }
+    }
+
+    if (r < 0)
+        return (errno == ENOENT || errno == ENOTDIR) ? 0 : -1;
+    if (S_ISLNK(st->st_mode))
+        return -1;
+
+    return 1;
+}
+#endif
+
+/* Fills full_path with the path for key inside the root directory, making
+ * sure it doesn't point outside of it.  ".." is resolved before symbolic
+ * links are followed: "link/../file" is "file" in the root directory, no
+ * matter where "link" points to.  */
+static bool
+resolve_path(struct serve_files_priv *priv, const char *key, char *full_path,
+    struct stat *st)
+{
+    char normalized[PATH_MAX];
+
+    if (UNLIKELY(!normalize_path(key, normalized, sizeof(normalized))))
+        return false;
+
+#ifdef HAS_OPENAT2
+    if (LIKELY(priv->dirs.usable)) {
+        int r = resolve_beneath(priv, normalized, st);
+
+        if (r == 0)
+            return false;
+        if (r > 0) {
+            const char *sep = priv->root_path_len == 1 ? "" : "/";
+            int len;
+
+            if (!*normalized)
+                sep = "";
+
+            len = snprintf(full_path, PATH_MAX, "%s%s%s", priv->root_path,
+                           sep, normalized);
+            return len >= 0 && len < PATH_MAX;
+        }
+    }
+#endif
+
+    if (UNLIKELY(!realpathat2(priv->root_fd, priv->root_path,
+                normalized, full_path, st)))
+        return false;
+
+    /* A sibling of the root directory sharing its name as a prefix (e.g.
+     * "/srv/www-private" for "/srv/www") is outside of it as well.  */
+    if (strncmp(full_path, priv->root_path, priv->root_path_len))
+        return false;
+    return priv->root_path_len == 1 || full_path[priv->root_path_len] == '/' ||
+        full_path[priv->root_path_len] == '\0';
+}
+
+static struct cache_entry *
+create_cache_entry(const char *key, void *context)
+{
+    struct serve_files_priv *priv = context;
     struct file_cache_entry *fce;
     struct stat st;
     const struct cache_funcs *funcs;
     char full_path[PATH_MAX];
 
-    if (UNLIKELY(!realpathat2(priv->root_fd, priv->root_path,
-                key, full_path, &st)))
+    if (UNLIKELY(!resolve_path(priv, key, full_path, &st)))
         return NULL;
 
     if (UNLIKELY(!is_world_readable(st.st_mode)))
         return NULL;
 
-    if (UNLIKELY(strncmp(full_path, priv->root_path, priv->root_path_len)))
-        return NULL;
-
     funcs = get_funcs(priv, key, full_path, &st);
     if (UNLIKELY(!funcs))
         return NULL;
@@ -625,6 +1490,9 @@ create_cache_entry(const char *key, void *context)
     if (UNLIKELY(!fce))
         return NULL;
 
+    fce->popularity_slot = popularity_slot(key);
+    fce->hits = 0;
+
     if (UNLIKELY(lwan_format_rfc_time(st.st_mtime, fce->last_modified.string) < 0)) {
         destroy_cache_entry((struct cache_entry *)fce, NULL);
         return NULL;
@@ -634,11 +1502,34 @@ create_cache_entry(const char *key, void *context)
     return (struct cache_entry *)fce;
 }
 
+static void
+precomputed_response_unref(void *data)
+{
+    struct precomputed_response *response = data;
+
+    if (response && !ATOMIC_DEC(response->refs))
+        free(response);
+}
+
+static void
+bundle_entry_free(void *data)
+{
+    struct mmap_cache_data *md = data;
+
+    /* Contents belong to the bundle.  */
+    precomputed_response_unref(md->uncompressed.response);
+    precomputed_response_unref(md->compressed.response);
+    pthread_spin_destroy(&md->lock);
+}
+
 static void
 mmap_free(void *data)
 {
     struct mmap_cache_data *md = data;
 
+    bundle_entry_free(md);
+    release_memory(md->priv, md->uncompressed.size + md->compressed.size);
+
     munmap(md->uncompressed.contents, md->uncompressed.size);
     free(md->compressed.contents);
 }
@@ -647,11 +1538,30 @@ static void
 sendfile_free(void *data)
 {
     struct sendfile_cache_data *sd = data;
+    struct serve_files_priv *priv = sd->priv;
+
+    precomputed_response_unref(sd->uncompressed.response);
+    precomputed_response_unref(sd->compressed.response);
+
+    if (!priv)
+        return;
 
-    if (sd->compressed.fd >= 0)
-        close(sd->compressed.fd);
-    if (sd->uncompressed.fd >= 0)
+    pthread_mutex_lock(&priv->fds.lock);
+
+    if (!(sd->state & SENDFILE_CLOSED)) {
+        list_del(&sd->lru);
+
+        if (sd->compressed.fd >= 0) {
+            close(sd->compressed.fd);
+            count_fds(priv, -1);
+        }
         close(sd->uncompressed.fd);
+        count_fds(priv, -1);
+    }
+
+    pthread_mutex_unlock(&priv->fds.lock);
+
+    free(sd->path);
 }
 
 static void
@@ -659,7 +1569,7 @@ dirlist_free(void *data)
 {
     struct dir_list_cache_data *dd = data;
 
-    strbuf_free(dd->rendered);
+    free(dd->full_path);
 }
 
 static void
@@ -670,6 +1580,246 @@ redir_free(void *data)
     free(rd->redir_to);
 }
 
+#define BUNDLE_FCE_SIZE \
+    (sizeof(struct file_cache_entry) + sizeof(struct mmap_cache_data))
+
+static ALWAYS_INLINE struct file_cache_entry *
+bundle_fce(const struct bundle *bundle, uint32_t index)
+{
+    return (struct file_cache_entry *)(bundle->fces + index * BUNDLE_FCE_SIZE);
+}
+
+static ALWAYS_INLINE bool
+is_in_bundle(const struct bundle *bundle, uint64_t offset, uint64_t len)
+{
+    return offset <= bundle->size && len <= bundle->size - offset;
+}
+
+static bool
+bundle_check(const struct bundle *bundle)
+{
+    const struct lwan_bundle_header *header = bundle->header;
+
+    if (bundle->size < sizeof(*header))
+        return false;
+    if (memcmp(header->magic, LWAN_BUNDLE_MAGIC, sizeof(header->magic)))
+        return false;
+    if (header->version != LWAN_BUNDLE_VERSION)
+        return false;
+    if (!header->n_buckets)
+        return false;
+    if (header->displacements_offset % sizeof(uint32_t) ||
+            header->entries_offset % sizeof(uint64_t))
+        return false;
+    if (!is_in_bundle(bundle, header->displacements_offset,
+                      (uint64_t)header->n_buckets * sizeof(uint32_t)))
+        return false;
+    if (!is_in_bundle(bundle, header->entries_offset,
+                      (uint64_t)header->n_entries * sizeof(struct lwan_bundle_entry)))
+        return false;
+
+    for (uint32_t i = 0; i < header->n_entries; i++) {
+        const struct lwan_bundle_entry *entry =
+            (const struct lwan_bundle_entry *)((char *)bundle->base +
+                header->entries_offset) + i;
+
+        if (!is_in_bundle(bundle, entry->path_offset, (uint64_t)entry->path_len + 1))
+            return false;
+        if (((char *)bundle->base)[entry->path_offset + entry->path_len] != '\0')
+            return false;
+        if (!is_in_bundle(bundle, entry->contents_offset, entry->contents_size))
+            return false;
+        if (!is_in_bundle(bundle, entry->deflated_offset, entry->deflated_size))
+            return false;
+    }
+
+    return true;
+}
+
+static void
+bundle_close(struct bundle *bundle)
+{
+    if (!bundle)
+        return;
+
+    if (bundle->fces) {
+        for (uint32_t i = 0; i < bundle->header->n_entries; i++)
+            bundle_entry_free(bundle_fce(bundle, i) + 1);
+        free(bundle->fces);
+    }
+
+    munmap(bundle->base, bundle->size);
+    free(bundle);
+}
+
+static struct bundle *
+bundle_open(const char *path)
+{
+    struct bundle *bundle;
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        lwan_status_perror("Could not open bundle \"%s\"", path);
+        return NULL;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        lwan_status_perror("Could not stat bundle \"%s\"", path);
+        goto close_fd;
+    }
+
+    bundle = calloc(1, sizeof(*bundle));
+    if (!bundle) {
+        lwan_status_perror("calloc");
+        goto close_fd;
+    }
+
+    bundle->size = (size_t)st.st_size;
+    bundle->base = mmap(NULL, bundle->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (bundle->base == MAP_FAILED) {
+        lwan_status_perror("Could not map bundle \"%s\"", path);
+        goto free_bundle;
+    }
+    close(fd);
+
+    /* Huge pages for file mappings depend on the kernel and the file
+     * system; it's fine if that's not possible.  */
+    if (madvise(bundle->base, bundle->size, MADV_HUGEPAGE) < 0)
+        lwan_status_debug("Huge pages not available for bundle \"%s\"", path);
+    if (madvise(bundle->base, bundle->size, MADV_WILLNEED) < 0)
+        lwan_status_perror("madvise");
+
+    bundle->header = bundle->base;
+    if (!bundle_check(bundle)) {
+        lwan_status_error("\"%s\" is not a valid bundle", path);
+        munmap(bundle->base, bundle->size);
+        free(bundle);
+        return NULL;
+    }
+
+    bundle->displacements = (const uint32_t *)((char *)bundle->base +
+        bundle->header->displacements_offset);
+    bundle->entries = (const struct lwan_bundle_entry *)((char *)bundle->base +
+        bundle->header->entries_offset);
+
+    bundle->fces = calloc(bundle->header->n_entries ? bundle->header->n_entries : 1,
+                          BUNDLE_FCE_SIZE);
+    if (!bundle->fces) {
+        lwan_status_perror("calloc");
+        bundle_close(bundle);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < bundle->header->n_entries; i++) {
+        const struct lwan_bundle_entry *entry = &bundle->entries[i];
+        struct file_cache_entry *fce = bundle_fce(bundle, i);
+        struct mmap_cache_data *md = (struct mmap_cache_data *)(fce + 1);
+        char *base = bundle->base;
+
+        md->uncompressed.contents = base + entry->contents_offset;
+        md->uncompressed.size = (unsigned long)entry->contents_size;
+        if (entry->deflated_size) {
+            md->compressed.contents = base + entry->deflated_offset;
+            md->compressed.size = (unsigned long)entry->deflated_size;
+        }
+        md->priv = NULL;
+        pthread_spin_init(&md->lock, PTHREAD_PROCESS_PRIVATE);
+
+        fce->funcs = &bundle_funcs;
+        fce->mime_type = lwan_determine_mime_type_for_file_name(
+            base + entry->path_offset);
+        fce->last_modified.integer = (time_t)entry->mtime;
+        if (lwan_format_rfc_time(fce->last_modified.integer,
+                                 fce->last_modified.string) < 0) {
+            lwan_status_error("Invalid modification time in bundle \"%s\"", path);
+            bundle_close(bundle);
+            return NULL;
+        }
+
+        /* Files in a bundle have no inode of their own; where they are
+         * in the bundle takes its place.  */
+        format_etag(fce->etag.identity, entry->contents_offset,
+                    (uint64_t)entry->mtime * 1000000000ull,
+                    entry->contents_size, "");
+        format_etag(fce->etag.encoded, entry->contents_offset,
+                    (uint64_t)entry->mtime * 1000000000ull,
+                    entry->contents_size, "-deflate");
+    }
+
+    lwan_status_debug("Serving %u files from bundle \"%s\"",
+        bundle->header->n_entries, path);
+
+    return bundle;
+
+free_bundle:
+    free(bundle);
+close_fd:
+    close(fd);
+    return NULL;
+}
+
+static struct file_cache_entry *
+bundle_lookup(const struct bundle *bundle, const char *key, size_t len)
+{
+    const struct lwan_bundle_header *header = bundle->header;
+    const struct lwan_bundle_entry *entry;
+    uint32_t index;
+
+    if (UNLIKELY(!header->n_entries))
+        return NULL;
+
+    index = lwan_perfect_hash_index(bundle->displacements, header->n_buckets,
+                                    header->seed, header->n_entries, key, len);
+
+    entry = &bundle->entries[index];
+    if (entry->path_len != len ||
+            memcmp((char *)bundle->base + entry->path_offset, key, len))
+        return NULL;
+
+    return bundle_fce(bundle, index);
+}
+
+static struct file_cache_entry *
+bundle_get(const struct serve_files_priv *priv, const struct lwan_request *request)
+{
+    const char *key = request->url.value;
+    size_t len = request->url.len;
+    char index_path[PATH_MAX];
+
+    /* Directories are served by their index file, if it's in the bundle;
+     * anything else (e.g. redirecting to add the slash) is left for the
+     * file system.  */
+    if (!len || key[len - 1] == '/') {
+        int r = snprintf(index_path, sizeof(index_path), "%.*s%s",
+                         (int)len, key, priv->index_html);
+
+        if (UNLIKELY(r < 0 || r >= (int)sizeof(index_path)))
+            return NULL;
+
+        key = index_path;
+        len = (size_t)r;
+    }
+
+    return bundle_lookup(priv->bundle, key, len);
+}
+
+static unsigned int
+default_max_fds(void)
+{
+    struct rlimit r;
+
+    /* The limit is raised to the hard limit once the configuration file
+     * has been read; leave most of it for connections.  */
+    if (getrlimit(RLIMIT_NOFILE, &r) < 0)
+        return 256;
+    if (r.rlim_max == RLIM_INFINITY || r.rlim_max > UINT_MAX)
+        return UINT_MAX / 4;
+
+    return (unsigned int)(r.rlim_max / 4);
+}
+
 static void *
 serve_files_init(const char *prefix, void *args)
 {
@@ -710,6 +1860,14 @@ serve_files_init(const char *prefix, void *args)
         goto out_cache_create;
     }
 
+    if (settings->bundle_path) {
+        priv->bundle = bundle_open(settings->bundle_path);
+        if (!priv->bundle)
+            goto out_bundle_open;
+    } else {
+        priv->bundle = NULL;
+    }
+
     if (settings->directory_list_template) {
         priv->directory_list_tpl = lwan_tpl_compile_file(
             settings->directory_list_template, file_list_desc);
@@ -723,6 +1881,14 @@ serve_files_init(const char *prefix, void *args)
         goto out_tpl_compile;
     }
 
+    priv->directory_list_json_tpl = lwan_tpl_compile_string_full(
+        directory_list_json_tpl_str, file_list_desc,
+        LWAN_TPL_FLAG_CONST_TEMPLATE);
+    if (!priv->directory_list_json_tpl) {
+        lwan_status_error("Could not compile JSON directory list template");
+        goto out_json_tpl_compile;
+    }
+
     priv->prefix = strdup(prefix);
     if (!priv->prefix) {
         lwan_status_error("Could not copy prefix");
@@ -736,10 +1902,41 @@ serve_files_init(const char *prefix, void *args)
     priv->serve_precompressed_files = settings->serve_precompressed_files;
     priv->auto_index = settings->auto_index;
 
+    memset(priv->in_memory.popularity, 0, sizeof(priv->in_memory.popularity));
+    priv->in_memory.max_size = settings->in_memory_max_size ?
+        settings->in_memory_max_size : 256 * 1024;
+    priv->in_memory.budget = settings->in_memory_budget ?
+        settings->in_memory_budget : 64 * 1024 * 1024;
+    priv->in_memory.used = 0;
+
+    priv->stream_min_size = settings->stream_min_size ?
+        settings->stream_min_size : 32 * 1024 * 1024;
+
+    memset(priv->dirs.slots, 0, sizeof(priv->dirs.slots));
+    pthread_mutex_init(&priv->dirs.lock, NULL);
+#ifdef HAS_OPENAT2
+    priv->dirs.usable = true;
+#else
+    priv->dirs.usable = false;
+#endif
+
+    list_head_init(&priv->fds.lru);
+    pthread_mutex_init(&priv->fds.lock, NULL);
+    priv->fds.open = 0;
+    priv->fds.max = settings->cache_max_fds ?
+        settings->cache_max_fds : default_max_fds();
+
+    init_multipart_type(priv);
+
     return priv;
 
 out_tpl_prefix_copy:
+    lwan_tpl_free(priv->directory_list_json_tpl);
+out_json_tpl_compile:
+    lwan_tpl_free(priv->directory_list_tpl);
 out_tpl_compile:
+    bundle_close(priv->bundle);
+out_bundle_open:
     cache_destroy(priv->cache);
 out_cache_create:
     free(priv);
@@ -760,7 +1957,16 @@ serve_files_init_from_hash(const char *prefix, const struct hash *hash)
         .serve_precompressed_files =
             parse_bool(hash_find(hash, "serve_precompressed_files"), true),
         .auto_index = parse_bool(hash_find(hash, "auto_index"), true),
-        .directory_list_template = hash_find(hash, "directory_list_template")
+        .directory_list_template = hash_find(hash, "directory_list_template"),
+        .bundle_path = hash_find(hash, "bundle"),
+        .in_memory_max_size =
+            (size_t)parse_long(hash_find(hash, "in_memory_max_size"), 0),
+        .in_memory_budget =
+            (size_t)parse_long(hash_find(hash, "in_memory_budget"), 0),
+        .stream_min_size =
+            (size_t)parse_long(hash_find(hash, "stream_min_size"), 0),
+        .cache_max_fds =
+            (unsigned int)parse_long(hash_find(hash, "cache_max_fds"), 0),
     };
     return serve_files_init(prefix, &settings);
 }
@@ -775,8 +1981,22 @@ serve_files_shutdown(void *data)
         return;
     }
 
+    lwan_tpl_free(priv->directory_list_json_tpl);
     lwan_tpl_free(priv->directory_list_tpl);
     cache_destroy(priv->cache);
+    bundle_close(priv->bundle);
+
+    lwan_status_debug("%u file descriptors still held by the cache",
+                      priv->fds.open);
+    pthread_mutex_destroy(&priv->fds.lock);
+
+    for (size_t i = 0; i < DIR_CACHE_SLOTS; i++) {
+        if (priv->dirs.slots[i].path) {
+            close(priv->dirs.slots[i].fd);
+            free(priv->dirs.slots[i].path);
+        }
+    }
+    pthread_mutex_destroy(&priv->dirs.lock);
     close(priv->root_fd);
     free(priv->root_path);
     free(priv->prefix);
@@ -784,24 +2004,42 @@ serve_files_shutdown(void *data)
 }
 
 static ALWAYS_INLINE bool
-client_has_fresh_content(struct lwan_request *request, time_t mtime)
+client_has_fresh_content(struct lwan_request *request,
+    struct file_cache_entry *fce, const char *etag)
 {
-    return request->header.if_modified_since && mtime <= request->header.if_modified_since;
+    /* If-Modified-Since is ignored if If-None-Match is present.  */
+    if (request->header.if_none_match.len)
+        return etag && lwan_request_etag_matches(request, etag, strlen(etag));
+
+    return request->header.if_modified_since &&
+        fce->last_modified.integer <= request->header.if_modified_since;
 }
 
 static size_t
 prepare_headers(struct lwan_request *request, enum lwan_http_status return_status,
     struct file_cache_entry *fce, size_t size, const char *compression_type,
-    char *header_buf, size_t header_buf_size)
+    const char *etag, const char *content_range, char *header_buf,
+    size_t header_buf_size)
 {
-    struct lwan_key_value additional_headers[3] = {
+    struct lwan_key_value additional_headers[5] = {
         [0] = { .key = "Last-Modified", .value = fce->last_modified.string },
     };
+    struct lwan_key_value *header = &additional_headers[1];
 
     request->response.content_length = size;
 
+    if (etag)
+        *header++ = (struct lwan_key_value) { .key = "ETag", .value = (char *)etag };
+
+    if (content_range) {
+        *header++ = (struct lwan_key_value) {
+            .key = "Content-Range",
+            .value = (char *)content_range
+        };
+    }
+
     if (compression_type) {
-        additional_headers[1] = (struct lwan_key_value) {
+        *header = (struct lwan_key_value) {
             .key = "Content-Encoding",
             .value = (char *)compression_type
         };
@@ -811,145 +2049,383 @@ prepare_headers(struct lwan_request *request, enum lwan_http_status return_statu
         header_buf, header_buf_size, additional_headers);
 }
 
-static ALWAYS_INLINE enum lwan_http_status
-compute_range(struct lwan_request *request, off_t *from, off_t *to, off_t size)
+/* Turns the ranges asked for into offsets into a file of @size bytes,
+ * sorted, with those overlapping or next to each other merged.  Without
+ * a Range header, that's the whole file.  */
+static enum lwan_http_status
+compute_ranges(const struct lwan_request *request, off_t size,
+    struct file_range ranges[static LWAN_MAX_RANGES], unsigned int *n_ranges)
 {
-    off_t f, t;
-
-    f = request->header.range.from;
-    t = request->header.range.to;
+    unsigned int n = 0, merged = 0;
 
-    /*
-     * No Range: header present: both t and f are -1
-     */
-    if (LIKELY(t <= 0 && f <= 0)) {
-        *from = 0;
-        *to = size;
+    if (LIKELY(!request->header.range.n)) {
+        ranges[0] = (struct file_range) { .from = 0, .to = size };
+        *n_ranges = 1;
         return HTTP_OK;
     }
 
-    /*
-     * To goes beyond from or To and From are the same: this is unsatisfiable.
-     */
-    if (UNLIKELY(t >= f))
-        return HTTP_RANGE_UNSATISFIABLE;
+    for (unsigned int i = 0; i < request->header.range.n; i++) {
+        const struct lwan_range *range = &request->header.range.parts[i];
+        struct file_range r;
+        unsigned int j;
 
-    /*
-     * Range goes beyond the size of the file
-     */
-    if (UNLIKELY(f >= size || t >= size))
-        return HTTP_RANGE_UNSATISFIABLE;
+        if (range->from < 0) {
+            if (UNLIKELY(!range->to))
+                continue;
+            r.from = range->to < size ? size - range->to : 0;
+            r.to = size;
+        } else {
+            if (UNLIKELY(range->from >= size))
+                continue;
+            r.from = range->from;
+            r.to = (range->to < 0 || range->to >= size) ? size : range->to + 1;
+        }
 
-    /*
-     * t < 0 means ranges from f to the file size
-     */
-    if (t < 0)
-        t = size - f;
-    else
-        t -= f;
+        for (j = n++; j > 0 && ranges[j - 1].from > r.from; j--)
+            ranges[j] = ranges[j - 1];
+        ranges[j] = r;
+    }
 
-    /*
-     * If for some reason the previous calculations yields something
-     * less than zero, the range is unsatisfiable.
-     */
-    if (UNLIKELY(t <= 0))
+    if (UNLIKELY(!n))
         return HTTP_RANGE_UNSATISFIABLE;
 
-    *from = f;
-    *to = t;
+    for (unsigned int i = 1; i < n; i++) {
+        if (ranges[i].from <= ranges[merged].to) {
+            if (ranges[i].to > ranges[merged].to)
+                ranges[merged].to = ranges[i].to;
+        } else {
+            ranges[++merged] = ranges[i];
+        }
+    }
 
+    *n_ranges = merged + 1;
     return HTTP_PARTIAL_CONTENT;
 }
 
+static void
+send_file_part(struct lwan_request *request, const struct file_source *src,
+    const struct file_range *range, const char *header, size_t header_len)
+{
+    size_t len = (size_t)(range->to - range->from);
+
+    if (src->contents) {
+        struct iovec response_vec[] = {
+            { .iov_base = (void *)header, .iov_len = header_len },
+            { .iov_base = (char *)src->contents + range->from, .iov_len = len },
+        };
+
+        lwan_writev(request, response_vec, N_ELEMENTS(response_vec));
+    } else if (src->streaming) {
+        lwan_sendfile_streaming(request, src->fd, range->from, len, header,
+                                header_len);
+    } else {
+        lwan_sendfile(request, src->fd, range->from, len, header, header_len);
+    }
+}
+
+static size_t
+format_part_header(char buf[static PART_HEADER_SIZE], const char *boundary,
+    const char *mime_type, const struct file_range *range, size_t size)
+{
+    int len = snprintf(buf, PART_HEADER_SIZE,
+                       "\r\n--%s\r\nContent-Type: %s\r\n"
+                       "Content-Range: bytes %" PRIu64 "-%" PRIu64 "/%zu\r\n\r\n",
+                       boundary, mime_type, (uint64_t)range->from,
+                       (uint64_t)range->to - 1, size);
+
+    if (UNLIKELY(len < 0 || len >= PART_HEADER_SIZE))
+        return 0;
+    return (size_t)len;
+}
+
 static enum lwan_http_status
-sendfile_serve(struct lwan_request *request, void *data)
+serve_multipart(struct lwan_request *request, struct file_cache_entry *fce,
+    const struct file_source *src, size_t size, const char *compression_type,
+    const char *etag, const struct file_range *ranges, unsigned int n_ranges)
 {
-    struct file_cache_entry *fce = data;
-    struct sendfile_cache_data *sd = (struct sendfile_cache_data *)(fce + 1);
-    char headers[DEFAULT_BUFFER_SIZE];
-    size_t header_len;
-    enum lwan_http_status return_status;
-    off_t from, to;
-    const char *compressed;
-    size_t size;
-    int fd;
+    const struct serve_files_priv *priv = request->response.stream.priv;
+    const char *boundary = priv->multipart_type +
+                           sizeof("multipart/byteranges; boundary=") - 1;
+    const char *mime_type = request->response.mime_type;
+    char headers[2 * DEFAULT_HEADERS_SIZE];
+    char part[PART_HEADER_SIZE];
+    char trailer[sizeof("\r\n----\r\n") + MULTIPART_BOUNDARY_LEN];
+    size_t header_len, part_len, trailer_len, total;
+
+    trailer_len = (size_t)snprintf(trailer, sizeof(trailer), "\r\n--%s--\r\n",
+                                   boundary);
+
+    total = trailer_len;
+    for (unsigned int i = 0; i < n_ranges; i++) {
+        part_len = format_part_header(part, boundary, mime_type, &ranges[i], size);
+        if (UNLIKELY(!part_len))
+            return HTTP_INTERNAL_ERROR;
 
-    if (sd->compressed.size && (request->flags & REQUEST_ACCEPT_GZIP)) {
-        from = 0;
-        to = (off_t)sd->compressed.size;
+        total += part_len + (size_t)(ranges[i].to - ranges[i].from);
+    }
 
-        compressed = compression_gzip;
-        fd = sd->compressed.fd;
-        size = sd->compressed.size;
+    request->response.mime_type = (char *)priv->multipart_type;
+    header_len = prepare_headers(request, HTTP_PARTIAL_CONTENT, fce, total,
+                                 compression_type, etag, NULL, headers,
+                                 sizeof(headers));
+    if (UNLIKELY(!header_len))
+        return HTTP_INTERNAL_ERROR;
+
+    if (lwan_request_get_method(request) == REQUEST_METHOD_HEAD) {
+        lwan_send(request, headers, header_len, 0);
+        return HTTP_PARTIAL_CONTENT;
+    }
 
-        return_status = HTTP_OK;
+    lwan_send(request, headers, header_len, MSG_MORE);
+    for (unsigned int i = 0; i < n_ranges; i++) {
+        part_len = format_part_header(part, boundary, mime_type, &ranges[i], size);
+        send_file_part(request, src, &ranges[i], part, part_len);
+    }
+    lwan_send(request, trailer, trailer_len, 0);
+
+    return HTTP_PARTIAL_CONTENT;
+}
+
+static enum lwan_http_status
+serve_file(struct lwan_request *request, struct file_cache_entry *fce,
+    const struct file_source *src, size_t size, const char *compression_type,
+    const char *etag)
+{
+    struct file_range ranges[LWAN_MAX_RANGES];
+    unsigned int n_ranges;
+    char headers[2 * DEFAULT_HEADERS_SIZE];
+    char content_range[sizeof("bytes -/") + 3 * 20];
+    size_t header_len;
+    enum lwan_http_status return_status;
+
+    /* A Range header is ignored if the client already has the file.  */
+    if (client_has_fresh_content(request, fce, etag)) {
+        return_status = HTTP_NOT_MODIFIED;
+        n_ranges = 0;
     } else {
-        return_status = compute_range(request, &from, &to, (off_t)sd->uncompressed.size);
+        return_status = compute_ranges(request, (off_t)size, ranges, &n_ranges);
         if (UNLIKELY(return_status == HTTP_RANGE_UNSATISFIABLE))
             return HTTP_RANGE_UNSATISFIABLE;
 
-        compressed = compression_none;
-        fd = sd->uncompressed.fd;
-        size = (size_t)(to - from);
-    }
-    if (UNLIKELY(fd < 0)) {
-        switch (-fd) {
-        case EACCES:
-            return HTTP_FORBIDDEN;
-        case EMFILE:
-        case ENFILE:
-            return HTTP_UNAVAILABLE;
-        default:
-            return HTTP_INTERNAL_ERROR;
+        if (n_ranges > 1) {
+            return serve_multipart(request, fce, src, size, compression_type,
+                                   etag, ranges, n_ranges);
         }
     }
 
-    if (client_has_fresh_content(request, fce->last_modified.integer))
-        return_status = HTTP_NOT_MODIFIED;
+    if (return_status == HTTP_PARTIAL_CONTENT) {
+        snprintf(content_range, sizeof(content_range),
+                 "bytes %" PRIu64 "-%" PRIu64 "/%zu", (uint64_t)ranges[0].from,
+                 (uint64_t)ranges[0].to - 1, size);
 
-    header_len = prepare_headers(request, return_status, fce, size,
-                compressed, headers, DEFAULT_HEADERS_SIZE);
+        header_len = prepare_headers(request, return_status, fce,
+                                     (size_t)(ranges[0].to - ranges[0].from),
+                                     compression_type, etag, content_range,
+                                     headers, sizeof(headers));
+    } else {
+        header_len = prepare_headers(request, return_status, fce, size,
+                                     compression_type, etag, NULL, headers,
+                                     sizeof(headers));
+    }
     if (UNLIKELY(!header_len))
         return HTTP_INTERNAL_ERROR;
 
-    if (lwan_request_get_method(request) == REQUEST_METHOD_HEAD || return_status == HTTP_NOT_MODIFIED) {
+    if (lwan_request_get_method(request) == REQUEST_METHOD_HEAD || !n_ranges)
         lwan_send(request, headers, header_len, 0);
-    } else {
-        lwan_sendfile(request, fd, from, (size_t)to, headers, header_len);
-    }
+    else
+        send_file_part(request, src, &ranges[0], headers, header_len);
 
     return return_status;
 }
 
 static enum lwan_http_status
 serve_contents_and_size(struct lwan_request *request, struct file_cache_entry *fce,
-    const char *compression_type, const void *contents, size_t size)
+    const char *compression_type, const char *etag, const void *contents,
+    size_t size)
 {
-    char headers[DEFAULT_BUFFER_SIZE];
-    size_t header_len;
-    enum lwan_http_status return_status = HTTP_OK;
+    const struct file_source src = { .contents = contents };
 
-    if (client_has_fresh_content(request, fce->last_modified.integer))
-        return_status = HTTP_NOT_MODIFIED;
+    return serve_file(request, fce, &src, size, compression_type, etag);
+}
 
-    header_len = prepare_headers(request, return_status,
-                                  fce, size, compression_type,
-                                  headers, DEFAULT_HEADERS_SIZE);
-    if (UNLIKELY(!header_len))
-        return HTTP_INTERNAL_ERROR;
+static ALWAYS_INLINE bool
+can_use_precomputed_response(const struct lwan_request *request)
+{
+    /* Only the most common case is precomputed; anything that changes the
+     * headers takes the slow path.  */
+    return (request->conn->flags & CONN_KEEP_ALIVE) &&
+        !(request->flags & (REQUEST_IS_HTTP_1_0 | REQUEST_ALLOW_CORS)) &&
+        !request->header.range.n;
+}
 
-    if (lwan_request_get_method(request) == REQUEST_METHOD_HEAD || return_status == HTTP_NOT_MODIFIED) {
-        lwan_send(request, headers, header_len, 0);
+static bool
+find_date_offsets(const char *headers, size_t len, size_t base, size_t offsets[2])
+{
+    static const char date[] = "\r\nDate: ";
+    static const char expires[] = "\r\nExpires: ";
+    const char *p;
+
+    p = memmem(headers, len, date, sizeof(date) - 1);
+    if (UNLIKELY(!p))
+        return false;
+    offsets[0] = base + (size_t)(p - headers) + sizeof(date) - 1;
+
+    p = memmem(headers, len, expires, sizeof(expires) - 1);
+    if (UNLIKELY(!p))
+        return false;
+    offsets[1] = base + (size_t)(p - headers) + sizeof(expires) - 1;
+
+    return true;
+}
+
+/* If @contents is NULL, only the headers are kept.  */
+static struct precomputed_response *
+build_precomputed_response(struct lwan_request *request,
+    struct file_cache_entry *fce, const char *compression_type,
+    const char *etag, const void *contents, size_t size)
+{
+    struct precomputed_response *response;
+    char not_modified[DEFAULT_HEADERS_SIZE];
+    char ok[DEFAULT_HEADERS_SIZE];
+    size_t not_modified_len, ok_len;
+    size_t contents_len = contents ? size : 0;
+
+    /* Built with the same function used for the slow path, so both yield
+     * the same bytes.  */
+    not_modified_len = prepare_headers(request, HTTP_NOT_MODIFIED, fce, size,
+                                       compression_type, etag, NULL,
+                                       not_modified, DEFAULT_HEADERS_SIZE);
+    ok_len = prepare_headers(request, HTTP_OK, fce, size, compression_type,
+                             etag, NULL, ok, DEFAULT_HEADERS_SIZE);
+    if (UNLIKELY(!not_modified_len || !ok_len))
+        return NULL;
+
+    response = malloc(sizeof(*response) + not_modified_len + ok_len +
+                      contents_len);
+    if (UNLIKELY(!response))
+        return NULL;
+
+    if (UNLIKELY(!find_date_offsets(not_modified, not_modified_len, 0,
+                                    &response->date_offsets[0]) ||
+                 !find_date_offsets(ok, ok_len, not_modified_len,
+                                    &response->date_offsets[2]))) {
+        free(response);
+        return NULL;
+    }
+
+    memcpy(response->data, not_modified, not_modified_len);
+    memcpy(response->data + not_modified_len, ok, ok_len);
+    if (contents_len)
+        memcpy(response->data + not_modified_len + ok_len, contents, contents_len);
+
+    response->refs = 1;
+    response->date = request->conn->thread->date.last;
+    response->not_modified_len = not_modified_len;
+    response->ok_headers_len = ok_len;
+    response->len = not_modified_len + ok_len + contents_len;
+
+    return response;
+}
+
+static struct precomputed_response *
+redate_precomputed_response(const struct precomputed_response *old,
+    const struct lwan_thread *thread)
+{
+    struct precomputed_response *response;
+
+    response = malloc(sizeof(*response) + old->len);
+    if (UNLIKELY(!response))
+        return NULL;
+
+    memcpy(response, old, sizeof(*response) + old->len);
+    for (int i = 0; i < 4; i++) {
+        memcpy(response->data + response->date_offsets[i],
+               (i & 1) ? thread->date.expires : thread->date.date, 29);
+    }
+
+    response->refs = 1;
+    response->date = thread->date.last;
+
+    return response;
+}
+
+/* Returns a reference to the response in @slot, (re)building it if it's
+ * not there yet or if it's from a second this thread has already left
+ * behind.  */
+static struct precomputed_response *
+get_precomputed_response(struct lwan_request *request,
+    struct file_cache_entry *fce, pthread_spinlock_t *lock,
+    struct precomputed_response **slot, const char *compression_type,
+    const char *etag, const void *contents, size_t size)
+{
+    const struct lwan_thread *thread = request->conn->thread;
+    struct precomputed_response *response, *fresh;
+
+    pthread_spin_lock(lock);
+    response = *slot;
+    if (response)
+        ATOMIC_INC(response->refs);
+    pthread_spin_unlock(lock);
+
+    if (LIKELY(response && response->date >= thread->date.last))
+        return response;
+
+    if (response) {
+        fresh = redate_precomputed_response(response, thread);
+        precomputed_response_unref(response);
     } else {
-        struct iovec response_vec[] = {
-            { .iov_base = headers, .iov_len = header_len },
-            { .iov_base = (void *)contents, .iov_len = size }
-        };
+        fresh = build_precomputed_response(request, fce, compression_type,
+                                           etag, contents, size);
+    }
+    if (UNLIKELY(!fresh))
+        return NULL;
 
-        lwan_writev(request, response_vec, N_ELEMENTS(response_vec));
+    /* Another thread might have beaten this one to it.  */
+    pthread_spin_lock(lock);
+    response = *slot;
+    if (!response || response->date < fresh->date) {
+        *slot = fresh;
+        ATOMIC_INC(fresh->refs);
+    } else {
+        ATOMIC_INC(response->refs);
+        fresh = response;
+        response = NULL;
     }
+    pthread_spin_unlock(lock);
 
-    return return_status;
+    precomputed_response_unref(response);
+    return fresh;
+}
+
+static enum lwan_http_status
+serve_precomputed_not_modified(struct lwan_request *request,
+    struct precomputed_response *response)
+{
+    coro_defer(request->conn->coro, precomputed_response_unref, response);
+
+    lwan_send(request, response->data, response->not_modified_len, 0);
+
+    return HTTP_NOT_MODIFIED;
+}
+
+static enum lwan_http_status
+serve_precomputed_response(struct lwan_request *request,
+    struct file_cache_entry *fce, const char *etag,
+    struct precomputed_response *response)
+{
+    const char *ok = response->data + response->not_modified_len;
+
+    if (client_has_fresh_content(request, fce, etag))
+        return serve_precomputed_not_modified(request, response);
+
+    coro_defer(request->conn->coro, precomputed_response_unref, response);
+
+    if (lwan_request_get_method(request) == REQUEST_METHOD_HEAD)
+        lwan_send(request, ok, response->ok_headers_len, 0);
+    else
+        lwan_send(request, ok, response->len - response->not_modified_len, 0);
+
+    return HTTP_OK;
 }
 
 static enum lwan_http_status
@@ -957,36 +2433,203 @@ mmap_serve(struct lwan_request *request, void *data)
 {
     struct file_cache_entry *fce = data;
     struct mmap_cache_data *md = (struct mmap_cache_data *)(fce + 1);
+    struct precomputed_response **slot;
     void *contents;
     size_t size;
     const char *compressed;
+    const char *etag;
 
-    if (md->compressed.size && (request->flags & REQUEST_ACCEPT_DEFLATE)) {
+    /* Ranges are only served from the file as is.  */
+    if (md->compressed.size && (request->flags & REQUEST_ACCEPT_DEFLATE) &&
+            !request->header.range.n) {
         contents = md->compressed.contents;
         size = md->compressed.size;
         compressed = compression_deflate;
+        etag = fce->etag.encoded;
+        slot = &md->compressed.response;
     } else {
         contents = md->uncompressed.contents;
         size = md->uncompressed.size;
         compressed = compression_none;
+        etag = fce->etag.identity;
+        slot = &md->uncompressed.response;
+    }
+
+    /* Larger files (popular ones, or those in bundles) are sent straight
+     * from the mapping.  */
+    if (LIKELY(size < SMALL_FILE_SIZE && can_use_precomputed_response(request))) {
+        struct precomputed_response *response = get_precomputed_response(
+            request, fce, &md->lock, slot, compressed, etag, contents, size);
+
+        if (LIKELY(response))
+            return serve_precomputed_response(request, fce, etag, response);
     }
 
-    return serve_contents_and_size(request, fce, compressed, contents, size);
+    return serve_contents_and_size(request, fce, compressed, etag, contents,
+                                   size);
 }
 
+/* Serves the file from an entry created just for this request, for when
+ * the cached one is for a file that has since been replaced.  These
+ * entries have no key.  */
 static enum lwan_http_status
-dirlist_serve(struct lwan_request *request, void *data)
+serve_uncached(struct lwan_request *request, struct serve_files_priv *priv)
+{
+    struct cache_entry *ce = create_cache_entry(request->url.value, priv);
+    struct file_cache_entry *fce = (struct file_cache_entry *)ce;
+
+    if (UNLIKELY(!ce))
+        return HTTP_NOT_FOUND;
+
+    memset(ce, 0, sizeof(*ce));
+    coro_defer2(request->conn->coro, CORO_DEFER2(destroy_cache_entry), ce,
+                priv);
+
+    request->response.mime_type = fce->mime_type;
+    return fce->funcs->serve(request, fce);
+}
+
+static enum lwan_http_status
+sendfile_serve(struct lwan_request *request, void *data)
 {
     struct file_cache_entry *fce = data;
+    struct sendfile_cache_data *sd = (struct sendfile_cache_data *)(fce + 1);
+    struct precomputed_response **slot;
+    const char *compressed;
+    const char *etag;
+    size_t size;
+    int fd;
+
+    if (LIKELY(sd->priv)) {
+        if (UNLIKELY(!sendfile_acquire(sd))) {
+            /* Couldn't reopen the file, or it's not the same anymore: the
+             * entry will be recreated once it expires; until then, each
+             * request gets one of its own.  */
+            sendfile_release(sd);
+            if (fce->base.key)
+                return serve_uncached(request, sd->priv);
+            return HTTP_UNAVAILABLE;
+        }
+        coro_defer(request->conn->coro, sendfile_release, sd);
+    }
+
+    /* Ranges are only served from the file as is.  */
+    if (sd->compressed.size && (request->flags & REQUEST_ACCEPT_GZIP) &&
+            !request->header.range.n) {
+        compressed = compression_gzip;
+        fd = sd->compressed.fd;
+        size = sd->compressed.size;
+        etag = fce->etag.encoded;
+        slot = &sd->compressed.response;
+    } else {
+        compressed = compression_none;
+        fd = sd->uncompressed.fd;
+        size = sd->uncompressed.size;
+        etag = fce->etag.identity;
+        slot = &sd->uncompressed.response;
+    }
+    if (UNLIKELY(fd < 0)) {
+        switch (-fd) {
+        case EACCES:
+            return HTTP_FORBIDDEN;
+        case EMFILE:
+        case ENFILE:
+            return HTTP_UNAVAILABLE;
+        default:
+            return HTTP_INTERNAL_ERROR;
+        }
+    }
+
+    if (client_has_fresh_content(request, fce, etag) &&
+            can_use_precomputed_response(request)) {
+        struct precomputed_response *response = get_precomputed_response(
+            request, fce, &sd->lock, slot, compressed, etag, NULL, size);
+
+        if (LIKELY(response))
+            return serve_precomputed_not_modified(request, response);
+    }
+
+    return serve_file(request, fce,
+                      &(struct file_source) { .fd = fd, .streaming = sd->streaming },
+                      size, compressed, etag);
+}
+
+static void
+flush_dirlist_chunk(struct strbuf *buf, void *data)
+{
+    struct lwan_request *request = data;
+
+    if (strbuf_get_length(buf) >= DIRLIST_CHUNK_SIZE)
+        lwan_response_send_chunk(request);
+}
+
+static enum lwan_http_status
+serve_dirlist(struct lwan_request *request, struct file_cache_entry *fce)
+{
+    struct serve_files_priv *priv = request->response.stream.priv;
     struct dir_list_cache_data *dd = (struct dir_list_cache_data *)(fce + 1);
+    struct strbuf *buf = request->response.buffer;
+    struct file_list vars = {
+        .full_path = dd->full_path,
+        .rel_path = dd->rel_path,
+        .offset = parse_long(lwan_request_get_query_param(request, "offset"), 0),
+        .limit = parse_long(lwan_request_get_query_param(request, "limit"), 0),
+    };
+    const char *format = lwan_request_get_query_param(request, "format");
+    struct lwan_tpl *tpl = priv->directory_list_tpl;
+
+    if (vars.offset < 0 || vars.limit < 0)
+        return HTTP_BAD_REQUEST;
+
+    if (format && !strcmp(format, "json")) {
+        vars.json = true;
+        tpl = priv->directory_list_json_tpl;
+        request->response.mime_type = "application/json";
+    }
+
+    /* Without chunked encoding, the whole listing has to be generated
+     * before its length is known.  */
+    if (request->flags & REQUEST_IS_HTTP_1_0) {
+        if (UNLIKELY(!lwan_tpl_apply_with_buffer(tpl, buf, &vars)))
+            return HTTP_INTERNAL_ERROR;
+
+        return serve_contents_and_size(request, fce, compression_none, NULL,
+                                       strbuf_get_buffer(buf),
+                                       strbuf_get_length(buf));
+    }
+
+    if (UNLIKELY(!lwan_response_set_chunked(request, HTTP_OK)))
+        return HTTP_INTERNAL_ERROR;
+
+    if (lwan_request_get_method(request) == REQUEST_METHOD_HEAD) {
+        request->flags &= ~RESPONSE_CHUNKED_ENCODING;
+        return HTTP_OK;
+    }
+
+    if (UNLIKELY(!lwan_tpl_apply_with_flush(tpl, buf, &vars,
+                                            request->conn->coro,
+                                            flush_dirlist_chunk, request)))
+        coro_yield(request->conn->coro, CONN_CORO_ABORT);
+
+    if (strbuf_get_length(buf))
+        lwan_response_send_chunk(request);
+    /* With an empty buffer, this sends the last chunk.  */
+    lwan_response_send_chunk(request);
+
+    return HTTP_OK;
+}
+
+static enum lwan_http_status
+dirlist_serve(struct lwan_request *request, void *data)
+{
+    struct file_cache_entry *fce = data;
     const char *icon;
     const void *contents;
     size_t size;
 
     icon = lwan_request_get_query_param(request, "icon");
     if (!icon) {
-        contents = strbuf_get_buffer(dd->rendered);
-        size = strbuf_get_length(dd->rendered);
+        return serve_dirlist(request, fce);
     } else if (!strcmp(icon, "back")) {
         contents = back_gif;
         size = sizeof(back_gif);
@@ -1003,7 +2646,8 @@ dirlist_serve(struct lwan_request *request, void *data)
         return HTTP_NOT_FOUND;
     }
 
-    return serve_contents_and_size(request, fce, compression_none, contents, size);
+    return serve_contents_and_size(request, fce, compression_none, NULL,
+                                   contents, size);
 }
 
 static enum lwan_http_status
@@ -1047,10 +2691,26 @@ serve_files_handle_cb(struct lwan_request *request, struct lwan_response *respon
         goto fail;
     }
 
+    if (priv->bundle) {
+        struct file_cache_entry *fce = bundle_get(priv, request);
+
+        if (fce) {
+            response->mime_type = fce->mime_type;
+            response->stream.callback = fce->funcs->serve;
+            response->stream.data = fce;
+            response->stream.priv = priv;
+
+            return HTTP_OK;
+        }
+    }
+
     ce = cache_coro_get_and_ref_entry(priv->cache, request->conn->coro,
                 request->url.value);
     if (LIKELY(ce)) {
         struct file_cache_entry *fce = (struct file_cache_entry *)ce;
+
+        ATOMIC_INC(fce->hits);
+
         response->mime_type = fce->mime_type;
         response->stream.callback = fce->funcs->serve;
         response->stream.data = ce;
@@ -29,6 +29,11 @@ struct lwan_serve_files_settings {
   const char *root_path;
   const char *index_html;
   const char *directory_list_template;
+  const char *bundle_path;
+  size_t in_memory_max_size;
+  size_t in_memory_budget;
+  size_t stream_min_size;
+  unsigned int cache_max_fds;
   bool serve_precompressed_files;
   bool auto_index;
 };
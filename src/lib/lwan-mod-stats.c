@@ -0,0 +1,95 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "lwan.h"
+#include "lwan-mod-stats.h"
+
+static const struct {
+    const char *name;
+    size_t offset;
+} counters[] = {
+#define COUNTER(name_) { .name = #name_, .offset = offsetof(struct lwan_stats, name_) }
+    COUNTER(shed_connections),
+    COUNTER(shed_per_ip),
+    COUNTER(shed_requests),
+    COUNTER(closed_idle),
+    COUNTER(busy_poll_spin_ns),
+    COUNTER(busy_poll_spin_hits),
+    COUNTER(busy_poll_sleep_ns),
+    COUNTER(busy_poll_sleeps),
+    COUNTER(sendfile_files),
+    COUNTER(sendfile_bytes),
+    COUNTER(sendfile_ns),
+    COUNTER(sendfile_yields),
+    COUNTER(sendfile_cached_fds),
+#undef COUNTER
+};
+
+static enum lwan_http_status
+stats_handle(struct lwan_request *request,
+    struct lwan_response *response,
+    void *data __attribute__((unused)))
+{
+    struct lwan_stats stats;
+
+    lwan_get_stats(request->conn->thread->lwan, &stats);
+
+    /* One "name value" line per counter, easy to scrape.  */
+    strbuf_reset(response->buffer);
+    for (size_t i = 0; i < N_ELEMENTS(counters); i++) {
+        const uint64_t *value =
+            (const uint64_t *)((const char *)&stats + counters[i].offset);
+
+        if (!strbuf_append_printf(response->buffer, "%s %" PRIu64 "\n",
+                                  counters[i].name, *value))
+            return HTTP_INTERNAL_ERROR;
+    }
+
+    response->mime_type = "text/plain";
+    return HTTP_OK;
+}
+
+static void *stats_init(const char *prefix __attribute__((unused)),
+    void *data __attribute__((unused)))
+{
+    return NULL;
+}
+
+static void *stats_init_from_hash(const char *prefix,
+    const struct hash *hash __attribute__((unused)))
+{
+    return stats_init(prefix, NULL);
+}
+
+const struct lwan_module *lwan_module_stats(void)
+{
+    static const struct lwan_module stats_module = {
+        .init = stats_init,
+        .init_from_hash = stats_init_from_hash,
+        .shutdown = NULL,
+        .handle = stats_handle,
+        .flags = 0
+    };
+
+    return &stats_module;
+}
@@ -0,0 +1,155 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lwan-perfect-hash.h"
+
+#define MAX_SEEDS 64
+#define MAX_DISPLACEMENT (1u << 24)
+#define UNUSED_INDEX UINT32_MAX
+
+struct bucket {
+    uint32_t index;
+    uint32_t n_keys;
+    /* Keys in this bucket are keys[members[first]] onwards.  */
+    uint32_t first;
+};
+
+static int compare_bucket_size(const void *a, const void *b)
+{
+    const struct bucket *ba = a;
+    const struct bucket *bb = b;
+
+    if (ba->n_keys != bb->n_keys)
+        return ba->n_keys < bb->n_keys ? 1 : -1;
+    return ba->index < bb->index ? -1 : ba->index > bb->index;
+}
+
+static uint32_t bucket_of(const struct lwan_perfect_hash_key *key,
+    uint32_t seed, uint32_t n_buckets)
+{
+    return lwan_perfect_hash(key->key, key->len, seed) % n_buckets;
+}
+
+/* Finds, for each bucket, a displacement that sends all of its keys to
+ * unused indices, starting with the fullest buckets ("hash, displace, and
+ * compress", minus the compression).  Returns false if some bucket can't
+ * be placed with this seed.  */
+static bool try_seed(const struct lwan_perfect_hash_key *keys,
+    uint32_t n_keys, uint32_t n_buckets, uint32_t seed,
+    struct bucket *buckets, uint32_t *members, uint32_t *candidate,
+    uint32_t *displacements, uint32_t *order)
+{
+    uint32_t first = 0;
+
+    for (uint32_t i = 0; i < n_buckets; i++)
+        buckets[i] = (struct bucket) { .index = i };
+    for (uint32_t i = 0; i < n_keys; i++)
+        buckets[bucket_of(&keys[i], seed, n_buckets)].n_keys++;
+    for (uint32_t i = 0; i < n_buckets; i++) {
+        buckets[i].first = first;
+        first += buckets[i].n_keys;
+        buckets[i].n_keys = 0;
+    }
+    for (uint32_t i = 0; i < n_keys; i++) {
+        struct bucket *bucket = &buckets[bucket_of(&keys[i], seed, n_buckets)];
+
+        members[bucket->first + bucket->n_keys++] = i;
+    }
+
+    qsort(buckets, n_buckets, sizeof(*buckets), compare_bucket_size);
+
+    for (uint32_t i = 0; i < n_keys; i++)
+        order[i] = UNUSED_INDEX;
+    memset(displacements, 0, n_buckets * sizeof(*displacements));
+
+    for (uint32_t i = 0; i < n_buckets && buckets[i].n_keys; i++) {
+        const struct bucket *bucket = &buckets[i];
+        const uint32_t *bucket_members = &members[bucket->first];
+        uint32_t displacement;
+
+        for (displacement = 1; displacement < MAX_DISPLACEMENT; displacement++) {
+            uint32_t placed;
+
+            for (placed = 0; placed < bucket->n_keys; placed++) {
+                const struct lwan_perfect_hash_key *key =
+                    &keys[bucket_members[placed]];
+                uint32_t index =
+                    lwan_perfect_hash(key->key, key->len, displacement) % n_keys;
+
+                if (order[index] != UNUSED_INDEX)
+                    break;
+
+                /* Keys in the same bucket can't share an index either.  */
+                for (uint32_t j = 0; j < placed; j++) {
+                    if (candidate[j] == index)
+                        goto next_displacement;
+                }
+
+                candidate[placed] = index;
+            }
+            if (placed == bucket->n_keys)
+                break;
+
+next_displacement:
+            ;
+        }
+        if (displacement == MAX_DISPLACEMENT)
+            return false;
+
+        for (uint32_t j = 0; j < bucket->n_keys; j++)
+            order[candidate[j]] = bucket_members[j];
+        displacements[bucket->index] = displacement;
+    }
+
+    return true;
+}
+
+/* Builds a table with n_buckets displacements for n_keys distinct keys,
+ * trying a few seeds.  On success, order[i] is the key at index i.
+ * Returns false if out of memory or if no seed worked.  */
+bool lwan_perfect_hash_build(const struct lwan_perfect_hash_key *keys,
+    uint32_t n_keys, uint32_t n_buckets, uint32_t *seed,
+    uint32_t *displacements, uint32_t *order)
+{
+    struct bucket *buckets = calloc(n_buckets, sizeof(*buckets));
+    uint32_t *members = calloc(n_keys ? n_keys : 1, sizeof(*members));
+    uint32_t *candidate = calloc(n_keys ? n_keys : 1, sizeof(*candidate));
+    bool success = false;
+
+    if (!buckets || !members || !candidate)
+        goto out;
+
+    for (*seed = 0; *seed < MAX_SEEDS; (*seed)++) {
+        if (try_seed(keys, n_keys, n_buckets, *seed, buckets, members,
+                     candidate, displacements, order)) {
+            success = true;
+            break;
+        }
+    }
+
+out:
+    free(buckets);
+    free(members);
+    free(candidate);
+
+    return success;
+}
@@ -0,0 +1,80 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Minimal perfect hashes for tables that are built once and then mapped
+ * as is: asset bundles (lwan-bundle.h) and redirect maps
+ * (lwan-redirect-map.h).  Doesn't depend on anything else in the library,
+ * so that tools can be built with just this file.
+ *
+ * A key is hashed with the table's seed to pick a bucket; hashing it
+ * again with that bucket's displacement gives its index.  Keys not in the
+ * table land on some other index, so the key has to be compared as well.
+ */
+
+struct lwan_perfect_hash_key {
+    const char *key;
+    size_t len;
+};
+
+static inline uint32_t
+lwan_perfect_hash(const char *key, size_t len, uint32_t seed)
+{
+    uint32_t hash = 0x811c9dc5 ^ seed;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 0x01000193;
+    }
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+
+    return hash;
+}
+
+/* n_keys must not be 0.  */
+static inline uint32_t
+lwan_perfect_hash_index(const uint32_t *displacements, uint32_t n_buckets,
+    uint32_t seed, uint32_t n_keys, const char *key, size_t len)
+{
+    uint32_t bucket = lwan_perfect_hash(key, len, seed) % n_buckets;
+
+    return lwan_perfect_hash(key, len, displacements[bucket]) % n_keys;
+}
+
+/* About 4 keys per bucket on average.  */
+static inline uint32_t
+lwan_perfect_hash_n_buckets(uint32_t n_keys)
+{
+    return n_keys ? (n_keys + 3) / 4 : 1;
+}
+
+bool lwan_perfect_hash_build(const struct lwan_perfect_hash_key *keys,
+    uint32_t n_keys, uint32_t n_buckets, uint32_t *seed,
+    uint32_t *displacements, uint32_t *order);
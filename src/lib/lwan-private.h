@@ -21,15 +21,97 @@
 
 #include "lwan.h"
 
+/* Each I/O thread gets its own cache line to count how many requests are
+ * being served with a particular URL map generation.  */
+#define URL_MAP_REFS_STRIDE (64 / sizeof(unsigned int))
+
+struct lwan_url_map_listener {
+    struct lwan_trie trie;
+    char *address;
+
+    /* Range of I/O threads dedicated to this listener, or -1 if it
+     * shares the threads not dedicated to any other listener.  */
+    int first_thread, last_thread;
+
+    /* Seconds to wait for data before waking accept() (TCP_DEFER_ACCEPT),
+     * and length of the TCP_FASTOPEN queue; 0 disables either.  */
+    unsigned int defer_accept;
+    int fast_open;
+};
+
+struct lwan_url_map_generation {
+    struct lwan_url_map_listener *listeners;
+    unsigned short n_listeners;
+
+    struct hash *instances;
+    unsigned int *refs;
+    unsigned int *epochs;
+    struct lwan_url_map_generation *next_retired;
+};
+
+void lwan_url_map_generation_release(unsigned int *refs);
+
+static inline unsigned int
+lwan_connection_get_listener(const struct lwan_connection *conn)
+{
+    return ((unsigned int)conn->flags >> CONN_LISTENER_SHIFT) & CONN_LISTENER_MAX;
+}
+
+static inline struct lwan_url_map_generation *
+lwan_url_map_generation_acquire(struct lwan *l, struct lwan_connection *conn)
+{
+    struct lwan_url_map_generation *gen = ATOMIC_READ(l->url_map);
+    size_t thread_id = (size_t)(conn->thread - l->thread.threads);
+    unsigned int *refs = &gen->refs[thread_id * URL_MAP_REFS_STRIDE];
+
+    /* Only the thread owning this connection touches this counter, and
+     * there's no yield between reading the pointer and incrementing it. */
+    (*refs)++;
+    coro_defer(conn->coro, CORO_DEFER(lwan_url_map_generation_release), refs);
+
+    return gen;
+}
+
 void lwan_response_init(struct lwan *l);
 void lwan_response_shutdown(struct lwan *l);
+void lwan_response_send_overloaded(int fd);
+
+#define LWAN_PER_IP_BUCKET_BITS 12
+#define LWAN_PER_IP_UNTRACKED 0xffff
+
+static inline void
+lwan_overload_release_client(struct lwan *l, int fd)
+{
+    if (l->overload.per_ip) {
+        unsigned short bucket = l->overload.per_ip_bucket[fd];
+
+        if (bucket != LWAN_PER_IP_UNTRACKED)
+            ATOMIC_DEC(l->overload.per_ip[bucket]);
+    }
+
+    ATOMIC_DEC(l->overload.connections);
+}
 
 void lwan_socket_init(struct lwan *l);
 void lwan_socket_shutdown(struct lwan *l);
 
 void lwan_thread_init(struct lwan *l);
 void lwan_thread_shutdown(struct lwan *l);
-void lwan_thread_add_client(struct lwan_thread *t, int fd);
+void lwan_thread_add_client(struct lwan_thread *t, int fd,
+                            unsigned int listener);
+void lwan_thread_await_fd(struct lwan_connection *conn, int fd,
+                          uint32_t events);
+bool lwan_thread_await_fd_until(struct lwan_connection *conn, int fd,
+                                uint32_t events, uint64_t deadline_ms);
+void lwan_thread_park(struct lwan_connection *conn);
+
+void lwan_conn_pool_free(struct lwan_conn_pool *pool);
+
+void lwan_sse_fan_out(struct lwan_thread *t,
+    void (*wake)(struct lwan_connection *conn, void *data), void *data);
+void lwan_sse_thread_free(struct lwan_sse_thread *st);
+
+void lwan_http_authorize_cache_free(struct lwan_auth_cache *cache);
 
 void lwan_status_init(struct lwan *l);
 void lwan_status_shutdown(struct lwan *l);
@@ -42,6 +124,10 @@ void lwan_job_del(bool (*cb)(void *data), void *data);
 void lwan_tables_init(void);
 void lwan_tables_shutdown(void);
 
+unsigned int lwan_serve_files_cached_fds(void);
+
+bool lwan_append_encoded_path(struct strbuf *buf, const char *path, size_t len);
+
 char *lwan_process_request(struct lwan *l, struct lwan_request *request,
                            struct lwan_value *buffer, char *next_request);
 size_t lwan_prepare_response_header_full(struct lwan_request *request,
@@ -57,7 +143,15 @@ uint8_t lwan_char_isdigit(char ch) __attribute__((pure));
 #ifdef HAVE_LUA
 #include <lua.h>
 
+struct lwan_lua_shared_dict;
+
 lua_State *lwan_lua_create_state(const char *script_file, const char *script);
+lua_State *lwan_lua_create_state_from_bytecode(const char *name,
+    const struct strbuf *bytecode, struct lwan_lua_shared_dict *const *shared,
+    size_t n_shared);
+bool lwan_lua_compile(const char *script_file, const char *script,
+    struct strbuf *bytecode);
 void lwan_lua_state_push_request(lua_State *L, struct lwan_request *request);
+struct lwan_request **lwan_lua_state_push_new_request(lua_State *L);
 const char *lwan_lua_state_last_error(lua_State *L);
 #endif
@@ -0,0 +1,183 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lwan.h"
+#include "lwan-rate-limit.h"
+
+/*
+ * Token buckets are implemented with GCRA: each client is represented by
+ * the "theoretical arrival time" (TAT) of its next request, so the whole
+ * state fits in a single word alongside a tag identifying the client, and
+ * can be updated with compare-and-swap.  A bucket whose TAT is in the past
+ * is full; it's indistinguishable from a client that has never been seen.
+ *
+ * The table is split in groups of 8 slots (one cache line); a client can
+ * only be in the group picked by its hash.  If it's not there, it takes
+ * over the slot that's closest to being full, so memory usage is fixed no
+ * matter how many clients there are, at the cost of sometimes forgetting
+ * about a client that's being throttled.
+ */
+
+#define SLOTS_PER_GROUP 8
+#define TAT_BITS 48
+#define TAT_MASK ((UINT64_C(1) << TAT_BITS) - 1)
+#define MAX_CAS_ATTEMPTS 4
+
+struct lwan_rate_limit {
+    uint64_t *slots;
+    uint64_t group_mask;
+
+    /* Both in microseconds.  */
+    uint64_t interval;
+    uint64_t tolerance;
+};
+
+static ALWAYS_INLINE uint64_t
+now_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static ALWAYS_INLINE uint64_t
+slot_tag(uint64_t key_hash)
+{
+    /* Low bits choose the group; use the high bits to tell clients apart.
+     * Zero is reserved for empty slots.  */
+    uint64_t tag = key_hash >> TAT_BITS;
+    return tag ? tag : 1;
+}
+
+struct lwan_rate_limit *
+lwan_rate_limit_new(unsigned int rate, unsigned int period,
+    unsigned int burst, size_t table_size)
+{
+    struct lwan_rate_limit *rl;
+    size_t n_groups = 1;
+
+    if (!rate || !period || !burst)
+        return NULL;
+
+    rl = malloc(sizeof(*rl));
+    if (!rl)
+        return NULL;
+
+    while (n_groups * SLOTS_PER_GROUP < table_size)
+        n_groups <<= 1;
+
+    if (posix_memalign((void **)&rl->slots, 64,
+                       n_groups * SLOTS_PER_GROUP * sizeof(uint64_t))) {
+        free(rl);
+        return NULL;
+    }
+    memset(rl->slots, 0, n_groups * SLOTS_PER_GROUP * sizeof(uint64_t));
+
+    rl->group_mask = n_groups - 1;
+    rl->interval = (uint64_t)period * 1000000 / rate;
+    if (!rl->interval)
+        rl->interval = 1;
+    rl->tolerance = rl->interval * burst;
+
+    return rl;
+}
+
+void
+lwan_rate_limit_free(struct lwan_rate_limit *rl)
+{
+    if (rl) {
+        free(rl->slots);
+        free(rl);
+    }
+}
+
+uint64_t
+lwan_rate_limit_hash(const void *key, size_t len)
+{
+    const unsigned char *p = key;
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+
+    /* FNV-1a, followed by a finalizer so that both the low bits (used to
+     * pick a group) and the high bits (used as a tag) are well mixed.  */
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= UINT64_C(0x100000001b3);
+    }
+
+    hash ^= hash >> 33;
+    hash *= UINT64_C(0xff51afd7ed558ccd);
+    hash ^= hash >> 33;
+    hash *= UINT64_C(0xc4ceb9fe1a85ec53);
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+bool
+lwan_rate_limit_allow(struct lwan_rate_limit *rl, uint64_t key_hash)
+{
+    uint64_t *group = &rl->slots[(key_hash & rl->group_mask) * SLOTS_PER_GROUP];
+    const uint64_t tag = slot_tag(key_hash);
+    const uint64_t now = now_usec();
+
+    for (int attempt = 0; attempt < MAX_CAS_ATTEMPTS; attempt++) {
+        uint64_t *victim = group;
+        uint64_t victim_value = 0;
+        uint64_t victim_tat = UINT64_MAX;
+
+        for (int i = 0; i < SLOTS_PER_GROUP; i++) {
+            uint64_t value = ATOMIC_READ(group[i]);
+            uint64_t tat = value & TAT_MASK;
+
+            if ((value >> TAT_BITS) == tag) {
+                uint64_t new_tat = (tat > now ? tat : now) + rl->interval;
+
+                if (new_tat - now > rl->tolerance)
+                    return false;
+                if (__sync_bool_compare_and_swap(&group[i], value,
+                                                 (tag << TAT_BITS) | new_tat))
+                    return true;
+                goto try_again;
+            }
+
+            if (tat < victim_tat) {
+                victim = &group[i];
+                victim_value = value;
+                victim_tat = tat;
+            }
+        }
+
+        if (__sync_bool_compare_and_swap(victim, victim_value,
+                                         (tag << TAT_BITS) | (now + rl->interval)))
+            return true;
+
+try_again:
+        ;
+    }
+
+    /* Too much contention for this group; let the request through rather
+     * than spinning.  */
+    return true;
+}
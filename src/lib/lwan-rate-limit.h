@@ -0,0 +1,33 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct lwan_rate_limit;
+
+struct lwan_rate_limit *lwan_rate_limit_new(unsigned int rate,
+    unsigned int period, unsigned int burst, size_t table_size);
+void lwan_rate_limit_free(struct lwan_rate_limit *rl);
+
+uint64_t lwan_rate_limit_hash(const void *key, size_t len);
+bool lwan_rate_limit_allow(struct lwan_rate_limit *rl, uint64_t key_hash);
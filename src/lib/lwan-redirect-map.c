@@ -0,0 +1,460 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lwan-private.h"
+#include "lwan-perfect-hash.h"
+#include "lwan-redirect-map.h"
+#include "hash.h"
+
+struct lwan_redirect_map {
+    void *base;
+    size_t size;
+    bool mapped;
+
+    const struct lwan_redirect_map_header *header;
+    const uint32_t *displacements;
+    const struct lwan_redirect_map_entry *entries;
+};
+
+struct redirect {
+    char *source;
+    char *target;
+    size_t source_len;
+    size_t target_len;
+    unsigned int status;
+};
+
+struct redirects {
+    struct redirect *redirects;
+    size_t n_redirects, capacity;
+};
+
+static bool is_redirect_status(unsigned int status)
+{
+    switch (status) {
+    case HTTP_MOVED_PERMANENTLY:
+    case HTTP_FOUND:
+    case HTTP_SEE_OTHER:
+    case HTTP_TEMPORARY_REDIRECT:
+    case HTTP_PERMANENT_REDIRECT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool parse_line(struct redirects *r, const char *path,
+    unsigned int line_number, char *line, struct hash *sources)
+{
+    char *saveptr;
+    char *source = strtok_r(line, " \t\r\n", &saveptr);
+    char *target, *status, *extra;
+    struct redirect *redirect;
+
+    if (!source || *source == '#')
+        return true;
+
+    target = strtok_r(NULL, " \t\r\n", &saveptr);
+    status = strtok_r(NULL, " \t\r\n", &saveptr);
+    extra = strtok_r(NULL, " \t\r\n", &saveptr);
+    if (!target || extra) {
+        lwan_status_error("%s:%u: Expecting \"source target [status]\"",
+            path, line_number);
+        return false;
+    }
+    if (*source != '/') {
+        lwan_status_error("%s:%u: Source must start with \"/\"", path,
+            line_number);
+        return false;
+    }
+
+    if (r->n_redirects == r->capacity) {
+        size_t capacity = r->capacity ? r->capacity * 2 : 256;
+        struct redirect *redirects =
+            reallocarray(r->redirects, capacity, sizeof(*redirects));
+
+        if (!redirects) {
+            lwan_status_perror("reallocarray");
+            return false;
+        }
+
+        r->redirects = redirects;
+        r->capacity = capacity;
+    }
+
+    redirect = &r->redirects[r->n_redirects];
+    redirect->status = status ? (unsigned int)parse_int(status, -1) :
+        HTTP_MOVED_PERMANENTLY;
+    if (!is_redirect_status(redirect->status)) {
+        lwan_status_error("%s:%u: Invalid redirect status: %s", path,
+            line_number, status);
+        return false;
+    }
+
+    redirect->source = strdup(source);
+    redirect->target = strdup(target);
+    if (!redirect->source || !redirect->target) {
+        lwan_status_perror("strdup");
+        free(redirect->source);
+        free(redirect->target);
+        return false;
+    }
+    redirect->source_len = strlen(source);
+    redirect->target_len = strlen(target);
+    r->n_redirects++;
+
+    switch (hash_add_unique(sources, redirect->source, NULL)) {
+    case 0:
+        return true;
+    case -EEXIST:
+        lwan_status_error("%s:%u: Duplicate source: %s", path, line_number,
+            source);
+        return false;
+    default:
+        lwan_status_perror("hash_add_unique");
+        return false;
+    }
+}
+
+static bool read_redirects(const char *path, struct redirects *r)
+{
+    struct hash *sources;
+    unsigned int line_number = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    bool success = false;
+    FILE *f;
+
+    f = fopen(path, "re");
+    if (!f) {
+        lwan_status_perror("Could not open redirect map \"%s\"", path);
+        return false;
+    }
+
+    /* Only to find duplicates; keys belong to the redirects.  */
+    sources = hash_str_new(NULL, NULL);
+    if (!sources)
+        goto out;
+
+    while (getline(&line, &line_size, f) >= 0) {
+        if (!parse_line(r, path, ++line_number, line, sources))
+            goto out;
+    }
+
+    if (ferror(f)) {
+        lwan_status_perror("Could not read redirect map \"%s\"", path);
+        goto out;
+    }
+    if (r->n_redirects > UINT32_MAX / 2) {
+        lwan_status_error("Too many redirects in \"%s\"", path);
+        goto out;
+    }
+
+    success = true;
+
+out:
+    hash_free(sources);
+    free(line);
+    fclose(f);
+    return success;
+}
+
+static void *lay_out_map(const struct redirects *r, uint32_t seed,
+    uint32_t n_buckets, const uint32_t *displacements,
+    struct redirect *const *slots, size_t *size)
+{
+    struct lwan_redirect_map_header *header;
+    struct lwan_redirect_map_entry *entries;
+    uint64_t entries_offset, offset;
+    char *base;
+
+    entries_offset = sizeof(*header) +
+        (n_buckets * sizeof(*displacements) + 7) / 8 * 8;
+
+    *size = entries_offset + r->n_redirects * sizeof(*entries);
+    for (size_t i = 0; i < r->n_redirects; i++)
+        *size += slots[i]->source_len + 1 + slots[i]->target_len + 1;
+
+    base = calloc(1, *size);
+    if (!base)
+        return NULL;
+
+    header = (struct lwan_redirect_map_header *)base;
+    memcpy(header->magic, LWAN_REDIRECT_MAP_MAGIC, sizeof(header->magic));
+    header->version = LWAN_REDIRECT_MAP_VERSION;
+    header->n_entries = (uint32_t)r->n_redirects;
+    header->n_buckets = n_buckets;
+    header->seed = seed;
+    header->displacements_offset = sizeof(*header);
+    header->entries_offset = entries_offset;
+
+    memcpy(base + header->displacements_offset, displacements,
+           n_buckets * sizeof(*displacements));
+
+    entries = (struct lwan_redirect_map_entry *)(base + entries_offset);
+    offset = entries_offset + r->n_redirects * sizeof(*entries);
+    for (size_t i = 0; i < r->n_redirects; i++) {
+        const struct redirect *redirect = slots[i];
+
+        entries[i] = (struct lwan_redirect_map_entry) {
+            .source_offset = offset,
+            .source_len = (uint32_t)redirect->source_len,
+            .target_offset = offset + redirect->source_len + 1,
+            .target_len = (uint32_t)redirect->target_len,
+            .status = redirect->status,
+        };
+
+        memcpy(base + entries[i].source_offset, redirect->source,
+               redirect->source_len);
+        memcpy(base + entries[i].target_offset, redirect->target,
+               redirect->target_len);
+        offset = entries[i].target_offset + redirect->target_len + 1;
+    }
+
+    return base;
+}
+
+void *lwan_redirect_map_compile(const char *path, size_t *size)
+{
+    struct redirects r = {};
+    struct lwan_perfect_hash_key *keys = NULL;
+    uint32_t *displacements = NULL, *order = NULL;
+    struct redirect **slots = NULL;
+    uint32_t n_buckets, seed;
+    void *base = NULL;
+
+    if (!read_redirects(path, &r))
+        goto out;
+
+    n_buckets = lwan_perfect_hash_n_buckets((uint32_t)r.n_redirects);
+
+    keys = calloc(r.n_redirects ? r.n_redirects : 1, sizeof(*keys));
+    displacements = calloc(n_buckets, sizeof(*displacements));
+    order = calloc(r.n_redirects ? r.n_redirects : 1, sizeof(*order));
+    slots = calloc(r.n_redirects ? r.n_redirects : 1, sizeof(*slots));
+    if (!keys || !displacements || !order || !slots) {
+        lwan_status_perror("calloc");
+        goto out;
+    }
+
+    for (size_t i = 0; i < r.n_redirects; i++) {
+        keys[i] = (struct lwan_perfect_hash_key) {
+            .key = r.redirects[i].source,
+            .len = r.redirects[i].source_len,
+        };
+    }
+    if (!lwan_perfect_hash_build(keys, (uint32_t)r.n_redirects, n_buckets,
+                                 &seed, displacements, order)) {
+        lwan_status_error("Could not find a perfect hash for \"%s\"", path);
+        goto out;
+    }
+    for (size_t i = 0; i < r.n_redirects; i++)
+        slots[i] = &r.redirects[order[i]];
+
+    base = lay_out_map(&r, seed, n_buckets, displacements, slots, size);
+    if (!base)
+        lwan_status_perror("calloc");
+
+out:
+    for (size_t i = 0; i < r.n_redirects; i++) {
+        free(r.redirects[i].source);
+        free(r.redirects[i].target);
+    }
+    free(r.redirects);
+    free(keys);
+    free(displacements);
+    free(order);
+    free(slots);
+
+    return base;
+}
+
+static ALWAYS_INLINE bool
+is_in_map(const struct lwan_redirect_map *map, uint64_t offset, uint64_t len)
+{
+    return offset <= map->size && len <= map->size - offset;
+}
+
+static bool
+is_string_in_map(const struct lwan_redirect_map *map, uint64_t offset,
+    uint32_t len)
+{
+    return is_in_map(map, offset, (uint64_t)len + 1) &&
+        ((const char *)map->base)[offset + len] == '\0';
+}
+
+static bool
+redirect_map_check(const struct lwan_redirect_map *map)
+{
+    const struct lwan_redirect_map_header *header = map->header;
+
+    if (map->size < sizeof(*header))
+        return false;
+    if (memcmp(header->magic, LWAN_REDIRECT_MAP_MAGIC, sizeof(header->magic)))
+        return false;
+    if (header->version != LWAN_REDIRECT_MAP_VERSION)
+        return false;
+    if (!header->n_buckets)
+        return false;
+    if (header->displacements_offset % sizeof(uint32_t) ||
+            header->entries_offset % sizeof(uint64_t))
+        return false;
+    if (!is_in_map(map, header->displacements_offset,
+                   (uint64_t)header->n_buckets * sizeof(uint32_t)))
+        return false;
+    if (!is_in_map(map, header->entries_offset,
+                   (uint64_t)header->n_entries * sizeof(struct lwan_redirect_map_entry)))
+        return false;
+
+    for (uint32_t i = 0; i < header->n_entries; i++) {
+        const struct lwan_redirect_map_entry *entry =
+            (const struct lwan_redirect_map_entry *)((char *)map->base +
+                header->entries_offset) + i;
+
+        if (!is_string_in_map(map, entry->source_offset, entry->source_len))
+            return false;
+        if (!is_string_in_map(map, entry->target_offset, entry->target_len))
+            return false;
+        if (!is_redirect_status(entry->status))
+            return false;
+    }
+
+    return true;
+}
+
+static bool is_compiled_map(int fd, const struct stat *st)
+{
+    char magic[sizeof(((struct lwan_redirect_map_header *)0)->magic)];
+
+    if ((size_t)st->st_size < sizeof(struct lwan_redirect_map_header))
+        return false;
+    if (pread(fd, magic, sizeof(magic), 0) != (ssize_t)sizeof(magic))
+        return false;
+
+    return !memcmp(magic, LWAN_REDIRECT_MAP_MAGIC, sizeof(magic));
+}
+
+struct lwan_redirect_map *lwan_redirect_map_open(const char *path)
+{
+    struct lwan_redirect_map *map;
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        lwan_status_perror("Could not open redirect map \"%s\"", path);
+        return NULL;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        lwan_status_perror("Could not stat redirect map \"%s\"", path);
+        goto close_fd;
+    }
+
+    map = calloc(1, sizeof(*map));
+    if (!map) {
+        lwan_status_perror("calloc");
+        goto close_fd;
+    }
+
+    if (is_compiled_map(fd, &st)) {
+        map->size = (size_t)st.st_size;
+        map->base = mmap(NULL, map->size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map->base == MAP_FAILED) {
+            lwan_status_perror("Could not map redirect map \"%s\"", path);
+            goto free_map;
+        }
+        map->mapped = true;
+    } else {
+        map->base = lwan_redirect_map_compile(path, &map->size);
+        if (!map->base)
+            goto free_map;
+    }
+    close(fd);
+
+    map->header = map->base;
+    if (!redirect_map_check(map)) {
+        lwan_status_error("\"%s\" is not a valid redirect map", path);
+        lwan_redirect_map_close(map);
+        return NULL;
+    }
+
+    map->displacements = (const uint32_t *)((char *)map->base +
+        map->header->displacements_offset);
+    map->entries = (const struct lwan_redirect_map_entry *)((char *)map->base +
+        map->header->entries_offset);
+
+    return map;
+
+free_map:
+    free(map);
+close_fd:
+    close(fd);
+    return NULL;
+}
+
+void lwan_redirect_map_close(struct lwan_redirect_map *map)
+{
+    if (!map)
+        return;
+
+    if (map->mapped)
+        munmap(map->base, map->size);
+    else
+        free(map->base);
+    free(map);
+}
+
+uint32_t lwan_redirect_map_get_count(const struct lwan_redirect_map *map)
+{
+    return map->header->n_entries;
+}
+
+const char *lwan_redirect_map_find(const struct lwan_redirect_map *map,
+    const char *path, size_t len, unsigned int *status)
+{
+    const struct lwan_redirect_map_header *header = map->header;
+    const struct lwan_redirect_map_entry *entry;
+    uint32_t index;
+
+    if (UNLIKELY(!header->n_entries))
+        return NULL;
+
+    index = lwan_perfect_hash_index(map->displacements, header->n_buckets,
+                                    header->seed, header->n_entries, path, len);
+
+    entry = &map->entries[index];
+    if (entry->source_len != len ||
+            memcmp((const char *)map->base + entry->source_offset, path, len))
+        return NULL;
+
+    *status = entry->status;
+    return (const char *)map->base + entry->target_offset;
+}
@@ -0,0 +1,66 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Redirect maps are read by the redirect module, either as text (one
+ * "source target [status]" line per redirect) or as written by
+ * mkredirmap (src/bin/tools).  Both end up in the same layout, which is
+ * used as is: a header, followed by the displacement table of a perfect
+ * hash of the sources (lwan-perfect-hash.h), the entries (in the order
+ * given by the hash), and the NUL-terminated sources and targets, all in
+ * host byte order.
+ */
+
+#define LWAN_REDIRECT_MAP_MAGIC "LWANRMAP"
+#define LWAN_REDIRECT_MAP_VERSION 1
+
+struct lwan_redirect_map_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_entries;
+    uint32_t n_buckets;
+    uint32_t seed;
+    uint64_t displacements_offset;
+    uint64_t entries_offset;
+};
+
+struct lwan_redirect_map_entry {
+    uint64_t source_offset;
+    uint64_t target_offset;
+    uint32_t source_len;
+    uint32_t target_len;
+    uint32_t status;
+    uint32_t padding;
+};
+
+struct lwan_redirect_map;
+
+void *lwan_redirect_map_compile(const char *path, size_t *size);
+
+struct lwan_redirect_map *lwan_redirect_map_open(const char *path);
+void lwan_redirect_map_close(struct lwan_redirect_map *map);
+
+uint32_t lwan_redirect_map_get_count(const struct lwan_redirect_map *map);
+const char *lwan_redirect_map_find(const struct lwan_redirect_map *map,
+    const char *path, size_t len, unsigned int *status);
@@ -38,6 +38,7 @@
 
 #include "lwan-config.h"
 #include "lwan-http-authorize.h"
+#include "lwan-rate-limit.h"
 
 enum lwan_read_finalizer {
     FINALIZER_DONE,
@@ -52,6 +53,7 @@ struct request_parser_helper {
     char *next_request;			/* For pipelined requests */
     struct lwan_value accept_encoding;
     struct lwan_value if_modified_since;
+    struct lwan_value if_none_match;
     struct lwan_value range;
     struct lwan_value cookie;
 
@@ -63,6 +65,8 @@ struct request_parser_helper {
     struct lwan_value post_data;
     struct lwan_value content_type;
 
+    struct lwan_value headers;
+
     time_t error_when_time;
     int error_when_n_packets;
     int urls_rewritten;
@@ -328,6 +332,31 @@ url_decode(char *str)
     return (ssize_t)(decoded - str);
 }
 
+bool
+lwan_append_encoded_path(struct strbuf *buf, const char *path, size_t len)
+{
+    static const char hex_digits[] = "0123456789ABCDEF";
+
+    /* Undoes url_decode(), for handlers that need to pass the URL on.  */
+    for (size_t i = 0; i < len; i++) {
+        const unsigned char ch = (unsigned char)path[i];
+        bool ok;
+
+        if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+                (ch >= '0' && ch <= '9') || (ch && strchr("-._~!$&'()*+,;=:@/", ch))) {
+            ok = strbuf_append_char(buf, (char)ch);
+        } else {
+            char escaped[3] = { '%', hex_digits[ch >> 4], hex_digits[ch & 15] };
+            ok = strbuf_append_str(buf, escaped, sizeof(escaped));
+        }
+
+        if (UNLIKELY(!ok))
+            return false;
+    }
+
+    return true;
+}
+
 static int
 key_value_compare(const void *a, const void *b)
 {
@@ -541,6 +570,7 @@ parse_headers(struct request_parser_helper *helper, char *buffer, char *buffer_e
         HTTP_HDR_CONTENT           = MULTICHAR_CONSTANT_L('C','o','n','t'),
         HTTP_HDR_COOKIE            = MULTICHAR_CONSTANT_L('C','o','o','k'),
         HTTP_HDR_IF_MODIFIED_SINCE = MULTICHAR_CONSTANT_L('I','f','-','M'),
+        HTTP_HDR_IF_NONE_MATCH     = MULTICHAR_CONSTANT_L('I','f','-','N'),
         HTTP_HDR_RANGE             = MULTICHAR_CONSTANT_L('R','a','n','g')
     };
 
@@ -591,6 +621,10 @@ parse_headers(struct request_parser_helper *helper, char *buffer, char *buffer_e
             helper->if_modified_since.value = value;
             helper->if_modified_since.len = length;
             break;
+        CASE_HEADER(HTTP_HDR_IF_NONE_MATCH, "If-None-Match")
+            helper->if_none_match.value = value;
+            helper->if_none_match.len = length;
+            break;
         CASE_HEADER(HTTP_HDR_RANGE, "Range")
             helper->range.value = value;
             helper->range.len = length;
@@ -629,32 +663,96 @@ parse_if_modified_since(struct lwan_request *request, struct request_parser_help
     request->header.if_modified_since = parsed;
 }
 
+static void
+parse_if_none_match(struct lwan_request *request, struct request_parser_helper *helper)
+{
+    /* Entity tags are only known by the handler, which compares them
+     * with lwan_request_etag_matches().  */
+    request->header.if_none_match = helper->if_none_match;
+}
+
+static bool
+parse_range_number(const char **p, const char *end, off_t *value)
+{
+    const char *s = *p;
+    uint64_t v = 0;
+
+    if (UNLIKELY(s == end || !lwan_char_isdigit(*s)))
+        return false;
+
+    for (; s < end && lwan_char_isdigit(*s); s++) {
+        if (UNLIKELY(v > (INT64_MAX - 9) / 10))
+            return false;
+        v = v * 10 + (uint64_t)(*s - '0');
+    }
+
+    *value = (off_t)v;
+    *p = s;
+    return true;
+}
+
+static const char *
+skip_range_separators(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+        p++;
+    return p;
+}
+
 static void
 parse_range(struct lwan_request *request, struct request_parser_helper *helper)
 {
+    struct lwan_range *parts = request->header.range.parts;
+    unsigned int n = 0;
+
     if (UNLIKELY(helper->range.len <= (sizeof("bytes=") - 1)))
         return;
 
-    char *range = helper->range.value;
-    if (UNLIKELY(strncmp(range, "bytes=", sizeof("bytes=") - 1)))
+    const char *p = helper->range.value;
+    const char *end = p + helper->range.len;
+    if (UNLIKELY(strncmp(p, "bytes=", sizeof("bytes=") - 1)))
         return;
 
-    range += sizeof("bytes=") - 1;
-    off_t from, to;
-
-    if (sscanf(range, "%"SCNu64"-%"SCNu64, &from, &to) == 2) {
-        request->header.range.from = from;
-        request->header.range.to = to;
-    } else if (sscanf(range, "-%"SCNu64, &to) == 1) {
-        request->header.range.from = 0;
-        request->header.range.to = to;
-    } else if (sscanf(range, "%"SCNu64"-", &from) == 1) {
-        request->header.range.from = from;
-        request->header.range.to = -1;
-    } else {
-        request->header.range.from = -1;
-        request->header.range.to = -1;
+    /* Anything unexpected, including too many ranges, and the header is
+     * ignored: the whole file is sent.  */
+    for (p = skip_range_separators(p + sizeof("bytes=") - 1, end); p < end;
+            p = skip_range_separators(p, end)) {
+        struct lwan_range range;
+
+        if (UNLIKELY(n == LWAN_MAX_RANGES))
+            return;
+
+        if (*p == '-') {
+            p++;
+            range.from = -1;
+            if (UNLIKELY(!parse_range_number(&p, end, &range.to)))
+                return;
+        } else {
+            if (UNLIKELY(!parse_range_number(&p, end, &range.from)))
+                return;
+            if (UNLIKELY(p == end || *p != '-'))
+                return;
+            p++;
+
+            if (p < end && lwan_char_isdigit(*p)) {
+                if (UNLIKELY(!parse_range_number(&p, end, &range.to)))
+                    return;
+                if (UNLIKELY(range.to < range.from))
+                    return;
+            } else {
+                range.to = -1;
+            }
+        }
+
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        if (UNLIKELY(p < end && *p != ','))
+            return;
+
+        parts[n++] = range;
     }
+
+    request->header.range.n = n;
 }
 
 static void
@@ -739,6 +837,10 @@ static enum lwan_http_status read_from_request_socket(struct lwan_request *reque
             switch (errno) {
             case EAGAIN:
             case EINTR:
+                /* Not a packet: e.g. the read tried right after the
+                 * connection was accepted, before the request arrived.  */
+                if (!total_read)
+                    n_packets--;
 yield_and_read_again:
                 request->conn->flags |= CONN_MUST_READ;
                 coro_yield(request->conn->coro, CONN_CORO_MAY_RESUME);
@@ -994,6 +1096,10 @@ read_post_data(struct lwan_request *request, struct request_parser_helper *helpe
         return HTTP_TOO_LARGE;
 
     size_t post_data_size = (size_t)parsed_size;
+    /* Nothing to wait for on the socket.  */
+    if (!post_data_size)
+        return HTTP_OK;
+
     size_t have;
     if (!helper->next_request) {
         have = 0;
@@ -1069,9 +1175,11 @@ parse_http_request(struct lwan_request *request, struct request_parser_helper *h
     if (UNLIKELY(!buffer))
         return HTTP_BAD_REQUEST;
 
+    helper->headers.value = buffer;
     buffer = parse_headers(helper, buffer, helper->buffer->value + helper->buffer->len);
     if (UNLIKELY(!buffer))
         return HTTP_BAD_REQUEST;
+    helper->headers.len = (size_t)(buffer - helper->headers.value);
 
     ssize_t decoded_len = url_decode(request->url.value);
     if (UNLIKELY(decoded_len < 0))
@@ -1083,6 +1191,76 @@ parse_http_request(struct lwan_request *request, struct request_parser_helper *h
     return HTTP_OK;
 }
 
+static bool
+find_header(const struct request_parser_helper *helper, const char *name,
+    struct lwan_value *value)
+{
+    const size_t name_len = strlen(name);
+    struct lwan_value headers = helper->headers;
+    struct lwan_value line;
+
+    while (lwan_request_next_raw_header(&headers, &line)) {
+        if (line.len > name_len && line.value[name_len] == ':'
+                && !strncasecmp(line.value, name, name_len)) {
+            char *v = line.value + name_len + 1;
+            char *v_end = line.value + line.len;
+
+            while (v < v_end && *v == ' ')
+                v++;
+
+            value->value = v;
+            value->len = (size_t)(v_end - v);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static uint64_t
+rate_limit_key(struct lwan_request *request,
+    const struct request_parser_helper *helper, const char *header)
+{
+    struct sockaddr_storage non_proxied_addr;
+    struct sockaddr_storage *sock_addr;
+    struct lwan_value value;
+
+    if (header && find_header(helper, header, &value))
+        return lwan_rate_limit_hash(value.value, value.len);
+
+    if (request->flags & REQUEST_PROXIED) {
+        sock_addr = (struct sockaddr_storage *)&request->proxy->from;
+    } else {
+        socklen_t sock_len = sizeof(non_proxied_addr);
+
+        sock_addr = &non_proxied_addr;
+        if (UNLIKELY(getpeername(request->fd, (struct sockaddr *)sock_addr,
+                                 &sock_len) < 0))
+            return 0;
+    }
+
+    switch (sock_addr->ss_family) {
+    case AF_INET: {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)sock_addr;
+        return lwan_rate_limit_hash(&sin->sin_addr, sizeof(sin->sin_addr));
+    }
+    case AF_INET6: {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sock_addr;
+
+        if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+            return lwan_rate_limit_hash(&sin6->sin6_addr.s6_addr[12],
+                                        sizeof(struct in_addr));
+        }
+
+        /* Clients usually get a whole /64, so use only the prefix.  */
+        return lwan_rate_limit_hash(&sin6->sin6_addr, 8);
+    }
+    default:
+        /* Unix sockets, unspecified PROXY addresses: all share a bucket.  */
+        return 0;
+    }
+}
+
 static enum lwan_http_status
 prepare_for_response(struct lwan_url_map *url_map,
                       struct lwan_request *request,
@@ -1091,6 +1269,13 @@ prepare_for_response(struct lwan_url_map *url_map,
     request->url.value += url_map->prefix_len;
     request->url.len -= url_map->prefix_len;
 
+    if (url_map->rate_limit.limiter) {
+        uint64_t key = rate_limit_key(request, helper, url_map->rate_limit.header);
+
+        if (!lwan_rate_limit_allow(url_map->rate_limit.limiter, key))
+            return HTTP_TOO_MANY_REQUESTS;
+    }
+
     if (url_map->flags & HANDLER_MUST_AUTHORIZE) {
         if (!lwan_http_authorize(request,
                         &helper->authorization,
@@ -1102,8 +1287,10 @@ prepare_for_response(struct lwan_url_map *url_map,
     if (url_map->flags & HANDLER_PARSE_QUERY_STRING)
         parse_query_string(request, helper);
 
-    if (url_map->flags & HANDLER_PARSE_IF_MODIFIED_SINCE)
+    if (url_map->flags & HANDLER_PARSE_IF_MODIFIED_SINCE) {
         parse_if_modified_since(request, helper);
+        parse_if_none_match(request, helper);
+    }
 
     if (url_map->flags & HANDLER_PARSE_RANGE)
         parse_range(request, helper);
@@ -1137,7 +1324,12 @@ prepare_for_response(struct lwan_url_map *url_map,
         if (UNLIKELY(status != HTTP_OK))
             return status;
 
-        parse_post_data(request, helper);
+        if (url_map->flags & HANDLER_RAW_POST_DATA) {
+            request->header.body = &helper->post_data;
+            request->header.content_type = &helper->content_type;
+        } else {
+            parse_post_data(request, helper);
+        }
     }
 
     return HTTP_OK;
@@ -1160,11 +1352,40 @@ handle_rewrite(struct lwan_request *request, struct request_parser_helper *helpe
     return true;
 }
 
+static void
+release_in_flight_request(void *data)
+{
+    struct lwan_connection *conn = data;
+
+    conn->thread->overload.in_flight--;
+    conn->flags &= ~CONN_IN_FLIGHT;
+}
+
+static bool
+admit_request(struct lwan *l, struct lwan_request *request)
+{
+    struct lwan_connection *conn = request->conn;
+    struct lwan_thread *t = conn->thread;
+
+    if (l->config.max_requests_per_thread
+            && t->overload.in_flight >= l->config.max_requests_per_thread) {
+        ATOMIC_INC(t->overload.shed_requests);
+        return false;
+    }
+
+    t->overload.in_flight++;
+    conn->flags |= CONN_IN_FLIGHT;
+    coro_defer(conn->coro, release_in_flight_request, conn);
+
+    return true;
+}
+
 char *
 lwan_process_request(struct lwan *l, struct lwan_request *request,
     struct lwan_value *buffer, char *next_request)
 {
     enum lwan_http_status status;
+    struct lwan_url_map_generation *url_map_gen;
     struct lwan_url_map *url_map;
 
     struct request_parser_helper helper = {
@@ -1173,6 +1394,8 @@ lwan_process_request(struct lwan *l, struct lwan_request *request,
         .error_when_n_packets = calculate_n_packets(DEFAULT_BUFFER_SIZE)
     };
 
+    request->helper = &helper;
+
     status = read_request(request, &helper);
     if (UNLIKELY(status != HTTP_OK)) {
         /* This request was bad, but maybe there's a good one in the
@@ -1188,14 +1411,27 @@ lwan_process_request(struct lwan *l, struct lwan_request *request,
         __builtin_unreachable();
     }
 
+    if (UNLIKELY(l->overload.enabled && !admit_request(l, request))) {
+        lwan_response_send_overloaded(request->fd);
+        coro_yield(request->conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+
     status = parse_http_request(request, &helper);
     if (UNLIKELY(status != HTTP_OK)) {
         lwan_default_response(request, status);
         goto out;
     }
 
+    /* The generation is pinned until the coroutine runs its deferred
+     * callbacks, so a configuration reload won't free the URL map (or the
+     * handler data) while this request is using it. */
+    url_map_gen = lwan_url_map_generation_acquire(l, request->conn);
+
 lookup_again:
-    url_map = lwan_trie_lookup_prefix(&l->url_map_trie, request->url.value);
+    url_map = lwan_trie_lookup_prefix(
+        &url_map_gen->listeners[lwan_connection_get_listener(request->conn)].trie,
+        request->url.value);
     if (UNLIKELY(!url_map)) {
         lwan_default_response(request, HTTP_NOT_FOUND);
         goto out;
@@ -1257,6 +1493,120 @@ lwan_request_get_cookie(struct lwan_request *request, const char *key)
     return value_lookup(&request->cookies, key);
 }
 
+const struct lwan_value *
+lwan_request_get_raw_headers(struct lwan_request *request)
+{
+    /* Header lines start right after the request line and end with the
+     * empty line; lines known to the parser have their '\r' replaced by
+     * '\0'.  */
+    return &request->helper->headers;
+}
+
+/* Takes the next line from raw headers (as returned by
+ * lwan_request_get_raw_headers(), and advanced by each call), without
+ * its line terminator.  The first line, where the request line was, is
+ * empty.  Returns false once there are no more lines.  */
+bool
+lwan_request_next_raw_header(struct lwan_value *headers, struct lwan_value *line)
+{
+    char *p = headers->value;
+    char *end = p + headers->len;
+    char *eol, *line_end;
+
+    if (p >= end)
+        return false;
+
+    eol = memchr(p, '\n', (size_t)(end - p));
+    if (!eol)
+        eol = end;
+
+    /* Headers known to parse_headers() had their '\r' replaced by '\0'. */
+    for (line_end = p; line_end < eol && *line_end != '\r' && *line_end; line_end++);
+
+    line->value = p;
+    line->len = (size_t)(line_end - p);
+
+    if (eol < end)
+        eol++;
+    headers->value = eol;
+    headers->len = (size_t)(end - eol);
+
+    return true;
+}
+
+const char *
+lwan_request_get_method_name(const struct lwan_request *request)
+{
+    switch (lwan_request_get_method(request)) {
+    case REQUEST_METHOD_GET:
+        return "GET";
+    case REQUEST_METHOD_HEAD:
+        return "HEAD";
+    case REQUEST_METHOD_POST:
+        return "POST";
+    case REQUEST_METHOD_OPTIONS:
+        return "OPTIONS";
+    case REQUEST_METHOD_DELETE:
+        return "DELETE";
+    default:
+        return NULL;
+    }
+}
+
+const struct lwan_value *
+lwan_request_get_raw_query_string(struct lwan_request *request)
+{
+    /* Only raw if the handler didn't ask for the query string to be
+     * parsed, as that decodes it in place.  */
+    return &request->helper->query_string;
+}
+
+bool
+lwan_request_etag_matches(const struct lwan_request *request,
+                          const char *etag, size_t etag_len)
+{
+    const char *p = request->header.if_none_match.value;
+    const char *end = p + request->header.if_none_match.len;
+
+    /* Most of the time, it's the single tag sent with the response.  */
+    if (request->header.if_none_match.len == etag_len && !memcmp(p, etag, etag_len))
+        return true;
+
+    while (p < end) {
+        const char *close;
+
+        if (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+            continue;
+        }
+
+        if (*p == '*')
+            return true;
+
+        /* If-None-Match uses the weak comparison, so W/"x" matches "x".  */
+        if (end - p > 2 && p[0] == 'W' && p[1] == '/')
+            p += 2;
+
+        if (UNLIKELY(*p != '"')) {
+            p = memchr(p, ',', (size_t)(end - p));
+            if (!p)
+                break;
+            continue;
+        }
+
+        close = memchr(p + 1, '"', (size_t)(end - p - 1));
+        if (UNLIKELY(!close))
+            break;
+
+        if ((size_t)(close + 1 - p) == etag_len && !memcmp(p, etag, etag_len))
+            return true;
+
+        p = close + 1;
+    }
+
+    return false;
+}
+
 ALWAYS_INLINE int
 lwan_connection_get_fd(const struct lwan *lwan, const struct lwan_connection *conn)
 {
@@ -1286,6 +1636,9 @@ lwan_request_get_remote_address(struct lwan_request *request,
             return NULL;
     }
 
+    if (sock_addr->ss_family == AF_UNIX)
+        return memcpy(buffer, "unix", sizeof("unix"));
+
     if (sock_addr->ss_family == AF_INET)
         return inet_ntop(AF_INET,
                          &((struct sockaddr_in *) sock_addr)->sin_addr,
@@ -95,39 +95,40 @@ lwan_response_shutdown(struct lwan *l __attribute__((unused)))
     lwan_tpl_free(error_template);
 }
 
-#ifndef NDEBUG
-static const char *
-get_request_method(struct lwan_request *request)
+void
+lwan_response_send_overloaded(int fd)
 {
-    switch (lwan_request_get_method(request)) {
-    case REQUEST_METHOD_GET:
-        return "GET";
-    case REQUEST_METHOD_HEAD:
-        return "HEAD";
-    case REQUEST_METHOD_POST:
-        return "POST";
-    case REQUEST_METHOD_OPTIONS:
-        return "OPTIONS";
-    case REQUEST_METHOD_DELETE:
-        return "DELETE";
-    default:
-        return "UNKNOWN";
-    }
+    /* Prebuilt so that shedding load is as cheap as possible; the
+     * connection is closed right after this is sent.  */
+    static const char response[] = "HTTP/1.1 503 Service Unavailable\r\n"
+        "Content-Type: text/plain\r\n"
+        "Content-Length: 19\r\n"
+        "Connection: close\r\n"
+        "Retry-After: 1\r\n"
+        "Server: lwan\r\n"
+        "\r\n"
+        "Service Unavailable";
+    ssize_t r = send(fd, response, sizeof(response) - 1,
+        MSG_NOSIGNAL | MSG_DONTWAIT);
+
+    (void)r;
 }
 
+#ifndef NDEBUG
 static void
 log_request(struct lwan_request *request, enum lwan_http_status status)
 {
+    const char *method = lwan_request_get_method_name(request);
     char ip_buffer[INET6_ADDRSTRLEN];
 
     lwan_status_debug("%s [%s] \"%s %s HTTP/%s\" %d %s",
         lwan_request_get_remote_address(request, ip_buffer),
         request->conn->thread->date.date,
-        get_request_method(request),
+        method ? method : "UNKNOWN",
         request->original_url.value,
         request->flags & REQUEST_IS_HTTP_1_0 ? "1.0" : "1.1",
         status,
-        request->response.mime_type);
+        request->response.mime_type ? request->response.mime_type : "-");
 }
 #else
 #define log_request(...)
@@ -152,8 +153,10 @@ lwan_response(struct lwan_request *request, enum lwan_http_status status)
         return;
     }
 
-    if (UNLIKELY(request->flags & RESPONSE_SENT_HEADERS)) {
-        lwan_status_debug("Headers already sent, ignoring call");
+    if (request->flags & RESPONSE_SENT_HEADERS) {
+        /* The handler sent the response by itself (e.g. relayed it from
+         * an upstream server); it still has to be logged.  */
+        log_request(request, status);
         return;
     }
 
@@ -19,14 +19,17 @@
 
 #define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include "lwan-private.h"
@@ -56,13 +59,11 @@ get_backlog_size(void)
 }
 
 static int
-setup_socket_from_systemd(void)
+setup_socket_from_systemd(int fd)
 {
-    int fd = SD_LISTEN_FDS_START;
-
-    if (!sd_is_socket_inet(fd, AF_UNSPEC, SOCK_STREAM, 1, 0))
+    if (sd_is_socket(fd, AF_UNSPEC, SOCK_STREAM, 1) <= 0)
         lwan_status_critical("Passed file descriptor is not a "
-            "listening TCP socket");
+            "listening stream socket");
 
     int flags = fcntl(fd, F_GETFD);
     if (flags < 0)
@@ -70,6 +71,12 @@ setup_socket_from_systemd(void)
     if (fcntl(fd, F_SETFD, flags | FD_CLOEXEC) < 0)
         lwan_status_critical_perror("Could not set socket flags");
 
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0)
+        lwan_status_critical_perror("Could not obtain socket flags");
+    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        lwan_status_critical_perror("Could not set socket flags");
+
     return fd;
 }
 
@@ -186,7 +193,7 @@ bind_and_listen_addrinfos(struct addrinfo *addrs, bool reuse_port)
     /* Try each address until we bind one successfully. */
     for (addr = addrs; addr; addr = addr->ai_next) {
         int fd = socket(addr->ai_family,
-            addr->ai_socktype | SOCK_CLOEXEC, addr->ai_protocol);
+            addr->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK, addr->ai_protocol);
         if (fd < 0)
             continue;
 
@@ -203,14 +210,76 @@ bind_and_listen_addrinfos(struct addrinfo *addrs, bool reuse_port)
     lwan_status_critical("Could not bind socket");
 }
 
+static bool
+unix_socket_is_stale(const struct sockaddr_un *sun, socklen_t len)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    bool stale;
+
+    if (fd < 0)
+        return false;
+
+    stale = connect(fd, (const struct sockaddr *)sun, len) < 0 &&
+        errno == ECONNREFUSED;
+    close(fd);
+
+    return stale;
+}
+
 static int
-setup_socket_normally(struct lwan *l)
+setup_unix_socket(const char *path)
+{
+    struct sockaddr_un sun = { .sun_family = AF_UNIX };
+    size_t path_len = strlen(path);
+    socklen_t len;
+    int fd;
+
+    if (!path_len || path_len >= sizeof(sun.sun_path))
+        lwan_status_critical("Invalid Unix socket path: %s", path);
+
+    memcpy(sun.sun_path, path, path_len);
+    if (*path == '@') {
+        /* Abstract namespace: the leading NUL byte is the marker, and
+         * the name isn't NUL-terminated.  */
+        sun.sun_path[0] = '\0';
+        len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + path_len);
+    } else {
+        len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + path_len + 1);
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+        lwan_status_critical_perror("socket");
+
+    if (bind(fd, (struct sockaddr *)&sun, len) < 0) {
+        /* A socket file left behind by a previous instance that isn't
+         * accepting connections anymore can be safely removed.  */
+        if (errno != EADDRINUSE || *path == '@' ||
+            !unix_socket_is_stale(&sun, len) || unlink(path) < 0 ||
+            bind(fd, (struct sockaddr *)&sun, len) < 0)
+            lwan_status_critical_perror("Could not bind to unix:%s", path);
+    }
+
+    if (listen(fd, get_backlog_size()) < 0)
+        lwan_status_critical_perror("listen");
+
+    lwan_status_info("Listening on unix:%s", path);
+
+    return fd;
+}
+
+static int
+setup_socket_normally(struct lwan *l, const char *address)
 {
     char *node, *port;
-    char *listener = strdupa(l->config.listener);
+    char *listener = strdupa(address);
+
+    if (!strncmp(listener, "unix:", sizeof("unix:") - 1))
+        return setup_unix_socket(listener + sizeof("unix:") - 1);
+
     sa_family_t family = parse_listener(listener, &node, &port);
     if (family == AF_UNSPEC)
-        lwan_status_critical("Could not parse listener: %s", l->config.listener);
+        lwan_status_critical("Could not parse listener: %s", address);
 
     struct addrinfo *addrs;
     struct addrinfo hints = {
@@ -232,33 +301,108 @@ setup_socket_normally(struct lwan *l)
 #define TCP_FASTOPEN 23
 #endif
 
-void
-lwan_socket_init(struct lwan *l)
-{
-    int fd, n;
+#ifndef TCP_DEFER_ACCEPT
+#define TCP_DEFER_ACCEPT 9
+#endif
 
-    lwan_status_debug("Initializing sockets");
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
 
-    n = sd_listen_fds(1);
-    if (n > 1) {
-        lwan_status_critical("Too many file descriptors received");
-    } else if (n == 1) {
-        fd = setup_socket_from_systemd();
-    } else {
-        fd = setup_socket_normally(l);
-    }
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+static void
+set_listener_options(struct lwan *l, int fd,
+                     const struct lwan_url_map_listener *config)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
 
     SET_SOCKET_OPTION(SOL_SOCKET, SO_LINGER,
         (&(struct linger){ .l_onoff = 1, .l_linger = 1 }), sizeof(struct linger));
 
+    if (getsockname(fd, (struct sockaddr *)&addr, &len) < 0)
+        lwan_status_critical_perror("getsockname");
+    if (addr.ss_family == AF_UNIX)
+        return;
+
 #ifdef __linux__
+    if (l->config.busy_poll) {
+        /* Accepted sockets inherit these.  Raising SO_BUSY_POLL above
+         * net.core.busy_read requires CAP_NET_ADMIN.  */
+        SET_SOCKET_OPTION_MAY_FAIL(SOL_SOCKET, SO_BUSY_POLL,
+                                   (int[]){ (int)l->config.busy_poll }, sizeof(int));
+        SET_SOCKET_OPTION_MAY_FAIL(SOL_SOCKET, SO_PREFER_BUSY_POLL,
+                                   (int[]){ 1 }, sizeof(int));
+    }
+
     SET_SOCKET_OPTION_MAY_FAIL(SOL_TCP, TCP_FASTOPEN,
-                                            (int[]){ 5 }, sizeof(int));
+                                   (int[]){ config->fast_open }, sizeof(int));
     SET_SOCKET_OPTION_MAY_FAIL(SOL_TCP, TCP_QUICKACK,
                                             (int[]){ 0 }, sizeof(int));
+    if (config->defer_accept) {
+        /* Connections are only handed to accept() once the request
+         * starts arriving, so the first read is unlikely to block.  */
+        SET_SOCKET_OPTION_MAY_FAIL(SOL_TCP, TCP_DEFER_ACCEPT,
+                                   (int[]){ (int)config->defer_accept }, sizeof(int));
+    }
 #endif
+}
+
+void
+lwan_socket_init(struct lwan *l)
+{
+    const struct lwan_url_map_generation *gen = l->url_map;
+    int n;
+
+    lwan_status_debug("Initializing sockets");
+
+    l->listener.listeners = calloc(gen->n_listeners, sizeof(struct lwan_listener));
+    if (!l->listener.listeners)
+        lwan_status_critical_perror("calloc");
+    l->listener.count = gen->n_listeners;
+
+    /* Sockets passed by systemd are assigned to listeners in the order
+     * they're declared in the configuration file.  */
+    n = sd_listen_fds(1);
+    if (n > 0 && n != gen->n_listeners) {
+        lwan_status_critical("%d file descriptors received, but %d listeners "
+            "are configured", n, gen->n_listeners);
+    }
+
+    for (unsigned short i = 0; i < gen->n_listeners; i++) {
+        struct lwan_listener *listener = &l->listener.listeners[i];
+
+        listener->address = strdup(gen->listeners[i].address);
+        if (n > 0)
+            listener->fd = setup_socket_from_systemd(SD_LISTEN_FDS_START + i);
+        else
+            listener->fd = setup_socket_normally(l, listener->address);
+
+        set_listener_options(l, listener->fd, &gen->listeners[i]);
+    }
+}
+
+void
+lwan_socket_shutdown(struct lwan *l)
+{
+    for (unsigned short i = 0; i < l->listener.count; i++) {
+        struct lwan_listener *listener = &l->listener.listeners[i];
+
+        close(listener->fd);
+
+        if (!strncmp(listener->address, "unix:/", sizeof("unix:/") - 1))
+            unlink(listener->address + sizeof("unix:") - 1);
+
+        free(listener->address);
+        free(listener->threads);
+    }
 
-    l->main_socket = fd;
+    free(l->listener.listeners);
+    l->listener.listeners = NULL;
+    l->listener.count = 0;
 }
 
 #undef SET_SOCKET_OPTION
@@ -0,0 +1,592 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "lwan-private.h"
+#include "lwan-io-wrappers.h"
+#include "lwan-sse.h"
+#include "list.h"
+
+/*
+ * Published events are formatted once, and kept in a ring of reference
+ * counted messages; each message is numbered, and each subscriber knows
+ * the number of the next message it should get.
+ *
+ * Subscribers are kept by the I/O thread that owns their connection.
+ * Publishing pokes the eventfd of every thread with subscribers, and the
+ * thread then writes the new messages to all of them in one go, without
+ * waking up their coroutines.  Only subscribers whose sockets can't take
+ * everything have their coroutines resumed, to finish writing with the
+ * usual machinery (yielding until the socket is writable); the thread
+ * leaves them alone until they catch up.
+ */
+
+#define MAX_BACKLOG 1024
+
+struct sse_message {
+    unsigned int refs;
+    size_t len;
+    char data[];
+};
+
+struct sse_slot {
+    struct lwan_sse_channel *channel;
+    struct list_node node;
+    struct list_head subscribers;
+    unsigned int n_subscribers;
+
+    /* Number of the next message this thread hasn't looked at.  */
+    uint64_t seen;
+};
+
+struct lwan_sse_channel {
+    pthread_mutex_t lock;
+    struct sse_message **ring;
+    uint64_t mask;
+    uint64_t head;
+
+    enum lwan_sse_slow_policy policy;
+    struct lwan *lwan;
+    unsigned int subscribers;
+
+    struct sse_slot slots[];
+};
+
+struct lwan_sse_thread {
+    int event_fd;
+    struct list_head slots;
+    struct list_head wake;
+};
+
+struct sse_subscriber {
+    struct lwan_request *request;
+    struct sse_slot *slot;
+    struct list_node node;
+    struct list_node wake_node;
+
+    uint64_t next;
+
+    /* Message "next", if only part of it ("offset" bytes) was written;
+     * kept until it's finished, even if the channel drops it.  */
+    struct sse_message *partial;
+    size_t offset;
+
+    bool busy;
+    bool waking;
+    bool kicked;
+
+    /* Only allocated once the subscriber falls behind.  */
+    struct sse_message **held;
+    unsigned int n_held;
+    struct iovec *iov;
+};
+
+static void
+message_unref(struct sse_message *msg)
+{
+    if (msg && !ATOMIC_DEC(msg->refs))
+        free(msg);
+}
+
+struct lwan_sse_channel *
+lwan_sse_channel_new(struct lwan *l, unsigned int backlog,
+    enum lwan_sse_slow_policy policy)
+{
+    struct lwan_sse_channel *channel;
+    uint64_t size = 1;
+
+    channel = calloc(1, sizeof(*channel) + l->thread.count * sizeof(struct sse_slot));
+    if (!channel)
+        return NULL;
+
+    if (backlog > MAX_BACKLOG)
+        backlog = MAX_BACKLOG;
+    while (size < backlog)
+        size <<= 1;
+
+    channel->ring = calloc(size, sizeof(*channel->ring));
+    if (!channel->ring) {
+        free(channel);
+        return NULL;
+    }
+
+    channel->mask = size - 1;
+    channel->policy = policy;
+    channel->lwan = l;
+    pthread_mutex_init(&channel->lock, NULL);
+
+    for (unsigned short i = 0; i < l->thread.count; i++) {
+        channel->slots[i].channel = channel;
+        list_head_init(&channel->slots[i].subscribers);
+    }
+
+    return channel;
+}
+
+void
+lwan_sse_channel_free(struct lwan_sse_channel *channel)
+{
+    if (!channel)
+        return;
+
+    for (uint64_t i = 0; i <= channel->mask; i++)
+        message_unref(channel->ring[i]);
+
+    pthread_mutex_destroy(&channel->lock);
+    free(channel->ring);
+    free(channel);
+}
+
+unsigned int
+lwan_sse_channel_get_subscribers(const struct lwan_sse_channel *channel)
+{
+    return ATOMIC_READ(channel->subscribers);
+}
+
+static struct sse_message *
+format_message(const char *event, const char *data, size_t data_len)
+{
+    struct sse_message *msg;
+    size_t lines = 1;
+    size_t len;
+    char *p;
+
+    for (size_t i = 0; i < data_len; i++) {
+        if (data[i] == '\n')
+            lines++;
+    }
+
+    len = (event ? sizeof("event: \r\n") - 1 + strlen(event) : 0) +
+        lines * (sizeof("data: \r\n") - 1) + data_len + 2;
+
+    msg = malloc(sizeof(*msg) + len);
+    if (!msg)
+        return NULL;
+
+    p = msg->data;
+    if (event)
+        p += sprintf(p, "event: %s\r\n", event);
+
+    while (true) {
+        const char *eol = memchr(data, '\n', data_len);
+        size_t line_len = eol ? (size_t)(eol - data) : data_len;
+
+        p = mempcpy(p, "data: ", sizeof("data: ") - 1);
+        p = mempcpy(p, data, line_len);
+        p = mempcpy(p, "\r\n", 2);
+
+        if (!eol)
+            break;
+        data += line_len + 1;
+        data_len -= line_len + 1;
+    }
+    p = mempcpy(p, "\r\n", 2);
+
+    msg->len = (size_t)(p - msg->data);
+    msg->refs = 1;
+
+    return msg;
+}
+
+bool
+lwan_sse_channel_publish(struct lwan_sse_channel *channel,
+    const char *event, const char *data, size_t data_len)
+{
+    struct sse_message *msg = format_message(event, data, data_len);
+    struct sse_message *dropped;
+    const uint64_t one = 1;
+
+    if (UNLIKELY(!msg))
+        return false;
+
+    pthread_mutex_lock(&channel->lock);
+    dropped = channel->ring[channel->head & channel->mask];
+    channel->ring[channel->head & channel->mask] = msg;
+    channel->head++;
+    pthread_mutex_unlock(&channel->lock);
+
+    message_unref(dropped);
+
+    for (unsigned short i = 0; i < channel->lwan->thread.count; i++) {
+        if (!ATOMIC_READ(channel->slots[i].n_subscribers))
+            continue;
+
+        /* Nothing to do if the counter is already non-zero and the
+         * eventfd couldn't take more; the thread is going to look at all
+         * of its channels anyway.  */
+        if (write(channel->lwan->thread.threads[i].sse->event_fd, &one,
+                  sizeof(one)) < 0 && errno != EAGAIN) {
+            lwan_status_perror("write");
+        }
+    }
+
+    return true;
+}
+
+/* Takes references to messages from @first up to the head of the channel,
+ * or to as many as it keeps.  Returns the number of the first message
+ * taken.  Must be called with the channel lock held.  */
+static uint64_t
+hold_messages(struct lwan_sse_channel *channel, uint64_t first,
+    struct sse_message **held, unsigned int *n_held)
+{
+    const uint64_t oldest = channel->head > channel->mask ?
+        channel->head - channel->mask - 1 : 0;
+
+    if (first < oldest)
+        first = oldest;
+
+    *n_held = 0;
+    for (uint64_t seq = first; seq < channel->head; seq++) {
+        struct sse_message *msg = channel->ring[seq & channel->mask];
+
+        ATOMIC_INC(msg->refs);
+        held[(*n_held)++] = msg;
+    }
+
+    return first;
+}
+
+static void
+release_messages(struct sse_message **held, unsigned int *n_held)
+{
+    for (unsigned int i = 0; i < *n_held; i++)
+        message_unref(held[i]);
+    *n_held = 0;
+}
+
+static int
+build_iovec(struct iovec *iov, struct sse_message **msgs, unsigned int n_msgs)
+{
+    int n_iov = 0;
+
+    for (unsigned int i = 0; i < n_msgs && n_iov < IOV_MAX; i++) {
+        iov[n_iov++] = (struct iovec) {
+            .iov_base = msgs[i]->data,
+            .iov_len = msgs[i]->len,
+        };
+    }
+
+    return n_iov;
+}
+
+/* Returns false if the subscriber missed messages and has to go.  Never
+ * called with a message partially written.  */
+static bool
+catch_up(struct sse_subscriber *sub, uint64_t first)
+{
+    if (sub->next >= first)
+        return true;
+
+    if (sub->slot->channel->policy == LWAN_SSE_DISCONNECT)
+        return false;
+
+    sub->next = first;
+    return true;
+}
+
+static void
+schedule_wake(struct lwan_sse_thread *st, struct sse_subscriber *sub)
+{
+    if (!sub->waking) {
+        sub->waking = true;
+        list_add_tail(&st->wake, &sub->wake_node);
+    }
+}
+
+/* Writes what's pending to a subscriber without blocking; if the socket
+ * can't take all of it, the coroutine is woken up to finish the job.  */
+static void
+fan_out_to(struct lwan_sse_thread *st, struct sse_subscriber *sub,
+    struct sse_message **msgs, unsigned int n_msgs, uint64_t first,
+    struct iovec *iov)
+{
+    struct msghdr msg = { .msg_iov = iov };
+    unsigned int skip;
+    ssize_t written;
+
+    if (!catch_up(sub, first)) {
+        sub->kicked = true;
+        schedule_wake(st, sub);
+        return;
+    }
+
+    skip = (unsigned int)(sub->next - first);
+    if (skip >= n_msgs)
+        return;
+
+    msg.msg_iovlen = (size_t)build_iovec(iov, msgs + skip, n_msgs - skip);
+    written = sendmsg(sub->request->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (written < 0) {
+        if (errno != EAGAIN)
+            sub->kicked = true;
+        else
+            sub->busy = true;
+        schedule_wake(st, sub);
+        return;
+    }
+
+    for (unsigned int i = skip; i < n_msgs; i++) {
+        if ((size_t)written < msgs[i]->len) {
+            if (written) {
+                ATOMIC_INC(msgs[i]->refs);
+                sub->partial = msgs[i];
+                sub->offset = (size_t)written;
+            }
+            sub->busy = true;
+            schedule_wake(st, sub);
+            return;
+        }
+
+        written -= (ssize_t)msgs[i]->len;
+        sub->next++;
+    }
+}
+
+static void
+fan_out_slot(struct lwan_sse_thread *st, struct sse_slot *slot)
+{
+    struct lwan_sse_channel *channel = slot->channel;
+    struct sse_message *msgs[channel->mask + 1];
+    struct iovec iov[channel->mask + 1 < IOV_MAX ? channel->mask + 1 : IOV_MAX];
+    struct sse_subscriber *sub;
+    unsigned int n_msgs;
+    uint64_t first;
+
+    if (ATOMIC_READ(channel->head) == slot->seen)
+        return;
+
+    pthread_mutex_lock(&channel->lock);
+    first = hold_messages(channel, slot->seen, msgs, &n_msgs);
+    slot->seen = channel->head;
+    pthread_mutex_unlock(&channel->lock);
+
+    list_for_each(&slot->subscribers, sub, node) {
+        if (!sub->busy && !sub->kicked)
+            fan_out_to(st, sub, msgs, n_msgs, first, iov);
+    }
+
+    release_messages(msgs, &n_msgs);
+}
+
+void
+lwan_sse_fan_out(struct lwan_thread *t,
+    void (*wake)(struct lwan_connection *conn, void *data), void *data)
+{
+    struct lwan_sse_thread *st = t->sse;
+    struct sse_subscriber *sub;
+    struct sse_slot *slot;
+    uint64_t counter;
+
+    if (read(st->event_fd, &counter, sizeof(counter)) < 0 && errno != EAGAIN)
+        lwan_status_perror("read");
+
+    list_for_each(&st->slots, slot, node)
+        fan_out_slot(st, slot);
+
+    /* Resuming a coroutine might end it, taking the subscriber with it;
+     * that's why this is done only after going through the lists.  */
+    while ((sub = list_pop(&st->wake, struct sse_subscriber, wake_node))) {
+        sub->waking = false;
+        wake(sub->request->conn, data);
+    }
+}
+
+void
+lwan_sse_thread_free(struct lwan_sse_thread *st)
+{
+    if (st) {
+        close(st->event_fd);
+        free(st);
+    }
+}
+
+static struct lwan_sse_thread *
+get_sse_thread(struct lwan_thread *t)
+{
+    struct lwan_sse_thread *st = t->sse;
+    struct epoll_event event = { .events = EPOLLIN };
+
+    if (LIKELY(st))
+        return st;
+
+    st = malloc(sizeof(*st));
+    if (!st)
+        return NULL;
+
+    st->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (st->event_fd < 0)
+        goto free_st;
+
+    list_head_init(&st->slots);
+    list_head_init(&st->wake);
+
+    /* The I/O thread tells this apart from client connections by the
+     * pointer.  */
+    event.data.ptr = st;
+    if (epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, st->event_fd, &event) < 0)
+        goto close_event_fd;
+
+    t->sse = st;
+    return st;
+
+close_event_fd:
+    close(st->event_fd);
+free_st:
+    free(st);
+    return NULL;
+}
+
+static void
+unsubscribe(void *data)
+{
+    struct sse_subscriber *sub = data;
+    struct sse_slot *slot = sub->slot;
+
+    list_del(&sub->node);
+    if (sub->waking)
+        list_del(&sub->wake_node);
+
+    if (!ATOMIC_DEC(slot->n_subscribers))
+        list_del(&slot->node);
+    ATOMIC_DEC(slot->channel->subscribers);
+
+    release_messages(sub->held, &sub->n_held);
+    message_unref(sub->partial);
+}
+
+/* Called by the subscriber's coroutine, which is free to block, after the
+ * I/O thread couldn't write everything.  */
+static void
+deliver(struct sse_subscriber *sub)
+{
+    struct lwan_sse_channel *channel = sub->slot->channel;
+
+    if (sub->partial) {
+        /* Part of it is already on the wire: if it were skipped, the
+         * next message would be appended to what was sent of it.  */
+        lwan_send(sub->request, sub->partial->data + sub->offset,
+            sub->partial->len - sub->offset, 0);
+
+        message_unref(sub->partial);
+        sub->partial = NULL;
+        sub->offset = 0;
+        sub->next++;
+    }
+
+    if (!sub->held) {
+        const size_t n_iov = channel->mask < IOV_MAX ? channel->mask + 1 : IOV_MAX;
+
+        sub->iov = coro_malloc(sub->request->conn->coro,
+            n_iov * sizeof(*sub->iov) + (channel->mask + 1) * sizeof(*sub->held));
+        if (UNLIKELY(!sub->iov)) {
+            sub->kicked = true;
+            return;
+        }
+        sub->held = (struct sse_message **)(sub->iov + n_iov);
+    }
+
+    while (true) {
+        uint64_t first;
+        int n_iov;
+
+        pthread_mutex_lock(&channel->lock);
+        first = hold_messages(channel, sub->next, sub->held, &sub->n_held);
+        pthread_mutex_unlock(&channel->lock);
+
+        if (!sub->n_held)
+            break;
+
+        if (!catch_up(sub, first)) {
+            sub->kicked = true;
+            return;
+        }
+
+        n_iov = build_iovec(sub->iov, sub->held, sub->n_held);
+        lwan_writev(sub->request, sub->iov, n_iov);
+
+        sub->next = first + (uint64_t)n_iov;
+        release_messages(sub->held, &sub->n_held);
+    }
+
+    sub->busy = false;
+}
+
+enum lwan_http_status
+lwan_sse_channel_subscribe(struct lwan_request *request,
+    struct lwan_sse_channel *channel)
+{
+    struct lwan_thread *t = request->conn->thread;
+    struct coro *coro = request->conn->coro;
+    struct lwan_sse_thread *st;
+    struct sse_subscriber *sub;
+    struct sse_slot *slot;
+
+    st = get_sse_thread(t);
+    if (UNLIKELY(!st))
+        return HTTP_INTERNAL_ERROR;
+
+    sub = coro_malloc(coro, sizeof(*sub));
+    if (UNLIKELY(!sub))
+        return HTTP_INTERNAL_ERROR;
+
+    if (!lwan_response_set_event_stream(request, HTTP_OK))
+        return HTTP_INTERNAL_ERROR;
+
+    slot = &channel->slots[t - t->lwan->thread.threads];
+    *sub = (struct sse_subscriber) {
+        .request = request,
+        .slot = slot,
+    };
+
+    pthread_mutex_lock(&channel->lock);
+    sub->next = channel->head;
+    if (list_empty(&slot->subscribers))
+        slot->seen = channel->head;
+    pthread_mutex_unlock(&channel->lock);
+
+    if (list_empty(&slot->subscribers))
+        list_add_tail(&st->slots, &slot->node);
+    list_add_tail(&slot->subscribers, &sub->node);
+    ATOMIC_INC(slot->n_subscribers);
+    ATOMIC_INC(channel->subscribers);
+    coro_defer(coro, unsubscribe, sub);
+
+    while (true) {
+        lwan_thread_park(request->conn);
+
+        if (sub->busy)
+            deliver(sub);
+        if (sub->kicked) {
+            coro_yield(coro, CONN_CORO_ABORT);
+            __builtin_unreachable();
+        }
+    }
+}
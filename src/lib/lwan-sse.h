@@ -0,0 +1,53 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2017 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include "lwan.h"
+
+/* What happens to subscribers that fall so far behind that events they
+ * haven't received yet are no longer kept by the channel.  */
+enum lwan_sse_slow_policy {
+    LWAN_SSE_DROP_OLDEST,
+    LWAN_SSE_DISCONNECT,
+};
+
+struct lwan_sse_channel;
+
+/* The channel keeps the last "backlog" events (rounded up to a power of
+ * two, up to 1024) for subscribers that can't keep up.  */
+struct lwan_sse_channel *lwan_sse_channel_new(struct lwan *l,
+    unsigned int backlog, enum lwan_sse_slow_policy policy);
+void lwan_sse_channel_free(struct lwan_sse_channel *channel);
+
+/* Can be called from any thread.  The event is formatted once and shared
+ * by all subscribers; data with more than one line is sent as multiple
+ * "data:" fields.  */
+bool lwan_sse_channel_publish(struct lwan_sse_channel *channel,
+    const char *event, const char *data, size_t data_len);
+
+/* Turns the response into an event stream and hands the connection over
+ * to the channel.  Only returns if that couldn't be done: the connection
+ * is closed when the client goes away or is disconnected for being too
+ * slow.  */
+enum lwan_http_status lwan_sse_channel_subscribe(struct lwan_request *request,
+    struct lwan_sse_channel *channel);
+
+unsigned int lwan_sse_channel_get_subscribers(const struct lwan_sse_channel *channel)
+    __attribute__((pure));
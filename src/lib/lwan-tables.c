@@ -126,9 +126,16 @@ lwan_http_status_as_string_with_code(enum lwan_http_status status)
 #define RESP(code,description)		[code] = #code " " description
     static const char *responses[] = {
         RESP(200, "OK"),
+        RESP(201, "Created"),
+        RESP(202, "Accepted"),
+        RESP(204, "No content"),
         RESP(206, "Partial content"),
         RESP(301, "Moved permanently"),
+        RESP(302, "Found"),
+        RESP(303, "See other"),
         RESP(304, "Not modified"),
+        RESP(307, "Temporary redirect"),
+        RESP(308, "Permanent redirect"),
         RESP(400, "Bad request"),
         RESP(401, "Not authorized"),
         RESP(403, "Forbidden"),
@@ -139,9 +146,12 @@ lwan_http_status_as_string_with_code(enum lwan_http_status status)
         RESP(416, "Requested range unsatisfiable"),
         RESP(418, "I'm a teapot"),
         RESP(420, "Client too high"),
+        RESP(429, "Too many requests"),
         RESP(500, "Internal server error"),
         RESP(501, "Not implemented"),
+        RESP(502, "Bad gateway"),
         RESP(503, "Service unavailable"),
+        RESP(504, "Gateway timeout"),
         RESP(520, "Server too high"),
     };
 #undef RESP
@@ -162,10 +172,23 @@ lwan_http_status_as_descriptive_string(enum lwan_http_status status)
     switch (status) {
     case HTTP_OK:
         return "Success!";
+    case HTTP_CREATED:
+        return "The resource has been created.";
+    case HTTP_ACCEPTED:
+        return "The request has been accepted for processing.";
+    case HTTP_NO_CONTENT:
+        return "There is no content to send for this request.";
     case HTTP_PARTIAL_CONTENT:
         return "Delivering part of requested resource.";
     case HTTP_MOVED_PERMANENTLY:
         return "This content has moved to another place.";
+    case HTTP_FOUND:
+    case HTTP_TEMPORARY_REDIRECT:
+        return "This content is temporarily at another place.";
+    case HTTP_SEE_OTHER:
+        return "The response can be found at another place.";
+    case HTTP_PERMANENT_REDIRECT:
+        return "This content has permanently moved to another place.";
     case HTTP_NOT_MODIFIED:
         return "The content has not changed since previous request.";
     case HTTP_BAD_REQUEST:
@@ -188,12 +211,18 @@ lwan_http_status_as_descriptive_string(enum lwan_http_status status)
         return "Client requested to brew coffee but device is a teapot.";
     case HTTP_CLIENT_TOO_HIGH:
         return "Client is too high to make a request.";
+    case HTTP_TOO_MANY_REQUESTS:
+        return "Client has sent too many requests; try again later.";
     case HTTP_INTERNAL_ERROR:
         return "The server encountered an internal error that couldn't be recovered from.";
     case HTTP_NOT_IMPLEMENTED:
         return "Server lacks the ability to fulfil the request.";
+    case HTTP_BAD_GATEWAY:
+        return "The upstream server sent an invalid response or couldn't be reached.";
     case HTTP_UNAVAILABLE:
         return "The server is either overloaded or down for maintenance.";
+    case HTTP_GATEWAY_TIMEOUT:
+        return "The upstream server did not answer in time.";
     case HTTP_SERVER_TOO_HIGH:
         return "The server is too high to answer the request.";
     }
@@ -118,6 +118,12 @@ struct lwan_tpl {
     size_t minimum_size;
 };
 
+struct flush {
+    struct coro *coro;
+    void (*func)(struct strbuf *buf, void *data);
+    void *data;
+};
+
 struct symtab {
     struct hash *hash;
     struct symtab *next;
@@ -1305,9 +1311,17 @@ end:
     return tpl;
 }
 
+static void
+free_iteration(struct coro **coro)
+{
+    if (*coro)
+        coro_free(*coro);
+    free(coro);
+}
+
 static struct chunk *
 apply_until(struct lwan_tpl *tpl, struct chunk *chunks, struct strbuf *buf, void *variables,
-            void *until_data)
+            void *until_data, const struct flush *flush)
 {
     static const void *const dispatch_table[] = {
         [ACTION_APPEND] = &&action_append,
@@ -1324,6 +1338,7 @@ apply_until(struct lwan_tpl *tpl, struct chunk *chunks, struct strbuf *buf, void
     };
     struct coro_switcher switcher;
     struct coro *coro = NULL;
+    struct coro **iteration = NULL;
     struct chunk *chunk = chunks;
 
     if (UNLIKELY(!chunk))
@@ -1365,7 +1380,7 @@ action_if_variable_not_empty: {
         if (empty) {
             chunk = cd->chunk;
         } else {
-            chunk = apply_until(tpl, chunk + 1, buf, variables, cd->chunk);
+            chunk = apply_until(tpl, chunk + 1, buf, variables, cd->chunk, flush);
         }
         NEXT_ACTION();
     }
@@ -1391,25 +1406,38 @@ action_start_iter:
     struct chunk_descriptor *cd = chunk->data;
     coro = coro_new(&switcher, cd->descriptor->generator, variables);
 
+    if (flush) {
+        /* The flush function might never return if the coroutine it runs
+         * in is aborted; free this one (and whatever its generator has
+         * deferred) along with it if that's the case.  */
+        iteration = coro_malloc_full(flush->coro, sizeof(*iteration),
+                                     free_iteration);
+        if (LIKELY(iteration))
+            *iteration = coro;
+    }
+
     bool resumed = coro_resume_value(coro, 0);
     bool negate = (chunk->flags & FLAGS_NEGATE) == FLAGS_NEGATE;
-    if (negate)
-        resumed = !resumed;
-    if (!resumed) {
-        chunk = cd->chunk;
-
-        if (negate)
+    if (negate || !resumed) {
+        if (resumed)
             coro_resume_value(coro, 1);
 
         coro_free(coro);
         coro = NULL;
+        if (iteration)
+            *iteration = NULL;
 
-        if (negate)
-            DISPATCH();
-        NEXT_ACTION();
+        /* A negated sequence is rendered once if the sequence is empty,
+         * with nothing to iterate on: its END_ITER is a no-op.  */
+        if (negate && !resumed)
+            chunk = apply_until(tpl, chunk + 1, buf, variables, chunk, flush);
+        else
+            chunk = cd->chunk;
+
+        DISPATCH();
     }
 
-    chunk = apply_until(tpl, chunk + 1, buf, variables, chunk);
+    chunk = apply_until(tpl, chunk + 1, buf, variables, chunk, flush);
     DISPATCH();
 
 action_end_iter:
@@ -1422,13 +1450,19 @@ action_end_iter:
         NEXT_ACTION();
     }
 
+    if (flush)
+        flush->func(buf, flush->data);
+
     if (!coro_resume_value(coro, 0)) {
         coro_free(coro);
         coro = NULL;
+        if (iteration)
+            *iteration = NULL;
         NEXT_ACTION();
     }
 
-    chunk = apply_until(tpl, ((struct chunk *)chunk->data) + 1, buf, variables, chunk->data);
+    chunk = apply_until(tpl, ((struct chunk *)chunk->data) + 1, buf, variables,
+                        chunk->data, flush);
     DISPATCH();
 
 finalize:
@@ -1446,7 +1480,29 @@ lwan_tpl_apply_with_buffer(struct lwan_tpl *tpl, struct strbuf *buf, void *varia
     if (UNLIKELY(!strbuf_grow_to(buf, tpl->minimum_size)))
         return NULL;
 
-    apply_until(tpl, tpl->chunks.base.base, buf, variables, NULL);
+    apply_until(tpl, tpl->chunks.base.base, buf, variables, NULL, NULL);
+
+    return buf;
+}
+
+struct strbuf *
+lwan_tpl_apply_with_flush(struct lwan_tpl *tpl, struct strbuf *buf,
+    void *variables, struct coro *coro,
+    void (*flush_func)(struct strbuf *buf, void *data), void *data)
+{
+    const struct flush flush = {
+        .coro = coro,
+        .func = flush_func,
+        .data = data
+    };
+
+    if (UNLIKELY(!strbuf_reset(buf)))
+        return NULL;
+
+    if (UNLIKELY(!strbuf_grow_to(buf, tpl->minimum_size)))
+        return NULL;
+
+    apply_until(tpl, tpl->chunks.base.base, buf, variables, NULL, &flush);
 
     return buf;
 }
@@ -86,5 +86,12 @@ struct lwan_tpl	*lwan_tpl_compile_string(const char *string, const struct lwan_v
 struct lwan_tpl	*lwan_tpl_compile_file(const char *filename, const struct lwan_var_descriptor *descriptor);
 struct strbuf	*lwan_tpl_apply(struct lwan_tpl *tpl, void *variables);
 struct strbuf	*lwan_tpl_apply_with_buffer(struct lwan_tpl *tpl, struct strbuf *buf, void *variables);
+/* Calls flush_func() after each item of a sequence, so that the output can
+ * be sent as it's generated.  It runs in @coro, which it may yield or
+ * abort: sequences still being iterated are freed with @coro's deferred
+ * functions.  */
+struct strbuf	*lwan_tpl_apply_with_flush(struct lwan_tpl *tpl, struct strbuf *buf,
+		    void *variables, struct coro *coro,
+		    void (*flush_func)(struct strbuf *buf, void *data), void *data);
 void	 	 lwan_tpl_free(struct lwan_tpl *tpl);
 
@@ -24,13 +24,19 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/epoll.h>
 
 #include "lwan-private.h"
 
+struct lwan_thread_deadline {
+    uint64_t when_ms;
+    struct lwan_connection *conn;
+};
+
 struct death_queue_t {
-    const struct lwan *lwan;
+    struct lwan *lwan;
     struct lwan_connection *conns;
     struct lwan_connection head;
     unsigned time;
@@ -42,6 +48,11 @@ static const uint32_t events_by_write_flag[] = {
     EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLET
 };
 
+/* Set in epoll_event.data for file descriptors other than the client
+ * socket (e.g. upstream connections) that a coroutine is waiting on.
+ * struct lwan_connection is 32-byte aligned, so the bit is free.  */
+#define AWAITED_FD_TAG ((uintptr_t)1)
+
 static inline int death_queue_node_to_idx(struct death_queue_t *dq,
     struct lwan_connection *conn)
 {
@@ -81,6 +92,30 @@ static bool death_queue_empty(struct death_queue_t *dq)
     return dq->head.next < 0;
 }
 
+static unsigned int
+death_queue_keep_alive_timeout(const struct death_queue_t *dq)
+{
+    const struct lwan *lwan = dq->lwan;
+    unsigned int soft_limit = lwan->overload.soft_limit;
+    unsigned int connections, max_connections;
+
+    if (LIKELY(!soft_limit))
+        return dq->keep_alive_timeout;
+
+    connections = ATOMIC_READ(lwan->overload.connections);
+    if (connections <= soft_limit || dq->keep_alive_timeout <= 1)
+        return dq->keep_alive_timeout;
+
+    /* Shrink the timeout linearly as the number of connections goes from
+     * the soft limit to the maximum.  */
+    max_connections = lwan->config.max_connections;
+    if (connections >= max_connections || max_connections == soft_limit)
+        return 1;
+
+    return 1 + (dq->keep_alive_timeout - 1u) * (max_connections - connections)
+        / (max_connections - soft_limit);
+}
+
 static void death_queue_move_to_last(struct death_queue_t *dq,
     struct lwan_connection *conn)
 {
@@ -94,14 +129,14 @@ static void death_queue_move_to_last(struct death_queue_t *dq,
      */
     conn->time_to_die = dq->time;
     if (conn->flags & (CONN_KEEP_ALIVE | CONN_SHOULD_RESUME_CORO))
-        conn->time_to_die += dq->keep_alive_timeout;
+        conn->time_to_die += death_queue_keep_alive_timeout(dq);
 
     death_queue_remove(dq, conn);
     death_queue_insert(dq, conn);
 }
 
 static void
-death_queue_init(struct death_queue_t *dq, const struct lwan *lwan)
+death_queue_init(struct death_queue_t *dq, struct lwan *lwan)
 {
     dq->lwan = lwan;
     dq->conns = lwan->conns;
@@ -116,17 +151,38 @@ death_queue_epoll_timeout(struct death_queue_t *dq)
     return death_queue_empty(dq) ? -1 : 1000;
 }
 
+static void
+deadlines_remove(struct lwan_thread *t, const struct lwan_connection *conn)
+{
+    for (unsigned int i = 0; i < t->deadlines.count; i++) {
+        if (t->deadlines.entries[i].conn == conn) {
+            t->deadlines.entries[i] = t->deadlines.entries[--t->deadlines.count];
+            return;
+        }
+    }
+}
+
 static ALWAYS_INLINE void
 destroy_coro(struct death_queue_t *dq, struct lwan_connection *conn)
 {
     death_queue_remove(dq, conn);
+    /* Otherwise, the next connection with this fd could be woken up by
+     * a deadline it never set.  */
+    if (UNLIKELY(conn->thread->deadlines.count) && (conn->flags & CONN_AWAITING_FD))
+        deadlines_remove(conn->thread, conn);
     if (LIKELY(conn->coro)) {
         coro_free(conn->coro);
         conn->coro = NULL;
     }
     if (conn->flags & CONN_IS_ALIVE) {
+        int fd = lwan_connection_get_fd(dq->lwan, conn);
+
         conn->flags &= ~CONN_IS_ALIVE;
-        close(lwan_connection_get_fd(dq->lwan, conn));
+
+        /* Before closing, as the main thread may reuse the fd right away */
+        if (dq->lwan->overload.enabled)
+            lwan_overload_release_client(dq->lwan, fd);
+        close(fd);
     }
 }
 
@@ -211,8 +267,19 @@ resume_coro_if_needed(struct death_queue_t *dq, struct lwan_connection *conn,
         return;
     }
 
+    /* Waiting on another file descriptor; lwan_thread_await_fd() has
+     * already set up the events for the client socket.  */
+    if (conn->flags & CONN_AWAITING_FD)
+        return;
+
     bool write_events;
     if (conn->flags & CONN_MUST_READ) {
+        /* Possibly still waiting for the first request (it's read before
+         * anything is known about the socket), in which case nothing has
+         * to change; toggling CONN_WRITE_EVENTS regardless would have the
+         * next write wait for read events.  */
+        if (!(conn->flags & CONN_WRITE_EVENTS))
+            return;
         write_events = true;
     } else {
         bool should_resume_coro = (yield_result == CONN_CORO_MAY_RESUME);
@@ -250,6 +317,12 @@ death_queue_kill_waiting(struct death_queue_t *dq)
         if (conn->time_to_die > dq->time)
             return;
 
+        /* Parked coroutines are waiting on the server, not the client.  */
+        if (conn->flags & CONN_PARKED) {
+            death_queue_move_to_last(dq, conn);
+            continue;
+        }
+
         destroy_coro(dq, conn);
     }
 
@@ -257,6 +330,30 @@ death_queue_kill_waiting(struct death_queue_t *dq)
     dq->time = 0;
 }
 
+static void
+death_queue_close_idle(struct death_queue_t *dq, struct lwan_thread *t)
+{
+    const struct lwan *lwan = dq->lwan;
+    int idx = dq->head.next;
+
+    /* Connections at the head of the queue saw activity the longest time
+     * ago.  Only look at a few of them on each iteration of the loop, and
+     * leave the ones handling a request alone.  */
+    for (int scanned = 0; idx >= 0 && scanned < 64; scanned++) {
+        struct lwan_connection *conn = &dq->conns[idx];
+
+        if (ATOMIC_READ(lwan->overload.connections) <= lwan->overload.soft_limit)
+            return;
+
+        idx = conn->next;
+        if (conn->flags & CONN_IN_FLIGHT)
+            continue;
+
+        destroy_coro(dq, conn);
+        ATOMIC_INC(t->overload.closed_idle);
+    }
+}
+
 static void
 death_queue_kill_all(struct death_queue_t *dq)
 {
@@ -288,7 +385,8 @@ spawn_coro(struct lwan_connection *conn,
     assert(!(conn->flags & CONN_SHOULD_RESUME_CORO));
 
     conn->coro = coro_new(switcher, process_request_coro, conn);
-    conn->flags = CONN_IS_ALIVE | CONN_SHOULD_RESUME_CORO;
+    conn->flags = (conn->flags & (CONN_LISTENER_MAX << CONN_LISTENER_SHIFT))
+                | CONN_IS_ALIVE | CONN_SHOULD_RESUME_CORO;
 
     death_queue_insert(dq, conn);
 }
@@ -319,6 +417,101 @@ watch_client(int epoll_fd, int fd, struct lwan_connection *conns)
     return &conns[fd];
 }
 
+static ALWAYS_INLINE uint64_t
+monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int
+busy_poll_wait(struct lwan_thread *t, int epoll_fd, struct epoll_event *events,
+    int max_events, int timeout)
+{
+    const uint64_t start = monotonic_ns();
+    const uint64_t deadline = start + t->lwan->config.busy_poll_budget * 1000ull;
+    uint64_t now;
+    int n_fds;
+
+    /* Trade CPU time for latency: keep polling without blocking for a
+     * while, so that the kernel doesn't have to wake this thread up when
+     * something happens.  */
+    do {
+        n_fds = epoll_wait(epoll_fd, events, max_events, 0);
+        now = monotonic_ns();
+
+        if (n_fds) {
+            ATOMIC_AAF(&t->busy_poll.spin_ns, now - start);
+            if (n_fds > 0)
+                ATOMIC_INC(t->busy_poll.spin_hits);
+            return n_fds;
+        }
+    } while (now < deadline);
+
+    ATOMIC_AAF(&t->busy_poll.spin_ns, now - start);
+
+    n_fds = epoll_wait(epoll_fd, events, max_events, timeout);
+
+    ATOMIC_AAF(&t->busy_poll.sleep_ns, monotonic_ns() - now);
+    ATOMIC_INC(t->busy_poll.sleeps);
+
+    return n_fds;
+}
+
+static int
+deadlines_epoll_timeout(const struct lwan_thread *t)
+{
+    const uint64_t now = monotonic_ns() / 1000000;
+    uint64_t earliest = UINT64_MAX;
+
+    for (unsigned int i = 0; i < t->deadlines.count; i++) {
+        if (t->deadlines.entries[i].when_ms < earliest)
+            earliest = t->deadlines.entries[i].when_ms;
+    }
+
+    if (earliest <= now)
+        return 0;
+    return earliest - now > INT32_MAX ? INT32_MAX : (int)(earliest - now);
+}
+
+static void
+deadlines_expire(struct lwan_thread *t, struct death_queue_t *dq, int epoll_fd)
+{
+    const uint64_t now = monotonic_ns() / 1000000;
+
+    for (unsigned int i = 0; i < t->deadlines.count;) {
+        struct lwan_connection *conn = t->deadlines.entries[i].conn;
+
+        if (t->deadlines.entries[i].when_ms > now) {
+            i++;
+            continue;
+        }
+
+        /* Removed before resuming, as the coroutine might add (or look
+         * for) entries.  */
+        t->deadlines.entries[i] = t->deadlines.entries[--t->deadlines.count];
+
+        if (!conn->coro || !(conn->flags & CONN_AWAITING_FD))
+            continue;
+
+        resume_coro_if_needed(dq, conn, epoll_fd);
+        if (conn->coro)
+            death_queue_move_to_last(dq, conn);
+    }
+}
+
+static void
+wake_sse_subscriber(struct lwan_connection *conn, void *data)
+{
+    struct death_queue_t *dq = data;
+
+    resume_coro_if_needed(dq, conn, conn->thread->epoll_fd);
+    if (conn->coro)
+        death_queue_move_to_last(dq, conn);
+}
+
 static void *
 thread_io_loop(void *data)
 {
@@ -326,6 +519,7 @@ thread_io_loop(void *data)
     const int epoll_fd = t->epoll_fd;
     const int read_pipe_fd = t->pipe_fd[0];
     const int max_events = min((int)t->lwan->thread.max_fd, 1024);
+    const bool busy_poll = t->lwan->config.busy_poll > 0;
     struct lwan *lwan = t->lwan;
     struct lwan_connection *conns = lwan->conns;
     struct epoll_event *events;
@@ -345,8 +539,27 @@ thread_io_loop(void *data)
     pthread_barrier_wait(&lwan->thread.barrier);
 
     for (;;) {
-        switch (n_fds = epoll_wait(epoll_fd, events, max_events,
-                                   death_queue_epoll_timeout(&dq))) {
+        int timeout = death_queue_epoll_timeout(&dq);
+        bool deadline_timeout = false;
+
+        if (UNLIKELY(t->deadlines.count)) {
+            int deadline = deadlines_epoll_timeout(t);
+
+            if (timeout < 0 || deadline < timeout) {
+                timeout = deadline;
+                deadline_timeout = true;
+            }
+        }
+
+        ATOMIC_INC(t->epoch);
+        if (busy_poll) {
+            n_fds = busy_poll_wait(t, epoll_fd, events, max_events, timeout);
+        } else {
+            n_fds = epoll_wait(epoll_fd, events, max_events, timeout);
+        }
+        ATOMIC_INC(t->epoch);
+
+        switch (n_fds) {
         case -1:
             switch (errno) {
             case EBADF:
@@ -355,7 +568,9 @@ thread_io_loop(void *data)
             }
             continue;
         case 0: /* timeout: shutdown waiting sockets */
-            death_queue_kill_waiting(&dq);
+            /* Waking up for a deadline doesn't mean a second went by.  */
+            if (!deadline_timeout)
+                death_queue_kill_waiting(&dq);
             break;
         default: /* activity in some of this poller's file descriptor */
             update_date_cache(t);
@@ -368,6 +583,16 @@ thread_io_loop(void *data)
                     if (LIKELY(cmd >= 0)) {
                         conn = watch_client(epoll_fd, cmd, conns);
                         spawn_coro(conn, &switcher, &dq);
+
+                        /* Most clients send the request right after the
+                         * handshake (and with TCP_DEFER_ACCEPT it's already
+                         * there): try reading it now rather than waiting
+                         * for another trip through epoll_wait().  If it's
+                         * not there yet, the coroutine yields asking for
+                         * more data, just like with a partial request.  */
+                        resume_coro_if_needed(&dq, conn, epoll_fd);
+                        if (!(conn->flags & CONN_IS_ALIVE))
+                            continue;
                     } else if (UNLIKELY(cmd == -1)) {
                         continue;
                     } else if (UNLIKELY(cmd == -2)) {
@@ -376,6 +601,21 @@ thread_io_loop(void *data)
                         lwan_status_debug("Unknown command received, ignored");
                         continue;
                     }
+                } else if (ep_event->data.ptr == t->sse) {
+                    lwan_sse_fan_out(t, wake_sse_subscriber, &dq);
+                    continue;
+                } else if (UNLIKELY((uintptr_t)ep_event->data.ptr & AWAITED_FD_TAG)) {
+                    conn = (struct lwan_connection *)
+                        ((uintptr_t)ep_event->data.ptr & ~AWAITED_FD_TAG);
+
+                    /* Hangups are reported to the coroutine by the next
+                     * read or write on that file descriptor.  Stale events
+                     * (the coroutine went away or stopped waiting) are
+                     * ignored: the awaited fd is armed with EPOLLONESHOT. */
+                    if (!conn->coro || !(conn->flags & CONN_AWAITING_FD))
+                        continue;
+
+                    resume_coro_if_needed(&dq, conn, epoll_fd);
                 } else {
                     conn = ep_event->data.ptr;
                     if (UNLIKELY(ep_event->events & (EPOLLRDHUP | EPOLLHUP))) {
@@ -389,11 +629,21 @@ thread_io_loop(void *data)
                 death_queue_move_to_last(&dq, conn);
             }
         }
+
+        if (UNLIKELY(t->deadlines.count))
+            deadlines_expire(t, &dq, epoll_fd);
+
+        /* Only after all events have been handled, as closing connections
+         * that are still in the events array isn't safe.  */
+        if (UNLIKELY(lwan->overload.soft_limit
+                && ATOMIC_READ(lwan->overload.connections) > lwan->overload.soft_limit))
+            death_queue_close_idle(&dq, t);
     }
 
 epoll_fd_closed:
     pthread_barrier_wait(&lwan->thread.barrier);
 
+
     death_queue_kill_all(&dq);
     free(events);
 
@@ -434,10 +684,112 @@ create_thread(struct lwan *l, struct lwan_thread *thread)
         lwan_status_critical_perror("pthread_attr_destroy");
 }
 
+/* Don't let a writable client socket (which is level-triggered) wake
+ * a coroutine up over and over while it's waiting on something else.  */
+static void
+stop_write_events(struct lwan_connection *conn)
+{
+    const int epoll_fd = conn->thread->epoll_fd;
+
+    if (conn->flags & CONN_WRITE_EVENTS) {
+        struct epoll_event client_event = {
+            .events = events_by_write_flag[1],
+            .data.ptr = conn
+        };
+        int client_fd = lwan_connection_get_fd(conn->thread->lwan, conn);
+
+        if (UNLIKELY(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client_fd, &client_event) < 0)) {
+            lwan_status_perror("epoll_ctl");
+            coro_yield(conn->coro, CONN_CORO_ABORT);
+            __builtin_unreachable();
+        }
+        conn->flags &= ~CONN_WRITE_EVENTS;
+    }
+}
+
 void
-lwan_thread_add_client(struct lwan_thread *t, int fd)
+lwan_thread_await_fd(struct lwan_connection *conn, int fd, uint32_t events)
 {
-    t->lwan->conns[fd].flags = 0;
+    const int epoll_fd = conn->thread->epoll_fd;
+    struct epoll_event event = {
+        .events = events | EPOLLONESHOT,
+        .data.ptr = (void *)((uintptr_t)conn | AWAITED_FD_TAG)
+    };
+
+    if (UNLIKELY(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0)) {
+        if (errno != ENOENT || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            lwan_status_perror("epoll_ctl");
+            coro_yield(conn->coro, CONN_CORO_ABORT);
+            __builtin_unreachable();
+        }
+    }
+
+    stop_write_events(conn);
+
+    conn->flags |= CONN_AWAITING_FD | CONN_SHOULD_RESUME_CORO;
+    coro_yield(conn->coro, CONN_CORO_MAY_RESUME);
+    conn->flags &= ~CONN_AWAITING_FD;
+}
+
+/* Sleeps until the I/O thread is told to wake this coroutine up by
+ * something else in the server (or the client sends something).  Parked
+ * connections aren't subject to the keep-alive timeout.  */
+void
+lwan_thread_park(struct lwan_connection *conn)
+{
+    stop_write_events(conn);
+
+    conn->flags |= CONN_AWAITING_FD | CONN_PARKED | CONN_SHOULD_RESUME_CORO;
+    coro_yield(conn->coro, CONN_CORO_MAY_RESUME);
+    conn->flags &= ~(CONN_AWAITING_FD | CONN_PARKED);
+}
+
+/* Like lwan_thread_await_fd(), but also wakes up once the deadline (in
+ * milliseconds, CLOCK_MONOTONIC; 0 for none) passes, returning false.  */
+bool
+lwan_thread_await_fd_until(struct lwan_connection *conn, int fd,
+                           uint32_t events, uint64_t deadline_ms)
+{
+    struct lwan_thread *t = conn->thread;
+
+    if (!deadline_ms) {
+        lwan_thread_await_fd(conn, fd, events);
+        return true;
+    }
+
+    if (monotonic_ns() / 1000000 >= deadline_ms)
+        return false;
+
+    if (UNLIKELY(t->deadlines.count == t->deadlines.size)) {
+        unsigned int size = t->deadlines.size ? t->deadlines.size * 2 : 16;
+        struct lwan_thread_deadline *entries = reallocarray(t->deadlines.entries,
+            size, sizeof(*entries));
+
+        if (UNLIKELY(!entries)) {
+            coro_yield(conn->coro, CONN_CORO_ABORT);
+            __builtin_unreachable();
+        }
+
+        t->deadlines.entries = entries;
+        t->deadlines.size = size;
+    }
+    t->deadlines.entries[t->deadlines.count++] = (struct lwan_thread_deadline) {
+        .when_ms = deadline_ms,
+        .conn = conn,
+    };
+
+    lwan_thread_await_fd(conn, fd, events);
+
+    /* Woken up by the fd: the entry is still there.  */
+    deadlines_remove(t, conn);
+
+    return monotonic_ns() / 1000000 < deadline_ms;
+}
+
+void
+lwan_thread_add_client(struct lwan_thread *t, int fd, unsigned int listener)
+{
+    t->lwan->conns[fd].flags = listener << CONN_LISTENER_SHIFT;
     t->lwan->conns[fd].thread = t;
 
     if (UNLIKELY(write(t->pipe_fd[1], &fd, sizeof(int)) < 0))
@@ -508,6 +860,11 @@ lwan_thread_shutdown(struct lwan *l)
 
         lwan_status_debug("Waiting for thread %d to finish", i);
         pthread_join(l->thread.threads[i].self, NULL);
+
+        free(t->deadlines.entries);
+        lwan_conn_pool_free(t->conn_pool);
+        lwan_sse_thread_free(t->sse);
+        lwan_http_authorize_cache_free(t->auth_cache);
     }
 
     free(l->thread.threads);
@@ -22,8 +22,10 @@
 #include <ctype.h>
 #include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <libproc.h>
 #include <limits.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
@@ -36,6 +38,7 @@
 
 #include "lwan-config.h"
 #include "lwan-http-authorize.h"
+#include "lwan-rate-limit.h"
 
 #if defined(HAVE_LUA)
 #include "lwan-lua.h"
@@ -50,6 +53,12 @@ static const struct lwan_config default_config = {
     .allow_cors = false,
     .expires = 1 * ONE_WEEK,
     .n_threads = 0,
+    .busy_poll = 0,
+    .busy_poll_budget = 50,
+    .max_connections = 0,
+    .max_connections_per_ip = 0,
+    .max_requests_per_thread = 0,
+    .overload_threshold = 80,
     .max_post_data_size = 10 * DEFAULT_BUFFER_SIZE,
     .allow_post_temp_file = false,
 };
@@ -119,38 +128,290 @@ static const struct lwan_module *lwan_module_find(struct lwan *l, const char *na
     return module;
 }
 
+struct url_map_instance {
+    const struct lwan_module *module;
+    void *data;
+    int refs;
+};
+
+struct url_map_node {
+    struct lwan_url_map url_map;
+    struct url_map_instance *instance;
+};
+
+static pthread_mutex_t url_map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+    pthread_mutex_t lock;
+    struct lwan_url_map_generation *head;
+} retired_url_maps = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static struct url_map_instance *
+url_map_instance_new(const struct lwan_module *module, void *data)
+{
+    struct url_map_instance *instance = malloc(sizeof(*instance));
+
+    if (!instance)
+        lwan_status_critical_perror("Could not allocate module instance");
+
+    instance->module = module;
+    instance->data = data;
+    instance->refs = 1;
+
+    return instance;
+}
+
+static void url_map_instance_unref(struct url_map_instance *instance)
+{
+    if (ATOMIC_DEC(instance->refs))
+        return;
+
+    if (instance->module->shutdown)
+        instance->module->shutdown(instance->data);
+    free(instance);
+}
+
 static void destroy_urlmap(void *data)
 {
-    struct lwan_url_map *url_map = data;
+    struct url_map_node *node = data;
+    struct lwan_url_map *url_map = &node->url_map;
 
-    if (url_map->module) {
-        const struct lwan_module *module = url_map->module;
-        if (module->shutdown)
-            module->shutdown(url_map->data);
+    if (node->instance) {
+        url_map_instance_unref(node->instance);
     } else if (url_map->data && url_map->flags & HANDLER_DATA_IS_HASH_TABLE) {
         hash_free(url_map->data);
     }
 
     free(url_map->authorization.realm);
     free(url_map->authorization.password_file);
+    lwan_rate_limit_free(url_map->rate_limit.limiter);
+    free(url_map->rate_limit.header);
     free((char *)url_map->prefix);
-    free(url_map);
+    free(node);
 }
 
-static struct lwan_url_map *add_url_map(struct lwan_trie *t, const char *prefix, const struct lwan_url_map *map)
+static struct lwan_url_map *add_url_map(struct lwan_trie *t, const char *prefix,
+    const struct lwan_url_map *map, struct url_map_instance *instance)
 {
-    struct lwan_url_map *copy = malloc(sizeof(*copy));
+    struct url_map_node *copy = malloc(sizeof(*copy));
 
     if (!copy)
         lwan_status_critical_perror("Could not copy URL map");
 
-    memcpy(copy, map, sizeof(*copy));
+    memcpy(&copy->url_map, map, sizeof(*map));
+    copy->instance = instance;
+
+    copy->url_map.prefix = strdup(prefix ? prefix : copy->url_map.prefix);
+    copy->url_map.prefix_len = strlen(copy->url_map.prefix);
+    lwan_trie_add(t, copy->url_map.prefix, copy);
+
+    return &copy->url_map;
+}
+
+static struct lwan_url_map_generation *url_map_generation_new(void)
+{
+    struct lwan_url_map_generation *gen = calloc(1, sizeof(*gen));
+
+    if (!gen)
+        lwan_status_critical_perror("Could not allocate URL map");
 
-    copy->prefix = strdup(prefix ? prefix : copy->prefix);
-    copy->prefix_len = strlen(copy->prefix);
-    lwan_trie_add(t, copy->prefix, copy);
+    gen->instances = hash_str_new(free,
+        (void (*)(void *))url_map_instance_unref);
+    if (!gen->instances)
+        lwan_status_critical("Could not allocate module instance table");
 
-    return copy;
+    return gen;
+}
+
+static struct lwan_url_map_listener *
+url_map_generation_add_listener(struct lwan_url_map_generation *gen,
+    const char *address)
+{
+    struct lwan_url_map_listener *listeners, *listener;
+
+    if (gen->n_listeners > CONN_LISTENER_MAX)
+        return NULL;
+
+    listeners = realloc(gen->listeners,
+        (gen->n_listeners + 1) * sizeof(*listeners));
+    if (!listeners)
+        lwan_status_critical_perror("Could not allocate listener");
+
+    gen->listeners = listeners;
+    listener = &listeners[gen->n_listeners++];
+
+    if (!lwan_trie_init(&listener->trie, destroy_urlmap))
+        lwan_status_critical("Could not initialize trie");
+    listener->address = strdup(address);
+    listener->first_thread = listener->last_thread = -1;
+    listener->defer_accept = 0;
+    listener->fast_open = 5;
+
+    return listener;
+}
+
+static void url_map_generation_destroy(struct lwan_url_map_generation *gen)
+{
+    for (unsigned short i = 0; i < gen->n_listeners; i++) {
+        lwan_trie_destroy(&gen->listeners[i].trie);
+        free(gen->listeners[i].address);
+    }
+    free(gen->listeners);
+
+    hash_free(gen->instances);
+    free(gen->refs);
+    free(gen->epochs);
+    free(gen);
+}
+
+void lwan_url_map_generation_release(unsigned int *refs)
+{
+    (*refs)--;
+}
+
+static void url_map_generation_publish(struct lwan *l,
+    struct lwan_url_map_generation *gen)
+{
+    struct lwan_url_map_generation *old;
+    size_t n_threads = l->thread.count;
+
+    if (posix_memalign((void **)&gen->refs, 64,
+                       n_threads * URL_MAP_REFS_STRIDE * sizeof(*gen->refs)))
+        lwan_status_critical_perror("posix_memalign");
+    memset(gen->refs, 0, n_threads * URL_MAP_REFS_STRIDE * sizeof(*gen->refs));
+
+    gen->epochs = calloc(n_threads, sizeof(*gen->epochs));
+    if (!gen->epochs)
+        lwan_status_critical_perror("calloc");
+
+    do {
+        old = l->url_map;
+    } while (!__sync_bool_compare_and_swap(&l->url_map, old, gen));
+
+    if (!old)
+        return;
+
+    /* Requests that started before the swap might still be using the
+     * old generation; snapshot the epoch of every I/O thread so that the
+     * reaper knows when it's safe to look at the reference counters.  */
+    for (size_t i = 0; i < n_threads; i++)
+        old->epochs[i] = ATOMIC_READ(l->thread.threads[i].epoch);
+
+    pthread_mutex_lock(&retired_url_maps.lock);
+    old->next_retired = retired_url_maps.head;
+    retired_url_maps.head = old;
+    pthread_mutex_unlock(&retired_url_maps.lock);
+}
+
+static bool url_map_generation_is_idle(const struct lwan *l,
+    const struct lwan_url_map_generation *gen)
+{
+    for (unsigned short i = 0; i < l->thread.count; i++) {
+        unsigned int epoch = gen->epochs[i];
+
+        /* An even epoch means the thread was handling events when the
+         * generation was replaced, and might have read the old pointer
+         * without bumping its counter yet.  Wait until it has gone back
+         * to epoll_wait() at least once.  */
+        if (!(epoch & 1) && ATOMIC_READ(l->thread.threads[i].epoch) == epoch)
+            return false;
+
+        if (ATOMIC_READ(gen->refs[i * URL_MAP_REFS_STRIDE]))
+            return false;
+    }
+
+    return true;
+}
+
+static bool url_map_generation_reap(void *data)
+{
+    struct lwan *l = data;
+    struct lwan_url_map_generation **gen, *reaped = NULL;
+    bool had_job = false;
+
+    pthread_mutex_lock(&retired_url_maps.lock);
+
+    for (gen = &retired_url_maps.head; *gen;) {
+        struct lwan_url_map_generation *cur = *gen;
+
+        if (url_map_generation_is_idle(l, cur)) {
+            *gen = cur->next_retired;
+            cur->next_retired = reaped;
+            reaped = cur;
+        } else {
+            gen = &cur->next_retired;
+        }
+    }
+
+    pthread_mutex_unlock(&retired_url_maps.lock);
+
+    while (reaped) {
+        struct lwan_url_map_generation *next = reaped->next_retired;
+
+        lwan_status_debug("Freeing URL map generation %p", reaped);
+        url_map_generation_destroy(reaped);
+        reaped = next;
+        had_job = true;
+    }
+
+    return had_job;
+}
+
+static void url_map_generation_reap_all(void)
+{
+    struct lwan_url_map_generation *gen = retired_url_maps.head;
+
+    while (gen) {
+        struct lwan_url_map_generation *next = gen->next_retired;
+
+        url_map_generation_destroy(gen);
+        gen = next;
+    }
+
+    retired_url_maps.head = NULL;
+}
+
+static char *url_map_instance_signature(const struct lwan_module *module,
+    const char *prefix, const struct hash *hash, const char *section,
+    size_t section_len)
+{
+    struct hash_iter iter;
+    struct strbuf signature;
+    const void *key, *value;
+    char *ret;
+
+    if (!strbuf_init(&signature))
+        return NULL;
+
+    strbuf_printf(&signature, "%p %s\n", module, prefix);
+    strbuf_append_str(&signature, section, section_len);
+
+    hash_iter_init(hash, &iter);
+    while (hash_iter_next(&iter, &key, &value))
+        strbuf_append_printf(&signature, "\n%s=%s", (const char *)key,
+            (const char *)value);
+
+    ret = strdup(strbuf_get_buffer(&signature));
+    strbuf_free(&signature);
+
+    return ret;
+}
+
+static struct url_map_instance *
+url_map_instance_find(struct lwan *l, struct lwan_url_map_generation *gen,
+    const char *signature)
+{
+    struct url_map_instance *instance;
+
+    instance = hash_find(gen->instances, signature);
+    if (!instance && l->url_map)
+        instance = hash_find(l->url_map->instances, signature);
+    if (instance)
+        ATOMIC_INC(instance->refs);
+
+    return instance;
 }
 
 static void parse_listener_prefix_authorization(struct config *c,
@@ -198,19 +459,83 @@ error:
     free(url_map->authorization.password_file);
 }
 
-static void parse_listener_prefix(struct config *c, struct config_line *l, struct lwan *lwan,
+static void parse_listener_prefix_rate_limit(struct config *c,
+                    struct config_line *l, struct lwan_url_map *url_map)
+{
+    long rate = 0, burst = 0, table_size = 1 << 16;
+    unsigned int period = 1;
+    char *header = NULL;
+
+    if (url_map->rate_limit.limiter) {
+        config_error(c, "Rate limit already specified");
+        return;
+    }
+
+    while (config_read_line(c, l)) {
+        switch (l->type) {
+        case CONFIG_LINE_TYPE_LINE:
+            if (streq(l->key, "rate")) {
+                rate = parse_long(l->value, 0);
+            } else if (streq(l->key, "period")) {
+                period = parse_time_period(l->value, 1);
+            } else if (streq(l->key, "burst")) {
+                burst = parse_long(l->value, 0);
+            } else if (streq(l->key, "table_size")) {
+                table_size = parse_long(l->value, table_size);
+            } else if (streq(l->key, "header")) {
+                free(header);
+                header = strdup(l->value);
+            } else {
+                config_error(c, "Unknown rate limit option: %s", l->key);
+                goto error;
+            }
+            break;
+
+        case CONFIG_LINE_TYPE_SECTION:
+            config_error(c, "Unexpected section: %s", l->key);
+            goto error;
+
+        case CONFIG_LINE_TYPE_SECTION_END:
+            if (rate <= 0 || burst < 0 || table_size <= 0) {
+                config_error(c, "Rate limit needs a positive rate, burst and table size");
+                goto error;
+            }
+
+            url_map->rate_limit.limiter = lwan_rate_limit_new((unsigned int)rate,
+                period, burst ? (unsigned int)burst : (unsigned int)rate,
+                (size_t)table_size);
+            if (!url_map->rate_limit.limiter) {
+                config_error(c, "Could not create rate limiter");
+                goto error;
+            }
+            url_map->rate_limit.header = header;
+            return;
+        }
+    }
+
+error:
+    free(header);
+}
+
+static void parse_listener_prefix(struct config *c, struct config_line *l,
+    struct lwan *lwan, struct lwan_url_map_generation *gen,
+    struct lwan_url_map_listener *listener,
     const struct lwan_module *module, void *handler)
 {
     struct lwan_url_map url_map = { };
+    struct url_map_instance *instance = NULL;
     struct hash *hash = hash_str_new(free, free);
     char *prefix = strdupa(l->value);
     struct config *isolated;
+    const char *section;
+    size_t section_len;
 
     isolated = config_isolate_section(c, l);
     if (!isolated) {
         config_error(c, "Could not isolate configuration file");
         goto out;
     }
+    section = config_isolated_section_text(isolated, &section_len);
 
     while (config_read_line(c, l)) {
       switch (l->type) {
@@ -243,6 +568,8 @@ static void parse_listener_prefix(struct config *c, struct config_line *l, struc
       case CONFIG_LINE_TYPE_SECTION:
           if (streq(l->key, "authorization")) {
               parse_listener_prefix_authorization(c, l, &url_map);
+          } else if (streq(l->key, "rate_limit")) {
+              parse_listener_prefix_rate_limit(c, l, &url_map);
           } else {
               if (!config_skip_section(c, l)) {
                   config_error(c, "Could not skip section");
@@ -277,13 +604,42 @@ add_map:
 
         hash = NULL;
     } else if (module && module->init_from_hash && module->handle) {
-        url_map.data = module->init_from_hash(prefix, hash);
-        if (module->parse_conf && !module->parse_conf(url_map.data, isolated)) {
-            const char *msg = config_last_error(isolated);
+        /* If this section didn't change since the configuration was last
+         * read, share the module instance (and whatever it has cached)
+         * with the generation being replaced.  */
+        char *signature = url_map_instance_signature(module, prefix, hash,
+            section, section_len);
 
-            config_error(c, "Error from module: %s", msg ? msg : "Unknown");
-            goto out;
+        if (signature)
+            instance = url_map_instance_find(lwan, gen, signature);
+
+        if (instance) {
+            lwan_status_debug("Reusing module instance for prefix %s", prefix);
+        } else {
+            void *data = module->init_from_hash(prefix, hash);
+
+            if (module->parse_conf && !module->parse_conf(data, isolated)) {
+                const char *msg = config_last_error(isolated);
+
+                config_error(c, "Error from module: %s", msg ? msg : "Unknown");
+
+                if (data && module->shutdown)
+                    module->shutdown(data);
+                free(signature);
+                goto out;
+            }
+
+            instance = url_map_instance_new(module, data);
+        }
+
+        if (signature) {
+            if (!hash_add_unique(gen->instances, signature, instance))
+                ATOMIC_INC(instance->refs);
+            else
+                free(signature);
         }
+
+        url_map.data = instance->data;
         url_map.handler = module->handle;
         url_map.flags |= module->flags;
         url_map.module = module;
@@ -292,48 +648,151 @@ add_map:
         goto out;
     }
 
-    add_url_map(&lwan->url_map_trie, prefix, &url_map);
+    add_url_map(&listener->trie, prefix, &url_map, instance);
+    url_map.rate_limit.limiter = NULL;
+    url_map.rate_limit.header = NULL;
 
 out:
+    lwan_rate_limit_free(url_map.rate_limit.limiter);
+    free(url_map.rate_limit.header);
     hash_free(hash);
     config_close(isolated);
 }
 
 void lwan_set_url_map(struct lwan *l, const struct lwan_url_map *map)
 {
-    lwan_trie_destroy(&l->url_map_trie);
-    if (UNLIKELY(!lwan_trie_init(&l->url_map_trie, destroy_urlmap)))
-        lwan_status_critical_perror("Could not initialize trie");
+    struct lwan_url_map_generation *gen = url_map_generation_new();
+
+    /* The map is installed in every listener (if more than one was
+     * declared in the configuration file); each module is initialized once
+     * per prefix, and its instance is shared by all of them.  */
+    for (unsigned short i = 0; i < l->url_map->n_listeners; i++) {
+        struct lwan_url_map_listener *listener = url_map_generation_add_listener(
+            gen, l->url_map->listeners[i].address);
+
+        listener->first_thread = l->url_map->listeners[i].first_thread;
+        listener->last_thread = l->url_map->listeners[i].last_thread;
+    }
 
     for (; map->prefix; map++) {
-        struct lwan_url_map *copy = add_url_map(&l->url_map_trie, NULL, map);
+        struct url_map_instance *instance = NULL;
 
-        if (UNLIKELY(!copy))
-            continue;
+        if (map->module && map->module->init) {
+            instance = url_map_instance_new(map->module,
+                map->module->init(map->prefix, map->args));
+        }
 
-        if (copy->module && copy->module->init) {
-            copy->data = copy->module->init(map->prefix, copy->args);
-            copy->flags = copy->module->flags;
-            copy->handler = copy->module->handle;
-        } else {
-            copy->flags = HANDLER_PARSE_MASK;
+        if (gen->n_listeners > 1 && map->rate_limit.limiter) {
+            lwan_status_critical("Rate limiter for prefix %s can't be shared "
+                "by %d listeners", map->prefix, gen->n_listeners);
+        }
+
+        for (unsigned short i = 0; i < gen->n_listeners; i++) {
+            struct lwan_url_map *copy;
+
+            copy = add_url_map(&gen->listeners[i].trie, NULL, map, instance);
+            if (i) {
+                /* Freed along with each copy.  */
+                if (map->authorization.realm)
+                    copy->authorization.realm = strdup(map->authorization.realm);
+                if (map->authorization.password_file)
+                    copy->authorization.password_file =
+                        strdup(map->authorization.password_file);
+                if (instance)
+                    ATOMIC_INC(instance->refs);
+            }
+
+            if (instance) {
+                copy->data = instance->data;
+                copy->flags = copy->module->flags;
+                copy->handler = copy->module->handle;
+            } else {
+                copy->flags = HANDLER_PARSE_MASK;
+            }
         }
     }
+
+    pthread_mutex_lock(&url_map_lock);
+    url_map_generation_publish(l, gen);
+    pthread_mutex_unlock(&url_map_lock);
+}
+
+static bool parse_thread_range(const char *value, int *first, int *last)
+{
+    char dash;
+
+    switch (sscanf(value, "%d%c%d", first, &dash, last)) {
+    case 1:
+        *last = *first;
+        break;
+    case 3:
+        if (dash != '-')
+            return false;
+        break;
+    default:
+        return false;
+    }
+
+    return *first >= 0 && *first <= *last;
 }
 
-static void parse_listener(struct config *c, struct config_line *l, struct lwan *lwan)
+static void parse_listener(struct config *c, struct config_line *l,
+    struct lwan *lwan, struct lwan_config *config,
+    struct lwan_url_map_generation *gen)
 {
-    free(lwan->config.listener);
-    lwan->config.listener = strdup(l->value);
+    struct lwan_url_map_listener *listener;
+
+    /* The first listener is the one reported in the configuration struct,
+     * for compatibility with programs that only expect one.  */
+    if (!gen->n_listeners) {
+        free(config->listener);
+        config->listener = strdup(l->value);
+    }
+
+    for (unsigned short i = 0; i < gen->n_listeners; i++) {
+        if (streq(gen->listeners[i].address, l->value)) {
+            config_error(c, "Listener %s declared more than once", l->value);
+            return;
+        }
+    }
+
+    listener = url_map_generation_add_listener(gen, l->value);
+    if (!listener) {
+        config_error(c, "At most %d listeners are supported",
+            CONN_LISTENER_MAX + 1);
+        return;
+    }
 
     while (config_read_line(c, l)) {
         switch (l->type) {
         case CONFIG_LINE_TYPE_LINE:
+            if (streq(l->key, "threads")) {
+                if (!parse_thread_range(l->value, &listener->first_thread,
+                                        &listener->last_thread)) {
+                    config_error(c, "Invalid thread range: %s", l->value);
+                    return;
+                }
+                continue;
+            }
+            if (streq(l->key, "defer_accept")) {
+                listener->defer_accept = parse_time_period(l->value, 0);
+                continue;
+            }
+            if (streq(l->key, "fast_open")) {
+                listener->fast_open = parse_int(l->value, listener->fast_open);
+                if (listener->fast_open < 0) {
+                    config_error(c, "Invalid TCP Fast Open queue length: %s",
+                        l->value);
+                    return;
+                }
+                continue;
+            }
+
             config_error(c, "Expecting prefix section");
             return;
         case CONFIG_LINE_TYPE_SECTION:
             if (streq(l->key, "prefix")) {
-                parse_listener_prefix(c, l, lwan, NULL, NULL);
+                parse_listener_prefix(c, l, lwan, gen, listener, NULL, NULL);
                 continue;
             }
 
@@ -342,7 +801,8 @@ static void parse_listener(struct config *c, struct config_line *l, struct lwan
 
                 void *handler = find_handler_symbol(l->key);
                 if (handler) {
-                    parse_listener_prefix(c, l, lwan, NULL, handler);
+                    parse_listener_prefix(c, l, lwan, gen, listener, NULL,
+                                          handler);
                     continue;
                 }
 
@@ -352,7 +812,8 @@ static void parse_listener(struct config *c, struct config_line *l, struct lwan
 
             const struct lwan_module *module = lwan_module_find(lwan, l->key);
             if (module) {
-                parse_listener_prefix(c, l, lwan, module, NULL);
+                parse_listener_prefix(c, l, lwan, gen, listener, module,
+                                      NULL);
                 continue;
             }
 
@@ -386,76 +847,102 @@ out:
     return "lwan.conf";
 }
 
-static bool setup_from_config(struct lwan *lwan, const char *path)
+static bool setup_from_config(struct lwan *lwan, struct lwan_config *config,
+    struct lwan_url_map_generation *gen, const char *path, bool reloading)
 {
     struct config *conf;
     struct config_line line;
     bool has_listener = false;
-    char path_buf[PATH_MAX];
+    bool ret = true;
 
-    if (!path)
-        path = get_config_path(path_buf);
     lwan_status_info("Loading configuration file: %s", path);
 
     conf = config_open(path);
     if (!conf)
         return false;
 
-    if (!lwan_trie_init(&lwan->url_map_trie, destroy_urlmap))
-        return false;
-
     while (config_read_line(conf, &line)) {
         switch (line.type) {
         case CONFIG_LINE_TYPE_LINE:
             if (streq(line.key, "keep_alive_timeout")) {
-                lwan->config.keep_alive_timeout = (unsigned short)parse_long(line.value,
+                config->keep_alive_timeout = (unsigned short)parse_long(line.value,
                             default_config.keep_alive_timeout);
             } else if (streq(line.key, "quiet")) {
-                lwan->config.quiet = parse_bool(line.value,
+                config->quiet = parse_bool(line.value,
                             default_config.quiet);
             } else if (streq(line.key, "reuse_port")) {
-                lwan->config.reuse_port = parse_bool(line.value,
+                config->reuse_port = parse_bool(line.value,
                             default_config.reuse_port);
             } else if (streq(line.key, "proxy_protocol")) {
-                lwan->config.proxy_protocol = parse_bool(line.value,
+                config->proxy_protocol = parse_bool(line.value,
                             default_config.proxy_protocol);
             } else if (streq(line.key, "allow_cors")) {
-                lwan->config.allow_cors = parse_bool(line.value,
+                config->allow_cors = parse_bool(line.value,
                             default_config.allow_cors);
             } else if (streq(line.key, "expires")) {
-                lwan->config.expires = parse_time_period(line.value,
+                config->expires = parse_time_period(line.value,
                             default_config.expires);
             } else if (streq(line.key, "error_template")) {
-                free(lwan->config.error_template);
-                lwan->config.error_template = strdup(line.value);
+                free(config->error_template);
+                config->error_template = strdup(line.value);
             } else if (streq(line.key, "threads")) {
                 long n_threads = parse_long(line.value, default_config.n_threads);
                 if (n_threads < 0)
                     config_error(conf, "Invalid number of threads: %d", n_threads);
-                lwan->config.n_threads = (unsigned short int)n_threads;
+                config->n_threads = (unsigned short int)n_threads;
             } else if (streq(line.key, "max_post_data_size")) {
                 long max_post_data_size = parse_long(line.value, (long)default_config.max_post_data_size);
                 if (max_post_data_size < 0)
                     config_error(conf, "Negative maximum post data size");
                 else if (max_post_data_size > 128 * 1<<20)
                     config_error(conf, "Maximum post data can't be over 128MiB");
-                lwan->config.max_post_data_size = (size_t)max_post_data_size;
+                config->max_post_data_size = (size_t)max_post_data_size;
+            } else if (streq(line.key, "busy_poll")) {
+                long busy_poll = parse_long(line.value, default_config.busy_poll);
+                if (busy_poll < 0)
+                    config_error(conf, "Invalid busy poll period: %d", busy_poll);
+                config->busy_poll = (unsigned int)busy_poll;
+            } else if (streq(line.key, "busy_poll_budget")) {
+                long budget = parse_long(line.value, default_config.busy_poll_budget);
+                if (budget < 0)
+                    config_error(conf, "Invalid busy poll budget: %d", budget);
+                config->busy_poll_budget = (unsigned int)budget;
+            } else if (streq(line.key, "max_connections")) {
+                long max = parse_long(line.value, default_config.max_connections);
+                if (max < 0)
+                    config_error(conf, "Invalid maximum number of connections: %d", max);
+                config->max_connections = (unsigned int)max;
+            } else if (streq(line.key, "max_connections_per_ip")) {
+                long max = parse_long(line.value, default_config.max_connections_per_ip);
+                if (max < 0)
+                    config_error(conf, "Invalid maximum number of connections per IP: %d", max);
+                config->max_connections_per_ip = (unsigned int)max;
+            } else if (streq(line.key, "max_requests_per_thread")) {
+                long max = parse_long(line.value, default_config.max_requests_per_thread);
+                if (max < 0)
+                    config_error(conf, "Invalid maximum number of requests per thread: %d", max);
+                config->max_requests_per_thread = (unsigned int)max;
+            } else if (streq(line.key, "overload_threshold")) {
+                long threshold = parse_long(line.value, default_config.overload_threshold);
+                if (threshold < 1 || threshold > 100)
+                    config_error(conf, "Overload threshold must be between 1 and 100%%");
+                config->overload_threshold = (unsigned int)threshold;
             } else if (streq(line.key, "allow_temp_files")) {
-                lwan->config.allow_post_temp_file = !!strstr(line.value, "post");
+                config->allow_post_temp_file = !!strstr(line.value, "post");
             } else {
                 config_error(conf, "Unknown config key: %s", line.key);
             }
             break;
         case CONFIG_LINE_TYPE_SECTION:
             if (streq(line.key, "listener")) {
-                if (!has_listener) {
-                    parse_listener(conf, &line, lwan);
-                    has_listener = true;
-                } else {
-                    config_error(conf, "Only one listener supported");
-                }
+                parse_listener(conf, &line, lwan, config, gen);
+                has_listener = true;
             } else if (streq(line.key, "straitjacket")) {
-                lwan_straitjacket_enforce_from_config(conf);
+                /* Privileges have been dropped already.  */
+                if (reloading)
+                    config_skip_section(conf, &line);
+                else
+                    lwan_straitjacket_enforce_from_config(conf);
             } else {
                 config_error(conf, "Unknown section type: %s", line.key);
             }
@@ -466,15 +953,185 @@ static bool setup_from_config(struct lwan *lwan, const char *path)
     }
 
     if (config_last_error(conf)) {
-        lwan_status_critical("Error on config file \"%s\", line %d: %s",
+        if (!reloading) {
+            lwan_status_critical("Error on config file \"%s\", line %d: %s",
+                  path, config_cur_line(conf), config_last_error(conf));
+        }
+
+        lwan_status_error("Error on config file \"%s\", line %d: %s",
               path, config_cur_line(conf), config_last_error(conf));
+        ret = false;
+    } else if (reloading && !has_listener) {
+        lwan_status_error("Config file \"%s\" has no listener", path);
+        ret = false;
     }
 
     config_close(conf);
 
+    return ret;
+}
+
+static bool same_listeners(const struct lwan_url_map_generation *running,
+    const struct lwan_url_map_generation *reloaded)
+{
+    if (running->n_listeners != reloaded->n_listeners)
+        return false;
+
+    for (unsigned short i = 0; i < running->n_listeners; i++) {
+        if (!streq(running->listeners[i].address, reloaded->listeners[i].address))
+            return false;
+    }
+
     return true;
 }
 
+static void warn_if_settings_changed(const struct lwan_config *running,
+    const struct lwan_config *reloaded,
+    const struct lwan_url_map_generation *running_gen,
+    const struct lwan_url_map_generation *reloaded_gen)
+{
+    for (unsigned short i = 0; i < running_gen->n_listeners; i++) {
+        const struct lwan_url_map_listener *a = &running_gen->listeners[i];
+        const struct lwan_url_map_listener *b = &reloaded_gen->listeners[i];
+
+        if (a->first_thread != b->first_thread || a->last_thread != b->last_thread) {
+            lwan_status_warning("Thread range for listener %s will change "
+                "after a restart", a->address);
+        }
+        if (a->defer_accept != b->defer_accept || a->fast_open != b->fast_open) {
+            lwan_status_warning("Socket options for listener %s will change "
+                "after a restart", a->address);
+        }
+    }
+
+    if (running->n_threads != reloaded->n_threads
+        || running->keep_alive_timeout != reloaded->keep_alive_timeout
+        || running->expires != reloaded->expires
+        || running->reuse_port != reloaded->reuse_port
+        || running->proxy_protocol != reloaded->proxy_protocol
+        || running->allow_cors != reloaded->allow_cors
+        || running->busy_poll != reloaded->busy_poll
+        || running->busy_poll_budget != reloaded->busy_poll_budget
+        || running->max_connections != reloaded->max_connections
+        || running->max_connections_per_ip != reloaded->max_connections_per_ip
+        || running->max_requests_per_thread != reloaded->max_requests_per_thread
+        || running->overload_threshold != reloaded->overload_threshold
+        || running->max_post_data_size != reloaded->max_post_data_size) {
+        lwan_status_warning("Only URL maps are reloaded; changes to other "
+            "settings will take effect after a restart");
+    }
+}
+
+static struct {
+    pthread_t self;
+    int pipe_fd[2];
+    char *config_path;
+} reloader = {
+    .pipe_fd = { -1, -1 },
+};
+
+static void reload_url_map(struct lwan *l)
+{
+    struct lwan_url_map_generation *gen;
+    struct lwan_config config = default_config;
+
+    /* These are freed before being replaced while parsing.  */
+    config.listener = NULL;
+    config.error_template = NULL;
+
+    pthread_mutex_lock(&url_map_lock);
+
+    gen = url_map_generation_new();
+    if (!setup_from_config(l, &config, gen, reloader.config_path, true)) {
+        url_map_generation_destroy(gen);
+
+        lwan_status_error("Could not reload configuration, keeping the "
+            "current URL map");
+    } else if (!same_listeners(l->url_map, gen)) {
+        url_map_generation_destroy(gen);
+
+        lwan_status_error("Listeners can't be added, removed, or reordered "
+            "without a restart; keeping the current URL map");
+    } else {
+        warn_if_settings_changed(&l->config, &config, l->url_map, gen);
+        url_map_generation_publish(l, gen);
+
+        lwan_status_info("Configuration reloaded");
+    }
+
+    pthread_mutex_unlock(&url_map_lock);
+
+    free(config.listener);
+    free(config.error_template);
+}
+
+static void *reload_thread(void *data)
+{
+    struct lwan *l = data;
+    char buffer[16];
+
+    for (;;) {
+        /* Many signals received in a short period are coalesced into a
+         * single reload, as it reads as many bytes as possible.  */
+        ssize_t r = read(reloader.pipe_fd[0], buffer, sizeof(buffer));
+
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+
+            lwan_status_perror("Could not read from reload pipe");
+            break;
+        }
+        if (!r)
+            break;
+
+        reload_url_map(l);
+    }
+
+    return NULL;
+}
+
+static void reloader_init(struct lwan *l, const char *path)
+{
+    /* Paths are resolved now as the working directory might change.  */
+    reloader.config_path = realpath(path, NULL);
+    if (!reloader.config_path) {
+        lwan_status_perror("Could not resolve %s; SIGHUP will not reload "
+            "configuration", path);
+        return;
+    }
+
+    if (pipe2(reloader.pipe_fd, O_CLOEXEC) < 0)
+        lwan_status_critical_perror("pipe2");
+    if (fcntl(reloader.pipe_fd[1], F_SETFL, O_NONBLOCK) < 0)
+        lwan_status_critical_perror("fcntl");
+
+    if (pthread_create(&reloader.self, NULL, reload_thread, l))
+        lwan_status_critical_perror("pthread_create");
+}
+
+static void reloader_shutdown(void)
+{
+    int write_fd = reloader.pipe_fd[1];
+
+    if (write_fd < 0)
+        return;
+
+    lwan_status_debug("Shutting down configuration reload thread");
+
+    /* Closing the write end makes the reload thread read EOF.  */
+    reloader.pipe_fd[1] = -1;
+    close(write_fd);
+
+    pthread_join(reloader.self, NULL);
+    close(reloader.pipe_fd[0]);
+    reloader.pipe_fd[0] = -1;
+
+    free(reloader.config_path);
+    reloader.config_path = NULL;
+}
+
+
 static rlim_t
 setup_open_file_count_limits(void)
 {
@@ -512,6 +1169,51 @@ allocate_connections(struct lwan *l, size_t max_open_files)
     memset(l->conns, 0, sz);
 }
 
+static void
+overload_init(struct lwan *l, size_t max_open_files)
+{
+    const struct lwan_config *config = &l->config;
+
+    l->overload.enabled = config->max_connections
+        || config->max_connections_per_ip || config->max_requests_per_thread;
+    if (!l->overload.enabled)
+        return;
+
+    /* Past the soft limit, keep-alive timeouts shrink and idle connections
+     * are closed, oldest first.  */
+    if (config->max_connections) {
+        l->overload.soft_limit = (unsigned int)(
+            (uint64_t)config->max_connections * config->overload_threshold / 100);
+        if (!l->overload.soft_limit)
+            l->overload.soft_limit = 1;
+
+        if (config->max_connections >= max_open_files) {
+            lwan_status_warning("Maximum number of connections (%d) is above "
+                "the file descriptor limit (%zu)", config->max_connections,
+                max_open_files);
+        }
+    }
+
+    if (config->max_connections_per_ip) {
+        l->overload.per_ip = calloc(1 << LWAN_PER_IP_BUCKET_BITS,
+            sizeof(*l->overload.per_ip));
+        l->overload.per_ip_bucket = calloc(max_open_files,
+            sizeof(*l->overload.per_ip_bucket));
+        if (!l->overload.per_ip || !l->overload.per_ip_bucket)
+            lwan_status_critical_perror("calloc");
+    }
+}
+
+static void
+overload_shutdown(struct lwan *l)
+{
+    if (!l->overload.enabled)
+        return;
+
+    free(l->overload.per_ip);
+    free(l->overload.per_ip_bucket);
+}
+
 static unsigned short int
 get_number_of_cpus(void)
 {
@@ -523,6 +1225,81 @@ get_number_of_cpus(void)
     return (unsigned short int)n_online_cpus;
 }
 
+static void
+assign_listener_threads(struct lwan *l)
+{
+    const struct lwan_url_map_generation *gen = l->url_map;
+    unsigned short n_shared = l->thread.count;
+    bool needs_shared = false;
+    bool *dedicated;
+
+    dedicated = calloc(l->thread.count, sizeof(*dedicated));
+    if (!dedicated)
+        lwan_status_critical_perror("calloc");
+
+    for (unsigned short i = 0; i < gen->n_listeners; i++) {
+        const struct lwan_url_map_listener *listener = &gen->listeners[i];
+
+        if (listener->first_thread < 0) {
+            needs_shared = true;
+            continue;
+        }
+
+        if (listener->last_thread >= l->thread.count) {
+            lwan_status_critical("Listener %s requires threads %d-%d, but "
+                "only %d I/O threads are available", listener->address,
+                listener->first_thread, listener->last_thread,
+                l->thread.count);
+        }
+
+        for (int t = listener->first_thread; t <= listener->last_thread; t++) {
+            if (!dedicated[t]) {
+                dedicated[t] = true;
+                n_shared--;
+            }
+        }
+    }
+
+    if (needs_shared && !n_shared) {
+        lwan_status_warning("All I/O threads are dedicated to listeners; "
+            "listeners without a thread range will use all of them");
+
+        memset(dedicated, 0, l->thread.count * sizeof(*dedicated));
+        n_shared = l->thread.count;
+    }
+
+    for (unsigned short i = 0; i < gen->n_listeners; i++) {
+        const struct lwan_url_map_listener *config = &gen->listeners[i];
+        struct lwan_listener *listener = &l->listener.listeners[i];
+        unsigned short n = 0;
+
+        if (config->first_thread < 0)
+            listener->n_threads = n_shared;
+        else
+            listener->n_threads = (unsigned short)(config->last_thread - config->first_thread + 1);
+
+        listener->threads = calloc(listener->n_threads, sizeof(*listener->threads));
+        if (!listener->threads)
+            lwan_status_critical_perror("calloc");
+
+        for (unsigned short t = 0; t < l->thread.count; t++) {
+            if (config->first_thread < 0) {
+                if (dedicated[t])
+                    continue;
+            } else if (t < config->first_thread || t > config->last_thread) {
+                continue;
+            }
+
+            listener->threads[n++] = t;
+        }
+
+        lwan_status_debug("Listener %s handled by %d I/O threads",
+            listener->address, listener->n_threads);
+    }
+
+    free(dedicated);
+}
+
 void
 lwan_init(struct lwan *l)
 {
@@ -535,9 +1312,42 @@ lwan_get_default_config(void)
     return &default_config;
 }
 
+void
+lwan_get_stats(const struct lwan *l, struct lwan_stats *stats)
+{
+    /* Counters are only ever updated atomically, so that they can be read
+     * here while other threads update them.  */
+    *stats = (struct lwan_stats) {
+        .shed_connections = ATOMIC_READ(l->overload.shed_connections),
+        .shed_per_ip = ATOMIC_READ(l->overload.shed_per_ip),
+        .sendfile_cached_fds = lwan_serve_files_cached_fds(),
+    };
+
+    for (unsigned short i = 0; i < l->thread.count; i++) {
+        const struct lwan_thread *t = &l->thread.threads[i];
+
+        stats->shed_requests += ATOMIC_READ(t->overload.shed_requests);
+        stats->closed_idle += ATOMIC_READ(t->overload.closed_idle);
+
+        stats->busy_poll_spin_ns += ATOMIC_READ(t->busy_poll.spin_ns);
+        stats->busy_poll_spin_hits += ATOMIC_READ(t->busy_poll.spin_hits);
+        stats->busy_poll_sleep_ns += ATOMIC_READ(t->busy_poll.sleep_ns);
+        stats->busy_poll_sleeps += ATOMIC_READ(t->busy_poll.sleeps);
+
+        stats->sendfile_files += ATOMIC_READ(t->sendfile.files);
+        stats->sendfile_bytes += ATOMIC_READ(t->sendfile.bytes);
+        stats->sendfile_ns += ATOMIC_READ(t->sendfile.ns);
+        stats->sendfile_yields += ATOMIC_READ(t->sendfile.yields);
+    }
+}
+
 void
 lwan_init_with_config(struct lwan *l, const struct lwan_config *config)
 {
+    struct lwan_url_map_generation *url_map = url_map_generation_new();
+    const char *config_path = NULL;
+    char path_buf[PATH_MAX];
+
     /* Load defaults */
     memset(l, 0, sizeof(*l));
     memcpy(&l->config, config, sizeof(*config));
@@ -555,16 +1365,25 @@ lwan_init_with_config(struct lwan *l, const struct lwan_config *config)
 
     lwan_module_init(l);
 
+    lwan_job_add(url_map_generation_reap, l);
+
     /* Load the configuration file. */
     if (config == &default_config || config->config_file_path) {
-        if (!setup_from_config(l, config->config_file_path))
+        config_path = config->config_file_path;
+        if (!config_path)
+            config_path = get_config_path(path_buf);
+
+        if (!setup_from_config(l, &l->config, url_map, config_path, false))
             lwan_status_critical("Could not read config file: %s",
-                config->config_file_path);
+                config_path);
 
         /* `quiet` key might have changed value. */
         lwan_status_init(l);
     }
 
+    if (!url_map->n_listeners)
+        url_map_generation_add_listener(url_map, l->config.listener);
+
     lwan_response_init(l);
 
     /* Continue initialization as normal. */
@@ -586,6 +1405,7 @@ lwan_init_with_config(struct lwan *l, const struct lwan_config *config)
 
     rlim_t max_open_files = setup_open_file_count_limits();
     allocate_connections(l, (size_t)max_open_files);
+    overload_init(l, (size_t)max_open_files);
 
     l->thread.max_fd = (unsigned)max_open_files / (unsigned)l->thread.count;
     lwan_status_info("Using %d threads, maximum %d sockets per thread",
@@ -593,9 +1413,15 @@ lwan_init_with_config(struct lwan *l, const struct lwan_config *config)
 
     signal(SIGPIPE, SIG_IGN);
 
+    url_map_generation_publish(l, url_map);
+
     lwan_thread_init(l);
     lwan_socket_init(l);
+    assign_listener_threads(l);
     lwan_http_authorize_init();
+
+    if (config_path)
+        reloader_init(l, config_path);
 }
 
 void
@@ -603,17 +1429,23 @@ lwan_shutdown(struct lwan *l)
 {
     lwan_status_info("Shutting down");
 
+    reloader_shutdown();
+
     free(l->config.listener);
     free(l->config.error_template);
     free(l->config.config_file_path);
 
     lwan_job_thread_shutdown();
     lwan_thread_shutdown(l);
+    lwan_socket_shutdown(l);
 
     lwan_status_debug("Shutting down URL handlers");
-    lwan_trie_destroy(&l->url_map_trie);
+    url_map_generation_reap_all();
+    url_map_generation_destroy(l->url_map);
+    l->url_map = NULL;
 
     free(l->conns);
+    overload_shutdown(l);
 
     lwan_response_shutdown(l);
     lwan_tables_shutdown();
@@ -622,9 +1454,75 @@ lwan_shutdown(struct lwan *l)
     lwan_module_shutdown(l);
 }
 
+static int
+client_address_bucket(int fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    uint64_t key;
+
+    if (getpeername(fd, (struct sockaddr *)&addr, &len) < 0)
+        return -1;
+
+    switch (addr.ss_family) {
+    case AF_INET:
+        key = ((struct sockaddr_in *)&addr)->sin_addr.s_addr;
+        break;
+    case AF_INET6: {
+        const struct in6_addr *in6 = &((struct sockaddr_in6 *)&addr)->sin6_addr;
+
+        if (IN6_IS_ADDR_V4MAPPED(in6)) {
+            uint32_t v4;
+
+            memcpy(&v4, &in6->s6_addr[12], sizeof(v4));
+            key = v4;
+        } else {
+            /* Clients usually get a whole /64, so use only the prefix.  */
+            memcpy(&key, in6->s6_addr, sizeof(key));
+        }
+        break;
+    }
+    default:
+        return -1;
+    }
+
+    /* Addresses that hash to the same bucket share the limit.  */
+    return (int)((key * 0x9e3779b97f4a7c15ull) >> (64 - LWAN_PER_IP_BUCKET_BITS));
+}
+
+static bool
+admit_client(struct lwan *l, int fd)
+{
+    if (l->config.max_connections
+            && ATOMIC_READ(l->overload.connections) >= l->config.max_connections) {
+        ATOMIC_INC(l->overload.shed_connections);
+        return false;
+    }
+
+    if (l->overload.per_ip) {
+        int bucket = client_address_bucket(fd);
+
+        if (bucket < 0) {
+            l->overload.per_ip_bucket[fd] = LWAN_PER_IP_UNTRACKED;
+        } else if (ATOMIC_READ(l->overload.per_ip[bucket])
+                    >= l->config.max_connections_per_ip) {
+            ATOMIC_INC(l->overload.shed_connections);
+            ATOMIC_INC(l->overload.shed_per_ip);
+            return false;
+        } else {
+            ATOMIC_INC(l->overload.per_ip[bucket]);
+            l->overload.per_ip_bucket[fd] = (unsigned short)bucket;
+        }
+    }
+
+    ATOMIC_INC(l->overload.connections);
+    return true;
+}
+
 static ALWAYS_INLINE void
-schedule_client(struct lwan *l, int fd)
+schedule_client(struct lwan *l, int fd, unsigned int listener_id)
 {
+    const struct lwan_listener *listener = &l->listener.listeners[listener_id];
     int thread;
 #ifdef __x86_64__
     static_assert(sizeof(struct lwan_connection) == 32,
@@ -635,56 +1533,154 @@ schedule_client(struct lwan *l, int fd)
      * results when fd=0, but this shouldn't happen (as 0 is either the
      * standard input or the main socket, but even if that changes,
      * scheduling will still work).  */
-    thread = ((fd - 1) / 2) % l->thread.count;
+    thread = ((fd - 1) / 2) % listener->n_threads;
 #else
     static int counter = 0;
-    thread = counter++ % l->thread.count;
+    thread = counter++ % listener->n_threads;
+#endif
+#ifdef SO_INCOMING_NAPI_ID
+    if (l->config.busy_poll) {
+        /* When busy polling, keep all connections arriving through the
+         * same NIC receive queue on the same thread, so each thread only
+         * polls its own queue.  */
+        unsigned int napi_id;
+        socklen_t len = sizeof(napi_id);
+
+        if (!getsockopt(fd, SOL_SOCKET, SO_INCOMING_NAPI_ID, &napi_id, &len)
+                && napi_id)
+            thread = (int)(napi_id % listener->n_threads);
+    }
 #endif
-    struct lwan_thread *t = &l->thread.threads[thread];
-    lwan_thread_add_client(t, fd);
+    struct lwan_thread *t = &l->thread.threads[listener->threads[thread]];
+    lwan_thread_add_client(t, fd, listener_id);
 }
 
-static volatile sig_atomic_t main_socket = -1;
+static volatile sig_atomic_t quit_pipe_fd = -1;
+
+static_assert(sizeof(quit_pipe_fd) >= sizeof(int), "size of sig_atomic_t > size of int");
+
+static void
+sighup_handler(int signal_number __attribute__((unused)))
+{
+    int saved_errno = errno;
+
+    if (reloader.pipe_fd[1] >= 0) {
+        /* If the pipe is full, a reload is already pending.  */
+        ssize_t r = write(reloader.pipe_fd[1], "", 1);
+        (void)r;
+    }
 
-static_assert(sizeof(main_socket) >= sizeof(int), "size of sig_atomic_t > size of int");
+    errno = saved_errno;
+}
 
 static void
 sigint_handler(int signal_number __attribute__((unused)))
 {
-    if (main_socket < 0)
-        return;
-    shutdown((int)main_socket, SHUT_RDWR);
-    close((int)main_socket);
-    main_socket = -1;
+    int saved_errno = errno;
+
+    if (quit_pipe_fd >= 0) {
+        ssize_t r = write((int)quit_pipe_fd, "", 1);
+        (void)r;
+    }
+
+    errno = saved_errno;
+}
+
+static bool
+accept_clients(struct lwan *l, unsigned int listener_id)
+{
+    const int fd = l->listener.listeners[listener_id].fd;
+
+    /* Listening sockets are non-blocking: drain the accept queue before
+     * polling again.  */
+    for (;;) {
+        int client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (LIKELY(client_fd >= 0)) {
+            if (UNLIKELY(l->overload.enabled && !admit_client(l, client_fd))) {
+                lwan_response_send_overloaded(client_fd);
+                close(client_fd);
+                continue;
+            }
+
+            schedule_client(l, client_fd, listener_id);
+            continue;
+        }
+
+        switch (errno) {
+        case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+        case EWOULDBLOCK:
+#endif
+            return true;
+        case EINTR:
+        case ECONNABORTED:
+            continue;
+        case EBADF:
+        case EINVAL:
+            return false;
+        }
+
+        lwan_status_perror("accept");
+        return true;
+    }
 }
 
 void
 lwan_main_loop(struct lwan *l)
 {
-    assert(main_socket == -1);
-    main_socket = l->main_socket;
+    const unsigned short n_listeners = l->listener.count;
+    struct pollfd *fds;
+    int quit_pipe[2];
+
+    assert(quit_pipe_fd == -1);
+
+    fds = calloc((size_t)n_listeners + 1, sizeof(*fds));
+    if (!fds)
+        lwan_status_critical_perror("calloc");
+
+    if (pipe2(quit_pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+        lwan_status_critical_perror("pipe2");
+
+    for (unsigned short i = 0; i < n_listeners; i++)
+        fds[i] = (struct pollfd) { .fd = l->listener.listeners[i].fd, .events = POLLIN };
+    fds[n_listeners] = (struct pollfd) { .fd = quit_pipe[0], .events = POLLIN };
+
+    quit_pipe_fd = quit_pipe[1];
     if (signal(SIGINT, sigint_handler) == SIG_ERR)
         lwan_status_critical("Could not set signal handler");
+    if (reloader.pipe_fd[1] >= 0 && signal(SIGHUP, sighup_handler) == SIG_ERR)
+        lwan_status_critical("Could not set signal handler");
 
     lwan_status_info("Ready to serve");
 
     for (;;) {
-        int client_fd = accept4((int)main_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
-        if (UNLIKELY(client_fd < 0)) {
-            switch (errno) {
-            case EBADF:
-            case ECONNABORTED:
-                if (main_socket < 0) {
-                    lwan_status_info("Signal 2 (Interrupt) received");
-                } else {
-                    lwan_status_info("Main socket closed for unknown reasons");
-                }
-                return;
-            }
+        if (UNLIKELY(poll(fds, (nfds_t)n_listeners + 1, -1) < 0)) {
+            if (errno != EINTR)
+                lwan_status_perror("poll");
+            continue;
+        }
 
-            lwan_status_perror("accept");
-        } else {
-            schedule_client(l, client_fd);
+        if (UNLIKELY(fds[n_listeners].revents)) {
+            lwan_status_info("Signal 2 (Interrupt) received");
+            break;
+        }
+
+        for (unsigned short i = 0; i < n_listeners; i++) {
+            if (!fds[i].revents)
+                continue;
+
+            if (UNLIKELY(fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) ||
+                UNLIKELY(!accept_clients(l, i))) {
+                lwan_status_info("Main socket closed for unknown reasons");
+                goto out;
+            }
         }
     }
+
+out:
+    quit_pipe_fd = -1;
+    close(quit_pipe[0]);
+    close(quit_pipe[1]);
+    free(fds);
 }
@@ -40,6 +40,9 @@ extern "C" {
 #define DEFAULT_BUFFER_SIZE 4096
 #define DEFAULT_HEADERS_SIZE 512
 
+/* Requests with more ranges than this get the whole thing.  */
+#define LWAN_MAX_RANGES 16
+
 #define N_ELEMENTS(array) (sizeof(array) / sizeof(array[0]))
 
 #ifdef DISABLE_INLINE_FUNCTIONS
@@ -126,9 +129,16 @@ static ALWAYS_INLINE int16_t string_as_int16(const char *s)
 
 enum lwan_http_status {
     HTTP_OK = 200,
+    HTTP_CREATED = 201,
+    HTTP_ACCEPTED = 202,
+    HTTP_NO_CONTENT = 204,
     HTTP_PARTIAL_CONTENT = 206,
     HTTP_MOVED_PERMANENTLY = 301,
+    HTTP_FOUND = 302,
+    HTTP_SEE_OTHER = 303,
     HTTP_NOT_MODIFIED = 304,
+    HTTP_TEMPORARY_REDIRECT = 307,
+    HTTP_PERMANENT_REDIRECT = 308,
     HTTP_BAD_REQUEST = 400,
     HTTP_NOT_AUTHORIZED = 401,
     HTTP_FORBIDDEN = 403,
@@ -139,9 +149,12 @@ enum lwan_http_status {
     HTTP_RANGE_UNSATISFIABLE = 416,
     HTTP_I_AM_A_TEAPOT = 418,
     HTTP_CLIENT_TOO_HIGH = 420,
+    HTTP_TOO_MANY_REQUESTS = 429,
     HTTP_INTERNAL_ERROR = 500,
     HTTP_NOT_IMPLEMENTED = 501,
+    HTTP_BAD_GATEWAY = 502,
     HTTP_UNAVAILABLE = 503,
+    HTTP_GATEWAY_TIMEOUT = 504,
     HTTP_SERVER_TOO_HIGH = 520,
 };
 
@@ -156,6 +169,7 @@ enum lwan_handler_flags {
     HANDLER_CAN_REWRITE_URL = 1<<7,
     HANDLER_PARSE_COOKIES = 1<<8,
     HANDLER_DATA_IS_HASH_TABLE = 1<<9,
+    HANDLER_RAW_POST_DATA = 1<<10,
 
     HANDLER_PARSE_MASK = 1<<0 | 1<<1 | 1<<2 | 1<<3 | 1<<4 | 1<<8
 };
@@ -190,8 +204,17 @@ enum lwan_connection_flags {
     CONN_SHOULD_RESUME_CORO = 1<<2,
     CONN_WRITE_EVENTS       = 1<<3,
     CONN_MUST_READ          = 1<<4,
+    CONN_IN_FLIGHT          = 1<<5,
+    CONN_AWAITING_FD        = 1<<6,
+    CONN_PARKED             = 1<<7,
+    CONN_NOTSENT_LOWAT      = 1<<8,
 };
 
+/* The index of the listener that accepted a connection is kept in the
+ * upper bits of its flags, so struct lwan_connection doesn't grow.  */
+#define CONN_LISTENER_SHIFT 24
+#define CONN_LISTENER_MAX 127
+
 enum lwan_connection_coro_yield {
     CONN_CORO_ABORT = -1,
     CONN_CORO_MAY_RESUME = 0,
@@ -204,6 +227,7 @@ struct lwan_key_value {
 };
 
 struct lwan_request;
+struct lwan_rate_limit;
 struct lwan_response {
     struct strbuf *buffer;
     const char *mime_type;
@@ -232,6 +256,12 @@ struct lwan_connection {
     int prev, next; /* for death queue */
 };
 
+struct lwan_range {
+    /* As sent by the client: "to" is inclusive, or -1 if the range goes
+     * up to the end; "from" is -1 to ask for the last "to" bytes.  */
+    off_t from, to;
+};
+
 struct lwan_proxy {
     union {
         struct sockaddr_in ipv4;
@@ -248,14 +278,16 @@ struct lwan_request {
     struct lwan_value original_url;
     struct lwan_connection *conn;
     struct lwan_proxy *proxy;
+    struct request_parser_helper *helper;
 
     struct lwan_key_value_array query_params, post_data, cookies;
 
     struct {
         time_t if_modified_since;
+        struct lwan_value if_none_match;
         struct {
-          off_t from;
-          off_t to;
+            struct lwan_range parts[LWAN_MAX_RANGES];
+            unsigned int n;
         } range;
         struct lwan_value *body;
         struct lwan_value *content_type;
@@ -287,6 +319,11 @@ struct lwan_url_map {
         char *realm;
         char *password_file;
     } authorization;
+
+    struct {
+        struct lwan_rate_limit *limiter;
+        char *header; /* Use the remote address if NULL or not sent */
+    } rate_limit;
 };
 
 struct lwan_thread {
@@ -300,6 +337,54 @@ struct lwan_thread {
     int epoll_fd;
     int pipe_fd[2];
     pthread_t self;
+
+    /* Odd while blocked in epoll_wait(), even while handling events.  Used
+     * to find out when the thread can't be holding a reference to an URL
+     * map generation that's been replaced.  */
+    unsigned int epoch;
+
+    /* Time spent spinning on epoll_wait() with a zero timeout and time
+     * spent blocked on it, in nanoseconds.  Only updated (by the thread
+     * itself) when busy polling is enabled; see lwan_get_stats().  */
+    struct {
+        uint64_t spin_ns;
+        uint64_t sleep_ns;
+        uint64_t spin_hits;
+        uint64_t sleeps;
+    } busy_poll;
+
+    /* Requests being handled by this thread, and how many requests and
+     * idle connections were dropped because of overload protection.  The
+     * counters are read by other threads, see lwan_get_stats().  */
+    struct {
+        unsigned int in_flight;
+        uint64_t shed_requests;
+        uint64_t closed_idle;
+    } overload;
+
+    /* Files sent with sendfile() (lwan-io-wrappers.c): how many, bytes
+     * sent, time from start to end, and times it had to wait for the
+     * socket; see lwan_get_stats().  */
+    struct {
+        uint64_t files;
+        uint64_t bytes;
+        uint64_t ns;
+        uint64_t yields;
+    } sendfile;
+
+    /* Coroutines waiting on another file descriptor until a deadline, in
+     * no particular order, and idle outbound connections (lwan-conn.c).  */
+    struct {
+        struct lwan_thread_deadline *entries;
+        unsigned int count, size;
+    } deadlines;
+    struct lwan_conn_pool *conn_pool;
+
+    /* Event stream subscribers on this thread, if any (lwan-sse.c).  */
+    struct lwan_sse_thread *sse;
+
+    /* Recently verified credentials (lwan-http-authorize.c).  */
+    struct lwan_auth_cache *auth_cache;
 };
 
 struct lwan_straitjacket {
@@ -314,6 +399,12 @@ struct lwan_config {
     size_t max_post_data_size;
     unsigned short keep_alive_timeout;
     unsigned int expires;
+    unsigned int busy_poll;
+    unsigned int busy_poll_budget;
+    unsigned int max_connections;
+    unsigned int max_connections_per_ip;
+    unsigned int max_requests_per_thread;
+    unsigned int overload_threshold;
     unsigned short n_threads;
     bool quiet;
     bool reuse_port;
@@ -322,8 +413,20 @@ struct lwan_config {
     bool allow_post_temp_file;
 };
 
+struct lwan_listener {
+    char *address;
+    int fd;
+
+    /* Indices of the I/O threads that handle connections accepted
+     * by this listener.  */
+    unsigned short *threads;
+    unsigned short n_threads;
+};
+
+struct lwan_url_map_generation;
+
 struct lwan {
-    struct lwan_trie url_map_trie;
+    struct lwan_url_map_generation *url_map;
     struct lwan_connection *conns;
 
     struct {
@@ -333,9 +436,56 @@ struct lwan {
         unsigned short count;
     } thread;
 
+    struct {
+        struct lwan_listener *listeners;
+        unsigned short count;
+    } listener;
+
+    struct {
+        /* Only tracked if any of the limits in lwan_config are set.  */
+        bool enabled;
+        unsigned int connections;
+        unsigned int soft_limit;
+
+        /* Open connections per (hashed) client address, and the bucket
+         * each file descriptor was counted in.  */
+        unsigned int *per_ip;
+        unsigned short *per_ip_bucket;
+
+        /* Updated by the main thread only.  */
+        uint64_t shed_connections;
+        uint64_t shed_per_ip;
+    } overload;
+
     struct hash *module_registry;
     struct lwan_config config;
-    int main_socket;
+};
+
+/* Counters summed over the whole server since it started; see
+ * lwan_get_stats(), and the "stats" module.  */
+struct lwan_stats {
+    uint64_t shed_connections;
+    uint64_t shed_per_ip;
+    uint64_t shed_requests;
+    uint64_t closed_idle;
+
+    /* Only counted if busy polling is enabled.  */
+    uint64_t busy_poll_spin_ns;
+    uint64_t busy_poll_spin_hits;
+    uint64_t busy_poll_sleep_ns;
+    uint64_t busy_poll_sleeps;
+
+    /* Totals for every file sent with sendfile(), not per connection:
+     * bytes / ns is the average throughput of a transfer.  Debug builds
+     * also log each transfer.  */
+    uint64_t sendfile_files;
+    uint64_t sendfile_bytes;
+    uint64_t sendfile_ns;
+    uint64_t sendfile_yields;
+
+    /* Not a total: descriptors currently held open by the sendfile()
+     * entries of every serve_files instance (see cache_max_fds).  */
+    uint64_t sendfile_cached_fds;
 };
 
 void lwan_set_url_map(struct lwan *l, const struct lwan_url_map *map);
@@ -350,8 +500,19 @@ const char *lwan_request_get_post_param(struct lwan_request *request, const char
     __attribute__((warn_unused_result));
 const char *lwan_request_get_query_param(struct lwan_request *request, const char *key)
     __attribute__((warn_unused_result));
+const struct lwan_value *lwan_request_get_raw_headers(struct lwan_request *request)
+    __attribute__((warn_unused_result));
+bool lwan_request_next_raw_header(struct lwan_value *headers, struct lwan_value *line)
+    __attribute__((warn_unused_result));
+const char *lwan_request_get_method_name(const struct lwan_request *request)
+    __attribute__((pure)) __attribute__((warn_unused_result));
+const struct lwan_value *lwan_request_get_raw_query_string(struct lwan_request *request)
+    __attribute__((warn_unused_result));
 const char * lwan_request_get_cookie(struct lwan_request *request, const char *key)
     __attribute__((warn_unused_result));
+bool lwan_request_etag_matches(const struct lwan_request *request,
+                               const char *etag, size_t etag_len)
+    __attribute__((warn_unused_result));
 
 bool lwan_response_set_chunked(struct lwan_request *request, enum lwan_http_status status);
 void lwan_response_send_chunk(struct lwan_request *request);
@@ -376,6 +537,8 @@ void lwan_straitjacket_enforce(const struct lwan_straitjacket *sj);
 
 const struct lwan_config *lwan_get_default_config(void);
 
+void lwan_get_stats(const struct lwan *l, struct lwan_stats *stats);
+
 int lwan_connection_get_fd(const struct lwan *lwan, const struct lwan_connection *conn)
     __attribute__((pure)) __attribute__((warn_unused_result));
 
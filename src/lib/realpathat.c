@@ -133,8 +133,11 @@ realpathat2(int dirfd, char *dirfdpath, const char *name, char *resolved,
             dest = mempmove(dest, start, (size_t)(end - start));
             *dest = '\0';
 
+            /* Paths that merely share a prefix with dirfdpath (e.g.
+             * "/srv/www-private" for "/srv/www") aren't beneath it.  */
             if ((dirfdlen == 1 && *dirfdpath == '/') ||
-                    strncmp(rpath, dirfdpath, (size_t)dirfdlen)) {
+                    strncmp(rpath, dirfdpath, (size_t)dirfdlen) ||
+                    rpath[dirfdlen] != '/') {
                 pathat = rpath;
             } else {
                 pathat = rpath + dirfdlen + 1;
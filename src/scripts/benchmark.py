@@ -5,9 +5,15 @@ from __future__ import print_function
 import commands
 import json
 import os
+import resource
+import select
+import socket
 import subprocess
 import sys
+import threading
 import time
+import urllib
+import urllib2
 
 LWAN_PATH = './build/testrunner/testrunner'
 for arg in sys.argv[1:]:
@@ -100,6 +106,148 @@ def cmdlineintarg(arg, default=0):
   return value
 
 
+def cmdlinestrarg(arg, default=None):
+  value = default
+  if arg in sys.argv:
+    index = sys.argv.index(arg)
+    del sys.argv[index]
+    value = sys.argv[index]
+    del sys.argv[index]
+  return value
+
+
+def small_file_latency(host, port, small_path, large_path, n_downloads, n_requests):
+  stop = threading.Event()
+
+  def download():
+    url = 'http://%s:%d%s' % (host, port, large_path)
+    while not stop.is_set():
+      try:
+        response = urllib2.urlopen(url)
+        while response.read(1 <<20) and not stop.is_set():
+          pass
+      except urllib2.URLError:
+        time.sleep(0.1)
+
+  def measure(n_downloads):
+    downloaders = [threading.Thread(target=download) for n in range(n_downloads)]
+    for downloader in downloaders:
+      downloader.start()
+
+    # Let the downloads get going before timing anything.
+    time.sleep(1 if n_downloads else 0)
+
+    url = 'http://%s:%d%s' % (host, port, small_path)
+    latencies = []
+    for n in range(n_requests):
+      start = time.time()
+      urllib2.urlopen(url).read()
+      latencies.append(time.time() - start)
+
+    stop.set()
+    for downloader in downloaders:
+      downloader.join()
+    stop.clear()
+
+    latencies.sort()
+    percentile = lambda p: latencies[min(len(latencies) - 1, len(latencies) * p // 100)] * 1000
+    clearstderrline()
+    print('%d,%d,%f,%f,%f,%f' % (n_downloads, n_requests, percentile(50),
+      percentile(90), percentile(99), latencies[-1] * 1000))
+
+  # Give lwan some time to start up.
+  for attempt in range(50):
+    try:
+      urllib2.urlopen('http://%s:%d%s' % (host, port, small_path)).read()
+      break
+    except urllib2.URLError:
+      time.sleep(0.1)
+
+  print('downloads,requests,p50_ms,p90_ms,p99_ms,max_ms')
+  measure(0)
+  measure(n_downloads)
+
+
+def sse_fanout(host, port, n_subscribers, n_events):
+  soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+  if soft < n_subscribers + 64:
+    resource.setrlimit(resource.RLIMIT_NOFILE, (min(hard, n_subscribers + 64), hard))
+
+  def publish(data):
+    url = 'http://%s:%d/sse-publish?data=%s' % (host, port, urllib.quote(data))
+    return int(urllib2.urlopen(url).read())
+
+  # Give lwan some time to start up.
+  for attempt in range(50):
+    try:
+      publish('warmup')
+      break
+    except urllib2.URLError:
+      time.sleep(0.1)
+
+  poller = select.epoll()
+  subscribers = {}
+  for n in range(n_subscribers):
+    sock = socket.create_connection((host, port))
+    sock.sendall('GET /sse-hub HTTP/1.1\r\nHost: %s\r\n\r\n' % host)
+    subscribers[sock.fileno()] = [sock, '']
+    poller.register(sock.fileno(), select.EPOLLIN)
+
+    if n % 1000 == 0:
+      clearstderrline()
+      sys.stderr.write('*** Connected %d of %d subscribers\r' % (n, n_subscribers))
+
+  def wait_for(data):
+    marker = 'data: %s\r\n\r\n' % data
+    pending = len(subscribers)
+
+    while pending:
+      for fd, _ in poller.poll(5):
+        subscriber = subscribers[fd]
+        if subscriber[1] is None:
+          continue
+        subscriber[1] += subscriber[0].recv(65536)
+        if marker in subscriber[1]:
+          pending -= 1
+          subscriber[1] = None
+
+    for subscriber in subscribers.values():
+      subscriber[1] = ''
+
+  # Every subscriber has been handed over to the hub once it's counted.
+  while publish('warmup') < n_subscribers:
+    time.sleep(0.1)
+  wait_for('warmup')
+
+  print('event,subscribers,seconds')
+  for event in range(n_events):
+    start = time.time()
+    publish('%d' % event)
+    wait_for('%d' % event)
+    clearstderrline()
+    print('%d,%d,%f' % (event, n_subscribers, time.time() - start))
+
+  for subscriber in subscribers.values():
+    subscriber[0].close()
+
+
+def lua_handlers(host, port, n_threads, n_connections, n_requests):
+  # Handlers from test.lua (and the inline script), as configured in
+  # testrunner.conf; every request runs in a Lua thread.
+  paths = ('/inline', '/lua/hello', '/lua/hello?name=foo', '/lua/cookie',
+           '/lua/random')
+
+  print('path,n_connections,rps,2xx,4xx,5xx')
+  for path in paths:
+    url = 'http://%s:%d%s' % (host, port, path)
+    results = weighttp(url, n_threads, n_connections, n_requests, True)
+    status = results['status_codes']
+
+    clearstderrline()
+    print('%s,%d,%d,%d,%d,%d' % (path, n_connections, results['reqs_per_sec'],
+      status['2xx'], status['4xx'], status['5xx']))
+
+
 class CSVOutput:
   def header(self):
     print('keep_alive,n_connections,rps,kbps,2xx,3xx,4xx,5xx')
@@ -127,7 +275,8 @@ class MatplotlibOutput:
 
     n_connections = self.n_connections[:len(self.rps['close'])]
 
-    plt.plot(n_connections, self.rps['keep-alive'], label='Keep-Alive')
+    if self.rps['keep-alive']:
+      plt.plot(n_connections, self.rps['keep-alive'], label='Keep-Alive')
     plt.plot(n_connections, self.rps['close'], label='Close',
           marker='o', linestyle='--', color='r')
 
@@ -151,13 +300,39 @@ class MatplotlibOutput:
 
 
 if __name__ == '__main__':
+  # Fan-out of server-sent events to many idle subscribers, one event
+  # at a time; measures how long it takes for all of them to get it.
+  sse_subscribers = cmdlineintarg('--sse-subscribers')
+  if sse_subscribers:
+    sse_fanout('localhost', 8080, sse_subscribers, cmdlineintarg('--sse-events', 10))
+    lwan.kill()
+    sys.exit(0)
+
+  # Latency of requests for a small file, alone and then while a large
+  # file is being downloaded over and over; the large file must be
+  # served by lwan (e.g. placed in wwwroot).
+  large_file = cmdlinestrarg('--large-file')
+  if large_file:
+    small_file_latency('localhost', 8080, cmdlinestrarg('--small-file', '/100.html'),
+      large_file, cmdlineintarg('--downloads', 4), cmdlineintarg('--small-requests', 1000))
+    lwan.kill()
+    sys.exit(0)
+
   if not weighttp_has_json_output():
     print('This script requires a special version of weighttp which supports JSON')
     print('output. Get it at http://github.com/lpereira/weighttp')
     sys.exit(1)
 
+  # Requests/s for Lua handlers, all with the same number of connections.
+  if cmdlineboolarg('--lua'):
+    lua_handlers('localhost', 8080, cmdlineintarg('--threads', 2),
+      cmdlineintarg('--connections', 100), cmdlineintarg('--request', 1000000))
+    lwan.kill()
+    sys.exit(0)
+
   plot = cmdlineboolarg('--plot')
   xkcd = cmdlineboolarg('--xkcd')
+  close_only = cmdlineboolarg('--close-only')
   n_threads = cmdlineintarg('--threads', 2)
   n_requests = cmdlineintarg('--request', 1000000)
   keep_alive_timeout = cmdlineintarg('--keep-alive-timeout', 5)
@@ -177,7 +352,9 @@ if __name__ == '__main__':
     output = CSVOutput()
 
   output.header()
-  for keep_alive in (True, False):
+  # Short-lived connections stress the accept path (TCP_DEFER_ACCEPT,
+  # TCP_FASTOPEN, first read) rather than request processing.
+  for keep_alive in ((False,) if close_only else (True, False)):
     for n_connections in steprange(n_conn_start, n_conn_end, n_conn_step):
       results = weighttp(url, n_threads, n_connections, n_requests, keep_alive)
       status = results['status_codes']
@@ -3,13 +3,17 @@
 #       performs certain system calls. This should speed up the mmap tests
 #       considerably and make it possible to perform more low-level tests.
 
+import base64
 import os
 import re
 import requests
+import shutil
 import signal
 import socket
+import struct
 import subprocess
 import sys
+import threading
 import time
 import unittest
 
@@ -21,6 +25,10 @@ for arg in sys.argv[1:]:
 
 print('Using', LWAN_PATH, 'for lwan')
 
+def tool_path(name):
+  # Tools in src/bin/tools are built along with the test runner.
+  return os.path.join(os.path.dirname(LWAN_PATH), '..', 'tools', name)
+
 class LwanTest(unittest.TestCase):
   def setUp(self):
     for spawn_try in range(20):
@@ -182,6 +190,112 @@ class TestFileServing(LwanTest):
     self.assertEqual(r.text, 'X' * 100)
 
 
+  def test_small_file_date_is_refreshed(self):
+    r = requests.get('http://127.0.0.1:8080/100.html')
+    self.assertResponseHtml(r)
+    self.assertTrue('date' in r.headers)
+    first_date = r.headers['date']
+
+    time.sleep(1.1)
+
+    r = requests.get('http://127.0.0.1:8080/100.html')
+    self.assertResponseHtml(r)
+    self.assertNotEqual(r.headers['date'], first_date)
+    self.assertEqual(r.text, 'X' * 100)
+
+
+  def test_small_file_not_modified(self):
+    r = requests.get('http://127.0.0.1:8080/100.html')
+    self.assertResponseHtml(r)
+
+    r = requests.get('http://127.0.0.1:8080/100.html',
+          headers={'If-Modified-Since': r.headers['last-modified']})
+    self.assertResponseHtml(r, 304)
+    self.assertEqual(r.text, '')
+
+
+  def test_small_file_etag(self):
+    r = requests.get('http://127.0.0.1:8080/100.html',
+          headers={'Accept-Encoding': 'foobar'})
+    self.assertResponseHtml(r)
+    self.assertTrue('etag' in r.headers)
+    etag = r.headers['etag']
+
+    r = requests.get('http://127.0.0.1:8080/100.html',
+          headers={'Accept-Encoding': 'deflate'})
+    self.assertResponseHtml(r)
+    self.assertNotEqual(r.headers['etag'], etag)
+
+    for if_none_match in (etag, 'W/' + etag, '"foo", ' + etag, '*'):
+      r = requests.get('http://127.0.0.1:8080/100.html',
+            headers={'Accept-Encoding': 'foobar',
+                     'If-None-Match': if_none_match})
+      self.assertResponseHtml(r, 304)
+      self.assertEqual(r.headers['etag'], etag)
+      self.assertEqual(r.text, '')
+
+    # If-Modified-Since is ignored when If-None-Match is present
+    r = requests.get('http://127.0.0.1:8080/100.html',
+          headers={'Accept-Encoding': 'foobar',
+                   'If-None-Match': '"foo"',
+                   'If-Modified-Since': r.headers['last-modified']})
+    self.assertResponseHtml(r)
+    self.assertEqual(r.text, 'X' * 100)
+
+
+  def test_larger_file_etag(self):
+    r = requests.get('http://127.0.0.1:8080/zero')
+    self.assertHttpResponseValid(r, 200, 'application/octet-stream')
+    self.assertTrue('etag' in r.headers)
+
+    r = requests.get('http://127.0.0.1:8080/zero',
+          headers={'If-None-Match': r.headers['etag'],
+                   'Range': 'bytes=100-'})
+    self.assertHttpResponseValid(r, 304, 'application/octet-stream')
+    self.assertEqual(r.text, '')
+
+
+  def test_single_range(self):
+    for path, size in (('/100.html', 100), ('/zero', 32768)):
+      r = requests.get('http://127.0.0.1:8080' + path,
+            headers={'Range': 'bytes=10-19'})
+      self.assertEqual(r.status_code, 206)
+      self.assertEqual(r.headers['content-range'], 'bytes 10-19/%d' % size)
+      self.assertEqual(r.headers['content-length'], '10')
+      self.assertFalse('content-encoding' in r.headers)
+
+      r = requests.get('http://127.0.0.1:8080' + path,
+            headers={'Range': 'bytes=-5'})
+      self.assertEqual(r.status_code, 206)
+      self.assertEqual(r.headers['content-range'],
+            'bytes %d-%d/%d' % (size - 5, size - 1, size))
+
+      r = requests.get('http://127.0.0.1:8080' + path,
+            headers={'Range': 'bytes=%d-' % size})
+      self.assertEqual(r.status_code, 416)
+
+
+  def test_multiple_ranges(self):
+    for path, size in (('/100.html', 100), ('/zero', 32768)):
+      r = requests.get('http://127.0.0.1:8080' + path,
+            headers={'Range': 'bytes=50-59,0-9,5-14'})
+      self.assertEqual(r.status_code, 206)
+
+      content_type = r.headers['content-type']
+      self.assertTrue(content_type.startswith('multipart/byteranges; boundary='))
+      boundary = content_type.split('=', 1)[1]
+
+      # Overlapping ranges are coalesced, and parts are sorted
+      parts = r.content.split(b'\r\n--' + boundary.encode())
+      self.assertEqual(parts[0], b'')
+      self.assertEqual(parts[-1], b'--\r\n')
+      self.assertEqual(len(parts), 4)
+      self.assertTrue(b'Content-Range: bytes 0-14/%d\r\n\r\n' % size in parts[1])
+      self.assertTrue(b'Content-Range: bytes 50-59/%d\r\n\r\n' % size in parts[2])
+      self.assertEqual(len(parts[1].split(b'\r\n\r\n', 1)[1]), 15)
+      self.assertEqual(len(parts[2].split(b'\r\n\r\n', 1)[1]), 10)
+
+
   def test_get_root(self):
     r = requests.get('http://127.0.0.1:8080/')
 
@@ -244,6 +358,34 @@ class TestFileServing(LwanTest):
     self.assertTrue('</html>' in r.text)
 
 
+  def test_directory_listing_json_paginated(self):
+    names = []
+    url = 'http://127.0.0.1:8080/icons/?format=json&limit=2'
+
+    for page in range(2):
+      r = requests.get(url)
+
+      self.assertHttpResponseValid(r, 200, 'application/json')
+      self.assertEqual(r.headers['transfer-encoding'], 'chunked')
+
+      listing = r.json()
+      self.assertEqual(listing['path'], '/icons')
+      for entry in listing['entries']:
+        self.assertEqual(entry['type'], 'image/gif')
+        self.assertTrue(entry['size'] > 0)
+      names += [entry['name'] for entry in listing['entries']]
+
+      if page == 0:
+        self.assertEqual(len(listing['entries']), 2)
+        self.assertTrue('format=json' in listing['next'])
+        url = 'http://127.0.0.1:8080/icons/' + listing['next']
+      else:
+        self.assertEqual(len(listing['entries']), 1)
+        self.assertFalse('next' in listing)
+
+    self.assertEqual(sorted(names), ['back.gif', 'file.gif', 'folder.gif'])
+
+
   def test_has_lwan_server_header(self):
     r = requests.get('http://127.0.0.1:8080/100.html')
     self.assertTrue('server' in r.headers)
@@ -378,6 +520,153 @@ class TestMalformedRequests(SocketTest):
     except requests.exceptions.ConnectionError:
       pass
 
+class TestPathResolution(SocketTest):
+  # A scratch directory inside the root, and a sibling of the root sharing
+  # its name as a prefix, which must never be reachable.
+  def setUp(self):
+    super().setUp()
+
+    root = os.path.realpath('wwwroot')
+    self.scratch = os.path.join(root, 'path-resolution')
+    self.outside = root + '-outside'
+    for path in (self.scratch, self.outside):
+      shutil.rmtree(path, ignore_errors=True)
+      self.addCleanup(shutil.rmtree, path, ignore_errors=True)
+
+    os.makedirs(os.path.join(self.scratch, 'a', 'b'))
+    os.makedirs(self.outside)
+    for path, contents in (('lexical.txt', 'lexical'),
+                           ('a/lexical.txt', 'physical'),
+                           ('a/b/deep.txt', 'deep'),
+                           ('a/b/other.txt', 'other')):
+      with open(os.path.join(self.scratch, path), 'w') as f:
+        f.write(contents)
+    with open(os.path.join(self.outside, 'secret.txt'), 'w') as f:
+      f.write('secret')
+
+    os.symlink('a/b', os.path.join(self.scratch, 'link'))
+    os.symlink(self.outside, os.path.join(self.scratch, 'escape'))
+    os.symlink('../../' + os.path.basename(self.outside),
+               os.path.join(self.scratch, 'escape-relative'))
+    os.symlink(os.path.join(self.outside, 'secret.txt'),
+               os.path.join(self.scratch, 'escape.txt'))
+
+  def get(self, path):
+    # Sent as is: HTTP clients would resolve dot segments themselves.
+    with self.connect() as sock:
+      sock.send('GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n' % path)
+      contents = ''
+      while '\r\n\r\n' not in contents:
+        contents += sock.recv(4096)
+
+      head, body = contents.split('\r\n\r\n', 1)
+      length = int(re.search(r'Content-Length: (\d+)', head, re.I).group(1))
+      while len(body) < length:
+        body += sock.recv(4096)
+
+    return int(head.split(' ')[1]), body
+
+  def assertNotFound(self, path):
+    status, body = self.get(path)
+    self.assertEqual(status, 404, path)
+    self.assertFalse('secret' in body, path)
+
+  def test_encoded_dot_dot(self):
+    self.assertNotFound('/%2e%2e/wwwroot-outside/secret.txt')
+    self.assertNotFound('/path-resolution/%2E%2E/%2e%2e/wwwroot-outside/secret.txt')
+
+  def test_dot_dot_above_root(self):
+    self.assertNotFound('/path-resolution/a/../../../wwwroot-outside/secret.txt')
+    self.assertEqual(self.get('/path-resolution/a/../lexical.txt'), (200, 'lexical'))
+
+  def test_symlink_out_of_root(self):
+    self.assertNotFound('/path-resolution/escape/secret.txt')
+    self.assertNotFound('/path-resolution/escape-relative/secret.txt')
+    self.assertNotFound('/path-resolution/escape.txt')
+
+  def test_symlink_in_root(self):
+    self.assertEqual(self.get('/path-resolution/link/deep.txt'), (200, 'deep'))
+
+  def test_dot_dot_is_resolved_before_symlinks(self):
+    # "link" points to "a/b", but "link/.." is where "link" is.
+    self.assertEqual(self.get('/path-resolution/link/../lexical.txt'), (200, 'lexical'))
+
+  def test_directory_replaced_while_cached(self):
+    # Opens (and caches) the directory.
+    self.assertEqual(self.get('/path-resolution/a/b/deep.txt'), (200, 'deep'))
+
+    os.rename(os.path.join(self.scratch, 'a', 'b'),
+              os.path.join(self.outside, 'b'))
+    os.mkdir(os.path.join(self.scratch, 'a', 'b'))
+    with open(os.path.join(self.scratch, 'a', 'b', 'other.txt'), 'w') as f:
+      f.write('replacement')
+
+    self.assertEqual(self.get('/path-resolution/a/b/other.txt'), (200, 'replacement'))
+
+
+class TestBundle(LwanTest):
+  # Bundles are mapped once at startup, so this one has to be packed
+  # before the test runner is started.
+  def setUp(self):
+    mkbundle = tool_path('mkbundle')
+    if not os.path.exists(mkbundle):
+      self.skipTest('mkbundle has not been built')
+
+    self.tree = os.path.realpath('bundle-tree')
+    shutil.rmtree(self.tree, ignore_errors=True)
+    self.addCleanup(shutil.rmtree, self.tree, ignore_errors=True)
+
+    os.makedirs(os.path.join(self.tree, 'dir'))
+    for path, contents in (('small.txt', 'small'),
+                           ('dir/index.html', 'index'),
+                           ('large.txt', 'compressible ' * 4096)):
+      with open(os.path.join(self.tree, path), 'w') as f:
+        f.write(contents)
+    # Neither is packed: one leads out of the tree, the other loops.
+    os.symlink(os.path.realpath('wwwroot/100.html'),
+               os.path.join(self.tree, 'link.html'))
+    os.symlink('..', os.path.join(self.tree, 'dir', 'loop'))
+
+    self.addCleanup(os.unlink, 'test.bundle')
+    output = subprocess.check_output([mkbundle, self.tree, 'test.bundle'],
+                                     stderr=subprocess.STDOUT)
+    self.assertTrue(b'Packed 3 files' in output)
+
+    super().setUp()
+
+  def test_served_from_bundle(self):
+    # Changing the tree doesn't change what's in the bundle.
+    with open(os.path.join(self.tree, 'small.txt'), 'w') as f:
+      f.write('changed')
+
+    r = requests.get('http://127.0.0.1:8080/bundled/small.txt')
+    self.assertResponsePlain(r)
+    self.assertEqual(r.text, 'small')
+
+    r = requests.get('http://127.0.0.1:8080/bundled/dir/')
+    self.assertResponseHtml(r)
+    self.assertEqual(r.text, 'index')
+
+  def test_deflated_copy(self):
+    r = requests.get('http://127.0.0.1:8080/bundled/large.txt',
+                     headers={'Accept-Encoding': 'deflate'})
+    self.assertResponsePlain(r)
+    self.assertEqual(r.headers['Content-Encoding'], 'deflate')
+    self.assertEqual(r.text, 'compressible ' * 4096)
+
+  def test_symlinks_are_not_packed(self):
+    # Not in the bundle, nor in "path".
+    for path in ('/bundled/link.html', '/bundled/dir/loop/small.txt'):
+      r = requests.get('http://127.0.0.1:8080' + path)
+      self.assertResponse404(r)
+
+  def test_falls_back_to_path(self):
+    r = requests.get('http://127.0.0.1:8080/bundled/100.html')
+    self.assertResponseHtml(r)
+    with open('wwwroot/100.html') as f:
+      self.assertEqual(r.text, f.read())
+
+
 class TestChunkedEncoding(LwanTest):
   def test_chunked_encoding(self):
     r = requests.get('http://localhost:8080/chunked')
@@ -390,6 +679,19 @@ class TestChunkedEncoding(LwanTest):
       ''.join('*This is chunk %d*\n' % i for i in range(11)) +
       'Last chunk\n')
 
+
+class TestTemplate(LwanTest):
+  def test_sequence(self):
+    r = requests.get('http://127.0.0.1:8080/template-sequence', params={'n': 3})
+    self.assertResponsePlain(r)
+    self.assertEqual(r.text, '[0][1][2].!')
+
+  def test_empty_sequence(self):
+    r = requests.get('http://127.0.0.1:8080/template-sequence', params={'n': 0})
+    self.assertResponsePlain(r)
+    self.assertEqual(r.text, '.empty!')
+
+
 class TestLua(LwanTest):
   def test_inline(self):
     r = requests.get('http://localhost:8080/inline')
@@ -406,6 +708,11 @@ class TestLua(LwanTest):
     self.assertResponseHtml(r)
     self.assertEqual(r.text, 'Hello, foo!')
 
+  def test_backend_connection(self):
+    r = requests.get('http://localhost:8080/lua/backend')
+    self.assertResponseHtml(r)
+    self.assertEqual(r.text, 'Backend said: Hello, world!')
+
   def test_cookies(self):
     cookies_to_send = {
         'FOO': 'BAR'
@@ -422,6 +729,109 @@ class TestLua(LwanTest):
       self.assertTrue(cookie in r.cookies)
       self.assertEqual(r.cookies[cookie], value)
 
+  def test_shared_dict(self):
+    counts = [int(float(requests.get('http://localhost:8080/lua/shared_incr?key=hits').text))
+              for i in range(8)]
+    self.assertEqual(counts, list(range(counts[0], counts[0] + 8)))
+
+    r = requests.get('http://localhost:8080/lua/shared?key=foo&value=bar')
+    self.assertResponseHtml(r)
+    self.assertEqual(r.text, 'bar')
+    r = requests.get('http://localhost:8080/lua/shared?key=foo')
+    self.assertEqual(r.text, 'bar')
+
+    r = requests.get('http://localhost:8080/lua/shared?key=foo&value=baz&ttl=0.1')
+    self.assertEqual(r.text, 'baz')
+    time.sleep(0.2)
+    r = requests.get('http://localhost:8080/lua/shared?key=foo')
+    self.assertEqual(r.text, 'nil')
+
+    # Huge TTLs (math.huge, here) never expire
+    r = requests.get('http://localhost:8080/lua/shared?key=foo&value=qux&ttl=inf')
+    self.assertEqual(r.text, 'qux')
+    r = requests.get('http://localhost:8080/lua/shared?key=foo')
+    self.assertEqual(r.text, 'qux')
+
+  def test_kept_request_is_unusable(self):
+    # Same connection, so that both requests are handled by the same thread
+    s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    s.connect(('127.0.0.1', 8080))
+    for expected in (b'kept', b'unusable', b'unusable'):
+      s.send(b'GET /lua/kept_request HTTP/1.1\r\nConnection: keep-alive\r\n\r\n')
+      response = s.recv(4096)
+      self.assertTrue(response.startswith(b'HTTP/1.1 200 OK'))
+      self.assertTrue(response.endswith(b'\r\n\r\n' + expected))
+    s.close()
+
+  def test_kept_connection_is_unusable(self):
+    s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    s.connect(('127.0.0.1', 8080))
+    for expected in (b'kept', b'unusable'):
+      s.send(b'GET /lua/kept_connection HTTP/1.1\r\nConnection: keep-alive\r\n\r\n')
+      response = s.recv(4096)
+      self.assertTrue(response.startswith(b'HTTP/1.1 200 OK'))
+      self.assertTrue(response.endswith(b'\r\n\r\n' + expected))
+    s.close()
+
+  def test_connect_by_name_fails(self):
+    r = requests.get('http://localhost:8080/lua/connect_by_name')
+    self.assertResponseHtml(r)
+    self.assertEqual(r.text, 'Invalid argument')
+
+  def test_dispatch_table(self):
+    # Handlers are picked by the first path component and the method.
+    r = requests.get('http://localhost:8080/lua/hello/ignored?name=foo')
+    self.assertEqual(r.text, 'Hello, foo!')
+
+    r = requests.get('http://localhost:8080/lua/')
+    self.assertResponseHtml(r)
+    self.assertIn('handle_get_hello', r.text)
+
+    for method, path in (('GET', '/lua/nosuch'), ('GET', '/lua/hell'),
+                         ('GET', '/lua/hellox'), ('POST', '/lua/hello'),
+                         ('GET', '/lua/starts')):
+      r = requests.request(method, 'http://localhost:8080' + path)
+      self.assertEqual(r.status_code, 404)
+
+  def test_script_is_reloaded(self):
+    def get(path):
+      s.send(b'GET ' + path + b' HTTP/1.1\r\nConnection: keep-alive\r\n\r\n')
+      return s.recv(4096)
+
+    with open('test.lua') as f:
+      original = f.read()
+
+    # Same connection, so that the thread replacing its state is one
+    # that already had one.
+    s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    s.connect(('127.0.0.1', 8080))
+    self.addCleanup(s.close)
+    self.assertTrue(get(b'/lua/hello').endswith(b'Hello, World!'))
+
+    try:
+      with open('test.lua.tmp', 'w') as f:
+        f.write('''function handle_get_item(req) req:set_response("get") end
+                   function handle_post_item(req) req:set_response("post") end
+                   handle_get_value = 42''')
+      os.rename('test.lua.tmp', 'test.lua')
+
+      # Changes are picked up by the job thread, which might be sleeping.
+      for i in range(40):
+        response = get(b'/lua/item')
+        if response.startswith(b'HTTP/1.1 200 OK'):
+          break
+        time.sleep(0.5)
+      self.assertTrue(response.endswith(b'\r\n\r\nget'))
+
+      r = requests.post('http://localhost:8080/lua/item/1')
+      self.assertEqual(r.text, 'post')
+
+      for path in (b'/lua/hello', b'/lua/value'):
+        self.assertTrue(get(path).startswith(b'HTTP/1.1 404 '))
+    finally:
+      with open('test.lua', 'w') as f:
+        f.write(original)
+
 
 class TestAuthentication(LwanTest):
   class TempHtpasswd:
@@ -460,6 +870,311 @@ class TestAuthentication(LwanTest):
 
       self.assertEqual(r.text, 'Hello, world!')
 
+  # "test123", hashed with SHA-512 crypt
+  HASHED_PASSWORD = '$6$lwansalt$zvMADV52a.XfOPTpmbV.BosJjIpS8dkyqq9ObzVUKddbOjWlB8UOwZTTxxarS60GdeecyEKHLpCKRGcg/KWck1'
+
+  def test_valid_hashed_creds(self):
+    with TestAuthentication.TempHtpasswd({'foo': 'bar', 'foobar': self.HASHED_PASSWORD}):
+      # Second time around, the credentials are found in the cache
+      for i in range(2):
+        r = requests.get('http://127.0.0.1:8080/admin', auth=requests.auth.HTTPBasicAuth('foobar', 'test123'))
+        self.assertResponsePlain(r)
+        self.assertEqual(r.text, 'Hello, world!')
+
+  def test_invalid_hashed_creds(self):
+    with TestAuthentication.TempHtpasswd({'foo': 'bar', 'foobar': self.HASHED_PASSWORD}):
+      for password in ('test12', self.HASHED_PASSWORD):
+        r = requests.get('http://127.0.0.1:8080/admin', auth=requests.auth.HTTPBasicAuth('foobar', password))
+        self.assertResponseHtml(r, status_code=401)
+
+  def test_hashed_creds_failures_are_throttled(self):
+    def get_admin(s, password):
+      creds = base64.b64encode(b'foobar:' + password).decode()
+      s.send(('GET /admin HTTP/1.1\r\nConnection: keep-alive\r\n'
+              'Authorization: Basic %s\r\n\r\n' % creds).encode())
+      return s.recv(4096)
+
+    with TestAuthentication.TempHtpasswd({'foobar': self.HASHED_PASSWORD}):
+      # Same connection, so that all requests are handled by the same thread
+      s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+      s.connect(('127.0.0.1', 8080))
+      for i in range(5):
+        response = get_admin(s, b'wrong%d' % i)
+        self.assertTrue(response.startswith(b'HTTP/1.1 401 '))
+
+      # Not even checked until the client stops failing for a while
+      response = get_admin(s, b'test123')
+      self.assertTrue(response.startswith(b'HTTP/1.1 401 '))
+      s.close()
+
+
+class TestRateLimit(LwanTest):
+  def test_rate_limit_by_remote_address(self):
+    for i in range(2):
+      r = requests.get('http://127.0.0.1:8080/rate-limited')
+      self.assertResponsePlain(r)
+
+    r = requests.get('http://127.0.0.1:8080/rate-limited')
+    self.assertResponseHtml(r, status_code=429)
+
+    r = requests.get('http://127.0.0.1:8080/hello')
+    self.assertResponsePlain(r)
+
+  def test_rate_limit_by_header(self):
+    for i in range(2):
+      r = requests.get('http://127.0.0.1:8080/rate-limited',
+                       headers={'X-Client-Id': 'foo'})
+      self.assertResponsePlain(r)
+
+    r = requests.get('http://127.0.0.1:8080/rate-limited',
+                     headers={'X-Client-Id': 'foo'})
+    self.assertResponseHtml(r, status_code=429)
+
+    r = requests.get('http://127.0.0.1:8080/rate-limited',
+                     headers={'X-Client-Id': 'bar'})
+    self.assertResponsePlain(r)
+
+
+class TestReverseProxy(LwanTest):
+  # /proxied forwards to this same instance; its first upstream is never
+  # up, so every request also exercises failing over to the next one.
+  def test_proxied_request(self):
+    r = requests.get('http://127.0.0.1:8080/proxied/hello?name=proxy')
+    self.assertResponsePlain(r)
+    self.assertEqual(r.text, 'Hello, proxy!')
+    self.assertEqual(r.headers['X-The-Answer-To-The-Universal-Question'], '42')
+
+  def test_request_headers_are_forwarded(self):
+    r = requests.get('http://127.0.0.1:8080/proxied/hello?dump_vars=1',
+                     cookies={'foo': 'bar'})
+    self.assertResponsePlain(r)
+    self.assertTrue('Key = "foo"; Value = "bar"' in r.text)
+    self.assertTrue('Key = "dump_vars"; Value = "1"' in r.text)
+
+  def test_proxied_post(self):
+    r = requests.post('http://127.0.0.1:8080/proxied/post/blend',
+                      json={'will-it-blend': True})
+    self.assertHttpResponseValid(r, 200, 'application/json')
+    self.assertEqual(r.json(), {'did-it-blend': 'oh-hell-yeah'})
+
+  def test_proxied_large_file(self):
+    r = requests.get('http://127.0.0.1:8080/proxied/zero')
+    self.assertHttpResponseValid(r, 200, 'application/octet-stream')
+    self.assertEqual(r.content, open('wwwroot/zero', 'rb').read())
+
+  def test_proxied_chunked_response(self):
+    r = requests.get('http://127.0.0.1:8080/proxied/chunked')
+    self.assertResponsePlain(r)
+    self.assertEqual(r.headers['Transfer-Encoding'], 'chunked')
+    self.assertEqual(r.text,
+      'Testing chunked encoding! First chunk\n' +
+      ''.join('*This is chunk %d*\n' % i for i in range(11)) +
+      'Last chunk\n')
+
+  def test_upstream_connections_are_reused(self):
+    with requests.Session() as s:
+      for i in range(10):
+        r = s.get('http://127.0.0.1:8080/proxied/hello?name=%d' % i)
+        self.assertResponsePlain(r)
+        self.assertEqual(r.text, 'Hello, %d!' % i)
+        r = s.get('http://127.0.0.1:8080/proxied/100.html')
+        self.assertResponseHtml(r)
+        self.assertEqual(len(r.content), 100)
+
+  def test_upstream_down(self):
+    r = requests.get('http://127.0.0.1:8080/proxied-down/')
+    self.assertResponseHtml(r, status_code=502)
+
+  def test_upstream_timeout(self):
+    # Connections are accepted by the kernel, but nothing is ever read
+    # from them or written to them.
+    with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as server:
+      server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+      server.bind(('127.0.0.1', 9002))
+      server.listen(16)
+
+      r = requests.get('http://127.0.0.1:8080/proxied-slow/')
+      self.assertResponseHtml(r, status_code=504)
+
+
+class FastCGIApplication(threading.Thread):
+  # Just enough of a FastCGI application to test the gateway: responds
+  # with the parameters and body it got, keeping connections open if asked.
+  def __init__(self, port):
+    super().__init__(daemon=True)
+    self.server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    self.server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    self.server.bind(('127.0.0.1', port))
+    self.server.listen(16)
+    self.connections = 0
+
+  def run(self):
+    while True:
+      try:
+        conn, _ = self.server.accept()
+      except OSError:
+        return
+      self.connections += 1
+      threading.Thread(target=self.serve, args=(conn,), daemon=True).start()
+
+  def stop(self):
+    # Tests can stop the application before tearDown() does.
+    if self.server.fileno() < 0:
+      return
+    self.server.shutdown(socket.SHUT_RDWR)
+    self.server.close()
+
+  @staticmethod
+  def recv_exactly(conn, length):
+    data = b''
+    while len(data) < length:
+      chunk = conn.recv(length - len(data))
+      if not chunk:
+        raise EOFError
+      data += chunk
+    return data
+
+  @staticmethod
+  def record(type, content, padding=0):
+    return struct.pack('>BBHHBx', 1, type, 1, len(content), padding) + \
+      content + b'\0' * padding
+
+  @staticmethod
+  def parse_params(data):
+    params = {}
+    while data:
+      lengths = []
+      for _ in range(2):
+        if data[0] & 0x80:
+          lengths.append(struct.unpack('>I', data[:4])[0] & 0x7fffffff)
+          data = data[4:]
+        else:
+          lengths.append(data[0])
+          data = data[1:]
+      name = data[:lengths[0]].decode()
+      params[name] = data[lengths[0]:lengths[0] + lengths[1]].decode()
+      data = data[lengths[0] + lengths[1]:]
+    return params
+
+  def serve(self, conn):
+    try:
+      while True:
+        params, stdin, keep_conn = b'', b'', False
+        while True:
+          _, type, _, length, padding = \
+            struct.unpack('>BBHHBx', self.recv_exactly(conn, 8))
+          content = self.recv_exactly(conn, length + padding)[:length]
+          if type == 1:
+            keep_conn = bool(content[2] & 1)
+          elif type == 4:
+            params += content
+          elif type == 5:
+            if not content:
+              break
+            stdin += content
+        self.respond(conn, self.parse_params(params), stdin)
+        if not keep_conn:
+          break
+    except (EOFError, OSError):
+      pass
+    conn.close()
+
+  def respond(self, conn, params, stdin):
+    path = params.get('PATH_INFO', '')
+    if path == '/slow':
+      time.sleep(2)
+    if path == '/redirect':
+      out = b'Location: /hello\r\n\r\n'
+    elif path == '/missing':
+      out = b'Status: 404 Not Found\nContent-Type: text/plain\n\nnot here'
+    elif path == '/large':
+      out = b'Content-Type: application/octet-stream\r\n\r\n' + b'x' * 200000
+    else:
+      body = ''.join('%s=%s\n' % kv for kv in sorted(params.items()))
+      body += 'connections=%d\n' % self.connections
+      out = b'Content-Type: text/plain\r\nX-Application: fastcgi\r\n\r\n' + \
+        body.encode() + stdin
+    response = self.record(7, b'warning from the application')
+    for i in range(0, len(out), 65535):
+      response += self.record(6, out[i:i + 65535], padding=i % 8)
+    response += self.record(6, b'') + self.record(3, b'\0\0\0\0\0\0\0\0')
+    conn.sendall(response)
+
+
+class TestFastCGI(LwanTest):
+  def setUp(self):
+    self.application = FastCGIApplication(9001)
+    self.application.start()
+    super().setUp()
+
+  def tearDown(self):
+    super().tearDown()
+    self.application.stop()
+
+  def get_params(self, r):
+    return dict(line.split('=', 1) for line in r.text.splitlines() if '=' in line)
+
+  def test_params(self):
+    r = requests.get('http://127.0.0.1:8080/fcgi/some/path?a=b&c=d',
+                     headers={'X-Foo': 'bar', 'Proxy': 'evil'})
+    self.assertResponsePlain(r)
+    self.assertEqual(r.headers['X-Application'], 'fastcgi')
+    params = self.get_params(r)
+    self.assertEqual(params['REQUEST_METHOD'], 'GET')
+    self.assertEqual(params['SCRIPT_FILENAME'], '/app.fcgi')
+    self.assertEqual(params['SCRIPT_NAME'], '/fcgi')
+    self.assertEqual(params['PATH_INFO'], '/some/path')
+    self.assertEqual(params['QUERY_STRING'], 'a=b&c=d')
+    self.assertEqual(params['REQUEST_URI'], '/fcgi/some/path?a=b&c=d')
+    self.assertEqual(params['HTTP_X_FOO'], 'bar')
+    self.assertEqual(params['SERVER_PORT'], '8080')
+    self.assertEqual(params['REMOTE_ADDR'], '127.0.0.1')
+    self.assertFalse('HTTP_PROXY' in params)
+
+  def test_post(self):
+    r = requests.post('http://127.0.0.1:8080/fcgi/post', data=b'some=data',
+                      headers={'Content-Type': 'application/x-www-form-urlencoded'})
+    self.assertResponsePlain(r)
+    params = self.get_params(r)
+    self.assertEqual(params['REQUEST_METHOD'], 'POST')
+    self.assertEqual(params['CONTENT_LENGTH'], '9')
+    self.assertEqual(params['CONTENT_TYPE'], 'application/x-www-form-urlencoded')
+    self.assertTrue(r.text.endswith('some=data'))
+
+  def test_status_and_location(self):
+    r = requests.get('http://127.0.0.1:8080/fcgi/missing')
+    self.assertResponsePlain(r, 404)
+    self.assertEqual(r.text, 'not here')
+
+    r = requests.get('http://127.0.0.1:8080/fcgi/redirect', allow_redirects=False)
+    self.assertEqual(r.status_code, 302)
+    self.assertEqual(r.headers['Location'], '/hello')
+
+  def test_large_response_is_streamed(self):
+    r = requests.get('http://127.0.0.1:8080/fcgi/large')
+    self.assertHttpResponseValid(r, 200, 'application/octet-stream')
+    self.assertEqual(r.headers['Transfer-Encoding'], 'chunked')
+    self.assertEqual(r.content, b'x' * 200000)
+
+  def test_connections_are_reused(self):
+    with requests.Session() as s:
+      for i in range(10):
+        r = s.get('http://127.0.0.1:8080/fcgi/?i=%d' % i)
+        self.assertResponsePlain(r)
+    self.assertEqual(self.get_params(r)['connections'], '1')
+
+  def test_application_timeout(self):
+    r = requests.get('http://127.0.0.1:8080/fcgi-timeout/slow')
+    self.assertResponseHtml(r, status_code=504)
+
+    r = requests.get('http://127.0.0.1:8080/fcgi-timeout/')
+    self.assertResponsePlain(r)
+
+  def test_application_down(self):
+    self.application.stop()
+    r = requests.get('http://127.0.0.1:8080/fcgi/')
+    self.assertResponseHtml(r, status_code=502)
+
 
 class TestHelloWorld(LwanTest):
   def test_cookies(self):
@@ -678,11 +1393,400 @@ Accept: text/plain,text/html;q=0.9,application/xhtml+xml;q=0.9,application/xml;q
       self.assertTrue(s in responses)
       responses = responses.replace(s, '')
 
+class TestEventStreamHub(SocketTest):
+  def publish(self, data, event=None, policy='drop_oldest', pad=0):
+    params = {'data': data, 'policy': policy, 'pad': pad}
+    if event:
+      params['event'] = event
+    r = requests.get('http://127.0.0.1:8080/sse-publish', params=params)
+    self.assertResponsePlain(r)
+    return int(r.text)
+
+  def wait_for_subscribers(self, n_subscribers, policy='drop_oldest'):
+    for attempt in range(50):
+      if self.publish('warmup', policy=policy) == n_subscribers:
+        break
+      time.sleep(0.1)
+    else:
+      self.fail('Subscribers never showed up')
+
+  def subscribe(self, n_subscribers):
+    socks = []
+    for n in range(n_subscribers):
+      sock = self.connect()
+      sock.send('GET /sse-hub HTTP/1.1\r\nHost: localhost\r\n\r\n')
+      socks.append(sock)
+
+    self.wait_for_subscribers(n_subscribers)
+
+    return socks
+
+  def slow_subscriber(self, policy):
+    # With a small receive buffer, and nothing read until everything has
+    # been published, the server can't write events as they come.
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+    sock.connect(('127.0.0.1', 8080))
+    sock.send(b'GET /sse-hub?policy=%s HTTP/1.1\r\nHost: localhost\r\n\r\n' %
+              policy.encode())
+    self.wait_for_subscribers(1, policy)
+
+    for i in range(200):
+      self.publish('event%d:' % i, policy=policy, pad=32768)
+    return sock
+
+  def assertEventsWellFormed(self, events):
+    numbers = []
+    for event in events:
+      m = re.match(rb'^data: (warmup|last|event(\d+):\.{32768})$', event)
+      self.assertTrue(m, event[:64])
+      if m.group(2):
+        numbers.append(int(m.group(2)))
+    self.assertEqual(numbers, sorted(numbers))
+    return numbers
+
+  def read_until(self, sock, marker):
+    contents = ''
+    while marker not in contents:
+      data = sock.recv(4096)
+      self.assertTrue(data, contents)
+      contents += data
+    return contents
+
+  def test_event_reaches_all_subscribers(self):
+    socks = self.subscribe(8)
+
+    self.assertEqual(self.publish('hello\nworld', 'greeting'), 8)
+
+    event = 'event: greeting\r\ndata: hello\r\ndata: world\r\n\r\n'
+    for sock in socks:
+      contents = self.read_until(sock, event)
+      self.assertTrue(contents.startswith('HTTP/1.1 200 OK'), contents)
+      self.assertTrue('Content-Type: text/event-stream' in contents, contents)
+      sock.close()
+
+  def test_slow_subscriber_drops_oldest(self):
+    sock = self.slow_subscriber('drop_oldest')
+    self.assertEqual(self.publish('last'), 1)
+
+    contents = b''
+    while not contents.endswith(b'data: last\r\n\r\n'):
+      data = sock.recv(65536)
+      self.assertTrue(data)
+      contents += data
+    sock.close()
+
+    head, body = contents.split(b'\r\n\r\n', 1)
+    self.assertTrue(head.startswith(b'HTTP/1.1 200 OK'))
+    numbers = self.assertEventsWellFormed(body.split(b'\r\n\r\n')[:-1])
+    # Events were dropped, but the newest ones made it.
+    self.assertTrue(len(numbers) < 200, numbers)
+    self.assertEqual(numbers[-1], 199)
+
+  def test_slow_subscriber_is_disconnected(self):
+    sock = self.slow_subscriber('disconnect')
+
+    contents = b''
+    while True:
+      data = sock.recv(65536)
+      if not data:
+        break
+      contents += data
+    sock.close()
+
+    # Whatever was sent before the connection was closed is intact,
+    # except maybe for the event that was being written.
+    head, body = contents.split(b'\r\n\r\n', 1)
+    self.assertTrue(head.startswith(b'HTTP/1.1 200 OK'))
+    numbers = self.assertEventsWellFormed(body.split(b'\r\n\r\n')[:-1])
+    self.assertTrue(len(numbers) < 200, numbers)
+    self.assertEqual(self.publish('anyone there?', policy='disconnect'), 0)
+
+  def test_subscribers_go_away_with_their_connections(self):
+    socks = self.subscribe(4)
+
+    for sock in socks:
+      sock.close()
+
+    for attempt in range(50):
+      if self.publish('anyone there?') == 0:
+        break
+      time.sleep(0.1)
+    else:
+      self.fail('Subscribers are still around')
+
+
 class TestArtificialResponse(LwanTest):
   def test_brew_coffee(self):
     r = requests.get('http://127.0.0.1:8080/brew-coffee')
 
     self.assertEqual(r.status_code, 418)
 
+
+class TestStats(LwanTest):
+  def test_counters(self):
+    r = requests.get('http://127.0.0.1:8080/stats')
+    self.assertResponsePlain(r)
+
+    counters = dict(line.split(' ') for line in r.text.splitlines())
+    for name in ('shed_connections', 'shed_per_ip', 'shed_requests', 'closed_idle',
+                 'busy_poll_spin_ns', 'busy_poll_sleeps', 'sendfile_bytes',
+                 'sendfile_cached_fds'):
+      self.assertTrue(name in counters)
+      self.assertTrue(int(counters[name]) >= 0)
+
+
+class TestCachedDescriptors(LwanTest):
+  # /few-fds sends every file with sendfile(), holding at most two
+  # descriptors open.
+  def setUp(self):
+    super().setUp()
+
+    self.scratch = os.path.join(os.path.realpath('wwwroot'), 'cached-fds')
+    shutil.rmtree(self.scratch, ignore_errors=True)
+    self.addCleanup(shutil.rmtree, self.scratch, ignore_errors=True)
+
+    os.makedirs(self.scratch)
+    for i in range(6):
+      self.write(i, 'file %d' % i)
+
+  def write(self, i, contents):
+    # Atomically, as deployments usually do.
+    path = os.path.join(self.scratch, 'f%d' % i)
+    with open(path + '.tmp', 'w') as f:
+      f.write(contents)
+    os.rename(path + '.tmp', path)
+
+  def get(self, i):
+    return requests.get('http://127.0.0.1:8080/few-fds/cached-fds/f%d' % i)
+
+  def cached_fds(self):
+    r = requests.get('http://127.0.0.1:8080/stats')
+    counters = dict(line.split(' ') for line in r.text.splitlines())
+    return int(counters['sendfile_cached_fds'])
+
+  def test_descriptors_are_bounded(self):
+    self.assertEqual(self.cached_fds(), 0)
+
+    for i in range(6):
+      r = self.get(i)
+      self.assertEqual(r.status_code, 200)
+      self.assertEqual(r.text, 'file %d' % i)
+
+    self.assertTrue(1 <= self.cached_fds() <= 2)
+
+    # Files whose descriptors were closed are reopened.
+    for i in range(6):
+      self.assertEqual(self.get(i).text, 'file %d' % i)
+
+  def test_file_replaced_after_descriptor_was_closed(self):
+    self.assertEqual(self.get(0).text, 'file 0')
+    for i in range(1, 6):
+      self.get(i)
+
+    self.write(0, 'replaced')
+
+    for _ in range(2):
+      r = self.get(0)
+      self.assertEqual(r.status_code, 200)
+      self.assertEqual(r.text, 'replaced')
+
+
+class TestInMemoryBudget(LwanTest):
+  # /budget keeps at most 40000 bytes in memory.  Whether a file was sent
+  # with sendfile() is told by the counter in /stats, read through the
+  # same connection so that it's been updated by then.
+  def setUp(self):
+    super().setUp()
+
+    self.scratch = os.path.join(os.path.realpath('wwwroot'), 'budget-test')
+    shutil.rmtree(self.scratch, ignore_errors=True)
+    self.addCleanup(shutil.rmtree, self.scratch, ignore_errors=True)
+
+    os.makedirs(self.scratch)
+    for name, size in (('small0', 8000), ('small1', 8000), ('small2', 8000),
+                       ('small3', 8000), ('medium', 20000), ('large', 50000)):
+      with open(os.path.join(self.scratch, name), 'w') as f:
+        f.write(('%s ' % name * size)[:size])
+
+    self.session = requests.Session()
+    self.addCleanup(self.session.close)
+
+  def get(self, name):
+    def sendfile_files():
+      r = self.session.get('http://127.0.0.1:8080/stats')
+      counters = dict(line.split(' ') for line in r.text.splitlines())
+      return int(counters['sendfile_files'])
+
+    before = sendfile_files()
+    r = self.session.get('http://127.0.0.1:8080/budget/budget-test/' + name,
+                         headers={'Accept-Encoding': 'deflate'})
+    self.assertEqual(r.status_code, 200)
+    self.assertEqual(len(r.text), os.path.getsize(os.path.join(self.scratch, name)))
+    return sendfile_files() != before, r.headers.get('Content-Encoding')
+
+  def test_small_files_use_half_the_budget(self):
+    # Small files are kept in memory, with a deflated copy, until half
+    # the budget is used.
+    for name in ('small0', 'small1', 'small2'):
+      self.assertEqual(self.get(name), (False, 'deflate'))
+    self.assertEqual(self.get('small3'), (True, None))
+
+  def test_popular_files_are_kept_in_memory(self):
+    self.assertEqual(self.get('medium'), (True, None))
+    self.assertEqual(self.get('large'), (True, None))
+
+    # Hits are counted when cache entries expire, after a few seconds.
+    for _ in range(16):
+      self.get('medium')
+      self.get('large')
+    for _ in range(80):
+      in_memory = not self.get('medium')[0]
+      if in_memory:
+        break
+      time.sleep(0.5)
+    self.assertTrue(in_memory)
+
+    # Too large to be deflated while the request waits.
+    self.assertEqual(self.get('medium'), (False, None))
+    # Popular too, but larger than the whole budget.
+    self.assertEqual(self.get('large'), (True, None))
+
+
+class TestUnixSocketListener(LwanTest):
+  def request(self, path):
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    s.connect('\0lwan-testsuite')
+    s.send(b'GET ' + path + b' HTTP/1.1\r\nConnection: close\r\n\r\n')
+
+    response = b''
+    while True:
+      data = s.recv(4096)
+      if not data:
+        break
+      response += data
+    s.close()
+
+    return response
+
+  def test_hello(self):
+    r = self.request(b'/hello')
+    self.assertTrue(r.startswith(b'HTTP/1.1 200 OK'))
+    self.assertTrue(r.endswith(b'Hello, world!'))
+
+  def test_listener_has_own_url_map(self):
+    r = self.request(b'/100.html')
+    self.assertTrue(r.startswith(b'HTTP/1.1 404 Not found'))
+
+    r = requests.get('http://127.0.0.1:8080/100.html')
+    self.assertResponseHtml(r)
+
+
+class TestRedirectMap(LwanTest):
+  def test_redirects(self):
+    for path, location, status in (
+        ('/legacy/old-page', '/100.html', 301),
+        ('/legacy/moved-temporarily', '/hello', 302),
+        ('/legacy/see-other', 'http://lwan.ws/', 303),
+        ('/legacy/keep-method', '/post/blend', 307)):
+      r = requests.get('http://127.0.0.1:8080' + path, allow_redirects=False)
+      self.assertEqual(r.status_code, status)
+      self.assertEqual(r.headers['location'], location)
+
+  def test_unknown_source(self):
+    for path in ('/legacy', '/legacy/old-pag', '/legacy/old-page/'):
+      r = requests.get('http://127.0.0.1:8080' + path, allow_redirects=False)
+      self.assertEqual(r.status_code, 404)
+
+  def get_once_reloaded(self, path):
+    # Changes are picked up by the job thread, which might be sleeping.
+    for i in range(40):
+      r = requests.get('http://127.0.0.1:8080' + path, allow_redirects=False)
+      if r.status_code != 404:
+        break
+      time.sleep(0.5)
+    return r
+
+  def test_map_is_reloaded(self):
+    with open('redirects.map') as f:
+      original = f.read()
+
+    try:
+      with open('redirects.map.tmp', 'w') as f:
+        f.write('/legacy/new-page /index.html 308\n')
+      os.rename('redirects.map.tmp', 'redirects.map')
+
+      r = self.get_once_reloaded('/legacy/new-page')
+      self.assertEqual(r.status_code, 308)
+      self.assertEqual(r.headers['location'], '/index.html')
+
+      r = requests.get('http://127.0.0.1:8080/legacy/old-page', allow_redirects=False)
+      self.assertEqual(r.status_code, 404)
+    finally:
+      with open('redirects.map', 'w') as f:
+        f.write(original)
+
+  def test_prebuilt_map(self):
+    mkredirmap = tool_path('mkredirmap')
+    if not os.path.exists(mkredirmap):
+      self.skipTest('mkredirmap has not been built')
+
+    with open('redirects.map') as f:
+      original = f.read()
+
+    try:
+      with open('redirects.txt', 'w') as f:
+        for i in range(1000):
+          f.write('/legacy/prebuilt/%d /hello?name=%d 302\n' % (i, i))
+
+      # Replaces redirects.map with the compiled map.
+      subprocess.check_call([mkredirmap, 'redirects.txt', 'redirects.map'],
+                            stderr=subprocess.DEVNULL)
+      with open('redirects.map', 'rb') as f:
+        self.assertEqual(f.read(8), b'LWANRMAP')
+
+      r = self.get_once_reloaded('/legacy/prebuilt/0')
+      self.assertEqual(r.status_code, 302)
+
+      for i in range(0, 1000, 37):
+        r = requests.get('http://127.0.0.1:8080/legacy/prebuilt/%d' % i,
+                         allow_redirects=False)
+        self.assertEqual(r.status_code, 302)
+        self.assertEqual(r.headers['location'], '/hello?name=%d' % i)
+
+      for path in ('/legacy/prebuilt/1000', '/legacy/old-page'):
+        r = requests.get('http://127.0.0.1:8080' + path, allow_redirects=False)
+        self.assertEqual(r.status_code, 404)
+    finally:
+      os.unlink('redirects.txt')
+      with open('redirects.map', 'w') as f:
+        f.write(original)
+
+
+class TestConfigReload(LwanTest):
+  def test_sighup_keeps_serving(self):
+    s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    s.connect(('127.0.0.1', 8080))
+    s.send(b'GET /hello HTTP/1.1\r\nConnection: keep-alive\r\n\r\n')
+    self.assertTrue(s.recv(4096).startswith(b'HTTP/1.1 200 OK'))
+
+    self.lwan.send_signal(signal.SIGHUP)
+    time.sleep(0.5)
+
+    # Connections established before the reload are still served.
+    s.send(b'GET /hello HTTP/1.1\r\nConnection: close\r\n\r\n')
+    self.assertTrue(s.recv(4096).startswith(b'HTTP/1.1 200 OK'))
+    s.close()
+
+    r = requests.get('http://127.0.0.1:8080/hello')
+    self.assertResponsePlain(r)
+
+    r = requests.get('http://127.0.0.1:8080/100.html')
+    self.assertResponseHtml(r)
+
+    r = requests.get('http://127.0.0.1:8080/elsewhere', allow_redirects=False)
+    self.assertEqual(r.status_code, 301)
+
+
 if __name__ == '__main__':
   unittest.main()
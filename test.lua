@@ -37,6 +37,73 @@ function handle_get_chunked(req)
     end
 end
 
+function handle_get_backend(req)
+    -- Talks to this same instance, as if it were some other service
+    local conn, err = req:connect("127.0.0.1:8080", 1000)
+    if not conn then
+        req:set_response("Could not connect: " .. err)
+        return
+    end
+
+    conn:write("GET /hello HTTP/1.0\r\n\r\n")
+
+    local response = {}
+    while true do
+        local data = conn:read()
+        if not data then break end
+        response[#response + 1] = data
+    end
+    conn:close()
+
+    response = table.concat(response)
+    req:set_response("Backend said: " .. string.match(response, "\r\n\r\n(.*)$"))
+end
+
+function handle_get_kept_request(req)
+    -- Requests kept around can't be used once they're over
+    if kept_request then
+        local ok = pcall(kept_request.query_param, kept_request, "name")
+        req:set_response(ok and "usable" or "unusable")
+    else
+        req:set_response("kept")
+    end
+    kept_request = req
+end
+
+function handle_get_kept_connection(req)
+    -- Same with connections, which are closed when the request ends
+    if kept_connection then
+        local ok = pcall(kept_connection.write, kept_connection, "GET / HTTP/1.0\r\n\r\n")
+        req:set_response(ok and "usable" or "unusable")
+    else
+        kept_connection = req:connect("127.0.0.1:8080", 1000)
+        req:set_response(kept_connection and "kept" or "could not connect")
+    end
+end
+
+function handle_get_connect_by_name(req)
+    -- Names would have to be looked up, blocking the whole thread
+    local conn, err = req:connect("localhost:8080", 1000)
+    req:set_response(conn and "connected" or err)
+end
+
+local counters = lwan.shared.counters
+
+function handle_get_shared_incr(req)
+    req:set_response(tostring(counters:incr(req:query_param[[key]])))
+end
+
+function handle_get_shared(req)
+    local key = req:query_param[[key]]
+    local value = req:query_param[[value]]
+
+    if value then
+        counters:set(key, value, tonumber(req:query_param[[ttl]]))
+    end
+
+    req:set_response(tostring(counters:get(key)))
+end
+
 function handle_get_random(req)
     req:set_response("Random number: " .. math.random())
 end